@@ -0,0 +1,67 @@
+#include "Benchmark/MkGpuScatteringStageTimings.h"
+#include "MkGpuScatteringGlobal.h"
+
+MK_OPTIMIZATION_OFF
+
+DEFINE_STAT(STAT_MkGpuScatteringStage_Build);
+DEFINE_STAT(STAT_MkGpuScatteringStage_Dispatch);
+DEFINE_STAT(STAT_MkGpuScatteringStage_Readback);
+DEFINE_STAT(STAT_MkGpuScatteringStage_TransformBuild);
+DEFINE_STAT(STAT_MkGpuScatteringStage_ClusterTree);
+DEFINE_STAT(STAT_MkGpuScatteringStage_Apply);
+
+const TCHAR* FMkGpuScatteringStageTimings::GetStageName(EMkScatteringStage Stage)
+{
+	static const TCHAR* Names[(int32)EMkScatteringStage::Num] = { TEXT("build"), TEXT("dispatch"), TEXT("readback"), TEXT("transform_build"), TEXT("cluster_tree"), TEXT("apply") };
+	return Stage < EMkScatteringStage::Num ? Names[(int32)Stage] : TEXT("unknown");
+}
+
+#if !UE_BUILD_SHIPPING
+namespace MkGpuScatteringStageTimings
+{
+	static std::atomic<bool> bEnabled{ false };
+	static std::atomic<uint64> Cycles[(int32)EMkScatteringStage::Num];
+	static std::atomic<uint32> Calls[(int32)EMkScatteringStage::Num];
+}
+
+void FMkGpuScatteringStageTimings::SetEnabled(bool bInEnabled)
+{
+	MkGpuScatteringStageTimings::bEnabled.store(bInEnabled, std::memory_order_relaxed);
+}
+
+bool FMkGpuScatteringStageTimings::IsEnabled()
+{
+	return MkGpuScatteringStageTimings::bEnabled.load(std::memory_order_relaxed);
+}
+
+void FMkGpuScatteringStageTimings::Add(EMkScatteringStage Stage, uint64 InCycles)
+{
+	using namespace MkGpuScatteringStageTimings;
+	Cycles[(int32)Stage].fetch_add(InCycles, std::memory_order_relaxed);
+	Calls[(int32)Stage].fetch_add(1, std::memory_order_relaxed);
+}
+
+FMkGpuScatteringStageTimings::FSnapshot FMkGpuScatteringStageTimings::GetSnapshot()
+{
+	using namespace MkGpuScatteringStageTimings;
+	FSnapshot Snapshot;
+	for (int32 Stage = 0; Stage < (int32)EMkScatteringStage::Num; ++Stage)
+	{
+		Snapshot.Cycles[Stage] = Cycles[Stage].load(std::memory_order_relaxed);
+		Snapshot.Calls[Stage] = Calls[Stage].load(std::memory_order_relaxed);
+	}
+	return Snapshot;
+}
+
+void FMkGpuScatteringStageTimings::Reset()
+{
+	using namespace MkGpuScatteringStageTimings;
+	for (int32 Stage = 0; Stage < (int32)EMkScatteringStage::Num; ++Stage)
+	{
+		Cycles[Stage].store(0, std::memory_order_relaxed);
+		Calls[Stage].store(0, std::memory_order_relaxed);
+	}
+}
+#endif
+
+MK_OPTIMIZATION_ON
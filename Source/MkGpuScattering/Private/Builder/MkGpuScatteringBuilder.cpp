@@ -1,12 +1,20 @@
 #include "Builder/MkGpuScatteringBuilder.h"
+#include "Builder/MkGpuScatteringTransformKernel.h"
 #include "Types/MkGpuScatteringTypes.h"
 #include "Readback/MkGpuScatteringReadbackManager.h"
+#include "Scheduler/MkGpuScatteringScheduler.h"
+#include "Cache/MkGpuScatteringDiskCache.h"
+#include "Cache/MkGpuScatteringBakedData.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
+#include "Trace/MkGpuScatteringTrace.h"
 #include "MkGpuScatteringGlobal.h"
 #include "MkGpuScatteringVolume.h"
 
 
 #include "Math/Halton.h"
 #include "Async/AsyncWork.h"
+#include "Tasks/Task.h"
 #include "LandscapeLight.h"
 #include "LandscapeProxy.h"
 #include "LandscapeComponent.h"
@@ -14,6 +22,7 @@
 #include "Components/InstancedStaticMeshComponent.h"
 #include "Components/HierarchicalInstancedStaticMeshComponent.h"
 #include "Runtime/Foliage/Public/GrassInstancedStaticMeshComponent.h"
+#include "PhysicsEngine/BodySetup.h"
 
 //
 #include "RenderUtils.h"
@@ -29,6 +38,7 @@
 
 LLM_DEFINE_TAG(MkGpuScatteringBuilder_Tick);
 LLM_DEFINE_TAG(MkGpuScatteringBuilder_Build);
+LLM_DEFINE_TAG(MkGpuScatteringBuilder_IssueJob);
 LLM_DEFINE_TAG(MkGpuScatteringBuilder_TransformBuild);
 LLM_DEFINE_TAG(MkGpuScatteringBuilder_WaitAndApply);
 LLM_DEFINE_TAG(MkGpuScatteringBuilder_CreateHISMC);
@@ -43,6 +53,8 @@ LLM_DEFINE_TAG(MkGpuScatteringBuilder_ApplyInstance);
 
 using namespace MkGpuScatteringBuilderTypes;
 
+extern int32 GMkGrassQualityLevel;
+
 
 MK_OPTIMIZATION_OFF
 
@@ -79,14 +91,159 @@ static FAutoConsoleVariableRef CVarMkGpuScatteringCullDistanceScale(
 
 
 
+static float GMkGpuScatteringIncrementalBuildFraction = 0.1f;
+static FAutoConsoleVariableRef CVarMkIncrementalBuildFraction(
+	TEXT("MkGpuScattering.IncrementalBuildFraction"),
+	GMkGpuScatteringIncrementalBuildFraction,
+	TEXT("Skip the build pass until a camera moves further than this fraction of the smallest guard band (discard distance - cull distance). 0 disables incremental build."));
+
+static int32 GMkGpuScatteringMaxConcurrentTransformTasks = 4;
+static FAutoConsoleVariableRef CVarMkMaxConcurrentTransformTasks(
+	TEXT("MkGpuScattering.MaxConcurrentTransformTasks"),
+	GMkGpuScatteringMaxConcurrentTransformTasks,
+	TEXT("Maximum number of transform builds running on worker threads across all builders. <= 0 builds everything on the game thread."));
+
+static int32 GMkGpuScatteringTransformKernel = 1;
+static FAutoConsoleVariableRef CVarMkTransformKernel(
+	TEXT("MkGpuScattering.TransformKernel"),
+	GMkGpuScatteringTransformKernel,
+	TEXT("0: Build instance transforms one at a time in double precision (reference); 1: SIMD batches of 4 in float."));
+
+// Transform tasks in flight across all builders
+static std::atomic<int32> GMkGpuScatteringNumTransformTasks{ 0 };
+
+static float GMkGpuScatteringMaxApplyTimeMs = 1.0f;
+static FAutoConsoleVariableRef CVarMkMaxApplyTimeMs(
+	TEXT("MkGpuScattering.MaxApplyTimeMs"),
+	GMkGpuScatteringMaxApplyTimeMs,
+	TEXT("Game thread time budget (ms) per frame for applying finished builds, creating collision bodies and destroying unused components across all builders. At least one of each happens per frame."));
+
+static int32 GMkGpuScatteringBatchedCollision = 1;
+static FAutoConsoleVariableRef CVarMkBatchedCollision(
+	TEXT("MkGpuScattering.BatchedCollision"),
+	GMkGpuScatteringBatchedCollision,
+	TEXT("1: Collision varieties take the prebuilt cluster tree and their instance bodies are created in batches within MkGpuScattering.MaxApplyTimeMs; 0: HISMC AddInstances, all bodies at once. Applies to components created afterwards."));
+
+static int32 GMkGpuScatteringInstanceBodyBatchSize = 256;
+static FAutoConsoleVariableRef CVarMkInstanceBodyBatchSize(
+	TEXT("MkGpuScattering.InstanceBodyBatchSize"),
+	GMkGpuScatteringInstanceBodyBatchSize,
+	TEXT("Number of instance bodies created per FBodyInstance::InitStaticBodies call."));
+
+// Game thread budget of WaitAndApplyResults, shared by every builder ticked in the frame.
+// The cost of each operation is predicted from a moving average of the measured ones.
+struct FMkGpuScatteringApplyBudget
+{
+	enum EOp : uint8
+	{
+		// cost per instance
+		AcceptPrebuiltTree,
+		AddInstances,
+		CreateInstanceBodies,
+		AppendMergedRange,
+		// cost per component, destroyed or recycled
+		DestroyComponent,
+		// cost per range, see FMkGrassVariety::bMergeComponents
+		RemoveMergedRange,
+		NumOps
+	};
+
+	uint64 Frame = MAX_uint64;
+	double UsedMs = 0.0;
+	int32 NumDone[NumOps] = {};
+	// ms per unit, seeded with rough figures and refined by Record
+	double CostMs[NumOps] = { 0.0002, 0.002, 0.001, 0.001, 0.1, 0.05 };
+
+	bool CanAfford(EOp Op, int32 NumUnits)
+	{
+		check(IsInGameThread());
+
+		if (Frame != GFrameCounter)
+		{
+			Frame = GFrameCounter;
+			UsedMs = 0.0;
+			FMemory::Memzero(NumDone);
+		}
+
+		// Every queue moves every frame whatever the budget
+		if (NumDone[Op] == 0)
+		{
+			return true;
+		}
+		return UsedMs + CostMs[Op] * NumUnits <= GMkGpuScatteringMaxApplyTimeMs;
+	}
+
+	void Record(EOp Op, int32 NumUnits, double Ms)
+	{
+		UsedMs += Ms;
+		++NumDone[Op];
+		CostMs[Op] = FMath::Lerp(CostMs[Op], Ms / FMath::Max(NumUnits, 1), 0.1);
+	}
+};
+static FMkGpuScatteringApplyBudget GMkGpuScatteringApplyBudget;
+
+static int32 GMkGpuScatteringComponentPoolSize = 32;
+static FAutoConsoleVariableRef CVarMkComponentPoolSize(
+	TEXT("MkGpuScattering.ComponentPoolSize"),
+	GMkGpuScatteringComponentPoolSize,
+	TEXT("Maximum number of hidden foliage components each builder keeps for reuse instead of destroying them. 0 disables the pool."));
+
+// Since startup, for the hit rate stat
+static uint64 GMkGpuScatteringComponentPoolHits = 0;
+static uint64 GMkGpuScatteringComponentPoolRequests = 0;
+
 static int32 GMkMaxInstancesPerComponent = 65536;
 static FAutoConsoleVariableRef CVarMkMaxInstancesPerComponent(
 	TEXT("MkGpuScattering.MaxInstancesPerComponent"),
 	GMkMaxInstancesPerComponent,
 	TEXT("Used to control the number of grass components created. More can be more efficient, but can be hitchy as new components come into range"));
 
+static int32 GMkGpuScatteringUseBakedData = 1;
+static FAutoConsoleVariableRef CVarMkUseBakedData(
+	TEXT("MkGpuScattering.UseBakedData"),
+	GMkGpuScatteringUseBakedData,
+	TEXT("1: Jobs baked by the MkGpuScatteringBake commandlet take their results from the landscape proxy instead of the GPU."));
+
 
 DECLARE_CYCLE_STAT(TEXT("MkGpuScattering Transform Build Time"), STAT_MkGpuScatteringTransformBuildTime, STATGROUP_Foliage);
+DECLARE_CYCLE_STAT(TEXT("MkGpuScattering Component Index Rebuild"), STAT_MkGpuScatteringComponentIndexRebuild, STATGROUP_MkGpuScattering);
+DECLARE_CYCLE_STAT(TEXT("MkGpuScattering Layout Table Rebuild"), STAT_MkGpuScatteringLayoutTableRebuild, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Landscape Components Visited"), STAT_MkGpuScatteringComponentsVisited, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Landscape Components Total"), STAT_MkGpuScatteringComponentsTotal, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Builds Evaluated"), STAT_MkGpuScatteringBuildsEvaluated, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Builds Skipped"), STAT_MkGpuScatteringBuildsSkipped, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Transform Tasks Launched"), STAT_MkGpuScatteringTransformTasksLaunched, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Dispatch To Apply Frames"), STAT_MkGpuScatteringDispatchToApplyFrames, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Baked Jobs"), STAT_MkGpuScatteringBakedJobs, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("In Flight Dispatched"), STAT_MkGpuScatteringInFlightDispatched, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("In Flight Readback Ready"), STAT_MkGpuScatteringInFlightReadbackReady, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("In Flight Transform Built"), STAT_MkGpuScatteringInFlightTransformBuilt, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Builds Applied"), STAT_MkGpuScatteringBuildsApplied, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Builds Deferred"), STAT_MkGpuScatteringBuildsDeferred, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Components Destroyed"), STAT_MkGpuScatteringComponentsDestroyed, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Components Pending Destroy"), STAT_MkGpuScatteringComponentsPendingDestroy, STATGROUP_MkGpuScattering);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Apply Budget Used (ms)"), STAT_MkGpuScatteringApplyBudgetUsed, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Component Pool Hits"), STAT_MkGpuScatteringComponentPoolHits, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Component Pool Misses"), STAT_MkGpuScatteringComponentPoolMisses, STATGROUP_MkGpuScattering);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Component Pool Hit Rate (%)"), STAT_MkGpuScatteringComponentPoolHitRate, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Components Pooled"), STAT_MkGpuScatteringComponentsPooled, STATGROUP_MkGpuScattering);
+DECLARE_CYCLE_STAT(TEXT("MkGpuScattering Create Instance Bodies"), STAT_MkGpuScatteringCreateInstanceBodies, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Instance Bodies Created"), STAT_MkGpuScatteringInstanceBodiesCreated, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Instance Bodies Pending"), STAT_MkGpuScatteringInstanceBodiesPending, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Merged Components"), STAT_MkGpuScatteringMergedComponents, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Merged Instances"), STAT_MkGpuScatteringMergedInstances, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Merged Ranges Pending Removal"), STAT_MkGpuScatteringMergedRangesPendingRemoval, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Jobs Issued"), STAT_MkGpuScatteringJobsIssued, STATGROUP_MkGpuScattering);
+DECLARE_MEMORY_STAT(TEXT("Issue Job Bytes Per Job"), STAT_MkGpuScatteringIssueJobBytesPerJob, STATGROUP_MkGpuScattering);
+
+#if ENABLE_LOW_LEVEL_MEM_TRACKER && STATS
+namespace MkGpuScatteringIssueJobStats
+{
+	// Tag amount when the count started, game thread only
+	static int64 BaselineBytes = -1;
+	static int64 NumJobs = 0;
+}
+#endif
 
 
 //~
@@ -107,8 +264,14 @@ struct FMkFoliagePlacementUtil
 struct FMkGpuScatteringTransformBuilder
 {
 	FMkCachedLandscapeFoliage::FGrassCompKey Key;
-	TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC;
+	// A HISMC of its own, or the shared component of a bMergeComponents variety
+	TWeakObjectPtr<UInstancedStaticMeshComponent> Foliage;
 	TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ> ResultBuffer;
+	// Quantized results, replaces ResultBuffer for varieties with bCompactResults
+	TArray<MkGpuScatteringBuilderTypes::FPackedLocationNormalScaleZ> PackedResults;
+	MkGpuScatteringBuilderTypes::FPackedResultFrame PackedFrame;
+	// Final transforms from Transform_CS, replaces ResultBuffer when bGpuTransforms
+	TArray<MkGpuScatteringBuilderTypes::FInstanceTransform> GpuTransforms;
 	FMatrix XForm;
 	FRandomStream RandomStream;
 
@@ -123,15 +286,43 @@ struct FMkGpuScatteringTransformBuilder
 	//bool RequireCPUAccess = false;
 	bool bCollisionEnabled = false;
 	bool bCheckCloseLandscape = false;
-	bool IsDone = false;
+	bool bGpuTransforms = false;
+	// Collision on a grass component, the bodies are created by UMkGpuScatteringBuilder::CreatePendingInstanceBodies
+	bool bBatchedCollision = false;
+	// Appended to a shared component, see FMkGrassVariety::bMergeComponents. Only MergedTransforms is built.
+	bool bMerged = false;
+	// Set last by Build, which may run on a worker thread
+	std::atomic<bool> IsDone{ false };
 
 	double BuildTime;
 
+	// GFrameCounter when the scattering job was issued
+	uint64 DispatchFrame = 0;
+	// For the trace events, see FMkGpuScatteringTrace
+	uint64 QueuedCycles = 0;
+	uint32 BuilderId = 0;
+
+	// Valid once Build was launched as a task
+	UE::Tasks::FTask Task;
+	bool bLaunched = false;
+
+	// Read from the component on the game thread so Build does not touch it
+	UWorld* World = nullptr;
+	FBox MeshBox = FBox(ForceInit);
+	int32 DesiredInstancesPerLeaf = 0;
+	bool bHasMesh = false;
+	FTransform ComponentTransform;
+	TWeakObjectPtr<UBodySetup> BodySetup;
+
 	// output
 	TArray<FInstancedStaticMeshInstanceData> InstanceData;
 	FStaticMeshInstanceData InstanceBuffer;
 	TArray<FClusterNode> ClusterTree;
 	int32 OutOcclusionLayerNum;
+	// World transforms of the instance bodies in InstanceData order, bBatchedCollision only
+	TArray<FTransform> BodyTransforms;
+	// Component space transforms for AddInstances, bMerged only
+	TArray<FTransform> MergedTransforms;
 
 	const FMkGrassVariety* GrassVariety;
 
@@ -139,27 +330,56 @@ struct FMkGpuScatteringTransformBuilder
 
 	FMkGpuScatteringTransformBuilder(
 		FMkCachedLandscapeFoliage::FGrassCompKey InKey
-		, TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> OutHISMC
+		, TWeakObjectPtr<UInstancedStaticMeshComponent> InFoliage
 		, TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ> InResultBuffer
+		, TArray<MkGpuScatteringBuilderTypes::FPackedLocationNormalScaleZ> InPackedResults
+		, const MkGpuScatteringBuilderTypes::FPackedResultFrame& InPackedFrame
+		, TArray<MkGpuScatteringBuilderTypes::FInstanceTransform> InGpuTransforms
+		, bool bInGpuTransforms
 		, const FMatrix& InXForm
 		, FRandomStream InRandomStream
 		, const FMkGrassVariety* InGrassVariety
 	)
 		: Key(MoveTemp(InKey))
-		, HISMC(OutHISMC)
+		, Foliage(InFoliage)
 		, ResultBuffer(MoveTemp(InResultBuffer))
+		, PackedResults(MoveTemp(InPackedResults))
+		, PackedFrame(InPackedFrame)
+		, GpuTransforms(MoveTemp(InGpuTransforms))
 		, XForm(InXForm)
 		, RandomStream(InRandomStream)
 		, InstanceBuffer(true)
 		, GrassVariety(InGrassVariety)
-		, Origin(HISMC->GetComponentLocation())
+		, Origin(Foliage->GetComponentLocation())
 	{
+		check(IsInGameThread());
+
 		BuildTime = 0.0;
 
+		const UHierarchicalInstancedStaticMeshComponent* HISMC = Cast<UHierarchicalInstancedStaticMeshComponent>(Foliage.Get());
+		bMerged = !HISMC;
+
+		if (const UStaticMesh* StaticMesh = Foliage->GetStaticMesh())
+		{
+			World = Foliage->GetWorld();
+			MeshBox = StaticMesh->GetBounds().GetBox();
+			DesiredInstancesPerLeaf = HISMC ? HISMC->DesiredInstancesPerLeaf() : 0;
+			bHasMesh = true;
+		}
+
 		//RequireCPUAccess = GrassVariety->bKeepInstanceBufferCPUCopy;
 		bCollisionEnabled = GrassVariety->CollisionProfileName != TEXT("NoCollision");
 		bCheckCloseLandscape = GrassVariety->bCheckCloseLandscape;
 
+		bGpuTransforms = bInGpuTransforms && !bCheckCloseLandscape;
+
+		bBatchedCollision = bCollisionEnabled && Foliage->IsA<UGrassInstancedStaticMeshComponent>();
+		if (bBatchedCollision)
+		{
+			ComponentTransform = Foliage->GetComponentTransform();
+			BodySetup = Foliage->GetBodySetup();
+		}
+
 		RandomRotation = GrassVariety->RandomRotation;
 		AlignToSurface = GrassVariety->AlignToSurface;
 
@@ -190,9 +410,9 @@ struct FMkGpuScatteringTransformBuilder
 		Clear();
 	}
 
-	void SetInstance(int32 InstanceIndex, const FMatrix& InXForm, float RandomFraction)
+	void SetInstance(int32 InstanceIndex, const FMatrix44f& InXForm, float RandomFraction)
 	{
-		InstanceBuffer.SetInstance(InstanceIndex, FMatrix44f(InXForm), RandomFraction);
+		InstanceBuffer.SetInstance(InstanceIndex, InXForm, RandomFraction);
 	}
 
 	FVector GetDefaultScale() const
@@ -266,34 +486,13 @@ struct FMkGpuScatteringTransformBuilder
 	void Clear()
 	{
 		ResultBuffer.Empty();
+		PackedResults.Empty();
+		GpuTransforms.Empty();
 
 		ClusterTree.Empty();
 		InstanceData.Empty();
-	}
-
-	// InstancedFoliage.h
-	FMatrix AlignToNormal(const FVector& InNormal, float AlignMaxAngle)
-	{
-		FRotator AlignRotation = InNormal.Rotation();
-		// Static meshes are authored along the vertical axis rather than the X axis, so we add 90 degrees to the static mesh's Pitch.
-		AlignRotation.Pitch -= 90.f;
-		// Clamp its value inside +/- one rotation
-		AlignRotation.Pitch = FRotator::NormalizeAxis(AlignRotation.Pitch);
-
-		// limit the maximum pitch angle if it's > 0.
-		if (AlignMaxAngle > 0.f)
-		{
-			int32 MaxPitch = static_cast<int32>(AlignMaxAngle);
-			if (AlignRotation.Pitch > MaxPitch)
-			{
-				AlignRotation.Pitch = MaxPitch;
-			}
-			else if (AlignRotation.Pitch < -MaxPitch)
-			{
-				AlignRotation.Pitch = -MaxPitch;
-			}
-		}
-		return AlignRotation.Quaternion().ToMatrix();
+		BodyTransforms.Empty();
+		MergedTransforms.Empty();
 	}
 
 	//~
@@ -301,27 +500,40 @@ struct FMkGpuScatteringTransformBuilder
 	{
 		SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringTransformBuildTime);
 		LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_TransformBuild);
+		MK_SCATTERING_STAGE_SCOPE(TransformBuild);
 
 		IsDone = false;
 
-		if (!HISMC.IsValid() || !HISMC->GetStaticMesh())
+		// World sweeps are only allowed on the game thread
+		check(!bCheckCloseLandscape || IsInGameThread());
+
+		if (!bHasMesh)
 		{
-			IsDone = true;
+			MarkDone();
 			return;
 		}
 
 
 		double StartTime = FPlatformTime::Seconds();
 
-		UWorld* World = HISMC->GetWorld();
-		FBoxSphereBounds MeshBounds = HISMC->GetStaticMesh()->GetBounds();
-
-		TArray<FMatrix> InstanceTransforms;
+		const FVector DefaultScale = GetDefaultScale();
 
+		// Scattering_CS appends in whatever order the waves finish, sort so the sequential draws below stay the same between rebuilds.
+		// Packed XY keeps Y in the high half, so the packed results sort the same way by their first dword.
+		ResultBuffer.Sort([](const FLocationNormalScaleZ& A, const FLocationNormalScaleZ& B)
+		{
+			return A.Location.Y != B.Location.Y ? A.Location.Y < B.Location.Y : A.Location.X < B.Location.X;
+		});
+		PackedResults.Sort([](const FPackedLocationNormalScaleZ& A, const FPackedLocationNormalScaleZ& B)
+		{
+			return A.PackedXY < B.PackedXY;
+		});
 
-		const FVector DefaultScale = GetDefaultScale();
+		// Random values are drawn in instance order so both kernels see the same sequence
+		MkGpuScatteringTransformKernel::FInstanceStreams Streams;
+		Streams.Reset(ResultBuffer.Num() + PackedResults.Num());
 
-		for (const FLocationNormalScaleZ& Result : ResultBuffer)
+		auto AddResult = [&](const FLocationNormalScaleZ& Result)
 		{
 			FVector LocationWithHeight = FVector(Result.Location);
 			FVector2D Location2D = FVector2D(LocationWithHeight);
@@ -355,43 +567,60 @@ struct FMkGpuScatteringTransformBuilder
 
 					if (!bCloseLandscape)
 					{
-						continue;
+						return;
 					}
 				}
 				//~!
 			}
 
-			FVector ComputedNormal = FVector(Result.ComputedNormal);
 			const float Rot = RandomRotation ? RandomStream.GetFraction() * 180.0f : 0.0f;
-			FVector RotVector = GrassVariety->RotationAxis * Rot;
+			Streams.Add(Result.Location, Result.ComputedNormal, FVector3f(Scale), PlacementOffsetZ, Rot);
+		};
 
-			const FMatrix BaseXForm = FScaleRotationTranslationMatrix(Scale, FRotator(RotVector.X, RotVector.Y, RotVector.Z), FVector::ZeroVector);
-			FMatrix OutXForm;
-			if (AlignToSurface && !ComputedNormal.IsNearlyZero())
+		for (const FLocationNormalScaleZ& Result : ResultBuffer)
+		{
+			AddResult(Result);
+		}
+		// Decoded one at a time, the full size results never exist for the whole component
+		for (const FPackedLocationNormalScaleZ& Packed : PackedResults)
+		{
+			AddResult(PackedFrame.Unpack(Packed));
+		}
+
+		MkGpuScatteringTransformKernel::FParams KernelParams;
+		KernelParams.RotationAxis = GrassVariety->RotationAxis;
+		KernelParams.AlignMaxAngle = GrassVariety->AlignMaxAngle;
+		KernelParams.bAlignToSurface = AlignToSurface;
+		KernelParams.XForm = XForm;
+
+		// Double until SetInstance, the cluster tree, the instance data and the bodies keep the full precision composition
+		TArray<FMatrix> InstanceTransforms;
+		if (bGpuTransforms)
+		{
+			// Already final and float, only copied
+			InstanceTransforms.SetNumUninitialized(GpuTransforms.Num());
+			for (int32 InstanceIndex = 0; InstanceIndex < GpuTransforms.Num(); InstanceIndex++)
 			{
-				//~ LandscapeGrass code
-				/*const FVector NewZ = ComputedNormal * FMath::Sign(ComputedNormal.Z);
-				const FVector NewX = (FVector(0, -1, 0) ^ NewZ).GetSafeNormal();
-				const FVector NewY = NewZ ^ NewX;
-				const FMatrix Align = FMatrix(NewX, NewY, NewZ, FVector::ZeroVector);*/
-				//~ LandscapeGrass code ~!
-
-				FMatrix Align = AlignToNormal(ComputedNormal, GrassVariety->AlignMaxAngle);
-				FMatrix AlignedXForm = (BaseXForm * Align);
-				FVector AxisZ = AlignedXForm.GetUnitAxis(EAxis::Z);
-				LocationWithHeight += AxisZ * (PlacementOffsetZ * Scale.Z);
-				OutXForm = AlignedXForm.ConcatTranslation(LocationWithHeight) * XForm;
+				InstanceTransforms[InstanceIndex] = FMatrix(GpuTransforms[InstanceIndex].ToMatrix());
 			}
-			else
+		}
+		else if (GMkGpuScatteringTransformKernel)
+		{
+			InstanceTransforms.SetNumUninitialized(Streams.Num());
+			Streams.Pad();
+			MkGpuScatteringTransformKernel::TransformBatch(KernelParams, Streams, InstanceTransforms);
+		}
+		else
+		{
+			InstanceTransforms.SetNumUninitialized(Streams.Num());
+			for (int32 InstanceIndex = 0; InstanceIndex < Streams.Num(); InstanceIndex++)
 			{
-				FVector AxisZ = BaseXForm.GetUnitAxis(EAxis::Z);
-				LocationWithHeight += AxisZ * (PlacementOffsetZ * Scale.Z);
-				OutXForm = BaseXForm.ConcatTranslation(LocationWithHeight) * XForm;
+				InstanceTransforms[InstanceIndex] = MkGpuScatteringTransformKernel::TransformScalar(KernelParams, Streams, InstanceIndex);
 			}
-			InstanceTransforms.Add(OutXForm);
 		}
 
 		ResultBuffer.Empty();
+		PackedResults.Empty();
 
 		int32 TotalInstances = 0;
 
@@ -401,32 +630,38 @@ struct FMkGpuScatteringTransformBuilder
 
 			TotalInstances += InstanceTransforms.Num();
 
+			if (bMerged)
+			{
+				// The shared component takes plain transforms and keeps no cluster tree of its own
+				MergedTransforms.Reset(InstanceTransforms.Num());
+				for (const FMatrix& Transform : InstanceTransforms)
+				{
+					MergedTransforms.Emplace(Transform);
+				}
+				BuildTime = FPlatformTime::Seconds() - StartTime;
+				MarkDone();
+				return;
+			}
+
 			InstanceBuffer.AllocateInstances(InstanceTransforms.Num(), 0, EResizeBufferFlags::AllowSlackOnGrow | EResizeBufferFlags::AllowSlackOnReduce, true);
 
 			for (int32 InstanceIndex = 0; InstanceIndex < InstanceTransforms.Num(); InstanceIndex++)
 			{
-				const FMatrix& OutXForm = InstanceTransforms[InstanceIndex];
-				SetInstance(InstanceIndex, OutXForm, RandomStream.GetFraction());
+				const float RandomFraction = bGpuTransforms ? GpuTransforms[InstanceIndex].OriginAndRandom.W : RandomStream.GetFraction();
+				SetInstance(InstanceIndex, FMatrix44f(InstanceTransforms[InstanceIndex]), RandomFraction);
 
 			}
 
-			if (!HISMC.IsValid() || !HISMC->GetStaticMesh())
-			{
-				IsDone = true;
-				return;
-			}
-
-			//TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC = Existing->Foliage;
-			int32 DesiredInstancesPerLeaf = HISMC->DesiredInstancesPerLeaf();
 			int32 NumInstances = InstanceTransforms.Num();
 			TArray<int32> SortedInstances;
 			TArray<int32> InstanceReorderTable;
 			TArray<float> InstanceCustomDataDummy;
 
-			FBox MeshBox(MeshBounds.GetBox());
-
 			//~ by jhlim
-			UGrassInstancedStaticMeshComponent::BuildTreeAnyThread(InstanceTransforms, InstanceCustomDataDummy, 0, MeshBox, ClusterTree, SortedInstances, InstanceReorderTable, OutOcclusionLayerNum, DesiredInstancesPerLeaf, false);
+			{
+				MK_SCATTERING_STAGE_SCOPE(ClusterTree);
+				UGrassInstancedStaticMeshComponent::BuildTreeAnyThread(InstanceTransforms, InstanceCustomDataDummy, 0, MeshBox, ClusterTree, SortedInstances, InstanceReorderTable, OutOcclusionLayerNum, DesiredInstancesPerLeaf, false);
+			}
 			//~! by jhlim
 
 			InstanceData.Reset(NumInstances);
@@ -456,107 +691,174 @@ struct FMkGpuScatteringTransformBuilder
 					SortedInstances[FirstUnfixedIndex] = FirstUnfixedIndex;
 				}
 			}
+
+			// Only the physics scene insertion is left for the game thread
+			if (bBatchedCollision)
+			{
+				BodyTransforms.SetNumUninitialized(InstanceData.Num());
+				for (int32 InstanceIndex = 0; InstanceIndex < InstanceData.Num(); InstanceIndex++)
+				{
+					BodyTransforms[InstanceIndex] = FTransform(InstanceData[InstanceIndex].Transform) * ComponentTransform;
+				}
+			}
 			BuildTime = FPlatformTime::Seconds() - StartTime;
 			//UE_LOG(LogTemp, Warning, TEXT("BuildTime %f"), BuildTime);
 		}
 
-		IsDone = true;
+		MarkDone();
 	}
 	//~ end of Build()
 
+	void MarkDone()
+	{
+		FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::TransformBuilt, BuilderId, Key.ComponentId, Key.SubsectionX, Key.SubsectionY, Key.VarietyIndex, QueuedCycles);
+		IsDone = true;
+	}
+
 };
 
 
 
 
 
-// LandscapeGrass.cpp에서 옮겨옴.
-struct FMkGpuScatteringBuilderBase
-{
-	bool bHaveValidData;
-	float GrassDensity;
-	FVector DrawScale;
-	FVector DrawLoc;
-	FMatrix LandscapeToWorld;
-
-	FIntPoint SectionBase;
-	FIntPoint LandscapeSectionOffset;
-	int32 ComponentSizeQuads;
-	FVector Origin;
-	FVector Extent;
-	FVector ComponentOrigin;
+//~ UMkGpuScatteringBuilder
+int32 UMkGpuScatteringBuilder::GrassUpdateInterval = 1;
 
-	int32 SqrtMaxInstances;
+UMkGpuScatteringBuilder::UMkGpuScatteringBuilder()
+{
+	PrimaryComponentTick.bCanEverTick = false;
+}
 
-	//
-	UTexture* HeightmapTexture = nullptr;
-	const FMkGrassVariety* GrassVariety;
 
-	FMkGpuScatteringBuilderBase(ALandscapeProxy* Landscape, ULandscapeComponent* Component, const FMkGrassVariety& InGrassVariety, int32 SqrtSubsections = 1, int32 SubX = 0, int32 SubY = 0, bool bEnableDensityScaling = true)
-	{
-		const float DensityScale = bEnableDensityScaling ? GMkGpuScatteringDensityScale : 1.0f;
-		GrassVariety = &InGrassVariety;
-		GrassDensity = GrassVariety->GetDensity() * DensityScale;
 
-		DrawScale = Landscape->GetRootComponent()->GetRelativeScale3D();
-		DrawLoc = Landscape->GetActorLocation();
-		LandscapeSectionOffset = Landscape->LandscapeSectionOffset;
+void UMkGpuScatteringBuilder::BeginPlay()
+{
+	Super::BeginPlay();
 
-		SectionBase = Component->GetSectionBase();
-		ComponentSizeQuads = Component->ComponentSizeQuads;
+}
 
-		Origin.X = DrawScale.X * SectionBase.X;
-		Origin.Y = DrawScale.Y * SectionBase.Y;
-		Origin.Z = 0.0f;
+void UMkGpuScatteringBuilder::OnUnregister()
+{
+	// Nothing may still work on the items once the proxy goes, the unapplied ones are issued again if it comes back
+	FMkGpuScatteringCpuEngine::WaitForTasks(GetUniqueID());
+	ReleaseTransformBuilds(true);
 
-		Extent.X = DrawScale.X * ComponentSizeQuads;
-		Extent.Y = DrawScale.Y * ComponentSizeQuads;
-		Extent.Z = 0.0f;
+	Super::OnUnregister();
+}
 
-		ComponentOrigin.X = DrawScale.X * (SectionBase.X - LandscapeSectionOffset.X);
-		ComponentOrigin.Y = DrawScale.Y * (SectionBase.Y - LandscapeSectionOffset.Y);
-		ComponentOrigin.Z = 0.0f;
+void UMkGpuScatteringBuilder::BeginDestroy()
+{
+	Super::BeginDestroy();
 
-		SqrtMaxInstances = FMath::CeilToInt32(FMath::Sqrt(FMath::Abs(Extent.X * Extent.Y * GrassDensity / 1000.0f / 1000.0f)));
+	// The running tasks are waited for by IsReadyForFinishDestroy, jobs still on the GPU or a worker only hold a weak handle
+	ReleaseTransformBuilds(false);
+	CompletedOutputs->Empty();
+}
 
-		bHaveValidData = SqrtMaxInstances != 0;
+bool UMkGpuScatteringBuilder::IsReadyForFinishDestroy()
+{
+	if (FMkGpuScatteringCpuEngine::HasPendingTasks(GetUniqueID()))
+	{
+		return false;
+	}
+	for (const FMkGpuScatteringTransformBuilder* TransformBuilder : TransformBuilders)
+	{
+		if (TransformBuilder && TransformBuilder->Task.IsValid() && !TransformBuilder->Task.IsCompleted())
+		{
+			return false;
+		}
+	}
+	return Super::IsReadyForFinishDestroy();
+}
 
-		LandscapeToWorld = Landscape->GetRootComponent()->GetComponentTransform().ToMatrixNoScale();
+void UMkGpuScatteringBuilder::FinishDestroy()
+{
+	FMkGpuScatteringCpuEngine::WaitForTasks(GetUniqueID());
+	ReleaseTransformBuilds(true);
 
-		//
-		HeightmapTexture = Component->GetHeightmap();
+	Super::FinishDestroy();
+}
 
-		if (bHaveValidData && SqrtSubsections != 1)
-		{
-			check(SqrtMaxInstances > 2 * SqrtSubsections);
-			SqrtMaxInstances /= SqrtSubsections;
-			check(SqrtMaxInstances > 0);
+// Settings a recycled component takes over as they are, everything else is applied again by ApplyVarietySettings
+static UMkGpuScatteringBuilder::FComponentPoolKey MakeComponentPoolKey(const FMkGrassVariety& GrassVariety, bool bGrassComponent)
+{
+	UMkGpuScatteringBuilder::FComponentPoolKey Key;
+	Key.Mesh = GrassVariety.GrassMesh;
+	Key.OverrideMaterials = GrassVariety.OverrideMaterials;
+	Key.CollisionProfileName = GrassVariety.CollisionProfileName;
+	Key.bGrassComponent = bGrassComponent;
+	Key.bCastShadow = GrassVariety.bCastDynamicShadow || GrassVariety.bCastContactShadow;
+	Key.bCastDynamicShadow = GrassVariety.bCastDynamicShadow;
+	Key.bCastContactShadow = GrassVariety.bCastContactShadow;
+	return Key;
+}
 
-			Extent.X /= SqrtSubsections;
-			Extent.Y /= SqrtSubsections;
+static UMkGpuScatteringBuilder::FComponentPoolKey MakeComponentPoolKey(const UHierarchicalInstancedStaticMeshComponent* HISMC)
+{
+	UMkGpuScatteringBuilder::FComponentPoolKey Key;
+	Key.Mesh = HISMC->GetStaticMesh();
+	Key.OverrideMaterials = HISMC->OverrideMaterials;
+	Key.CollisionProfileName = HISMC->GetCollisionProfileName();
+	Key.bGrassComponent = HISMC->IsA<UGrassInstancedStaticMeshComponent>();
+	Key.bCastShadow = HISMC->CastShadow;
+	Key.bCastDynamicShadow = HISMC->bCastDynamicShadow;
+	Key.bCastContactShadow = HISMC->bCastContactShadow;
+	return Key;
+}
 
-			Origin.X += Extent.X * SubX;
-			Origin.Y += Extent.Y * SubY;
-		}
-	}
-};
+// The part of CreateHISMC that differs between varieties of the same pool key
+static void ApplyVarietySettings(UInstancedStaticMeshComponent* Component, const FMkGrassVariety& GrassVariety, int32 InstancingRandomSeed)
+{
+	Component->MinLOD = GrassVariety.MinLOD;
+	Component->bOverrideMinLOD = (Component->MinLOD > 0);
+	Component->bReceivesDecals = GrassVariety.bReceivesDecals;
 
+	Component->InstancingRandomSeed = InstancingRandomSeed;// FolSeed;
 
+	Component->LightingChannels = GrassVariety.LightingChannels;
+	Component->bAffectDistanceFieldLighting = GrassVariety.bAffectDistanceFieldLighting;
+	Component->bEvaluateWorldPositionOffset = GrassVariety.bEvaluateWorldPositionOffset;
+	Component->WorldPositionOffsetDisableDistance = GrassVariety.InstanceWorldPositionOffsetDisableDistance;
+	Component->ShadowCacheInvalidationBehavior = GrassVariety.ShadowCacheInvalidationBehavior;
 
-//~ UMkGpuScatteringBuilder
-int32 UMkGpuScatteringBuilder::GrassUpdateInterval = 1;
+	Component->InstanceStartCullDistance = static_cast<int32>(GrassVariety.GetStartCullDistance()/* * GMkGpuScatteringCullDistanceScale*/);
+	Component->InstanceEndCullDistance = static_cast<int32>(GrassVariety.GetEndCullDistance()/* * GMkGpuScatteringCullDistanceScale*/);
+}
 
-UMkGpuScatteringBuilder::UMkGpuScatteringBuilder()
+// The part of CreateHISMC covered by the pool key, see MakeComponentPoolKey
+static void ApplyPoolKeySettings(UInstancedStaticMeshComponent* Component, const FMkGrassVariety& GrassVariety)
 {
-	PrimaryComponentTick.bCanEverTick = false;
-}
+	FName CollisionProfileName = GrassVariety.CollisionProfileName;
+	bool bDisableCollision = CollisionProfileName == TEXT("NoCollision");
 
+	Component->Mobility = EComponentMobility::Static;
+	Component->SetStaticMesh(GrassVariety.GrassMesh);
+	Component->bSelectable = false;
+	Component->bHasPerInstanceHitProxies = false;
 
+	Component->SetCollisionProfileName(CollisionProfileName);
+	Component->bDisableCollision = bDisableCollision;
 
-void UMkGpuScatteringBuilder::BeginPlay()
+	Component->SetCanEverAffectNavigation(false);
+
+	Component->bCastStaticShadow = false;
+	Component->CastShadow = (GrassVariety.bCastDynamicShadow || GrassVariety.bCastContactShadow);// && !bDisableDynamicShadows;
+	//Component->CastShadow = (GrassVariety.bCastDynamicShadow)/* && !bDisableDynamicShadows*/;
+	Component->bCastDynamicShadow = GrassVariety.bCastDynamicShadow/* && !bDisableDynamicShadows*/;
+	Component->bCastContactShadow = GrassVariety.bCastContactShadow/* && !bDisableDynamicShadows*/;
+	Component->OverrideMaterials = GrassVariety.OverrideMaterials;
+}
+
+static void RegisterFoliageComponent(UInstancedStaticMeshComponent* Component, AActor* Owner)
 {
-	Super::BeginPlay();
+	Component->PrecachePSOs();
+	Component->AttachToComponent(Owner->GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
 
+	FTransform DesiredTransform = Owner->GetRootComponent()->GetComponentTransform();
+	DesiredTransform.RemoveScaling();
+	Component->SetWorldTransform(DesiredTransform);
+
+	Component->RegisterComponent();
 }
 
 UHierarchicalInstancedStaticMeshComponent* UMkGpuScatteringBuilder::CreateHISMC(AActor* Owner, const FMkGrassVariety& GrassVariety, int32 InstancingRandomSeed)
@@ -564,53 +866,154 @@ UHierarchicalInstancedStaticMeshComponent* UMkGpuScatteringBuilder::CreateHISMC(
 	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_CreateHISMC);
 
 
-	FName CollisionProfileName = GrassVariety.CollisionProfileName;
-	bool bDisableCollision = CollisionProfileName == TEXT("NoCollision");
+	bool bDisableCollision = GrassVariety.CollisionProfileName == TEXT("NoCollision");
 
-	UHierarchicalInstancedStaticMeshComponent* HISMC = bDisableCollision ? NewObject<UGrassInstancedStaticMeshComponent>(Owner) : NewObject<UHierarchicalInstancedStaticMeshComponent>(Owner);
-	HISMC->Mobility = EComponentMobility::Static;
-	HISMC->SetStaticMesh(GrassVariety.GrassMesh);
-	HISMC->MinLOD = GrassVariety.MinLOD;
-	HISMC->bOverrideMinLOD = (HISMC->MinLOD > 0);
-	HISMC->bSelectable = false;
-	HISMC->bHasPerInstanceHitProxies = false;
-	HISMC->bReceivesDecals = GrassVariety.bReceivesDecals;
-
-	HISMC->SetCollisionProfileName(CollisionProfileName);
-	HISMC->bDisableCollision = bDisableCollision;
-
-	HISMC->SetCanEverAffectNavigation(false);
-	HISMC->InstancingRandomSeed = InstancingRandomSeed;// FolSeed;
-
-	HISMC->LightingChannels = GrassVariety.LightingChannels;
-	HISMC->bCastStaticShadow = false;
-	HISMC->CastShadow = (GrassVariety.bCastDynamicShadow || GrassVariety.bCastContactShadow);// && !bDisableDynamicShadows;
-	//HISMC->CastShadow = (GrassVariety.bCastDynamicShadow)/* && !bDisableDynamicShadows*/;
-	HISMC->bAffectDistanceFieldLighting = GrassVariety.bAffectDistanceFieldLighting;
-	HISMC->bCastDynamicShadow = GrassVariety.bCastDynamicShadow/* && !bDisableDynamicShadows*/;
-	HISMC->bCastContactShadow = GrassVariety.bCastContactShadow/* && !bDisableDynamicShadows*/;
-	HISMC->OverrideMaterials = GrassVariety.OverrideMaterials;
-	HISMC->bEvaluateWorldPositionOffset = GrassVariety.bEvaluateWorldPositionOffset;
-	HISMC->WorldPositionOffsetDisableDistance = GrassVariety.InstanceWorldPositionOffsetDisableDistance;
-	HISMC->ShadowCacheInvalidationBehavior = GrassVariety.ShadowCacheInvalidationBehavior;
-
-	HISMC->InstanceStartCullDistance = static_cast<int32>(GrassVariety.GetStartCullDistance()/* * GMkGpuScatteringCullDistanceScale*/);
-	HISMC->InstanceEndCullDistance = static_cast<int32>(GrassVariety.GetEndCullDistance()/* * GMkGpuScatteringCullDistanceScale*/);
-
-	HISMC->PrecachePSOs();
-	HISMC->AttachToComponent(Owner->GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
+	// Grass components take the cluster tree of the transform builder, collision included unless MkGpuScattering.BatchedCollision is off
+	const bool bGrassComponent = bDisableCollision || GMkGpuScatteringBatchedCollision;
 
-	FTransform DesiredTransform = Owner->GetRootComponent()->GetComponentTransform();
-	DesiredTransform.RemoveScaling();
-	HISMC->SetWorldTransform(DesiredTransform);
+	if (UHierarchicalInstancedStaticMeshComponent* PooledHISMC = AcquirePooledHISMC(MakeComponentPoolKey(GrassVariety, bGrassComponent)))
+	{
+		// Registered, attached and hidden since ReleaseHISMC, showing it again refreshes the render state
+		ApplyVarietySettings(PooledHISMC, GrassVariety, InstancingRandomSeed);
+		PooledHISMC->SetVisibility(true);
+		return PooledHISMC;
+	}
 
-	HISMC->RegisterComponent();
+	UHierarchicalInstancedStaticMeshComponent* HISMC = bGrassComponent ? NewObject<UGrassInstancedStaticMeshComponent>(Owner) : NewObject<UHierarchicalInstancedStaticMeshComponent>(Owner);
+	ApplyPoolKeySettings(HISMC, GrassVariety);
+	ApplyVarietySettings(HISMC, GrassVariety, InstancingRandomSeed);
+	RegisterFoliageComponent(HISMC, Owner);
 
 	FoliageComponents.Add(HISMC);
 
 	return HISMC;
 }
 
+UInstancedStaticMeshComponent* UMkGpuScatteringBuilder::FindOrCreateMergedComponent(AActor* Owner, const FMkGrassVariety& GrassVariety, uint32 MergedKey)
+{
+	for (const FMergedFoliage& Merged : MergedFoliage)
+	{
+		if (Merged.MergedKey == MergedKey && Merged.Component.IsValid())
+		{
+			return Merged.Component.Get();
+		}
+	}
+
+	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_CreateHISMC);
+
+	check(GrassVariety.UsesMergedComponent());
+
+	// The component was destroyed from outside, the trim pass already dropped the items that used it
+	MergedFoliage.RemoveAllSwap([](const FMergedFoliage& Merged) { return !Merged.Component.IsValid(); }, EAllowShrinking::No);
+
+	// No cluster tree to rebuild, instances are appended and removed in place
+	UInstancedStaticMeshComponent* Component = NewObject<UInstancedStaticMeshComponent>(Owner);
+	ApplyPoolKeySettings(Component, GrassVariety);
+	ApplyVarietySettings(Component, GrassVariety, (int32)(MergedKey | 1));
+	// RemoveMergedRange mirrors the swap on FMergedFoliage::InstanceOwners
+	Component->bSupportRemoveAtSwap = true;
+	RegisterFoliageComponent(Component, Owner);
+
+#if WITH_EDITOR
+	Owner->AddInstanceComponent(Component);
+#endif
+
+	MergedComponents.Add(Component);
+	FMergedFoliage& Merged = MergedFoliage.AddDefaulted_GetRef();
+	Merged.MergedKey = MergedKey;
+	Merged.Component = Component;
+
+	return Component;
+}
+
+UMkGpuScatteringBuilder::FMergedFoliage* UMkGpuScatteringBuilder::FindMergedFoliage(const UInstancedStaticMeshComponent* Component)
+{
+	return MergedFoliage.FindByPredicate([Component](const FMergedFoliage& Merged) { return Merged.Component.Get() == Component; });
+}
+
+int32 UMkGpuScatteringBuilder::RemoveMergedRange(UInstancedStaticMeshComponent* Component, uint32 RangeHandle)
+{
+	FMergedFoliage* Merged = FindMergedFoliage(Component);
+	if (!Merged)
+	{
+		return 0;
+	}
+
+	if (!ensureMsgf(Merged->InstanceOwners.Num() == Component->GetInstanceCount(), TEXT("[UMkGpuScatteringBuilder] Merged component %s has %d instances, %d are tracked"), *Component->GetName(), Component->GetInstanceCount(), Merged->InstanceOwners.Num()))
+	{
+		return 0;
+	}
+
+	// Descending, each removal moves the current last instance into the hole like RemoveInstances does with bSupportRemoveAtSwap
+	TArray<int32> Indices;
+	for (int32 InstanceIndex = Merged->InstanceOwners.Num() - 1; InstanceIndex >= 0; --InstanceIndex)
+	{
+		if (Merged->InstanceOwners[InstanceIndex] == RangeHandle)
+		{
+			Indices.Add(InstanceIndex);
+		}
+	}
+	if (Indices.IsEmpty())
+	{
+		return 0;
+	}
+
+	for (int32 InstanceIndex : Indices)
+	{
+		Merged->InstanceOwners.RemoveAtSwap(InstanceIndex, 1, EAllowShrinking::No);
+	}
+	Component->RemoveInstances(Indices);
+
+	return Indices.Num();
+}
+
+
+UHierarchicalInstancedStaticMeshComponent* UMkGpuScatteringBuilder::AcquirePooledHISMC(const FComponentPoolKey& Key)
+{
+	const bool bPoolEnabled = GMkGpuScatteringComponentPoolSize > 0;
+	TArray<TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent>>* Bucket = bPoolEnabled ? ComponentPool.Find(Key) : nullptr;
+	while (Bucket && Bucket->Num())
+	{
+		UHierarchicalInstancedStaticMeshComponent* HISMC = Bucket->Pop(EAllowShrinking::No).Get();
+		--NumPooledComponents;
+		DEC_DWORD_STAT(STAT_MkGpuScatteringComponentsPooled);
+		if (HISMC && HISMC->IsRegistered())
+		{
+			INC_DWORD_STAT(STAT_MkGpuScatteringComponentPoolHits);
+			++GMkGpuScatteringComponentPoolHits;
+			++GMkGpuScatteringComponentPoolRequests;
+			SET_FLOAT_STAT(STAT_MkGpuScatteringComponentPoolHitRate, 100.0f * GMkGpuScatteringComponentPoolHits / GMkGpuScatteringComponentPoolRequests);
+			return HISMC;
+		}
+	}
+
+	if (bPoolEnabled)
+	{
+		INC_DWORD_STAT(STAT_MkGpuScatteringComponentPoolMisses);
+		++GMkGpuScatteringComponentPoolRequests;
+		SET_FLOAT_STAT(STAT_MkGpuScatteringComponentPoolHitRate, 100.0f * GMkGpuScatteringComponentPoolHits / GMkGpuScatteringComponentPoolRequests);
+	}
+	return nullptr;
+}
+
+bool UMkGpuScatteringBuilder::ReleaseHISMC(UHierarchicalInstancedStaticMeshComponent* HISMC)
+{
+	if (NumPooledComponents >= GMkGpuScatteringComponentPoolSize || !HISMC->IsRegistered())
+	{
+		return false;
+	}
+
+	// ClearInstances tears the bodies down, a batch still pending must not land on the next user
+	PendingInstanceBodies.RemoveAll([HISMC](const FPendingInstanceBodies& Pending) { return Pending.HISMC == HISMC; });
+
+	HISMC->ClearInstances();
+	HISMC->SetVisibility(false);
+
+	ComponentPool.FindOrAdd(MakeComponentPoolKey(HISMC)).Add(HISMC);
+	++NumPooledComponents;
+	INC_DWORD_STAT(STAT_MkGpuScatteringComponentsPooled);
+	return true;
+}
 
 void UMkGpuScatteringBuilder::SetScatteringTypes(const TArray<UMkGpuScatteringTypes*>& InScatteringTypes)
 {
@@ -621,6 +1024,17 @@ void UMkGpuScatteringBuilder::SetScatteringTypes(const TArray<UMkGpuScatteringTy
 		return;
 	}
 
+	bool bChanged = ScatteringTypes.Num() != InScatteringTypes.Num();
+	for (int32 Index = 0; !bChanged && Index < InScatteringTypes.Num(); ++Index)
+	{
+		bChanged = ScatteringTypes[Index] != InScatteringTypes[Index];
+	}
+	if (bChanged)
+	{
+		LayoutTable.Reset();
+		bForceFullBuild = true;
+	}
+
 	ScatteringTypes.Empty();
 	ScatteringTypes.Append(InScatteringTypes);
 
@@ -641,92 +1055,430 @@ void UMkGpuScatteringBuilder::SetScatteringTypes(const TArray<UMkGpuScatteringTy
 	});*/
 }
 
-void UMkGpuScatteringBuilder::OnDelegateCompueteFinish(const FMkGpuScatteringBuilderOutput& Output)
+void UMkGpuScatteringBuilder::OnDelegateCompueteFinish(FMkGpuScatteringBuilderOutput&& Output)
+{
+	check(IsInGameThread());
+
+	MakeHandle().Deliver(MoveTemp(Output));
+}
+
+FMkGpuScatteringBuilderHandle UMkGpuScatteringBuilder::MakeHandle()
 {
-	check(!IsInGameThread());
+	FMkGpuScatteringBuilderHandle Handle;
+	Handle.WeakBuilder = this;
+	Handle.CompletedOutputs = CompletedOutputs;
+	Handle.BuilderId = GetUniqueID();
+	return Handle;
+}
 
+void FMkGpuScatteringBuilderHandle::Deliver(FMkGpuScatteringBuilderOutput&& Output) const
+{
+	// No thread check, a disk cache load can be retracted onto the game thread by FMkGpuScatteringDiskCache::WaitForTasks
 
 	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Build_DelegateFinish);
 
-	FMkCachedLandscapeFoliage::FGrassCompKey GrassCompKey;
-	GrassCompKey.BasedOn = Output.BasedOn;
-	GrassCompKey.CachedMaxInstancesPerComponent = Output.CachedMaxInstancesPerComponent;
-	GrassCompKey.NumVarieties = Output.NumVarieties;
-	GrassCompKey.SqrtSubsections = Output.SqrtSubsections;
-	GrassCompKey.SubsectionX = Output.SubsectionX;
-	GrassCompKey.SubsectionY = Output.SubsectionY;
-	GrassCompKey.VarietyIndex = Output.VarietyIndex;
-
-	FMkCachedLandscapeFoliage::FGrassComp* Existing = FoliageCache.CachedGrassComps.Find(GrassCompKey);
-	if (!Existing || !Existing->Pending || !Existing->Foliage.IsValid())
+	if (Output.DiskCacheKey && !Output.bGpuTransforms)
 	{
-		return;
+		if (Output.bCompactResults)
+		{
+			FMkGpuScatteringDiskCache::StoreAsync(Output.DiskCacheKey, Output.PackedResults);
+		}
+		else
+		{
+			FMkGpuScatteringDiskCache::StoreAsync(Output.DiskCacheKey, Output.ResultBuffer);
+		}
 	}
 
-	TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC = Existing->Foliage;
-	FRandomStream RandomStream(HISMC->InstancingRandomSeed);
-
-	FMkGpuScatteringTransformBuilder* TransformBuilder = new FMkGpuScatteringTransformBuilder(GrassCompKey, HISMC, Output.ResultBuffer, Output.XForm, RandomStream, Output.GrassVariety);
-	TransformBuilder->Build();
+	FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::ReadbackReady, BuilderId, Output.ComponentId, Output.SubsectionX, Output.SubsectionY, Output.VarietyIndex, Output.QueuedCycles);
 
-	//if (TransformBuilder->RequireCPUAccess)
-	if (TransformBuilder->bCollisionEnabled) // 충돌 객체의 우선순위를 높임
+	// Only hand the result off, the cache and the HISMC belong to the game thread. Dropped if the builder went away meanwhile.
+	if (TSharedPtr<FMkGpuScatteringCompletedOutputs, ESPMode::ThreadSafe> Outputs = CompletedOutputs.Pin())
 	{
-		TransformBuilders.Insert(MoveTemp(TransformBuilder), 0);
+		Outputs->Enqueue(MoveTemp(Output));
 	}
-	else
-	{
-		TransformBuilders.Add(MoveTemp(TransformBuilder));
-	}
-
-	Existing->Pending = false;
 }
 
-// ClusterTree build 과정에서 약간의 leak이 발생하는듯(UnrealInsight에서 확인함)
-void UMkGpuScatteringBuilder::Build(const TArray<FVector>& Cameras, int32& InOutNumCompsCreated, UMkGpuScatteringReadbackManager* ReadbackManager)
+void UMkGpuScatteringBuilder::ConsumeCompletedOutputs()
 {
-	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Build);
-
-	if (bPendingFlushCache || !LandscapeProxy)
-	{
-		return;
-	}
+	check(IsInGameThread());
 
-	TArray<TObjectPtr<ULandscapeComponent>> LandscapeComponents = LandscapeProxy->LandscapeComponents;
+	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Build_DelegateFinish);
 
-	float GrassMaxDiscardDistance = 0.0f;
-	for (const UMkGpuScatteringTypes* ScatteringType : ScatteringTypes)
+	FMkGpuScatteringBuilderOutput Output;
+	while (CompletedOutputs->Dequeue(Output))
 	{
-		/*if (!ScatteringType.IsValid())
+		FMkCachedLandscapeFoliage::FGrassCompKey GrassCompKey;
+		GrassCompKey.BasedOn = Output.BasedOn;
+		GrassCompKey.ComponentId = Output.ComponentId;
+		GrassCompKey.CachedMaxInstancesPerComponent = Output.CachedMaxInstancesPerComponent;
+		GrassCompKey.NumVarieties = Output.NumVarieties;
+		GrassCompKey.SqrtSubsections = Output.SqrtSubsections;
+		GrassCompKey.SubsectionX = Output.SubsectionX;
+		GrassCompKey.SubsectionY = Output.SubsectionY;
+		GrassCompKey.VarietyIndex = Output.VarietyIndex;
+
+		const int32 ExistingIndex = FoliageCache.Find(GrassCompKey);
+
+		if (BakeCapture && Output.BakeKey)
 		{
+			// The bake only keeps the results, the item is released without building instances.
+			// Baked data is stored full size, the keys of compact varieties differ anyway.
+			if (Output.PackedResults.Num() > 0)
+			{
+				Output.PackedFrame.Unpack(Output.PackedResults, Output.ResultBuffer);
+			}
+			BakeCapture->Add(Output.BakeKey, MoveTemp(Output.ResultBuffer));
+			if (ExistingIndex != INDEX_NONE)
+			{
+				FoliageCache.GetState(ExistingIndex).bPending = false;
+			}
 			continue;
-		}*/
-		if (!ScatteringType)
+		}
+
+		if (ExistingIndex == INDEX_NONE)
 		{
 			continue;
 		}
 
-		for (const FMkGrassVariety& Variety : ScatteringType->GrassVarieties)
+		FMkCachedLandscapeFoliage::FGrassCompState& ExistingState = FoliageCache.GetState(ExistingIndex);
+		const FMkCachedLandscapeFoliage::FGrassComp& ExistingComp = FoliageCache.GetComp(ExistingIndex);
+		TWeakObjectPtr<UInstancedStaticMeshComponent> Foliage = ExistingComp.GetFoliage();
+		if (!ExistingState.bPending || !Foliage.IsValid())
 		{
-			if (GrassMaxDiscardDistance < Variety.GetEndCullDistance())
-			{
-				GrassMaxDiscardDistance = Variety.GetEndCullDistance();
-			}
+			continue;
 		}
-	}
 
-	float GrassMaxCulledDiscardDistance = GrassMaxDiscardDistance * GMkGpuScatteringCullDistanceScale * FMath::Max(GMkGpuScatteringGuardBandDiscardMultiplier, GMkGpuScatteringGuardBandMultiplier);
-	float GrassMaxSquareDiscardDistance = GrassMaxCulledDiscardDistance * GrassMaxCulledDiscardDistance;
+		if (Output.bDiskCacheLoadFailed)
+		{
+			// No results, the next trim evicts the item and Build gathers it again. The file is forgotten, so the job goes to the GPU.
+			ExistingState.bPending = false;
+			ExistingState.bComponentRemoved = true;
+			bForceFullBuild = true;
+			continue;
+		}
+
+		FRandomStream RandomStream(ExistingComp.InstancingRandomSeed);
+
+		// The item stays pending until the builder is applied, so it can't be evicted while a task still works on it
+		FMkGpuScatteringTransformBuilder* TransformBuilder = new FMkGpuScatteringTransformBuilder(GrassCompKey, Foliage, MoveTemp(Output.ResultBuffer), MoveTemp(Output.PackedResults), Output.PackedFrame, MoveTemp(Output.InstanceTransforms), Output.bGpuTransforms, Output.XForm, RandomStream, Output.GrassVariety);
+		TransformBuilder->DispatchFrame = Output.DispatchFrame;
+		TransformBuilder->QueuedCycles = Output.QueuedCycles;
+		TransformBuilder->BuilderId = GetUniqueID();
+
+		//if (TransformBuilder->RequireCPUAccess)
+		if (TransformBuilder->bCollisionEnabled) // 충돌 객체의 우선순위를 높임
+		{
+			TransformBuilders.Insert(MoveTemp(TransformBuilder), 0);
+		}
+		else
+		{
+			TransformBuilders.Add(MoveTemp(TransformBuilder));
+		}
+	}
+}
+
+void UMkGpuScatteringBuilder::LaunchTransformBuilds()
+{
+	check(IsInGameThread());
+
+	const int32 MaxTasks = GMkGpuScatteringMaxConcurrentTransformTasks;
+
+	// In order, so collision builders go first
+	for (FMkGpuScatteringTransformBuilder* TransformBuilder : TransformBuilders)
+	{
+		if (TransformBuilder->bLaunched)
+		{
+			continue;
+		}
+
+		// Sweeps against the world can't leave the game thread
+		if (TransformBuilder->bCheckCloseLandscape || MaxTasks <= 0)
+		{
+			TransformBuilder->bLaunched = true;
+			TransformBuilder->Build();
+			continue;
+		}
+
+		if (GMkGpuScatteringNumTransformTasks.load() >= MaxTasks)
+		{
+			continue;
+		}
+
+		++GMkGpuScatteringNumTransformTasks;
+		INC_DWORD_STAT(STAT_MkGpuScatteringTransformTasksLaunched);
+
+		TransformBuilder->bLaunched = true;
+		TransformBuilder->Task = UE::Tasks::Launch(UE_SOURCE_LOCATION, [TransformBuilder]()
+		{
+			TransformBuilder->Build();
+			--GMkGpuScatteringNumTransformTasks;
+		});
+	}
+}
+
+void UMkGpuScatteringBuilder::WaitForTransformBuilds()
+{
+	for (FMkGpuScatteringTransformBuilder* TransformBuilder : TransformBuilders)
+	{
+		if (TransformBuilder && TransformBuilder->Task.IsValid())
+		{
+			TransformBuilder->Task.Wait();
+		}
+	}
+}
+
+void UMkGpuScatteringBuilder::ReleaseTransformBuilds(bool bWait)
+{
+	if (bWait)
+	{
+		WaitForTransformBuilds();
+	}
+
+	for (int32 Index = TransformBuilders.Num() - 1; Index >= 0; --Index)
+	{
+		FMkGpuScatteringTransformBuilder* TransformBuilder = TransformBuilders[Index];
+		if (TransformBuilder && TransformBuilder->Task.IsValid() && !TransformBuilder->Task.IsCompleted())
+		{
+			continue;
+		}
+
+		if (TransformBuilder)
+		{
+			// Never applied, the next trim evicts the item and Build gathers it again
+			const int32 ExistingIndex = FoliageCache.Find(TransformBuilder->Key);
+			if (ExistingIndex != INDEX_NONE)
+			{
+				FMkCachedLandscapeFoliage::FGrassCompState& ExistingState = FoliageCache.GetState(ExistingIndex);
+				ExistingState.bPending = false;
+				ExistingState.bComponentRemoved = true;
+			}
+			TransformBuilder->Clear();
+			delete(TransformBuilder);
+		}
+		TransformBuilders.RemoveAt(Index, 1, EAllowShrinking::No);
+	}
+}
+
+bool UMkGpuScatteringBuilder::CanSkipBuild(const TArray<FVector>& Cameras, float SmallestGuardBand) const
+{
+	if (bForceFullBuild || GMkGpuScatteringIncrementalBuildFraction <= 0.0f || SmallestGuardBand <= 0.0f)
+	{
+		return false;
+	}
+
+	// in-flight work finished since the last full pass
+	if (NumPendingComps != NumPendingAtLastBuild)
+	{
+		return false;
+	}
+
+	if (Cameras.Num() != LastBuildCameras.Num())
+	{
+		return false;
+	}
+
+	const double Threshold = GMkGpuScatteringIncrementalBuildFraction * SmallestGuardBand;
+	const double SquaredThreshold = Threshold * Threshold;
+	for (int32 Index = 0; Index < Cameras.Num(); ++Index)
+	{
+		if (FVector::DistSquared(Cameras[Index], LastBuildCameras[Index]) > SquaredThreshold)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void UMkGpuScatteringBuilder::UpdateLayoutTable()
+{
+	FMkGpuScatteringLayoutTable::FSettings Settings;
+	Settings.DrawScale = LandscapeProxy->GetRootComponent()->GetRelativeScale3D();
+	Settings.ComponentSizeQuads = LandscapeProxy->ComponentSizeQuads;
+	Settings.QualityLevel = GMkGrassQualityLevel;
+	Settings.bUseQualityLevels = GEngine && GEngine->UseGrassVarityPerQualityLevels;
+	Settings.DensityScale = GMkGpuScatteringDensityScale;
+	Settings.CullDistanceScale = GMkGpuScatteringCullDistanceScale;
+	Settings.GuardBandMultiplier = GMkGpuScatteringGuardBandMultiplier;
+	Settings.GuardBandDiscardMultiplier = GMkGpuScatteringGuardBandDiscardMultiplier;
+	Settings.MaxInstancesPerComponent = FMath::Max<int32>(1024, GMkMaxInstancesPerComponent);
+	for (const UMkGpuScatteringTypes* ScatteringType : ScatteringTypes)
+	{
+		Settings.ScatteringTypesChangeTag = HashCombine(Settings.ScatteringTypesChangeTag, ScatteringType ? ScatteringType->GetChangeTag() : 0);
+	}
+
+	if (LayoutTable.bValid && LayoutTable.Settings == Settings)
+	{
+		return;
+	}
+
+	SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringLayoutTableRebuild);
+
+	LayoutTable.Reset();
+	LayoutTable.Settings = Settings;
+	LayoutTable.bValid = true;
+
+	// cache keys and halton offsets may differ from the last pass
+	bForceFullBuild = true;
+
+	float GrassMaxDiscardDistance = 0.0f;
+	float GrassMinEndCullDistance = MAX_flt;
+	for (const UMkGpuScatteringTypes* ScatteringType : ScatteringTypes)
+	{
+		if (!ScatteringType)
+		{
+			continue;
+		}
+
+		for (const FMkGrassVariety& Variety : ScatteringType->GrassVarieties)
+		{
+			const int32 EndCullDistance = Variety.GetEndCullDistance();
+			GrassMaxDiscardDistance = FMath::Max<float>(GrassMaxDiscardDistance, EndCullDistance);
+			if (EndCullDistance > 0)
+			{
+				GrassMinEndCullDistance = FMath::Min<float>(GrassMinEndCullDistance, EndCullDistance);
+			}
+		}
+	}
+
+	LayoutTable.MaxDiscardDistance = GrassMaxDiscardDistance * Settings.CullDistanceScale * FMath::Max(Settings.GuardBandDiscardMultiplier, Settings.GuardBandMultiplier);
+
+	// Instances become visible at the cull distance but are created at the discard distance,
+	// so a camera can move through part of that band before anything new can show up.
+	LayoutTable.SmallestGuardBand = GrassMinEndCullDistance < MAX_flt
+		? GrassMinEndCullDistance * Settings.CullDistanceScale * (Settings.GuardBandDiscardMultiplier - 1.0f)
+		: 0.0f;
+
+	// Same math as FGrassBuilderBase in LandscapeGrass.cpp, every component of a proxy shares the draw scale and the size.
+	const double ExtentX = Settings.DrawScale.X * Settings.ComponentSizeQuads;
+	const double ExtentY = Settings.DrawScale.Y * Settings.ComponentSizeQuads;
+
+	uint32 HaltonBaseIndex = 1;
+	int32 GrassVarietyIndex = -1;
+	for (const UMkGpuScatteringTypes* ScatteringType : ScatteringTypes)
+	{
+		if (!ScatteringType || !ScatteringType->bEnable)
+		{
+			continue;
+		}
+
+		int32 LocalVarietyIndex = -1;
+		for (const FMkGrassVariety& GrassVariety : ScatteringType->GrassVarieties)
+		{
+			++GrassVarietyIndex;
+			++LocalVarietyIndex;
+
+			const int32 EndCullDistance = GrassVariety.GetEndCullDistance();
+			const float GrassDensity = GrassVariety.GetDensity();
+			if (!GrassVariety.GrassMesh || GrassDensity <= 0.0f || EndCullDistance <= 0)
+			{
+				continue;
+			}
+
+			FMkGpuScatteringLayoutTable::FVarietyLayout& Layout = LayoutTable.Varieties.AddDefaulted_GetRef();
+			Layout.ScatteringType = ScatteringType;
+			Layout.GrassVariety = &GrassVariety;
+			Layout.VarietyIndex = GrassVarietyIndex;
+			Layout.NumVarieties = ScatteringType->GrassVarieties.Num();
+			if (GrassVariety.UsesMergedComponent())
+			{
+				Layout.MergedKey = HashCombine(GetTypeHash(ScatteringType->GetPathName()), GetTypeHash(LocalVarietyIndex));
+			}
+			Layout.DiscardDistance = Settings.GuardBandDiscardMultiplier * (float)EndCullDistance * Settings.CullDistanceScale;
+			Layout.bUseHalton = !GrassVariety.bUseGrid;
+			Layout.bCollision = GrassVariety.CollisionProfileName != UCollisionProfile::NoCollision_ProfileName;
+			Layout.SpawnLayerName = ScatteringType->bEnableSpawnLayer ? ScatteringType->SpawnLayerName : TEXT("All");
+
+			const int32 SqrtMaxInstances = FMath::CeilToInt32(FMath::Sqrt(FMath::Abs(ExtentX * ExtentY * GrassDensity * Settings.DensityScale / 1000.0f / 1000.0f)));
+			if (SqrtMaxInstances > 0)
+			{
+				Layout.SqrtSubsections = FMath::Clamp<int32>(FMath::CeilToInt(float(SqrtMaxInstances) / FMath::Sqrt((float)Settings.MaxInstancesPerComponent)), 1, 16);
+			}
+			Layout.MaxInstancesSub = FMath::Square(SqrtMaxInstances / Layout.SqrtSubsections);
+
+			if (Layout.bUseHalton)
+			{
+				Layout.HaltonBaseIndex = HaltonBaseIndex;
+				HaltonBaseIndex += Layout.MaxInstancesSub * Layout.SqrtSubsections * Layout.SqrtSubsections;
+			}
+
+			// ULandscapeComponent::CachedLocalBox always spans [0, ComponentSizeQuads] in XY
+			const double SubSize = double(Settings.ComponentSizeQuads) / Layout.SqrtSubsections;
+			Layout.LocalSubBoxes.Reserve(Layout.SqrtSubsections * Layout.SqrtSubsections);
+			for (int32 SubX = 0; SubX < Layout.SqrtSubsections; SubX++)
+			{
+				for (int32 SubY = 0; SubY < Layout.SqrtSubsections; SubY++)
+				{
+					Layout.LocalSubBoxes.Emplace(FVector2D(SubSize * SubX, SubSize * SubY), FVector2D(SubSize * (SubX + 1), SubSize * (SubY + 1)));
+				}
+			}
+		}
+	}
+}
+
+// ClusterTree build 과정에서 약간의 leak이 발생하는듯(UnrealInsight에서 확인함)
+void UMkGpuScatteringBuilder::Build(const TArray<FVector>& Cameras, UMkGpuScatteringScheduler* Scheduler)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Build);
+	MK_SCATTERING_STAGE_SCOPE(Build);
+
+	bSkippedBuildThisFrame = false;
+
+	if (bPendingFlushCache || !LandscapeProxy || !Scheduler)
+	{
+		return;
+	}
+
+	if (ComponentIndex.NeedsRebuild(LandscapeProxy))
+	{
+		SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringComponentIndexRebuild);
+		TArray<uint32> RemovedComponentIds;
+		ComponentIndex.Rebuild(LandscapeProxy, RemovedComponentIds);
+		for (uint32 ComponentId : RemovedComponentIds)
+		{
+			FoliageCache.MarkComponentRemoved(ComponentId);
+		}
+		bForceFullBuild = true;
+	}
+
+	UpdateLayoutTable();
+
+	const float GrassMaxCulledDiscardDistance = LayoutTable.MaxDiscardDistance;
+	const float GrassMaxSquareDiscardDistance = GrassMaxCulledDiscardDistance * GrassMaxCulledDiscardDistance;
+	const float SmallestGuardBand = LayoutTable.SmallestGuardBand;
+
+	if (CanSkipBuild(Cameras, SmallestGuardBand))
+	{
+		// the cache items found by the last full pass are refreshed in WaitAndApplyResults
+		bSkippedBuildThisFrame = true;
+		INC_DWORD_STAT(STAT_MkGpuScatteringBuildsSkipped);
+		return;
+	}
+
+	INC_DWORD_STAT(STAT_MkGpuScatteringBuildsEvaluated);
+	bForceFullBuild = false;
+	LastBuildCameras = Cameras;
+	NumPendingAtLastBuild = NumPendingComps;
+	++BuildEpoch;
+
+	const bool bTracking = FMkGpuScatteringTrace::IsTracking();
+	if (!bTracking)
+	{
+		QueuedJobTimes.Reset();
+	}
 
 
 	//~ Sorting
 	struct SortedLandscapeElement
 	{
-		SortedLandscapeElement(ULandscapeComponent* InComponent, float InMinDistance, const FBox& InBoundsBox)
+		SortedLandscapeElement(ULandscapeComponent* InComponent, float InMinDistance, const FBox& InBoundsBox, const FTransform& InComponentTransform, uint32 InNameHash, uint32 InComponentId)
 			: LandscapeProxy(InComponent->GetLandscapeProxy())
 			, Component(InComponent)
 			, MinDistance(InMinDistance)
 			, BoundsBox(InBoundsBox)
+			, ComponentTransform(InComponentTransform)
+			, NameHash(InNameHash)
+			, ComponentId(InComponentId)
 		{
 
 		}
@@ -735,23 +1487,47 @@ void UMkGpuScatteringBuilder::Build(const TArray<FVector>& Cameras, int32& InOut
 		ULandscapeComponent* Component;
 		float MinDistance;
 		FBox BoundsBox;
+		FTransform ComponentTransform;
+		uint32 NameHash;
+		uint32 ComponentId;
 	};
 
+	// Only the cells around the cameras can be within the discard distance.
+	/*static*/ TArray<int32> CandidateComponents;
+	if (Cameras.Num())
+	{
+		ComponentIndex.Query(Cameras, GrassMaxCulledDiscardDistance, CandidateComponents);
+	}
+	else
+	{
+		CandidateComponents.Reserve(ComponentIndex.Num());
+		for (int32 EntryIndex = 0; EntryIndex < ComponentIndex.Num(); ++EntryIndex)
+		{
+			CandidateComponents.Add(EntryIndex);
+		}
+	}
+
+	INC_DWORD_STAT_BY(STAT_MkGpuScatteringComponentsTotal, ComponentIndex.Num());
+	INC_DWORD_STAT_BY(STAT_MkGpuScatteringComponentsVisited, CandidateComponents.Num());
+
 	/*static*/ TArray<SortedLandscapeElement> SortedLandscapeComponents;
-	SortedLandscapeComponents.Reset(LandscapeComponents.Num());
+	SortedLandscapeComponents.Reset(CandidateComponents.Num());
 
-	for (ULandscapeComponent* Component : LandscapeComponents)
+	for (int32 EntryIndex : CandidateComponents)
 	{
+		const FMkLandscapeComponentIndex::FEntry& Entry = ComponentIndex.GetEntry(EntryIndex);
+		ULandscapeComponent* Component = Entry.Component.Get();
 		if (!Component)
 		{
+			// unregistered since the last rebuild
+			ComponentIndex.MarkDirty();
 			continue;
 		}
 
-		FBoxSphereBounds WorldBounds = Component->CalcBounds(Component->GetComponentTransform());
 		float MinSqrDistanceToComponent = Cameras.Num() ? MAX_flt : 0.0f;
 		for (const FVector& CameraPos : Cameras)
 		{
-			MinSqrDistanceToComponent = FMath::Min<float>(MinSqrDistanceToComponent, static_cast<float>(WorldBounds.ComputeSquaredDistanceFromBoxToPoint(CameraPos)));
+			MinSqrDistanceToComponent = FMath::Min<float>(MinSqrDistanceToComponent, static_cast<float>(ComputeSquaredDistanceFromBoxToPoint(Entry.WorldBox.Min, Entry.WorldBox.Max, CameraPos)));
 		}
 
 		// GrassVarieties 중 가장 먼 Grass 거리를 기준으로 그려질 가능성이 없는 LandscapeComponent 필터링
@@ -760,218 +1536,329 @@ void UMkGpuScatteringBuilder::Build(const TArray<FVector>& Cameras, int32& InOut
 			continue;
 		}
 
-		SortedLandscapeComponents.Emplace(Component, FMath::Sqrt(MinSqrDistanceToComponent), WorldBounds.GetBox());
+		SortedLandscapeComponents.Emplace(Component, FMath::Sqrt(MinSqrDistanceToComponent), Entry.WorldBox, Entry.ComponentTransform, Entry.NameHash, Entry.ComponentId);
 	}
 
 	Algo::Sort(SortedLandscapeComponents, [](const SortedLandscapeElement& A, const SortedLandscapeElement& B) { return A.MinDistance < B.MinDistance; });
 	//~ end of Sorting
 
 
-	float GuardBand = GMkGpuScatteringGuardBandMultiplier;
-	float DiscardGuardBand = GMkGpuScatteringGuardBandDiscardMultiplier;
-	bool bCullSubsections = GMkGpuScatteringCullSubsections > 0;
-	float CullDistanceScale = GMkGpuScatteringCullDistanceScale;
+	const bool bCullSubsections = GMkGpuScatteringCullSubsections > 0;
+	const int32 MaxInstancesPerComponent = LayoutTable.Settings.MaxInstancesPerComponent;
+	const double CurrentTime = FPlatformTime::Seconds();
 
-	int32 GrassMaxCreatePerFrame = 1; //GGrassMaxCreatePerFrame;
-
-	//UE_LOG(LogTemp, Warning, TEXT("[MkGpuScattering] SortedLandscapeComponents %d"), SortedLandscapeComponents.Num());
 	for (const SortedLandscapeElement& SortedLandscapeComponent : SortedLandscapeComponents)
 	{
 		ULandscapeComponent* LandscapeComponent = SortedLandscapeComponent.Component;
-		float MinDistanceToComp = SortedLandscapeComponent.MinDistance;
-
-		uint32 HaltonBaseIndex = 1;
-		int32 GrassVarietyIndex = -1;
-
-		//ERHIFeatureLevel::Type FeatureLevel = GetWorld()->Scene->GetFeatureLevel();
-		int32 MaxInstancesPerComponent = FMath::Max<int32>(1024, GMkMaxInstancesPerComponent);
+		const float MinDistanceToComp = SortedLandscapeComponent.MinDistance;
+		const FBox& LocalBox = LandscapeComponent->CachedLocalBox;
 
-		//for (const TWeakObjectPtr<UMkGpuScatteringTypes>& ScatteringType : ScatteringTypes)
-		for (const UMkGpuScatteringTypes* ScatteringType : ScatteringTypes)
+		for (int32 LayoutIndex = 0; LayoutIndex < LayoutTable.Varieties.Num(); ++LayoutIndex)
 		{
-			if (!ScatteringType || !ScatteringType->bEnable)
+			const FMkGpuScatteringLayoutTable::FVarietyLayout& Layout = LayoutTable.Varieties[LayoutIndex];
+			if (MinDistanceToComp > Layout.DiscardDistance)
 			{
 				continue;
 			}
 
-			bool bEnableSpawnLayer = ScatteringType->bEnableSpawnLayer;
-			bool bEnableBlockingLayer = ScatteringType->bEnableBlockingLayer;
-
-			FString SpawnLayerName = (bEnableSpawnLayer) ? ScatteringType->SpawnLayerName : TEXT("All");
-			FString BlockingLayerName =	(bEnableBlockingLayer) ? ScatteringType->BlockingLayerName : TEXT("None");
-			for (const FMkGrassVariety& GrassVariety : ScatteringType->GrassVarieties)
+			const int32 SqrtSubsections = Layout.SqrtSubsections;
+			const bool bCullThisSubsections = bCullSubsections && SqrtSubsections > 1;
+			for (int32 SubX = 0; SubX < SqrtSubsections; SubX++)
 			{
-				++GrassVarietyIndex;
-
-				int32 EndCullDistance = GrassVariety.GetEndCullDistance();
-				if (!GrassVariety.GrassMesh || GrassVariety.GetDensity() <= 0.0f || EndCullDistance <= 0)
+				for (int32 SubY = 0; SubY < SqrtSubsections; SubY++)
 				{
-					continue;
-				}
+					float MinDistanceToSubComp = MinDistanceToComp;
 
-				float MustHaveDistance = GuardBand * (float)EndCullDistance * CullDistanceScale;
-				float DiscardDistance = DiscardGuardBand * (float)EndCullDistance * CullDistanceScale;
+					if (bCullThisSubsections)
+					{
+						const FBox2D& LocalSubBox2D = Layout.LocalSubBoxes[SubX * SqrtSubsections + SubY];
+						const FBox LocalSubBox(FVector(LocalSubBox2D.Min, LocalBox.Min.Z), FVector(LocalSubBox2D.Max, LocalBox.Max.Z));
+						const FBox WorldSubBox = LocalSubBox.TransformBy(SortedLandscapeComponent.ComponentTransform);
 
+						MinDistanceToSubComp = Cameras.Num() ? MAX_flt : 0.0f;
+						for (const FVector& Pos : Cameras)
+						{
+							MinDistanceToSubComp = FMath::Min<float>(MinDistanceToSubComp, static_cast<float>(ComputeSquaredDistanceFromBoxToPoint(WorldSubBox.Min, WorldSubBox.Max, Pos)));
+						}
+						MinDistanceToSubComp = FMath::Sqrt(MinDistanceToSubComp);
+					}
 
-				bool bUseHalton = !GrassVariety.bUseGrid;
+					if (MinDistanceToSubComp > Layout.DiscardDistance)
+					{
+						continue;
+					}
 
-				if (!bUseHalton && MinDistanceToComp > DiscardDistance)
-				{
-					continue;
-				}
+					FMkCachedLandscapeFoliage::FGrassCompKey Key;
+					Key.BasedOn = LandscapeComponent;
+					Key.ComponentId = SortedLandscapeComponent.ComponentId;
+					Key.SqrtSubsections = SqrtSubsections;
+					Key.CachedMaxInstancesPerComponent = MaxInstancesPerComponent;
+					Key.SubsectionX = SubX;
+					Key.SubsectionY = SubY;
+					Key.NumVarieties = Layout.NumVarieties;
+					Key.VarietyIndex = Layout.VarietyIndex;
+
+					const int32 ExistingIndex = FoliageCache.Find(Key);
+					if (ExistingIndex != INDEX_NONE)
+					{
+						FMkCachedLandscapeFoliage::FGrassCompState& ExistingState = FoliageCache.GetState(ExistingIndex);
+						ExistingState.Touch(GFrameNumber, CurrentTime);
+						ExistingState.LastTouchedBuild = BuildEpoch;
+						continue;
+					}
 
+					// Creation is budgeted across all builders by the scheduler, gather the candidate only.
+					FMkGpuScatteringJob Job;
+					Job.Builder = this;
+					Job.LandscapeComponent = LandscapeComponent;
+					Job.ScatteringType = Layout.ScatteringType;
+					Job.GrassVariety = Layout.GrassVariety;
+					Job.Key = Key;
+					Job.HaltonBaseIndex = Layout.GetHaltonIndex(SubX, SubY);
+					Job.ComponentNameHash = SortedLandscapeComponent.NameHash;
+					Job.LayoutIndex = LayoutIndex;
+					Job.Distance = MinDistanceToSubComp;
+					Job.JobClass = Layout.bCollision ? EMkGpuScatteringJobClass::Collision : EMkGpuScatteringJobClass::Visual;
+
+					if (bTracking)
+					{
+						// The job is gathered again every frame until it is issued, the time to visible starts at the first one
+						FQueuedJobTime& QueuedTime = QueuedJobTimes.FindOrAdd(FMkGpuScatteringTrace::MakeJobId(Key.ComponentId, SubX, SubY, Key.VarietyIndex));
+						if (!QueuedTime.Cycles)
+						{
+							QueuedTime.Cycles = FPlatformTime::Cycles64();
+							FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Queued, GetUniqueID(), Key.ComponentId, SubX, SubY, Key.VarietyIndex, QueuedTime.Cycles);
+						}
+						QueuedTime.BuildEpoch = BuildEpoch;
+						Job.QueuedCycles = QueuedTime.Cycles;
+					}
 
-				FMkGpuScatteringBuilderBase ForSubsectionMath(LandscapeProxy, LandscapeComponent, GrassVariety);
+					Scheduler->AddJob(MoveTemp(Job));
 
-				int32 SqrtSubsections = 1;
-				if (ForSubsectionMath.bHaveValidData && ForSubsectionMath.SqrtMaxInstances > 0)
-				{
-					SqrtSubsections = FMath::Clamp<int32>(FMath::CeilToInt(float(ForSubsectionMath.SqrtMaxInstances) / FMath::Sqrt((float)MaxInstancesPerComponent)), 1, 16);
+					// there is work left that may not be issued this frame, evaluate again next frame
+					bForceFullBuild = true;
 				}
+			}
+		}
+	}
 
-				int32 MaxInstancesSub = FMath::Square(ForSubsectionMath.SqrtMaxInstances / SqrtSubsections);
-				if (bUseHalton && MinDistanceToComp > DiscardDistance)
-				{
-					HaltonBaseIndex += MaxInstancesSub * SqrtSubsections * SqrtSubsections;
-					continue;
-				}
-				//UE_LOG(LogTemp, Warning, TEXT("[MkGpuScattering] SqrtSubsections %d, MaxInstancesSub %d, SqrtMaxInstances %d"), SqrtSubsections, MaxInstancesSub, ForSubsectionMath.SqrtMaxInstances);
+	// Jobs that left the range before they were issued
+	for (auto It = QueuedJobTimes.CreateIterator(); It; ++It)
+	{
+		if (It.Value().BuildEpoch != BuildEpoch)
+		{
+			It.RemoveCurrent();
+		}
+	}
+}
 
-				FBox LocalBox = LandscapeComponent->CachedLocalBox;
-				FVector LocalExtentDiv = (LocalBox.Max - LocalBox.Min) * FVector(1.0f / float(SqrtSubsections), 1.0f / float(SqrtSubsections), 1.0f);
-				for (int32 SubX = 0; SubX < SqrtSubsections; SubX++)
-				{
-					for (int32 SubY = 0; SubY < SqrtSubsections; SubY++)
-					{
-						float MinDistanceToSubComp = MinDistanceToComp;
 
-						FBox WorldSubBox;
+void UMkGpuScatteringBuilder::EndFrameIssueJobStats()
+{
+	check(IsInGameThread());
 
-						if ((bCullSubsections && SqrtSubsections > 1))// || Component->ActiveExcludedBoxes.Num())
-						{
-							FVector BoxMin;
-							BoxMin.X = LocalBox.Min.X + LocalExtentDiv.X * float(SubX);
-							BoxMin.Y = LocalBox.Min.Y + LocalExtentDiv.Y * float(SubY);
-							BoxMin.Z = LocalBox.Min.Z;
-
-							FVector BoxMax;
-							BoxMax.X = LocalBox.Min.X + LocalExtentDiv.X * float(SubX + 1);
-							BoxMax.Y = LocalBox.Min.Y + LocalExtentDiv.Y * float(SubY + 1);
-							BoxMax.Z = LocalBox.Max.Z;
-
-							FBox LocalSubBox(BoxMin, BoxMax);
-							WorldSubBox = LocalSubBox.TransformBy(LandscapeComponent->GetComponentTransform());
-
-							//if (bCullSubsections && SqrtSubsections > 1)
-							{
-								MinDistanceToSubComp = Cameras.Num() ? MAX_flt : 0.0f;
-								for (auto& Pos : Cameras)
-								{
-									MinDistanceToSubComp = FMath::Min<float>(MinDistanceToSubComp, static_cast<float>(ComputeSquaredDistanceFromBoxToPoint(WorldSubBox.Min, WorldSubBox.Max, Pos)));
-								}
-								MinDistanceToSubComp = FMath::Sqrt(MinDistanceToSubComp);
-							}
-						}
+#if ENABLE_LOW_LEVEL_MEM_TRACKER && STATS
+	using namespace MkGpuScatteringIssueJobStats;
 
-						if (bUseHalton)
-						{
-							HaltonBaseIndex += MaxInstancesSub;  // we are going to pre-increment this for all of the continues...however we need to subtract later if we actually do this sub
-						}
+	if (!FLowLevelMemTracker::IsEnabled())
+	{
+		return;
+	}
 
-						if (MinDistanceToSubComp > DiscardDistance)
-						{
-							continue;
-						}
+	// Net bytes still held under the tag. LLM folds the thread counts in once per frame, the running ratio hides that frame of lag.
+	const int64 TagBytes = FLowLevelMemTracker::Get().GetTagAmountForTracker(ELLMTracker::Default, FName(TEXT("MkGpuScatteringBuilder_IssueJob")), ELLMTagSet::None);
+	if (BaselineBytes < 0)
+	{
+		BaselineBytes = TagBytes;
+		NumJobs = 0;
+		return;
+	}
+	if (NumJobs > 0)
+	{
+		SET_MEMORY_STAT(STAT_MkGpuScatteringIssueJobBytesPerJob, FMath::Max<int64>(TagBytes - BaselineBytes, 0) / NumJobs);
+	}
+#endif
+}
 
+bool UMkGpuScatteringBuilder::IssueJob(const FMkGpuScatteringJob& Job, UMkGpuScatteringReadbackManager* ReadbackManager)
+{
+	ULandscapeComponent* LandscapeComponent = Job.LandscapeComponent;
+	if (bPendingFlushCache || !LandscapeProxy || !LandscapeComponent || !LayoutTable.Varieties.IsValidIndex(Job.LayoutIndex) || FoliageCache.Find(Job.Key) != INDEX_NONE)
+	{
+		return false;
+	}
 
-						FMkCachedLandscapeFoliage::FGrassComp NewComp;
-						NewComp.Key.BasedOn = LandscapeComponent;
-						NewComp.Key.SqrtSubsections = SqrtSubsections;
-						NewComp.Key.CachedMaxInstancesPerComponent = MaxInstancesPerComponent;
-						NewComp.Key.SubsectionX = SubX;
-						NewComp.Key.SubsectionY = SubY;
-						NewComp.Key.NumVarieties = ScatteringType->GrassVarieties.Num();
-						NewComp.Key.VarietyIndex = GrassVarietyIndex;
+	const FMkGpuScatteringLayoutTable::FVarietyLayout& Layout = LayoutTable.Varieties[Job.LayoutIndex];
+	if (Layout.GrassVariety != Job.GrassVariety)
+	{
+		// the layout was rebuilt after the job was gathered
+		return false;
+	}
 
-						uint32 HaltonIndexForSub = 0;
-						if (bUseHalton)
-						{
-							check(HaltonBaseIndex > (uint32)MaxInstancesSub);
-							HaltonIndexForSub = HaltonBaseIndex - (uint32)MaxInstancesSub;
-						}
+	const UMkGpuScatteringTypes* ScatteringType = Job.ScatteringType;
+	const FMkGrassVariety& GrassVariety = *Job.GrassVariety;
 
-						//UE_LOG(LogTemp, Log, TEXT("!!!!!!!! HaltonIndexForSub %d"), HaltonIndexForSub);
+	FMkCachedLandscapeFoliage::FGrassComp NewComp;
+	NewComp.Key = Job.Key;
 
-						FMkCachedLandscapeFoliage::FGrassComp* Existing = FoliageCache.CachedGrassComps.Find(NewComp.Key);
-						if (Existing)
-						{
-							Existing->Touch();
-							continue;
-						}
-						if (InOutNumCompsCreated >= GrassMaxCreatePerFrame)
-						{
-							continue;
-						}
-						InOutNumCompsCreated++;
-						//UE_LOG(LogTemp, Warning, TEXT("Frame %d(%s), InOutNumCompsCreated %d"), GFrameCounter, *LandscapeProxy->GetName(), InOutNumCompsCreated);
+	FMkCachedLandscapeFoliage::FGrassCompState NewState;
+	NewState.Touch(GFrameNumber, FPlatformTime::Seconds());
+	NewState.LastTouchedBuild = BuildEpoch;
 
-						//UE_LOG(LogTemp, Warning, TEXT("LandscapeComponent->GetName().ToLower() %s"), *LandscapeComponent->GetName().ToLower());
-						int32 FolSeed = FCrc::StrCrc32(StringCast<ANSICHAR>(*FString::Printf(TEXT("%s%d %d %d"), *LandscapeComponent->GetName().ToLower(), SubX, SubY, GrassVarietyIndex)).Get());
-						if (FolSeed == 0)
-						{
-							FolSeed++;
-						}
+	const uint32 SubX = Job.Key.SubsectionX;
+	const uint32 SubY = Job.Key.SubsectionY;
+	const uint32 GrassVarietyIndex = Job.Key.VarietyIndex;
 
-						// Do not record the transaction of creating temp component for visualizations
-						ClearFlags(RF_Transactional);
-						bool PreviousPackageDirtyFlag = GetOutermost()->IsDirty();
+	// Tracing was turned on after the job was gathered, its time to visible starts now
+	const uint64 QueuedCycles = Job.QueuedCycles ? Job.QueuedCycles : (FMkGpuScatteringTrace::IsTracking() ? FPlatformTime::Cycles64() : 0);
+	QueuedJobTimes.Remove(FMkGpuScatteringTrace::MakeJobId(Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex));
 
-						UHierarchicalInstancedStaticMeshComponent* HISMC = CreateHISMC(LandscapeProxy, GrassVariety, FolSeed);
-						NewComp.CachedBuffers = new FMkGpuScatteringCachedBuffers();
-						NewComp.Foliage = HISMC;
+	// Integer version of the former Crc("<component name><SubX> <SubY> <VarietyIndex>"), the name part is cached by the component index.
+	int32 FolSeed = (int32)HashCombineFast(Job.ComponentNameHash, (SubX & 0xff) | ((SubY & 0xff) << 8) | ((GrassVarietyIndex & 0xffff) << 16));
+	if (FolSeed == 0)
+	{
+		FolSeed++;
+	}
+
+	// Do not record the transaction of creating temp component for visualizations
+	ClearFlags(RF_Transactional);
+	bool PreviousPackageDirtyFlag = GetOutermost()->IsDirty();
+
+	NewComp.InstancingRandomSeed = FolSeed;
+	if (GrassVariety.UsesMergedComponent())
+	{
+		// Shared by every item of the variety, the item only owns a range of its instances
+		NewComp.MergedFoliage = FindOrCreateMergedComponent(LandscapeProxy, GrassVariety, Layout.MergedKey);
+		NewComp.MergedRangeHandle = ++NextMergedRangeHandle;
+		if (NewComp.MergedRangeHandle == 0)
+		{
+			NewComp.MergedRangeHandle = ++NextMergedRangeHandle;
+		}
+	}
+	else
+	{
+		UHierarchicalInstancedStaticMeshComponent* HISMC = CreateHISMC(LandscapeProxy, GrassVariety, FolSeed);
+		NewComp.Foliage = HISMC;
 
 #if WITH_EDITOR
-						LandscapeProxy->AddInstanceComponent(HISMC);
+		LandscapeProxy->AddInstanceComponent(HISMC);
 #endif
-						FMkGpuScatteringCS_Param* Param = new FMkGpuScatteringCS_Param(
-							this
-							, SpawnLayerName
-							, BlockingLayerName
-							, LandscapeProxy
-							, NewComp
-							, &GrassVariety
-							, HaltonIndexForSub
-							, MaxInstancesPerComponent
-							, ReadbackManager
-						);
-
-						if (ScatteringType->bEnableSpawnLayer && !Param->WeightmapTexture)
-						{
-							FoliageCache.CachedGrassComps.Add(NewComp);
+	}
 
-							SetFlags(RF_Transactional);
-							GetOutermost()->SetDirtyFlag(PreviousPackageDirtyFlag);
-							continue;
-						}
+	// What the job itself allocates: its parameters, the pending batch and the cache item growing.
+	// Copies of baked results and disk cache loads are tagged on their own.
+	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_IssueJob);
+#if ENABLE_LOW_LEVEL_MEM_TRACKER && STATS
+	++MkGpuScatteringIssueJobStats::NumJobs;
+#endif
+	INC_DWORD_STAT(STAT_MkGpuScatteringJobsIssued);
+
+	FMkGpuScatteringCS_Param Param(
+		this
+		, Layout.SpawnLayerName
+		, LandscapeProxy
+		, NewComp
+		, &GrassVariety
+		, Job.HaltonBaseIndex
+		, Job.Key.CachedMaxInstancesPerComponent
+		, ReadbackManager
+	);
+	Param.BuilderOutput.QueuedCycles = QueuedCycles;
+
+	const bool bNothingToScatter = ScatteringType->bEnableSpawnLayer && !Param.WeightmapTexture;
+
+	bool bDispatched = false;
+	TArrayView<const FLocationNormalScaleZ> BakedResults;
+	if (bNothingToScatter)
+	{
+		// nothing to scatter on this component, keep the empty item so it is not requested again
+		NewState.bPending = false;
+	}
+	else if (BakeCapture)
+	{
+		// The bake wants what the GPU produces now, baked data and the disk cache are skipped
+		Param.bGpuTransform = false;
+		Param.BuilderOutput.BakeKey = Param.MakePlacementKey();
+		FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Dispatched, GetUniqueID(), Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex, QueuedCycles);
+		FMkAsyncBuilderInterface::Dispatch(MoveTemp(Param));
+		bDispatched = true;
+	}
+	else if (FindBakedResults(Param, BakedResults))
+	{
+		LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Build_DelegateFinish);
+		INC_DWORD_STAT(STAT_MkGpuScatteringBakedJobs);
+		FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::CacheHit, GetUniqueID(), Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex, QueuedCycles);
+		Param.BuilderOutput.ResultBuffer = BakedResults;
+		OnDelegateCompueteFinish(MoveTemp(Param.BuilderOutput));
+		bDispatched = true;
+	}
+	else if (FMkGpuScatteringDiskCache::IsEnabled())
+	{
+		const uint64 DiskCacheKey = Param.MakeDiskCacheKey();
+		if (DiskCacheKey && FMkGpuScatteringDiskCache::Contains(DiskCacheKey))
+		{
+			// Same inputs as a previous run, the results come from disk and the GPU is skipped
+			FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::CacheHit, GetUniqueID(), Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex, QueuedCycles);
+			FMkGpuScatteringDiskCache::LoadAsync(DiskCacheKey, Param.Builder, MoveTemp(Param.BuilderOutput));
+		}
+		else
+		{
+			// Transform_CS results never reach the CPU, nothing to store
+			Param.BuilderOutput.DiskCacheKey = Param.bGpuTransform ? 0 : DiskCacheKey;
+			FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Dispatched, GetUniqueID(), Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex, QueuedCycles);
+			FMkAsyncBuilderInterface::Dispatch(MoveTemp(Param));
+		}
+		bDispatched = true;
+	}
+	else
+	{
+		FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Dispatched, GetUniqueID(), Job.Key.ComponentId, SubX, SubY, GrassVarietyIndex, QueuedCycles);
+		FMkAsyncBuilderInterface::Dispatch(MoveTemp(Param));
+		bDispatched = true;
+	}
 
-						if (!AsyncBuilderInterface)
-						{
-							AsyncBuilderInterface = new FMkAsyncBuilderInterface();
-						}
-						AsyncBuilderInterface->Dispatch(*Param);
-						delete(Param);
+	FoliageCache.Add(MoveTemp(NewComp), NewState);
 
-						FoliageCache.CachedGrassComps.Add(NewComp);
+	SetFlags(RF_Transactional);
+	GetOutermost()->SetDirtyFlag(PreviousPackageDirtyFlag);
 
-						SetFlags(RF_Transactional);
-						GetOutermost()->SetDirtyFlag(PreviousPackageDirtyFlag);
-					}
-				}
-			}
+	return bDispatched;
+}
+
+bool UMkGpuScatteringBuilder::FindBakedResults(const FMkGpuScatteringCS_Param& Param, TArrayView<const FLocationNormalScaleZ>& OutResults) const
+{
+	if (!GMkGpuScatteringUseBakedData || !LandscapeProxy)
+	{
+		return false;
+	}
+
+	USceneComponent* RootComponent = LandscapeProxy->GetRootComponent();
+	UMkGpuScatteringBakedData* BakedData = RootComponent ? RootComponent->GetAssetUserData<UMkGpuScatteringBakedData>() : nullptr;
+	if (!BakedData || BakedData->GetNumEntries() == 0)
+	{
+		return false;
+	}
+
+#if WITH_EDITOR
+	// The placement key does not cover the heightmap and weightmap content, sculpted or painted landscapes go through the GPU
+	if (BakedSourceCheckFrame != GFrameCounter)
+	{
+		BakedSourceCheckFrame = GFrameCounter;
+		bBakedSourceMatches = BakedData->MatchesSource(LandscapeProxy);
+		if (!bBakedSourceMatches && !bWarnedStaleBakedData)
+		{
+			UE_LOG(LogTemp, Display, TEXT("[UMkGpuScatteringBuilder] Baked data of %s is older than its landscape, ignored until the next bake"), *LandscapeProxy->GetActorNameOrLabel());
+			bWarnedStaleBakedData = true;
 		}
 	}
-}
+	if (!bBakedSourceMatches)
+	{
+		return false;
+	}
+#endif
 
+	return BakedData->Find(Param.MakePlacementKey(), OutResults);
+}
 
 void UMkGpuScatteringBuilder::WaitAndApplyResults()
 {
@@ -983,75 +1870,144 @@ void UMkGpuScatteringBuilder::WaitAndApplyResults()
 	//
 	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_WaitAndApply);
 
-	TSet<UHierarchicalInstancedStaticMeshComponent*> StillUsed;
 	{
-		QUICK_SCOPE_CYCLE_COUNTER(STAT_Grass_StillUsed);
+		QUICK_SCOPE_CYCLE_COUNTER(STAT_Grass_Trim);
+		MK_SCATTERING_STAGE_SCOPE(Apply);
 
 		// trim cached items based on time, pending and emptiness
-		double OldestToKeepTime = FPlatformTime::Seconds() - GMkGpuScatteringMinTimeToKeepGrass;
+		const double CurrentTime = FPlatformTime::Seconds();
+		double OldestToKeepTime = CurrentTime - GMkGpuScatteringMinTimeToKeepGrass;
 		uint32 OldestToKeepFrame = GFrameNumber - GMkGpuScatteringMinTimeToKeepGrass * GetGrassUpdateInterval();
 
-		for (FMkCachedLandscapeFoliage::TGrassSet::TIterator Iter(FoliageCache.CachedGrassComps); Iter; ++Iter)
+		NumPendingComps = 0;
+
+		// Backwards because RemoveAt swaps the last item in. The cold item is only read for the component check.
+		for (int32 Index = FoliageCache.Num() - 1; Index >= 0; --Index)
 		{
-			/*const*/ FMkCachedLandscapeFoliage::FGrassComp& GrassItem = *Iter;
-			UHierarchicalInstancedStaticMeshComponent* Used = GrassItem.Foliage.Get();
-			bool bOld =	!GrassItem.Pending
-				&& (!GrassItem.Key.BasedOn.Get()
-					|| /*!GrassItem.Key.GrassType.Get() ||*/
-					!Used || (GrassItem.LastUsedFrameNumber < OldestToKeepFrame && GrassItem.LastUsedTime < OldestToKeepTime));
+			FMkCachedLandscapeFoliage::FGrassCompState& State = FoliageCache.GetState(Index);
 
-			if (bOld)
+			// Build was skipped because the cameras did not move, so everything the last full pass found is still in use.
+			if (bSkippedBuildThisFrame && State.LastTouchedBuild == BuildEpoch)
 			{
-				delete(GrassItem.CachedBuffers);
-
-				Iter.RemoveCurrent();
+				State.Touch(GFrameNumber, CurrentTime);
 			}
-			else if (Used)
+			if (State.bPending)
 			{
-				if (!StillUsed.Num())
+				++NumPendingComps;
+				continue;
+			}
+
+			FMkCachedLandscapeFoliage::FGrassComp& GrassItem = FoliageCache.GetComp(Index);
+			// Also drops the items whose component, own or merged, was destroyed from outside (level unload, editor delete)
+			bool bOld = State.bComponentRemoved || (State.LastUsedFrameNumber < OldestToKeepFrame && State.LastUsedTime < OldestToKeepTime)
+				|| !GrassItem.GetFoliage().IsValid();
+			if (bOld)
+			{
+				if (GrassItem.MergedRangeHandle)
 				{
-					StillUsed.Reserve(FoliageCache.CachedGrassComps.Num());
+					PendingRangeRemovals.Add({ GrassItem.MergedFoliage, GrassItem.MergedRangeHandle });
 				}
-				if (Used)
+				else
 				{
-					//UE_LOG(LogTemp, Warning, TEXT("PerInstanceSMData.Num %d"), Used->PerInstanceSMData.Num());
-					StillUsed.Add(Used);
+					PendingDestroyFoliage.Add(GrassItem.Foliage);
 				}
+
+				FoliageCache.RemoveAt(Index);
 			}
 		}
 	}
 
-	if (StillUsed.Num() < FoliageComponents.Num())
+#if STATS
+	{
+		// Live jobs per stage, the pending items without a transform builder still wait for their results
+		int32 NumBuilt = 0;
+		for (const FMkGpuScatteringTransformBuilder* TransformBuilder : TransformBuilders)
+		{
+			NumBuilt += TransformBuilder && TransformBuilder->IsDone ? 1 : 0;
+		}
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringInFlightDispatched, FMath::Max(NumPendingComps - TransformBuilders.Num(), 0));
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringInFlightReadbackReady, TransformBuilders.Num() - NumBuilt);
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringInFlightTransformBuilt, NumBuilt);
+
+		for (const FMergedFoliage& Merged : MergedFoliage)
+		{
+			INC_DWORD_STAT_BY(STAT_MkGpuScatteringMergedInstances, Merged.InstanceOwners.Num());
+		}
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringMergedComponents, MergedFoliage.Num());
+	}
+#endif
+
+	if (PendingDestroyFoliage.Num())
 	{
 		QUICK_SCOPE_CYCLE_COUNTER(STAT_Grass_DelComps);
+		MK_SCATTERING_STAGE_SCOPE(Apply);
 
-		// delete components that are no longer used
-		for (int32 Index = 0; Index < FoliageComponents.Num(); Index++)
+		// recycle or delete components that are no longer used, as many as the budget allows
+		while (PendingDestroyFoliage.Num() && GMkGpuScatteringApplyBudget.CanAfford(FMkGpuScatteringApplyBudget::DestroyComponent, 1))
 		{
-			UHierarchicalInstancedStaticMeshComponent* HComponent = FoliageComponents[Index];
-			if (!StillUsed.Contains(HComponent))
+			UHierarchicalInstancedStaticMeshComponent* HComponent = PendingDestroyFoliage.Pop(EAllowShrinking::No).Get();
+			if (!HComponent)
 			{
-				if (HComponent)
-				{
-					HComponent->ClearInstances();
-					HComponent->DetachFromComponent(FDetachmentTransformRules(EDetachmentRule::KeepRelative, false));
-					HComponent->DestroyComponent();
-				}
-				FoliageComponents.RemoveAtSwap(Index--);
+				continue;
+			}
 
-				//if (!bForceSync)
-				{
-					break; // one per frame is fine
-				}
+			const double DestroyStartTime = FPlatformTime::Seconds();
+
+			if (!ReleaseHISMC(HComponent))
+			{
+				FoliageComponents.RemoveSingleSwap(HComponent, EAllowShrinking::No);
+				HComponent->ClearInstances();
+				HComponent->DetachFromComponent(FDetachmentTransformRules(EDetachmentRule::KeepRelative, false));
+				HComponent->DestroyComponent();
+			}
+
+			const double DestroyMs = (FPlatformTime::Seconds() - DestroyStartTime) * 1000.0;
+			GMkGpuScatteringApplyBudget.Record(FMkGpuScatteringApplyBudget::DestroyComponent, 1, DestroyMs);
+			INC_FLOAT_STAT_BY(STAT_MkGpuScatteringApplyBudgetUsed, (float)DestroyMs);
+			INC_DWORD_STAT(STAT_MkGpuScatteringComponentsDestroyed);
+		}
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringComponentsPendingDestroy, PendingDestroyFoliage.Num());
+	}
+
+	if (PendingRangeRemovals.Num())
+	{
+		QUICK_SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringRemoveMergedRanges);
+		MK_SCATTERING_STAGE_SCOPE(Apply);
+
+		// Oldest first, each removal walks the whole component so they are budgeted one by one
+		int32 NumRemoved = 0;
+		while (NumRemoved < PendingRangeRemovals.Num() && GMkGpuScatteringApplyBudget.CanAfford(FMkGpuScatteringApplyBudget::RemoveMergedRange, 1))
+		{
+			const FPendingRangeRemoval& Removal = PendingRangeRemovals[NumRemoved++];
+			UInstancedStaticMeshComponent* Component = Removal.Component.Get();
+			if (!Component)
+			{
+				continue;
 			}
+
+			const double RemoveStartTime = FPlatformTime::Seconds();
+
+			RemoveMergedRange(Component, Removal.RangeHandle);
+
+			const double RemoveMs = (FPlatformTime::Seconds() - RemoveStartTime) * 1000.0;
+			GMkGpuScatteringApplyBudget.Record(FMkGpuScatteringApplyBudget::RemoveMergedRange, 1, RemoveMs);
+			INC_FLOAT_STAT_BY(STAT_MkGpuScatteringApplyBudgetUsed, (float)RemoveMs);
 		}
+		PendingRangeRemovals.RemoveAt(0, NumRemoved, EAllowShrinking::No);
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringMergedRangesPendingRemoval, PendingRangeRemovals.Num());
 	}
 
+	CreatePendingInstanceBodies();
+
+	ConsumeCompletedOutputs();
+
 	if (TransformBuilders.IsEmpty())
 	{
 		return;
 	}
 
+	LaunchTransformBuilds();
+
 	for (int32 Index = 0; Index < TransformBuilders.Num(); Index++)
 	{
 		if (!TransformBuilders.IsValidIndex(Index))
@@ -1063,7 +2019,6 @@ void UMkGpuScatteringBuilder::WaitAndApplyResults()
 		FMkGpuScatteringTransformBuilder* TransformBuilder = TransformBuilders[Index];
 		if (!TransformBuilder)
 		{
-			TransformBuilders.RemoveAtSwap(Index--);
 			continue;
 		}
 		if (!TransformBuilder->IsDone)
@@ -1071,13 +2026,70 @@ void UMkGpuScatteringBuilder::WaitAndApplyResults()
 			continue;
 		}
 
+		UInstancedStaticMeshComponent* Foliage = TransformBuilder->Foliage.Get();
+		if (TransformBuilder->bMerged && Foliage && TransformBuilder->MergedTransforms.Num() > 0)
+		{
+			const int32 NumMergedInstances = TransformBuilder->MergedTransforms.Num();
+			if (!GMkGpuScatteringApplyBudget.CanAfford(FMkGpuScatteringApplyBudget::AppendMergedRange, NumMergedInstances))
+			{
+				INC_DWORD_STAT(STAT_MkGpuScatteringBuildsDeferred);
+				continue;
+			}
+
+			QUICK_SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringAppendMergedRange);
+			MK_SCATTERING_STAGE_SCOPE(Apply);
 
+			const double ApplyStartTime = FPlatformTime::Seconds();
+
+			const int32 ExistingIndex = FoliageCache.Find(TransformBuilder->Key);
+			FMergedFoliage* Merged = FindMergedFoliage(Foliage);
+			if (ExistingIndex != INDEX_NONE && Merged)
+			{
+				// Appended at the end, InstanceOwners tags them with the range of the item
+				Foliage->AddInstances(TransformBuilder->MergedTransforms, false, false);
+				Merged->InstanceOwners.Reserve(Merged->InstanceOwners.Num() + NumMergedInstances);
+				const uint32 RangeHandle = FoliageCache.GetComp(ExistingIndex).MergedRangeHandle;
+				for (int32 InstanceIndex = 0; InstanceIndex < NumMergedInstances; InstanceIndex++)
+				{
+					Merged->InstanceOwners.Add(RangeHandle);
+				}
+
+				FMkCachedLandscapeFoliage::FGrassCompState& ExistingState = FoliageCache.GetState(ExistingIndex);
+				ExistingState.bPending = false;
+				ExistingState.Touch(GFrameNumber, FPlatformTime::Seconds());
+			}
+
+			SET_DWORD_STAT(STAT_MkGpuScatteringDispatchToApplyFrames, (uint32)(GFrameCounter - TransformBuilder->DispatchFrame));
+			FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Applied, TransformBuilder->BuilderId, TransformBuilder->Key.ComponentId, TransformBuilder->Key.SubsectionX, TransformBuilder->Key.SubsectionY, TransformBuilder->Key.VarietyIndex, TransformBuilder->QueuedCycles);
+			FMkGpuScatteringTrace::AddTimeToVisible(TransformBuilder->QueuedCycles);
+
+			delete(TransformBuilders[Index]);
+			TransformBuilders[Index] = nullptr;
+
+			const double ApplyMs = (FPlatformTime::Seconds() - ApplyStartTime) * 1000.0;
+			GMkGpuScatteringApplyBudget.Record(FMkGpuScatteringApplyBudget::AppendMergedRange, NumMergedInstances, ApplyMs);
+			INC_FLOAT_STAT_BY(STAT_MkGpuScatteringApplyBudgetUsed, (float)ApplyMs);
+			INC_DWORD_STAT(STAT_MkGpuScatteringBuildsApplied);
+			continue;
+		}
 
 		int32 NumBuiltRenderInstances = TransformBuilder->InstanceBuffer.GetNumInstances();
-		UHierarchicalInstancedStaticMeshComponent* HISMC = (TransformBuilder->HISMC.Get());
+		UHierarchicalInstancedStaticMeshComponent* HISMC = Cast<UHierarchicalInstancedStaticMeshComponent>(Foliage);
 		if (HISMC && NumBuiltRenderInstances > 0)
 		{
+			const bool bAddInstances = !HISMC->bDisableCollision && !TransformBuilder->bBatchedCollision;
+			const FMkGpuScatteringApplyBudget::EOp ApplyOp = bAddInstances ? FMkGpuScatteringApplyBudget::AddInstances : FMkGpuScatteringApplyBudget::AcceptPrebuiltTree;
+			if (!GMkGpuScatteringApplyBudget.CanAfford(ApplyOp, NumBuiltRenderInstances))
+			{
+				// Left for a later frame, a smaller build further down may still fit
+				INC_DWORD_STAT(STAT_MkGpuScatteringBuildsDeferred);
+				continue;
+			}
+
 			QUICK_SCOPE_CYCLE_COUNTER(STAT_FoliageGrassEndComp_AcceptPrebuiltTree);
+			MK_SCATTERING_STAGE_SCOPE(Apply);
+
+			const double ApplyStartTime = FPlatformTime::Seconds();
 
 #if false
 			//HISMC->ReleasePerInstanceRenderData();
@@ -1105,7 +2117,7 @@ void UMkGpuScatteringBuilder::WaitAndApplyResults()
 				HISMC->RegisterComponent();
 			}
 #else
-			if (!HISMC->bDisableCollision)
+			if (bAddInstances)
 			{
 				TArray<FTransform> TMs;
 				for (const FInstancedStaticMeshInstanceData& InstanceData : TransformBuilder->InstanceData)
@@ -1120,43 +2132,170 @@ void UMkGpuScatteringBuilder::WaitAndApplyResults()
 				if (UGrassInstancedStaticMeshComponent* GrassHISMC = Cast<UGrassInstancedStaticMeshComponent>(HISMC))
 				{
 					GrassHISMC->AcceptPrebuiltTree(TransformBuilder->ClusterTree, TransformBuilder->OutOcclusionLayerNum, NumBuiltRenderInstances, &TransformBuilder->InstanceBuffer);
+
+					// The transforms kept for a previous build of the component are stale now
+					PendingInstanceBodies.RemoveAll([HISMC](const FPendingInstanceBodies& Pending) { return Pending.HISMC == HISMC; });
+					if (TransformBuilder->bBatchedCollision && TransformBuilder->BodyTransforms.Num())
+					{
+						FPendingInstanceBodies& Pending = PendingInstanceBodies.AddDefaulted_GetRef();
+						Pending.HISMC = HISMC;
+						Pending.BodySetup = TransformBuilder->BodySetup;
+						Pending.Transforms = MoveTemp(TransformBuilder->BodyTransforms);
+					}
 				}
 			}
 #endif
 
-			FMkCachedLandscapeFoliage::FGrassComp* Existing = FoliageCache.CachedGrassComps.Find(TransformBuilder->Key);
-			if (Existing)
+			SET_DWORD_STAT(STAT_MkGpuScatteringDispatchToApplyFrames, (uint32)(GFrameCounter - TransformBuilder->DispatchFrame));
+			FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Applied, TransformBuilder->BuilderId, TransformBuilder->Key.ComponentId, TransformBuilder->Key.SubsectionX, TransformBuilder->Key.SubsectionY, TransformBuilder->Key.VarietyIndex, TransformBuilder->QueuedCycles);
+			FMkGpuScatteringTrace::AddTimeToVisible(TransformBuilder->QueuedCycles);
+
+			const int32 ExistingIndex = FoliageCache.Find(TransformBuilder->Key);
+			if (ExistingIndex != INDEX_NONE)
 			{
-				Existing->Pending = false;
-				Existing->Touch();
+				FMkCachedLandscapeFoliage::FGrassCompState& ExistingState = FoliageCache.GetState(ExistingIndex);
+				ExistingState.bPending = false;
+				ExistingState.Touch(GFrameNumber, FPlatformTime::Seconds());
 			}
 			TransformBuilder->Clear();
 
 			delete(TransformBuilders[Index]);
-			TransformBuilders.RemoveAtSwap(Index--);
-			break;
-		}
-	}
+			TransformBuilders[Index] = nullptr;
 
+			const double ApplyMs = (FPlatformTime::Seconds() - ApplyStartTime) * 1000.0;
+			GMkGpuScatteringApplyBudget.Record(ApplyOp, NumBuiltRenderInstances, ApplyMs);
+			INC_FLOAT_STAT_BY(STAT_MkGpuScatteringApplyBudgetUsed, (float)ApplyMs);
+			INC_DWORD_STAT(STAT_MkGpuScatteringBuildsApplied);
+			continue;
+		}
 
+		// Nothing to apply, release the item so it can be trimmed or rebuilt
+		FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage::Applied, TransformBuilder->BuilderId, TransformBuilder->Key.ComponentId, TransformBuilder->Key.SubsectionX, TransformBuilder->Key.SubsectionY, TransformBuilder->Key.VarietyIndex, TransformBuilder->QueuedCycles);
+		const int32 ExistingIndex = FoliageCache.Find(TransformBuilder->Key);
+		if (ExistingIndex != INDEX_NONE)
+		{
+			FoliageCache.GetState(ExistingIndex).bPending = false;
+		}
+		delete(TransformBuilders[Index]);
+		TransformBuilders[Index] = nullptr;
+	}
 
+	// Compacted once, in order, so collision builds stay in front and the rest stay oldest first
+	TransformBuilders.RemoveAll([](const FMkGpuScatteringTransformBuilder* TransformBuilder) { return TransformBuilder == nullptr; });
 }
 
 
-void UMkGpuScatteringBuilder::FlushCache()
+void UMkGpuScatteringBuilder::CreatePendingInstanceBodies()
 {
-	bPendingFlushCache = true;
+	if (PendingInstanceBodies.IsEmpty())
+	{
+		return;
+	}
 
-	for (FMkGpuScatteringTransformBuilder* TransformBuilder : TransformBuilders)
+	SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringCreateInstanceBodies);
+	MK_SCATTERING_STAGE_SCOPE(Apply);
+
+	const int32 BatchSize = FMath::Max(GMkGpuScatteringInstanceBodyBatchSize, 1);
+
+	// Oldest first, collision builds are applied before the visual ones
+	for (int32 Index = 0; Index < PendingInstanceBodies.Num(); Index++)
 	{
-		while (!TransformBuilder->IsDone)
+		FPendingInstanceBodies& Pending = PendingInstanceBodies[Index];
+		UHierarchicalInstancedStaticMeshComponent* HISMC = Pending.HISMC.Get();
+		UBodySetup* BodySetup = Pending.BodySetup.Get();
+		UWorld* World = HISMC ? HISMC->GetWorld() : nullptr;
+
+		// Evicted meanwhile
+		if (!HISMC || !BodySetup || !World)
 		{
+			PendingInstanceBodies.RemoveAt(Index--, 1, EAllowShrinking::No);
 			continue;
 		}
-		TransformBuilder->Clear();
-		delete(TransformBuilder);
+
+		// OnDestroyPhysicsState terminated the bodies, they are made again once the physics state is back
+		if (!HISMC->IsPhysicsStateCreated() || !World->GetPhysicsScene())
+		{
+			Pending.NextIndex = 0;
+			continue;
+		}
+
+		if (HISMC->InstanceBodies.Num() != Pending.NextIndex)
+		{
+			if (HISMC->InstanceBodies.Num())
+			{
+				// The component made its own bodies
+				PendingInstanceBodies.RemoveAt(Index--, 1, EAllowShrinking::No);
+				continue;
+			}
+			// RecreatePhysicsState ran in between, CreateAllInstanceBodies found no PerInstanceSMData
+			Pending.NextIndex = 0;
+		}
+
+		bool bOverBudget = false;
+		while (Pending.NextIndex < Pending.Transforms.Num())
+		{
+			const int32 NumBodies = FMath::Min(BatchSize, Pending.Transforms.Num() - Pending.NextIndex);
+			if (!GMkGpuScatteringApplyBudget.CanAfford(FMkGpuScatteringApplyBudget::CreateInstanceBodies, NumBodies))
+			{
+				bOverBudget = true;
+				break;
+			}
+
+			const double StartTime = FPlatformTime::Seconds();
+
+			// Same setup as UInstancedStaticMeshComponent::CreateAllInstanceBodies for static instances
+			TArray<FBodyInstance*> Bodies;
+			Bodies.Reserve(NumBodies);
+			TArray<FTransform> Transforms(Pending.Transforms.GetData() + Pending.NextIndex, NumBodies);
+			for (int32 BodyIndex = 0; BodyIndex < NumBodies; BodyIndex++)
+			{
+				FBodyInstance* Body = new FBodyInstance;
+				Body->CopyBodyInstancePropertiesFrom(&HISMC->BodyInstance);
+				Body->InstanceBodyIndex = Pending.NextIndex + BodyIndex;
+				Body->bAutoWeld = false;
+				Body->SetInstanceSimulatePhysics(false);
+				Bodies.Add(Body);
+			}
+			FBodyInstance::InitStaticBodies(Bodies, Transforms, BodySetup, HISMC, World->GetPhysicsScene());
+
+			// The component owns them from here, ClearAllInstanceBodies terminates them with the physics state
+			HISMC->InstanceBodies.Append(Bodies);
+			Pending.NextIndex += NumBodies;
+
+			const double CreateMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+			GMkGpuScatteringApplyBudget.Record(FMkGpuScatteringApplyBudget::CreateInstanceBodies, NumBodies, CreateMs);
+			INC_FLOAT_STAT_BY(STAT_MkGpuScatteringApplyBudgetUsed, (float)CreateMs);
+			INC_DWORD_STAT_BY(STAT_MkGpuScatteringInstanceBodiesCreated, NumBodies);
+		}
+
+		if (bOverBudget)
+		{
+			break;
+		}
 	}
+
+#if STATS
+	for (const FPendingInstanceBodies& Pending : PendingInstanceBodies)
+	{
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringInstanceBodiesPending, Pending.Transforms.Num() - Pending.NextIndex);
+	}
+#endif
+}
+
+void UMkGpuScatteringBuilder::FlushCache()
+{
+	bPendingFlushCache = true;
+	ComponentIndex.Reset();
+	LayoutTable.Reset();
+	LastBuildCameras.Reset();
+	NumPendingComps = 0;
+	bForceFullBuild = true;
+
+	ReleaseTransformBuilds(true);
 	TransformBuilders.Empty();
+	CompletedOutputs->Empty();
+	QueuedJobTimes.Empty();
+	PendingInstanceBodies.Empty();
 	FoliageCache.ClearCache();
 
 	for (TObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC : FoliageComponents)
@@ -1164,16 +2303,28 @@ void UMkGpuScatteringBuilder::FlushCache()
 		HISMC->DestroyComponent();
 	}
 	FoliageComponents.Empty();
+	PendingDestroyFoliage.Empty();
+	DEC_DWORD_STAT_BY(STAT_MkGpuScatteringComponentsPooled, NumPooledComponents);
+	ComponentPool.Empty();
+	NumPooledComponents = 0;
+
+	for (TObjectPtr<UInstancedStaticMeshComponent> Component : MergedComponents)
+	{
+		Component->DestroyComponent();
+	}
+	MergedComponents.Empty();
+	MergedFoliage.Empty();
+	PendingRangeRemovals.Empty();
 
 	ScatteringTypes.Empty();
 	bPendingFlushCache = false;
 }
 
-void UMkGpuScatteringBuilder::UpdateTick(const TArray<FVector>& Cameras, float DeltaTime, int32& InOutNumComponentsCreated, UMkGpuScatteringReadbackManager* ReadbackManager)
+void UMkGpuScatteringBuilder::UpdateTick(const TArray<FVector>& Cameras, float DeltaTime, UMkGpuScatteringScheduler* Scheduler)
 {
 	LLM_SCOPE_BYTAG(MkGpuScatteringBuilder_Tick);
 
-	Build(Cameras, InOutNumComponentsCreated, ReadbackManager);
+	Build(Cameras, Scheduler);
 	WaitAndApplyResults();
 }
 //~ end of UMkGpuScatteringBuilder
@@ -0,0 +1,217 @@
+#include "Builder/MkGpuScatteringComponentIndex.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "LandscapeProxy.h"
+#include "LandscapeComponent.h"
+
+
+MK_OPTIMIZATION_OFF
+
+//~ FMkLandscapeComponentIndex
+bool FMkLandscapeComponentIndex::NeedsRebuild(const ALandscapeProxy* LandscapeProxy) const
+{
+	if (bDirty || !LandscapeProxy)
+	{
+		return true;
+	}
+
+	// Registering or unregistering a component always touches the proxy's array, so the count and the
+	// allocation are enough to detect it without walking the components.
+	const TArray<TObjectPtr<ULandscapeComponent>>& LandscapeComponents = LandscapeProxy->LandscapeComponents;
+	if (SourceNum != LandscapeComponents.Num() || SourceData != LandscapeComponents.GetData())
+	{
+		return true;
+	}
+
+	const USceneComponent* RootComponent = LandscapeProxy->GetRootComponent();
+	return RootComponent && !RootComponent->GetComponentTransform().Equals(SourceTransform);
+}
+
+void FMkLandscapeComponentIndex::Reset()
+{
+	ResetGrid();
+	ComponentIds.Reset();
+	NextComponentId = 1;
+}
+
+void FMkLandscapeComponentIndex::ResetGrid()
+{
+	Entries.Reset();
+	CellStart.Reset();
+	CellEntries.Reset();
+	GridSize = FIntPoint::ZeroValue;
+	SourceNum = INDEX_NONE;
+	SourceData = nullptr;
+	bDirty = true;
+}
+
+void FMkLandscapeComponentIndex::Rebuild(const ALandscapeProxy* LandscapeProxy, TArray<uint32>& OutRemovedIds)
+{
+	ResetGrid();
+	OutRemovedIds.Reset();
+
+	TMap<TWeakObjectPtr<ULandscapeComponent>, uint32> PreviousIds = MoveTemp(ComponentIds);
+	ComponentIds.Reset();
+
+	if (!LandscapeProxy)
+	{
+		PreviousIds.GenerateValueArray(OutRemovedIds);
+		return;
+	}
+
+	const TArray<TObjectPtr<ULandscapeComponent>>& LandscapeComponents = LandscapeProxy->LandscapeComponents;
+	SourceNum = LandscapeComponents.Num();
+	SourceData = LandscapeComponents.GetData();
+	if (const USceneComponent* RootComponent = LandscapeProxy->GetRootComponent())
+	{
+		SourceTransform = RootComponent->GetComponentTransform();
+	}
+	bDirty = false;
+
+	FBox2D GridBounds(ForceInit);
+	double MaxComponentSize = 0.0;
+
+	Entries.Reserve(LandscapeComponents.Num());
+	for (ULandscapeComponent* Component : LandscapeComponents)
+	{
+		if (!Component)
+		{
+			continue;
+		}
+
+		uint32 ComponentId = 0;
+		if (!PreviousIds.RemoveAndCopyValue(Component, ComponentId))
+		{
+			ComponentId = NextComponentId++;
+		}
+		ComponentIds.Add(Component, ComponentId);
+
+		FEntry& Entry = Entries.AddDefaulted_GetRef();
+		Entry.Component = Component;
+		Entry.ComponentId = ComponentId;
+		Entry.ComponentTransform = Component->GetComponentTransform();
+		Entry.WorldBox = Component->CalcBounds(Entry.ComponentTransform).GetBox();
+		Entry.NameHash = FCrc::StrCrc32(*Component->GetName().ToLower());
+
+		const FVector Size = Entry.WorldBox.GetSize();
+		MaxComponentSize = FMath::Max3(MaxComponentSize, Size.X, Size.Y);
+		GridBounds += FVector2D(Entry.WorldBox.Min);
+		GridBounds += FVector2D(Entry.WorldBox.Max);
+	}
+
+	PreviousIds.GenerateValueArray(OutRemovedIds);
+
+	if (Entries.IsEmpty())
+	{
+		return;
+	}
+
+	// One cell per component keeps every component in at most four cells.
+	CellSize = FMath::Max(MaxComponentSize, 1.0);
+	GridOrigin = GridBounds.Min;
+	GridSize.X = FMath::Max(1, FMath::CeilToInt32((GridBounds.Max.X - GridBounds.Min.X) / CellSize));
+	GridSize.Y = FMath::Max(1, FMath::CeilToInt32((GridBounds.Max.Y - GridBounds.Min.Y) / CellSize));
+
+	const int32 NumCells = GridSize.X * GridSize.Y;
+
+	// counting pass
+	TArray<int32> CellCounts;
+	CellCounts.SetNumZeroed(NumCells);
+	for (const FEntry& Entry : Entries)
+	{
+		const FIntPoint MinCell = GetCellCoord(FVector2D(Entry.WorldBox.Min));
+		const FIntPoint MaxCell = GetCellCoord(FVector2D(Entry.WorldBox.Max));
+		for (int32 Y = MinCell.Y; Y <= MaxCell.Y; ++Y)
+		{
+			for (int32 X = MinCell.X; X <= MaxCell.X; ++X)
+			{
+				++CellCounts[GetCellIndex(X, Y)];
+			}
+		}
+	}
+
+	CellStart.SetNumUninitialized(NumCells + 1);
+	CellStart[0] = 0;
+	for (int32 CellIndex = 0; CellIndex < NumCells; ++CellIndex)
+	{
+		CellStart[CellIndex + 1] = CellStart[CellIndex] + CellCounts[CellIndex];
+		CellCounts[CellIndex] = CellStart[CellIndex];
+	}
+
+	// fill pass
+	CellEntries.SetNumUninitialized(CellStart[NumCells]);
+	for (int32 EntryIndex = 0; EntryIndex < Entries.Num(); ++EntryIndex)
+	{
+		const FEntry& Entry = Entries[EntryIndex];
+		const FIntPoint MinCell = GetCellCoord(FVector2D(Entry.WorldBox.Min));
+		const FIntPoint MaxCell = GetCellCoord(FVector2D(Entry.WorldBox.Max));
+		for (int32 Y = MinCell.Y; Y <= MaxCell.Y; ++Y)
+		{
+			for (int32 X = MinCell.X; X <= MaxCell.X; ++X)
+			{
+				CellEntries[CellCounts[GetCellIndex(X, Y)]++] = EntryIndex;
+			}
+		}
+	}
+}
+
+FIntPoint FMkLandscapeComponentIndex::GetCellCoord(const FVector2D& Location) const
+{
+	const FVector2D Local = (Location - GridOrigin) / CellSize;
+	return FIntPoint(
+		FMath::Clamp(FMath::FloorToInt32(Local.X), 0, GridSize.X - 1),
+		FMath::Clamp(FMath::FloorToInt32(Local.Y), 0, GridSize.Y - 1));
+}
+
+void FMkLandscapeComponentIndex::Query(const TArray<FVector>& Cameras, double Radius, TArray<int32>& OutCandidates)
+{
+	OutCandidates.Reset();
+
+	if (Entries.IsEmpty())
+	{
+		return;
+	}
+
+	if (++CurrentStamp == 0)
+	{
+		// wrapped around, make sure no stale stamp survives
+		for (FEntry& Entry : Entries)
+		{
+			Entry.QueryStamp = 0;
+		}
+		CurrentStamp = 1;
+	}
+
+	const FBox2D GridBounds(GridOrigin, GridOrigin + FVector2D(GridSize) * CellSize);
+	for (const FVector& CameraPos : Cameras)
+	{
+		const FBox2D QueryBox(FVector2D(CameraPos) - FVector2D(Radius), FVector2D(CameraPos) + FVector2D(Radius));
+		if (!QueryBox.Intersect(GridBounds))
+		{
+			continue;
+		}
+
+		const FIntPoint MinCell = GetCellCoord(QueryBox.Min);
+		const FIntPoint MaxCell = GetCellCoord(QueryBox.Max);
+		for (int32 Y = MinCell.Y; Y <= MaxCell.Y; ++Y)
+		{
+			for (int32 X = MinCell.X; X <= MaxCell.X; ++X)
+			{
+				const int32 CellIndex = GetCellIndex(X, Y);
+				for (int32 Index = CellStart[CellIndex]; Index < CellStart[CellIndex + 1]; ++Index)
+				{
+					const int32 EntryIndex = CellEntries[Index];
+					FEntry& Entry = Entries[EntryIndex];
+					if (Entry.QueryStamp != CurrentStamp)
+					{
+						Entry.QueryStamp = CurrentStamp;
+						OutCandidates.Add(EntryIndex);
+					}
+				}
+			}
+		}
+	}
+}
+//~ end of FMkLandscapeComponentIndex
+
+MK_OPTIMIZATION_ON
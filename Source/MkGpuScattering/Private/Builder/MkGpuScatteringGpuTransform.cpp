@@ -0,0 +1,210 @@
+#include "Builder/MkGpuScatteringGpuTransform.h"
+#include "Types/MkGpuScatteringTypes.h"
+#include "MkGpuScatteringGlobal.h"
+
+using namespace MkGpuScatteringBuilderTypes;
+
+MK_OPTIMIZATION_OFF
+
+namespace MkGpuScatteringGpuTransform
+{
+	FParams FParams::Make(const FMkGrassVariety& GrassVariety, int32 InstancingRandomSeed, const FMatrix& XForm)
+	{
+		FParams Params;
+		Params.XForm = FMatrix44f(XForm);
+		Params.RotationAxis = FVector3f(GrassVariety.RotationAxis);
+		Params.ScaleX = FVector2f(GrassVariety.ScaleX.Min, GrassVariety.ScaleX.Max);
+		Params.ScaleY = FVector2f(GrassVariety.ScaleY.Min, GrassVariety.ScaleY.Max);
+		Params.ScaleZ = FVector2f(GrassVariety.ScaleZ.Min, GrassVariety.ScaleZ.Max);
+		Params.ZOffset = FVector2f(GrassVariety.ZOffset.Min, GrassVariety.ZOffset.Max);
+		Params.AlignMaxPitch = GrassVariety.AlignMaxAngle > 0.0f ? (float)static_cast<int32>(GrassVariety.AlignMaxAngle) : 0.0f;
+		Params.VoronoiValidMax = GrassVariety.VoronoiValidRange.Max;
+		Params.Scaling = (uint32)GrassVariety.Scaling;
+		Params.Seed = (uint32)InstancingRandomSeed;
+		Params.bRandomRotation = GrassVariety.RandomRotation;
+		Params.bAlignToSurface = GrassVariety.AlignToSurface;
+		Params.bUseVoronoiNoise = GrassVariety.bUseVoronoiNoise;
+
+		// same as FMkGpuScatteringTransformBuilder
+		const FFloatInterval& ScaleX = GrassVariety.ScaleX;
+		const FFloatInterval& ScaleY = GrassVariety.ScaleY;
+		const FFloatInterval& ScaleZ = GrassVariety.ScaleZ;
+		FVector3f DefaultScale(ScaleX.Min > 0.0f && FMath::IsNearlyZero(ScaleX.Size()) ? ScaleX.Min : 1.0f,
+			ScaleY.Min > 0.0f && FMath::IsNearlyZero(ScaleY.Size()) ? ScaleY.Min : 1.0f,
+			ScaleZ.Min > 0.0f && FMath::IsNearlyZero(ScaleZ.Size()) ? ScaleZ.Min : 1.0f);
+		switch (GrassVariety.Scaling)
+		{
+		case EMkGrassScaling::Uniform:
+			DefaultScale.Y = DefaultScale.X;
+			DefaultScale.Z = DefaultScale.X;
+			Params.bRandomScale = ScaleX.Size() > 0;
+			break;
+		case EMkGrassScaling::Free:
+			Params.bRandomScale = ScaleX.Size() > 0 || ScaleY.Size() > 0 || ScaleZ.Size() > 0;
+			break;
+		case EMkGrassScaling::LockXY:
+			DefaultScale.Y = DefaultScale.X;
+			Params.bRandomScale = ScaleX.Size() > 0 || ScaleZ.Size() > 0;
+			break;
+		default:
+			check(0);
+		}
+		Params.DefaultScale = DefaultScale;
+
+		return Params;
+	}
+
+	// PCG hash
+	uint32 Hash(uint32 Value)
+	{
+		const uint32 State = Value * 747796405u + 2891336453u;
+		const uint32 Word = ((State >> ((State >> 28u) + 4u)) ^ State) * 277803737u;
+		return (Word >> 22u) ^ Word;
+	}
+
+	uint32 GetInstanceKey(const FVector3f& Location, uint32 Seed)
+	{
+		const int32 Xcm = (int32)FMath::FloorToFloat(Location.X + 0.5f);
+		const int32 Ycm = (int32)FMath::FloorToFloat(Location.Y + 0.5f);
+		return Hash(Seed ^ Hash((uint32)Xcm ^ Hash((uint32)Ycm)));
+	}
+
+	float GetRandom(uint32 Key, uint32 Index)
+	{
+		return float(Hash(Key + Index * 0x9E3779B9u) >> 8) * (1.0f / 16777216.0f);
+	}
+
+	int32 GetRandomSeedForPosition(const FVector3f& Location)
+	{
+		const int64 Xcm = (int64)FMath::FloorToFloat(Location.X + 0.5f);
+		const int64 Ycm = (int64)FMath::FloorToFloat(Location.Y + 0.5f);
+		return (int32)HashCombine(GetTypeHash(Xcm), GetTypeHash(Ycm));
+	}
+
+	FDraws Draw(const FParams& Params, const FLocationNormalScaleZ& Result)
+	{
+		const uint32 Key = GetInstanceKey(Result.Location, Params.Seed);
+		// MkStreamFRand
+		FRandomStream PositionStream(GetRandomSeedForPosition(Result.Location));
+
+		FDraws Draws;
+		Draws.Scale = Params.DefaultScale;
+		if (Params.bRandomScale)
+		{
+			// FMkGpuScatteringTransformBuilder::GetRandomScale
+			float Alpha = Result.ScaleZ;
+			FVector2f RangeX = Params.ScaleX;
+			FVector2f RangeY = Params.ScaleY;
+			FVector2f RangeZ = Params.ScaleZ;
+			if (Params.bUseVoronoiNoise && Alpha > Params.VoronoiValidMax)
+			{
+				Alpha = 1.0f - Alpha;
+				RangeX.X = FMath::Max(RangeX.X * Alpha, 1.0f);
+				RangeY.X = FMath::Max(RangeY.X * Alpha, 1.0f);
+				RangeZ.X = FMath::Max(RangeZ.X * Alpha, 0.5f);
+			}
+
+			const float InterpAlpha = Alpha + PositionStream.FRand();
+			const float X = RangeX.X + InterpAlpha * (RangeX.Y - RangeX.X);
+			const float Y = RangeY.X + InterpAlpha * (RangeY.Y - RangeY.X);
+			const float Z = RangeZ.X + InterpAlpha * (RangeZ.Y - RangeZ.X);
+			switch (Params.Scaling)
+			{
+			case (uint32)EMkGrassScaling::Free:   Draws.Scale = FVector3f(X, Y, Z); break;
+			case (uint32)EMkGrassScaling::LockXY: Draws.Scale = FVector3f(X, X, Z); break;
+			default:                              Draws.Scale = FVector3f(X, X, X); break;
+			}
+		}
+
+		Draws.OffsetZ = Params.ZOffset.X + PositionStream.FRand() * (Params.ZOffset.Y - Params.ZOffset.X);
+		Draws.Rotation = Params.bRandomRotation ? GetRandom(Key, 2) * 180.0f : 0.0f;
+		Draws.RandomFraction = GetRandom(Key, 3);
+		return Draws;
+	}
+
+	// FRotationMatrix, degrees
+	static void RotatorToMatrix(float Pitch, float Yaw, float Roll, float M[3][3])
+	{
+		float SP, CP, SY, CY, SR, CR;
+		FMath::SinCos(&SP, &CP, FMath::DegreesToRadians(Pitch));
+		FMath::SinCos(&SY, &CY, FMath::DegreesToRadians(Yaw));
+		FMath::SinCos(&SR, &CR, FMath::DegreesToRadians(Roll));
+
+		M[0][0] = CP * CY;
+		M[0][1] = CP * SY;
+		M[0][2] = SP;
+		M[1][0] = SR * SP * CY - CR * SY;
+		M[1][1] = SR * SP * SY + CR * CY;
+		M[1][2] = -SR * CP;
+		M[2][0] = -(CR * SP * CY + SR * SY);
+		M[2][1] = CY * SR - CR * SP * SY;
+		M[2][2] = CR * CP;
+	}
+
+	FInstanceTransform ComputeInstance(const FParams& Params, const FLocationNormalScaleZ& Result)
+	{
+		FInstanceTransform Out;
+
+		const FDraws Draws = Draw(Params, Result);
+
+		float R[3][3];
+		const FVector3f RotVector = Params.RotationAxis * Draws.Rotation;
+		RotatorToMatrix(RotVector.X, RotVector.Y, RotVector.Z, R);
+
+		const FVector3f& Normal = Result.ComputedNormal;
+		if (Params.bAlignToSurface && !Normal.IsNearlyZero())
+		{
+			// AlignToNormal
+			const float Yaw = FMath::RadiansToDegrees(FMath::Atan2(Normal.Y, Normal.X));
+			float Pitch = FMath::RadiansToDegrees(FMath::Atan2(Normal.Z, FMath::Sqrt(Normal.X * Normal.X + Normal.Y * Normal.Y))) - 90.0f;
+			if (Pitch <= -180.0f)
+			{
+				Pitch += 360.0f;
+			}
+			if (Params.AlignMaxPitch > 0.0f)
+			{
+				Pitch = FMath::Clamp(Pitch, -Params.AlignMaxPitch, Params.AlignMaxPitch);
+			}
+
+			float A[3][3];
+			RotatorToMatrix(Pitch, Yaw, 0.0f, A);
+
+			float Aligned[3][3];
+			for (int32 Row = 0; Row < 3; ++Row)
+			{
+				for (int32 Col = 0; Col < 3; ++Col)
+				{
+					Aligned[Row][Col] = R[Row][0] * A[0][Col] + R[Row][1] * A[1][Col] + R[Row][2] * A[2][Col];
+				}
+			}
+			FMemory::Memcpy(R, Aligned, sizeof(R));
+		}
+
+		const float Lift = Draws.OffsetZ * FMath::Abs(Draws.Scale.Z);
+		const FVector3f Translation(
+			Result.Location.X + R[2][0] * Lift,
+			Result.Location.Y + R[2][1] * Lift,
+			Result.Location.Z + R[2][2] * Lift);
+
+		const FMatrix44f& X = Params.XForm;
+		const float Scales[3] = { Draws.Scale.X, Draws.Scale.Y, Draws.Scale.Z };
+		for (int32 Row = 0; Row < 3; ++Row)
+		{
+			const FVector3f Local(Scales[Row] * R[Row][0], Scales[Row] * R[Row][1], Scales[Row] * R[Row][2]);
+			Out.Rows[Row] = FVector4f(
+				Local.X * X.M[0][0] + Local.Y * X.M[1][0] + Local.Z * X.M[2][0],
+				Local.X * X.M[0][1] + Local.Y * X.M[1][1] + Local.Z * X.M[2][1],
+				Local.X * X.M[0][2] + Local.Y * X.M[1][2] + Local.Z * X.M[2][2],
+				0.0f);
+		}
+		Out.OriginAndRandom = FVector4f(
+			Translation.X * X.M[0][0] + Translation.Y * X.M[1][0] + Translation.Z * X.M[2][0] + X.M[3][0],
+			Translation.X * X.M[0][1] + Translation.Y * X.M[1][1] + Translation.Z * X.M[2][1] + X.M[3][1],
+			Translation.X * X.M[0][2] + Translation.Y * X.M[1][2] + Translation.Z * X.M[2][2] + X.M[3][2],
+			Draws.RandomFraction);
+
+		return Out;
+	}
+}
+
+MK_OPTIMIZATION_ON
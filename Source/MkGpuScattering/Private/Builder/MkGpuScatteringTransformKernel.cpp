@@ -0,0 +1,238 @@
+#include "Builder/MkGpuScatteringTransformKernel.h"
+#include "MkGpuScatteringGlobal.h"
+
+// Left optimized in every configuration, the batch loop relies on the vector intrinsics being inlined.
+
+namespace MkGpuScatteringTransformKernel
+{
+	template<typename FuncType>
+	static FORCEINLINE void ForEachStream(FInstanceStreams& Streams, FuncType&& Func)
+	{
+		Func(Streams.LocationX); Func(Streams.LocationY); Func(Streams.LocationZ);
+		Func(Streams.NormalX); Func(Streams.NormalY); Func(Streams.NormalZ);
+		Func(Streams.ScaleX); Func(Streams.ScaleY); Func(Streams.ScaleZ);
+		Func(Streams.OffsetZ);
+		Func(Streams.Rotation);
+	}
+
+	void FInstanceStreams::Reset(int32 ExpectedNum)
+	{
+		const int32 Capacity = Align(ExpectedNum, BatchSize);
+		ForEachStream(*this, [Capacity](TArray<float>& Stream) { Stream.Reset(Capacity); });
+		NumInstances = 0;
+	}
+
+	void FInstanceStreams::Add(const FVector3f& Location, const FVector3f& Normal, const FVector3f& Scale, float InOffsetZ, float InRotation)
+	{
+		LocationX.Add(Location.X); LocationY.Add(Location.Y); LocationZ.Add(Location.Z);
+		NormalX.Add(Normal.X); NormalY.Add(Normal.Y); NormalZ.Add(Normal.Z);
+		ScaleX.Add(Scale.X); ScaleY.Add(Scale.Y); ScaleZ.Add(Scale.Z);
+		OffsetZ.Add(InOffsetZ);
+		Rotation.Add(InRotation);
+		++NumInstances;
+	}
+
+	void FInstanceStreams::Pad()
+	{
+		const int32 PaddedNum = Align(NumInstances, BatchSize);
+		ForEachStream(*this, [PaddedNum](TArray<float>& Stream) { Stream.SetNumZeroed(PaddedNum, EAllowShrinking::No); });
+	}
+
+	FMatrix AlignToNormal(const FVector& InNormal, float AlignMaxAngle)
+	{
+		FRotator AlignRotation = InNormal.Rotation();
+		// Static meshes are authored along the vertical axis rather than the X axis, so we add 90 degrees to the static mesh's Pitch.
+		AlignRotation.Pitch -= 90.f;
+		// Clamp its value inside +/- one rotation
+		AlignRotation.Pitch = FRotator::NormalizeAxis(AlignRotation.Pitch);
+
+		// limit the maximum pitch angle if it's > 0.
+		if (AlignMaxAngle > 0.f)
+		{
+			int32 MaxPitch = static_cast<int32>(AlignMaxAngle);
+			if (AlignRotation.Pitch > MaxPitch)
+			{
+				AlignRotation.Pitch = MaxPitch;
+			}
+			else if (AlignRotation.Pitch < -MaxPitch)
+			{
+				AlignRotation.Pitch = -MaxPitch;
+			}
+		}
+		return AlignRotation.Quaternion().ToMatrix();
+	}
+
+	FMatrix TransformScalar(const FParams& Params, const FInstanceStreams& Streams, int32 Index)
+	{
+		FVector LocationWithHeight(Streams.LocationX[Index], Streams.LocationY[Index], Streams.LocationZ[Index]);
+		const FVector ComputedNormal(Streams.NormalX[Index], Streams.NormalY[Index], Streams.NormalZ[Index]);
+		const FVector Scale(Streams.ScaleX[Index], Streams.ScaleY[Index], Streams.ScaleZ[Index]);
+		const float PlacementOffsetZ = Streams.OffsetZ[Index];
+		const FVector RotVector = Params.RotationAxis * Streams.Rotation[Index];
+
+		const FMatrix BaseXForm = FScaleRotationTranslationMatrix(Scale, FRotator(RotVector.X, RotVector.Y, RotVector.Z), FVector::ZeroVector);
+		if (Params.bAlignToSurface && !ComputedNormal.IsNearlyZero())
+		{
+			const FMatrix AlignedXForm = BaseXForm * AlignToNormal(ComputedNormal, Params.AlignMaxAngle);
+			LocationWithHeight += AlignedXForm.GetUnitAxis(EAxis::Z) * (PlacementOffsetZ * Scale.Z);
+			return AlignedXForm.ConcatTranslation(LocationWithHeight) * Params.XForm;
+		}
+
+		LocationWithHeight += BaseXForm.GetUnitAxis(EAxis::Z) * (PlacementOffsetZ * Scale.Z);
+		return BaseXForm.ConcatTranslation(LocationWithHeight) * Params.XForm;
+	}
+
+	// FRotationMatrix of (Pitch, Yaw, Roll) in degrees, one rotation per lane
+	static FORCEINLINE void RotatorToMatrix(VectorRegister4Float Pitch, VectorRegister4Float Yaw, VectorRegister4Float Roll, VectorRegister4Float M[3][3])
+	{
+		const VectorRegister4Float DegToRad = VectorSetFloat1(UE_PI / 180.0f);
+		Pitch = VectorMultiply(Pitch, DegToRad);
+		Yaw = VectorMultiply(Yaw, DegToRad);
+		Roll = VectorMultiply(Roll, DegToRad);
+
+		VectorRegister4Float SP, CP, SY, CY, SR, CR;
+		VectorSinCos(&SP, &CP, &Pitch);
+		VectorSinCos(&SY, &CY, &Yaw);
+		VectorSinCos(&SR, &CR, &Roll);
+
+		M[0][0] = VectorMultiply(CP, CY);
+		M[0][1] = VectorMultiply(CP, SY);
+		M[0][2] = SP;
+
+		M[1][0] = VectorSubtract(VectorMultiply(SR, VectorMultiply(SP, CY)), VectorMultiply(CR, SY));
+		M[1][1] = VectorAdd(VectorMultiply(SR, VectorMultiply(SP, SY)), VectorMultiply(CR, CY));
+		M[1][2] = VectorNegate(VectorMultiply(SR, CP));
+
+		M[2][0] = VectorNegate(VectorAdd(VectorMultiply(CR, VectorMultiply(SP, CY)), VectorMultiply(SR, SY)));
+		M[2][1] = VectorSubtract(VectorMultiply(CY, SR), VectorMultiply(CR, VectorMultiply(SP, SY)));
+		M[2][2] = VectorMultiply(CR, CP);
+	}
+
+	void TransformBatch(const FParams& Params, const FInstanceStreams& Streams, TArrayView<FMatrix> OutTransforms)
+	{
+		const int32 Num = Streams.Num();
+		check(OutTransforms.Num() >= Num);
+		check(Streams.LocationX.Num() >= Align(Num, BatchSize));
+
+		// Foliage space transform, applied per lane in double
+		const FMatrix& X = Params.XForm;
+
+		const VectorRegister4Float AxisPitch = VectorSetFloat1((float)Params.RotationAxis.X);
+		const VectorRegister4Float AxisYaw = VectorSetFloat1((float)Params.RotationAxis.Y);
+		const VectorRegister4Float AxisRoll = VectorSetFloat1((float)Params.RotationAxis.Z);
+
+		const VectorRegister4Float Zero = VectorZeroFloat();
+		const VectorRegister4Float NormalTolerance = VectorSetFloat1(UE_KINDA_SMALL_NUMBER);
+		const VectorRegister4Float RadToDeg = VectorSetFloat1(180.0f / UE_PI);
+		const VectorRegister4Float QuarterTurn = VectorSetFloat1(90.0f);
+		const VectorRegister4Float MinusHalfTurn = VectorSetFloat1(-180.0f);
+		const VectorRegister4Float FullTurn = VectorSetFloat1(360.0f);
+
+		const bool bClampPitch = Params.AlignMaxAngle > 0.0f;
+		const float MaxPitch = (float)static_cast<int32>(Params.AlignMaxAngle);
+		const VectorRegister4Float MaxPitchV = VectorSetFloat1(MaxPitch);
+		const VectorRegister4Float MinPitchV = VectorSetFloat1(-MaxPitch);
+
+		// Local scaled rotation rows and translation in SoA, [Row * 3 + Col][Lane]
+		alignas(16) float Elements[12][BatchSize];
+
+		for (int32 Base = 0; Base < Num; Base += BatchSize)
+		{
+			const VectorRegister4Float LocX = VectorLoad(Streams.LocationX.GetData() + Base);
+			const VectorRegister4Float LocY = VectorLoad(Streams.LocationY.GetData() + Base);
+			const VectorRegister4Float LocZ = VectorLoad(Streams.LocationZ.GetData() + Base);
+			const VectorRegister4Float ScaleX = VectorLoad(Streams.ScaleX.GetData() + Base);
+			const VectorRegister4Float ScaleY = VectorLoad(Streams.ScaleY.GetData() + Base);
+			const VectorRegister4Float ScaleZ = VectorLoad(Streams.ScaleZ.GetData() + Base);
+			const VectorRegister4Float OffsetZ = VectorLoad(Streams.OffsetZ.GetData() + Base);
+			const VectorRegister4Float Rot = VectorLoad(Streams.Rotation.GetData() + Base);
+
+			VectorRegister4Float R[3][3];
+			RotatorToMatrix(VectorMultiply(AxisPitch, Rot), VectorMultiply(AxisYaw, Rot), VectorMultiply(AxisRoll, Rot), R);
+
+			if (Params.bAlignToSurface)
+			{
+				const VectorRegister4Float NormalX = VectorLoad(Streams.NormalX.GetData() + Base);
+				const VectorRegister4Float NormalY = VectorLoad(Streams.NormalY.GetData() + Base);
+				const VectorRegister4Float NormalZ = VectorLoad(Streams.NormalZ.GetData() + Base);
+
+				// !IsNearlyZero()
+				const VectorRegister4Float AlignMask = VectorBitwiseOr(
+					VectorBitwiseOr(VectorCompareGT(VectorAbs(NormalX), NormalTolerance), VectorCompareGT(VectorAbs(NormalY), NormalTolerance)),
+					VectorCompareGT(VectorAbs(NormalZ), NormalTolerance));
+
+				if (VectorMaskBits(AlignMask))
+				{
+					// FVector::Rotation, then the pitch adjustments of AlignToNormal
+					const VectorRegister4Float LengthXY = VectorSqrt(VectorMultiplyAdd(NormalX, NormalX, VectorMultiply(NormalY, NormalY)));
+					const VectorRegister4Float AlignYaw = VectorMultiply(VectorATan2(NormalY, NormalX), RadToDeg);
+					VectorRegister4Float AlignPitch = VectorSubtract(VectorMultiply(VectorATan2(NormalZ, LengthXY), RadToDeg), QuarterTurn);
+					// NormalizeAxis, the pitch can only be in [-180, 0] at this point
+					AlignPitch = VectorSelect(VectorCompareLE(AlignPitch, MinusHalfTurn), VectorAdd(AlignPitch, FullTurn), AlignPitch);
+					if (bClampPitch)
+					{
+						AlignPitch = VectorMin(VectorMax(AlignPitch, MinPitchV), MaxPitchV);
+					}
+
+					VectorRegister4Float A[3][3];
+					RotatorToMatrix(AlignPitch, AlignYaw, Zero, A);
+
+					// Base * Align, lanes without a usable normal keep the base rotation
+					for (int32 Row = 0; Row < 3; ++Row)
+					{
+						VectorRegister4Float Aligned[3];
+						for (int32 Col = 0; Col < 3; ++Col)
+						{
+							Aligned[Col] = VectorMultiplyAdd(R[Row][0], A[0][Col], VectorMultiplyAdd(R[Row][1], A[1][Col], VectorMultiply(R[Row][2], A[2][Col])));
+						}
+						for (int32 Col = 0; Col < 3; ++Col)
+						{
+							R[Row][Col] = VectorSelect(AlignMask, Aligned[Col], R[Row][Col]);
+						}
+					}
+				}
+			}
+
+			// GetUnitAxis(Z) * (OffsetZ * ScaleZ) : the unit z row keeps the sign of ScaleZ, so only its magnitude is left
+			const VectorRegister4Float Lift = VectorMultiply(OffsetZ, VectorAbs(ScaleZ));
+			const VectorRegister4Float Translation[3] =
+			{
+				VectorMultiplyAdd(R[2][0], Lift, LocX),
+				VectorMultiplyAdd(R[2][1], Lift, LocY),
+				VectorMultiplyAdd(R[2][2], Lift, LocZ),
+			};
+
+			const VectorRegister4Float Scales[3] = { ScaleX, ScaleY, ScaleZ };
+			for (int32 Row = 0; Row < 3; ++Row)
+			{
+				for (int32 Col = 0; Col < 3; ++Col)
+				{
+					VectorStoreAligned(VectorMultiply(Scales[Row], R[Row][Col]), Elements[Row * 3 + Col]);
+				}
+			}
+			for (int32 Col = 0; Col < 3; ++Col)
+			{
+				VectorStoreAligned(Translation[Col], Elements[9 + Col]);
+			}
+
+			// Local * XForm in double
+			const int32 NumLanes = FMath::Min(BatchSize, Num - Base);
+			for (int32 Lane = 0; Lane < NumLanes; ++Lane)
+			{
+				FMatrix& Out = OutTransforms[Base + Lane];
+				for (int32 Row = 0; Row < 4; ++Row)
+				{
+					const double L0 = Elements[Row * 3 + 0][Lane];
+					const double L1 = Elements[Row * 3 + 1][Lane];
+					const double L2 = Elements[Row * 3 + 2][Lane];
+					// Only the translation row picks up the XForm origin
+					const double W = Row == 3 ? 1.0 : 0.0;
+					for (int32 Col = 0; Col < 4; ++Col)
+					{
+						Out.M[Row][Col] = L0 * X.M[0][Col] + L1 * X.M[1][Col] + L2 * X.M[2][Col] + W * X.M[3][Col];
+					}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,366 @@
+#include "Builder/MkGpuScatteringTransformKernel.h"
+#include "Builder/MkGpuScatteringGpuTransform.h"
+#include "Shaders/MkGpuScatteringShaders.h"
+#include "Types/MkGpuScatteringTypes.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "Misc/App.h"
+#include "Misc/AutomationTest.h"
+#include "RenderingThread.h"
+#include "RHIGPUReadback.h"
+#include "RenderGraphUtils.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace MkTransformKernelValidation
+{
+	using namespace MkGpuScatteringTransformKernel;
+
+	struct FCase
+	{
+		const TCHAR* Name;
+		FParams Params;
+	};
+
+	static void FillStreams(FRandomStream& Random, int32 NumInstances, FInstanceStreams& OutStreams)
+	{
+		OutStreams.Reset(NumInstances);
+		for (int32 Index = 0; Index < NumInstances; ++Index)
+		{
+			// one landscape component worth of locations
+			const FVector3f Location(Random.FRandRange(0.0f, 25400.0f), Random.FRandRange(0.0f, 25400.0f), Random.FRandRange(-2000.0f, 2000.0f));
+
+			// Mostly upward normals plus the zero normal that skips the alignment.
+			// A straight down normal is left out, its pitch sits on the NormalizeAxis wrap and the clamp then depends on the last bit.
+			FVector3f Normal;
+			switch (Index % 16)
+			{
+			case 0: Normal = FVector3f::ZeroVector; break;
+			case 1: Normal = FVector3f(0.0f, 0.0f, 1.0f); break;
+			case 2: Normal = FVector3f(Random.GetUnitVector()); break;
+			default: Normal = FVector3f(Random.FRandRange(-0.7f, 0.7f), Random.FRandRange(-0.7f, 0.7f), 1.0f).GetSafeNormal(); break;
+			}
+
+			const float UniformScale = Random.FRandRange(0.5f, 3.0f);
+			const FVector3f Scale = (Index & 1) ? FVector3f(UniformScale) : FVector3f(Random.FRandRange(0.5f, 3.0f), Random.FRandRange(0.5f, 3.0f), Random.FRandRange(0.5f, 3.0f));
+
+			OutStreams.Add(Location, Normal, Scale, Random.FRandRange(-50.0f, 50.0f), Random.GetFraction() * 180.0f);
+		}
+		OutStreams.Pad();
+	}
+
+	static bool Run(FAutomationTestBase& Test, int32 NumInstances, float Tolerance)
+	{
+
+		FRandomStream Random(0x4d6b);
+
+		// component offset inside a large proxy, with a bit of rotation and scale to exercise the whole XForm
+		const FMatrix ProxyXForm = FScaleRotationTranslationMatrix(FVector(1.0, 1.0, 1.0), FRotator(0.0, 30.0, 0.0), FVector(204800.0, -102400.0, 512.0));
+
+		TArray<FCase> Cases;
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Yaw");
+			Case.Params.RotationAxis = FVector(0.0, 1.0, 0.0);
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("AllAxes");
+			Case.Params.RotationAxis = FVector(0.3, 1.0, 0.7);
+			Case.Params.XForm = ProxyXForm;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Align");
+			Case.Params.RotationAxis = FVector(0.0, 1.0, 0.0);
+			Case.Params.bAlignToSurface = true;
+			Case.Params.XForm = ProxyXForm;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("AlignClamp");
+			Case.Params.RotationAxis = FVector(0.0, 1.0, 0.0);
+			Case.Params.bAlignToSurface = true;
+			Case.Params.AlignMaxAngle = 25.5f;
+			Case.Params.XForm = ProxyXForm;
+		}
+
+		FInstanceStreams Streams;
+		FillStreams(Random, NumInstances, Streams);
+
+		TArray<FMatrix44f> Reference;
+		TArray<FMatrix> Batched;
+		Reference.SetNumUninitialized(NumInstances);
+		Batched.SetNumUninitialized(NumInstances);
+
+		bool bAllPassed = true;
+		UE_LOG(LogTemp, Log, TEXT("[MkGpuScattering] Transform kernel validation, %d instances, tolerance %g"), NumInstances, Tolerance);
+		UE_LOG(LogTemp, Log, TEXT("  %-12s %12s %12s %12s %10s"), TEXT(""), TEXT("scalar ms"), TEXT("batch ms"), TEXT("max error"), TEXT("failed"));
+
+		for (const FCase& Case : Cases)
+		{
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 Index = 0; Index < NumInstances; ++Index)
+			{
+				Reference[Index] = FMatrix44f(TransformScalar(Case.Params, Streams, Index));
+			}
+			const double ScalarTime = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			TransformBatch(Case.Params, Streams, Batched);
+			const double BatchTime = FPlatformTime::Seconds() - StartTime;
+
+			// relative to the element magnitude, translations are in the hundreds of thousands
+			float MaxError = 0.0f;
+			int32 NumFailed = 0;
+			int32 FirstFailed = INDEX_NONE;
+			for (int32 Index = 0; Index < NumInstances; ++Index)
+			{
+				float InstanceError = 0.0f;
+				for (int32 Row = 0; Row < 4; ++Row)
+				{
+					for (int32 Col = 0; Col < 4; ++Col)
+					{
+						const float Expected = Reference[Index].M[Row][Col];
+						const float Error = FMath::Abs((float)Batched[Index].M[Row][Col] - Expected) / FMath::Max(1.0f, FMath::Abs(Expected));
+						InstanceError = FMath::Max(InstanceError, Error);
+					}
+				}
+				MaxError = FMath::Max(MaxError, InstanceError);
+				if (!(InstanceError <= Tolerance) && NumFailed++ == 0)
+				{
+					FirstFailed = Index;
+				}
+			}
+
+			UE_LOG(LogTemp, Log, TEXT("  %-12s %12.3f %12.3f %12g %10d"), Case.Name, ScalarTime * 1000.0, BatchTime * 1000.0, MaxError, NumFailed);
+			if (NumFailed)
+			{
+				bAllPassed = false;
+				UE_LOG(LogTemp, Warning, TEXT("  %s : instance %d\n    scalar %s\n    batch  %s"), Case.Name, FirstFailed, *Reference[FirstFailed].ToString(), *Batched[FirstFailed].ToString());
+			}
+		}
+
+		if (!bAllPassed)
+		{
+			Test.AddError(TEXT("Transform kernel does not match the scalar path"));
+		}
+		return bAllPassed;
+	}
+}
+
+namespace MkGpuTransformValidation
+{
+	using namespace MkGpuScatteringBuilderTypes;
+
+	// FMkFoliagePlacementUtil::GetRandomSeedForPosition, the seed of the CPU path's scale and ZOffset draws
+	static int32 GetCpuSeedForPosition(const FVector3f& Location)
+	{
+		const FVector2D Position = FVector2D(FVector(Location));
+		const int64 Xcm = FMath::RoundToInt(Position.X);
+		const int64 Ycm = FMath::RoundToInt(Position.Y);
+		return HashCombine(GetTypeHash(Xcm), GetTypeHash(Ycm));
+	}
+
+	static bool CanRunGpu()
+	{
+		return FApp::CanEverRender() && IsFeatureLevelSupported(GMaxRHIShaderPlatform, ERHIFeatureLevel::SM5);
+	}
+
+	// Transform_CS over Results, read back
+	static void TransformGpu(const MkGpuScatteringGpuTransform::FParams& Params, const TArray<FLocationNormalScaleZ>& Results, TArray<FInstanceTransform>& OutTransforms)
+	{
+		const uint32 NumInstances = (uint32)Results.Num();
+		const uint32 TransformBytes = NumInstances * sizeof(FInstanceTransform);
+		OutTransforms.SetNumUninitialized(NumInstances);
+
+		ENQUEUE_RENDER_COMMAND(MkValidateGpuTransform)([&](FRHICommandListImmediate& RHICmdList)
+		{
+			FRDGBuilder GraphBuilder(RHICmdList);
+
+			FProgressInfo Progress;
+			Progress.Count = NumInstances;
+			Progress.MaxInstances = NumInstances;
+
+			FMkScatteringArena Arena;
+			Arena.ProgressInfo = CreateStructuredBuffer(GraphBuilder, TEXT("MkValidateProgressInfo"), sizeof(FProgressInfo), 1, &Progress, sizeof(FProgressInfo));
+			Arena.Results = CreateStructuredBuffer(GraphBuilder, TEXT("MkValidateResults"), sizeof(uint32), NumInstances * ResultDwords, Results.GetData(), NumInstances * sizeof(FLocationNormalScaleZ));
+			Arena.Transforms = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FInstanceTransform), NumInstances), TEXT("MkValidateTransforms"));
+			Arena.TransformsUAV = GraphBuilder.CreateUAV(Arena.Transforms);
+
+			AddPass_MkTransform(GraphBuilder, Params, nullptr, NumInstances, Arena, 0, 0, 0);
+
+			FRHIGPUBufferReadback Readback(TEXT("MkValidateTransforms"));
+			AddEnqueueCopyPass(GraphBuilder, &Readback, Arena.Transforms, TransformBytes);
+			GraphBuilder.Execute();
+			RHICmdList.BlockUntilGPUIdle();
+
+			FPlatformMemory::Memcpy(OutTransforms.GetData(), Readback.Lock(TransformBytes), TransformBytes);
+			Readback.Unlock();
+		});
+		FlushRenderingCommands();
+	}
+
+	static float GetInstanceError(const FMatrix44f& Actual, const FMatrix44f& Expected)
+	{
+		float InstanceError = 0.0f;
+		for (int32 Row = 0; Row < 4; ++Row)
+		{
+			for (int32 Col = 0; Col < 3; ++Col)
+			{
+				const float Error = FMath::Abs(Actual.M[Row][Col] - Expected.M[Row][Col]) / FMath::Max(1.0f, FMath::Abs(Expected.M[Row][Col]));
+				InstanceError = FMath::Max(InstanceError, Error);
+			}
+		}
+		return InstanceError;
+	}
+
+	// The GPU stage only swaps the random source of rotation and RandomFraction, so with the same draws it has to land on the CPU path.
+	// Checks the C++ reference of Transform_CS without RHI, then Transform_CS itself against it when the process can render.
+	static bool Run(FAutomationTestBase& Test, int32 NumInstances, float Tolerance)
+	{
+
+		FRandomStream Random(0x4d6b);
+
+		const FMatrix ProxyXForm = FScaleRotationTranslationMatrix(FVector(1.0, 1.0, 1.0), FRotator(0.0, 30.0, 0.0), FVector(204800.0, -102400.0, 512.0));
+
+		TArray<FLocationNormalScaleZ> Results;
+		Results.SetNumUninitialized(NumInstances);
+		for (int32 Index = 0; Index < NumInstances; ++Index)
+		{
+			FLocationNormalScaleZ& Result = Results[Index];
+			Result.Location = FVector3f(Random.FRandRange(0.0f, 25400.0f), Random.FRandRange(0.0f, 25400.0f), Random.FRandRange(-2000.0f, 2000.0f));
+			Result.ComputedNormal = (Index % 16) == 0 ? FVector3f::ZeroVector : FVector3f(Random.FRandRange(-0.7f, 0.7f), Random.FRandRange(-0.7f, 0.7f), 1.0f).GetSafeNormal();
+			Result.ScaleZ = Random.GetFraction();
+		}
+
+		struct FCase
+		{
+			const TCHAR* Name;
+			FMkGrassVariety Variety;
+		};
+		TArray<FCase> Cases;
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Uniform");
+			Case.Variety.Scaling = EMkGrassScaling::Uniform;
+			Case.Variety.ScaleX = FFloatInterval(0.8f, 1.5f);
+			Case.Variety.RandomRotation = true;
+			Case.Variety.RotationAxis = FVector(0.0, 1.0, 0.0);
+			Case.Variety.ZOffset = FFloatInterval(-5.0f, 5.0f);
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("FreeAlign");
+			Case.Variety.Scaling = EMkGrassScaling::Free;
+			Case.Variety.ScaleX = FFloatInterval(0.5f, 2.0f);
+			Case.Variety.ScaleY = FFloatInterval(1.0f, 1.5f);
+			Case.Variety.ScaleZ = FFloatInterval(0.7f, 3.0f);
+			Case.Variety.RandomRotation = true;
+			Case.Variety.RotationAxis = FVector(0.3, 1.0, 0.7);
+			Case.Variety.AlignToSurface = true;
+			Case.Variety.AlignMaxAngle = 25.5f;
+			Case.Variety.ZOffset = FFloatInterval(-20.0f, 0.0f);
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Voronoi");
+			Case.Variety.Scaling = EMkGrassScaling::LockXY;
+			Case.Variety.ScaleX = FFloatInterval(1.0f, 4.0f);
+			Case.Variety.ScaleZ = FFloatInterval(1.0f, 2.0f);
+			Case.Variety.bUseVoronoiNoise = true;
+			Case.Variety.VoronoiValidRange = FFloatInterval(0.2f, 0.6f);
+			Case.Variety.AlignToSurface = true;
+		}
+
+		const bool bGpu = CanRunGpu();
+
+		bool bAllPassed = true;
+		UE_LOG(LogTemp, Log, TEXT("[MkGpuScattering] GPU transform reference validation, %d instances, tolerance %g%s"), NumInstances, Tolerance, bGpu ? TEXT("") : TEXT(", no renderer, Transform_CS skipped"));
+		UE_LOG(LogTemp, Log, TEXT("  %-12s %12s %10s %12s %10s"), TEXT(""), TEXT("max error"), TEXT("failed"), TEXT("gpu error"), TEXT("gpu failed"));
+
+		for (const FCase& Case : Cases)
+		{
+			const MkGpuScatteringGpuTransform::FParams Params = MkGpuScatteringGpuTransform::FParams::Make(Case.Variety, 1234, ProxyXForm);
+
+			MkGpuScatteringTransformKernel::FParams KernelParams;
+			KernelParams.RotationAxis = Case.Variety.RotationAxis;
+			KernelParams.AlignMaxAngle = Case.Variety.AlignMaxAngle;
+			KernelParams.bAlignToSurface = Case.Variety.AlignToSurface;
+			KernelParams.XForm = ProxyXForm;
+
+			MkGpuScatteringTransformKernel::FInstanceStreams Streams;
+			Streams.Reset(1);
+
+			TArray<FInstanceTransform> Reference;
+			Reference.SetNumUninitialized(NumInstances);
+
+			float MaxError = 0.0f;
+			int32 NumFailed = 0;
+			for (int32 Index = 0; Index < NumInstances; ++Index)
+			{
+				const FLocationNormalScaleZ& Result = Results[Index];
+				const FInstanceTransform Instance = MkGpuScatteringGpuTransform::ComputeInstance(Params, Result);
+				Reference[Index] = Instance;
+
+				// Scale and ZOffset have to come from the CPU path's own stream
+				const MkGpuScatteringGpuTransform::FDraws Draws = MkGpuScatteringGpuTransform::Draw(Params, Result);
+				if (!(Draws.RandomFraction >= 0.0f && Draws.RandomFraction < 1.0f) || Instance.OriginAndRandom.W != Draws.RandomFraction
+					|| MkGpuScatteringGpuTransform::GetRandomSeedForPosition(Result.Location) != GetCpuSeedForPosition(Result.Location))
+				{
+					++NumFailed;
+					continue;
+				}
+
+				Streams.Reset(1);
+				Streams.Add(Result.Location, Result.ComputedNormal, Draws.Scale, Draws.OffsetZ, Draws.Rotation);
+				const FMatrix44f Expected(MkGpuScatteringTransformKernel::TransformScalar(KernelParams, Streams, 0));
+				const float InstanceError = GetInstanceError(Instance.ToMatrix(), Expected);
+				MaxError = FMath::Max(MaxError, InstanceError);
+				NumFailed += InstanceError <= Tolerance ? 0 : 1;
+			}
+
+			// The shader against its reference. RandomFraction is integer math on both sides and has to match exactly.
+			float MaxGpuError = 0.0f;
+			int32 NumGpuFailed = 0;
+			if (bGpu)
+			{
+				TArray<FInstanceTransform> Gpu;
+				TransformGpu(Params, Results, Gpu);
+				for (int32 Index = 0; Index < NumInstances; ++Index)
+				{
+					const float InstanceError = GetInstanceError(Gpu[Index].ToMatrix(), Reference[Index].ToMatrix());
+					MaxGpuError = FMath::Max(MaxGpuError, InstanceError);
+					NumGpuFailed += InstanceError <= Tolerance && Gpu[Index].OriginAndRandom.W == Reference[Index].OriginAndRandom.W ? 0 : 1;
+				}
+			}
+
+			UE_LOG(LogTemp, Log, TEXT("  %-12s %12g %10d %12g %10d"), Case.Name, MaxError, NumFailed, MaxGpuError, NumGpuFailed);
+			bAllPassed &= NumFailed == 0 && NumGpuFailed == 0;
+		}
+
+		if (!bAllPassed)
+		{
+			Test.AddError(TEXT("GPU transform reference or Transform_CS does not match the CPU path"));
+		}
+		return bAllPassed;
+	}
+}
+
+// Checks the C++ reference of Transform_CS against the CPU transform path, then Transform_CS against the reference when the process can render
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMkGpuScatteringGpuTransformTest, "MkGpuScattering.GpuTransform", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FMkGpuScatteringGpuTransformTest::RunTest(const FString& Parameters)
+{
+	return MkGpuTransformValidation::Run(*this, 100000, 1.0e-3f);
+}
+
+// Compares the SIMD transform kernel against the scalar reference
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMkGpuScatteringTransformKernelTest, "MkGpuScattering.TransformKernel", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FMkGpuScatteringTransformKernelTest::RunTest(const FString& Parameters)
+{
+	return MkTransformKernelValidation::Run(*this, 100000, 1.0e-3f);
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "Cache/MkGpuScatteringBakedData.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "Algo/BinarySearch.h"
+#include "Hash/xxhash.h"
+#include "LandscapeProxy.h"
+#include "LandscapeComponent.h"
+
+#include UE_INLINE_GENERATED_CPP_BY_NAME(MkGpuScatteringBakedData)
+
+MK_OPTIMIZATION_OFF
+
+namespace MkGpuScatteringBuilderTypes
+{
+	// Only used by BulkSerialize when the archive has to swap bytes
+	static FArchive& operator<<(FArchive& Ar, FLocationNormalScaleZ& Result)
+	{
+		Ar << Result.Location;
+		Ar << Result.ComputedNormal;
+		Ar << Result.ScaleZ;
+		return Ar;
+	}
+}
+
+using namespace MkGpuScatteringBuilderTypes;
+
+namespace MkGpuScatteringBakedData
+{
+	// Bump when the layout below changes, older data is dropped on load
+	static constexpr int32 Version = 2;
+}
+
+//~ UMkGpuScatteringBakedData
+void UMkGpuScatteringBakedData::Serialize(FArchive& Ar)
+{
+	Super::Serialize(Ar);
+
+	int32 Version = MkGpuScatteringBakedData::Version;
+	Ar << Version;
+
+	TArray<uint64> LoadedKeys;
+	TArray<uint32> LoadedOffsets;
+	TArray<FLocationNormalScaleZ> LoadedResults;
+
+	TArray<uint64>& SerializedKeys = Ar.IsLoading() ? LoadedKeys : Keys;
+	TArray<uint32>& SerializedOffsets = Ar.IsLoading() ? LoadedOffsets : Offsets;
+	TArray<FLocationNormalScaleZ>& SerializedResults = Ar.IsLoading() ? LoadedResults : Results;
+
+	SerializedKeys.BulkSerialize(Ar);
+	SerializedOffsets.BulkSerialize(Ar);
+	SerializedResults.BulkSerialize(Ar);
+
+#if WITH_EDITORONLY_DATA
+	// Version 1 had no hash, that data stays unused in the editor until the next bake
+	if (!Ar.IsFilterEditorOnly() && Version >= 2)
+	{
+		Ar << SourceHash;
+	}
+#endif
+
+	if (Ar.IsLoading())
+	{
+		if (Version != MkGpuScatteringBakedData::Version || LoadedOffsets.Num() != LoadedKeys.Num() + 1)
+		{
+			// Baked by another version, the GPU path takes over until the next bake
+			Keys.Reset();
+			Offsets.Reset();
+			Results.Reset();
+			return;
+		}
+
+		Keys = MoveTemp(LoadedKeys);
+		Offsets = MoveTemp(LoadedOffsets);
+		Results = MoveTemp(LoadedResults);
+	}
+}
+
+bool UMkGpuScatteringBakedData::Find(uint64 Key, TArrayView<const FLocationNormalScaleZ>& OutResults) const
+{
+	const int32 Index = Algo::BinarySearch(Keys, Key);
+	if (Index == INDEX_NONE)
+	{
+		return false;
+	}
+
+	const uint32 Begin = Offsets[Index];
+	const uint32 End = Offsets[Index + 1];
+	if (Begin > End || End > (uint32)Results.Num())
+	{
+		return false;
+	}
+
+	OutResults = TArrayView<const FLocationNormalScaleZ>(Results.GetData() + Begin, End - Begin);
+	return true;
+}
+
+void UMkGpuScatteringBakedData::SetResults(TMap<uint64, TArray<FLocationNormalScaleZ>>&& InResults)
+{
+	InResults.KeySort(TLess<uint64>());
+
+	Keys.Reset(InResults.Num());
+	Offsets.Reset(InResults.Num() + 1);
+	Results.Reset();
+
+	for (const TPair<uint64, TArray<FLocationNormalScaleZ>>& Pair : InResults)
+	{
+		Keys.Add(Pair.Key);
+		Offsets.Add(Results.Num());
+		Results.Append(Pair.Value);
+	}
+	Offsets.Add(Results.Num());
+
+	InResults.Empty();
+}
+
+#if WITH_EDITOR
+uint64 UMkGpuScatteringBakedData::MakeSourceHash(const ALandscapeProxy* LandscapeProxy)
+{
+	FXxHash64Builder Hasher;
+	if (LandscapeProxy)
+	{
+		for (const ULandscapeComponent* Component : LandscapeProxy->LandscapeComponents)
+		{
+			if (!Component)
+			{
+				continue;
+			}
+
+			if (const UTexture2D* Heightmap = Component->GetHeightmap())
+			{
+				const FGuid HeightmapId = Heightmap->Source.GetId();
+				Hasher.Update(&HeightmapId, sizeof(FGuid));
+			}
+			for (const UTexture2D* Weightmap : Component->GetWeightmapTextures())
+			{
+				if (Weightmap)
+				{
+					const FGuid WeightmapId = Weightmap->Source.GetId();
+					Hasher.Update(&WeightmapId, sizeof(FGuid));
+				}
+			}
+		}
+	}
+
+	const uint64 Hash = Hasher.Finalize().Hash;
+	return Hash != 0 ? Hash : 1;
+}
+
+bool UMkGpuScatteringBakedData::MatchesSource(const ALandscapeProxy* LandscapeProxy) const
+{
+	return SourceHash != 0 && SourceHash == MakeSourceHash(LandscapeProxy);
+}
+#endif
+//~ end of UMkGpuScatteringBakedData
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,419 @@
+#include "Cache/MkGpuScatteringDiskCache.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "Async/MappedFileHandle.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/LowLevelMemTracker.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Tasks/Task.h"
+
+LLM_DEFINE_TAG(MkGpuScatteringDiskCache);
+
+MK_OPTIMIZATION_OFF
+
+static int32 GMkGpuScatteringDiskCache = 0;
+static FAutoConsoleVariableRef CVarMkDiskCache(
+	TEXT("MkGpuScattering.DiskCache"),
+	GMkGpuScatteringDiskCache,
+	TEXT("1: Keep the scattering results under Saved/MkGpuScattering and read them back instead of dispatching when the landscape, the variety and the density did not change. Jobs with MkGpuScattering.GpuTransform only read, their results never reach the CPU."));
+
+static int32 GMkGpuScatteringDiskCacheMaxMB = 512;
+static FAutoConsoleVariableRef CVarMkDiskCacheMaxMB(
+	TEXT("MkGpuScattering.DiskCacheMaxMB"),
+	GMkGpuScatteringDiskCacheMaxMB,
+	TEXT("Size of the disk cache in MB. The least recently used files are deleted past it, 0 : no limit."));
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Disk Cache Hits"), STAT_MkGpuScatteringDiskCacheHits, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Disk Cache Misses"), STAT_MkGpuScatteringDiskCacheMisses, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Disk Cache Files"), STAT_MkGpuScatteringDiskCacheFiles, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Disk Cache Evictions"), STAT_MkGpuScatteringDiskCacheEvictions, STATGROUP_MkGpuScattering);
+DECLARE_MEMORY_STAT(TEXT("Disk Cache Bytes"), STAT_MkGpuScatteringDiskCacheBytes, STATGROUP_MkGpuScattering);
+
+using namespace MkGpuScatteringBuilderTypes;
+
+namespace MkGpuScatteringDiskCache
+{
+	static constexpr uint32 Magic = 0x43534B4D; // MKSC
+	static constexpr uint32 Version = 1;
+
+	struct FHeader
+	{
+		uint32 Magic;
+		uint32 Version;
+		uint64 Key;
+		uint32 ElementSize;
+		uint32 NumResults;
+	};
+	static_assert(sizeof(FHeader) == 24, "FHeader is written as is");
+
+	struct FEntry
+	{
+		int64 NumBytes = 0;
+		// Written or read, the file time stamp carries it to the next session
+		FDateTime LastUse;
+	};
+
+	// Keys with a file on disk, filled from the directory by a task, see FMkGpuScatteringDiskCache::StartScan
+	static TMap<uint64, FEntry> KnownKeys;
+	static int64 TotalBytes = 0;
+	static FCriticalSection KnownKeysLock;
+	// Game thread
+	static bool bScanStarted = false;
+
+	// Loads and stores still running
+	static TArray<UE::Tasks::FTask> Tasks;
+	static FCriticalSection TasksLock;
+
+	static FString GetFilename(uint64 Key)
+	{
+		return FPaths::Combine(FMkGpuScatteringDiskCache::GetCacheDir(), FString::Printf(TEXT("%016llx.mksc"), Key));
+	}
+
+	// KnownKeysLock held
+	static void UpdateStats()
+	{
+		SET_DWORD_STAT(STAT_MkGpuScatteringDiskCacheFiles, KnownKeys.Num());
+		SET_MEMORY_STAT(STAT_MkGpuScatteringDiskCacheBytes, TotalBytes);
+	}
+
+	static void ScanCacheDir()
+	{
+		TMap<uint64, FEntry> Found;
+		IFileManager::Get().IterateDirectoryStat(*FMkGpuScatteringDiskCache::GetCacheDir(), [&Found](const TCHAR* Filename, const FFileStatData& StatData)
+		{
+			if (!StatData.bIsDirectory && FPaths::GetExtension(Filename) == TEXT("mksc"))
+			{
+				FEntry& Entry = Found.Add(FParse::HexNumber64(*FPaths::GetBaseFilename(Filename)));
+				Entry.NumBytes = StatData.FileSize;
+				Entry.LastUse = StatData.ModificationTime;
+			}
+			return true;
+		});
+
+		FScopeLock Lock(&KnownKeysLock);
+		for (const TPair<uint64, FEntry>& Pair : Found)
+		{
+			if (!KnownKeys.Contains(Pair.Key))
+			{
+				KnownKeys.Add(Pair.Key, Pair.Value);
+				TotalBytes += Pair.Value.NumBytes;
+			}
+		}
+		UpdateStats();
+	}
+
+	static void Forget(uint64 Key)
+	{
+		FScopeLock Lock(&KnownKeysLock);
+		FEntry Entry;
+		if (KnownKeys.RemoveAndCopyValue(Key, Entry))
+		{
+			TotalBytes -= Entry.NumBytes;
+		}
+		UpdateStats();
+	}
+
+	// Deletes the least recently used files until the cache is back under MkGpuScattering.DiskCacheMaxMB.
+	// A file a load still reads may fail to delete, it is forgotten all the same and found again by the next scan.
+	static void TrimToBudget()
+	{
+		const int64 MaxBytes = (int64)GMkGpuScatteringDiskCacheMaxMB * 1024 * 1024;
+		if (MaxBytes <= 0)
+		{
+			return;
+		}
+
+		TArray<uint64> Evicted;
+		{
+			FScopeLock Lock(&KnownKeysLock);
+			if (TotalBytes <= MaxBytes)
+			{
+				return;
+			}
+
+			// Down to 90 % so the next stores do not trim again right away
+			const int64 TargetBytes = MaxBytes - MaxBytes / 10;
+			KnownKeys.ValueSort([](const FEntry& A, const FEntry& B) { return A.LastUse < B.LastUse; });
+			for (TMap<uint64, FEntry>::TIterator It = KnownKeys.CreateIterator(); It && TotalBytes > TargetBytes; ++It)
+			{
+				TotalBytes -= It->Value.NumBytes;
+				Evicted.Add(It->Key);
+				It.RemoveCurrent();
+			}
+			UpdateStats();
+		}
+
+		INC_DWORD_STAT_BY(STAT_MkGpuScatteringDiskCacheEvictions, Evicted.Num());
+		for (uint64 Key : Evicted)
+		{
+			IFileManager::Get().Delete(*GetFilename(Key), false, false, true);
+		}
+	}
+
+	static void AddTask(UE::Tasks::FTask&& Task)
+	{
+		FScopeLock Lock(&TasksLock);
+		Tasks.RemoveAllSwap([](const UE::Tasks::FTask& Existing) { return Existing.IsCompleted(); }, EAllowShrinking::No);
+		Tasks.Add(MoveTemp(Task));
+	}
+
+	template <typename ResultType>
+	static void CopyResults(const uint8* Data, uint32 NumResults, TArray<ResultType>& OutResults)
+	{
+		OutResults.SetNumUninitialized(NumResults);
+		FPlatformMemory::Memcpy(OutResults.GetData(), Data, (int64)NumResults * sizeof(ResultType));
+	}
+
+	// Copies the results out of Data, into ResultBuffer or PackedResults depending on the format they were stored in.
+	// False if the file does not belong to Key or is cut short.
+	static bool ReadResults(uint64 Key, const uint8* Data, int64 NumBytes, FMkGpuScatteringBuilderOutput& Output)
+	{
+		if (NumBytes < (int64)sizeof(FHeader))
+		{
+			return false;
+		}
+
+		FHeader Header;
+		FPlatformMemory::Memcpy(&Header, Data, sizeof(FHeader));
+		const bool bPacked = Header.ElementSize == sizeof(FPackedLocationNormalScaleZ);
+		if (Header.Magic != Magic || Header.Version != Version || Header.Key != Key || (!bPacked && Header.ElementSize != sizeof(FLocationNormalScaleZ)))
+		{
+			return false;
+		}
+
+		const int64 PayloadBytes = (int64)Header.NumResults * Header.ElementSize;
+		if (NumBytes < (int64)sizeof(FHeader) + PayloadBytes)
+		{
+			return false;
+		}
+
+		if (bPacked)
+		{
+			CopyResults(Data + sizeof(FHeader), Header.NumResults, Output.PackedResults);
+		}
+		else
+		{
+			CopyResults(Data + sizeof(FHeader), Header.NumResults, Output.ResultBuffer);
+		}
+		return true;
+	}
+
+	static bool Load(uint64 Key, FMkGpuScatteringBuilderOutput& Output)
+	{
+		const FString Filename = GetFilename(Key);
+
+		// Only the pages that are touched come in, the copy streams the file
+		TUniquePtr<IMappedFileHandle> MappedFile(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*Filename));
+		if (MappedFile)
+		{
+			TUniquePtr<IMappedFileRegion> Region(MappedFile->MapRegion(0, MappedFile->GetFileSize()));
+			return Region && ReadResults(Key, Region->GetMappedPtr(), Region->GetMappedSize(), Output);
+		}
+
+		// Platforms without mapped files
+		TArray64<uint8> Bytes;
+		return FFileHelper::LoadFileToArray(Bytes, *Filename, FILEREAD_Silent) && ReadResults(Key, Bytes.GetData(), Bytes.Num(), Output);
+	}
+
+	template <typename ResultType>
+	static bool Store(uint64 Key, const TArray<ResultType>& Results)
+	{
+		const FString Filename = GetFilename(Key);
+		// Written aside and moved in, a reader never sees half a file
+		const FString TempFilename = FPaths::CreateTempFilename(*FMkGpuScatteringDiskCache::GetCacheDir(), TEXT("MkScattering"), TEXT(".tmp"));
+
+		TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*TempFilename, FILEWRITE_Silent));
+		if (!Writer)
+		{
+			return false;
+		}
+
+		FHeader Header;
+		Header.Magic = Magic;
+		Header.Version = Version;
+		Header.Key = Key;
+		Header.ElementSize = sizeof(ResultType);
+		Header.NumResults = Results.Num();
+		Writer->Serialize(&Header, sizeof(FHeader));
+		Writer->Serialize(const_cast<ResultType*>(Results.GetData()), Results.Num() * sizeof(ResultType));
+
+		const bool bWritten = Writer->Close() && !Writer->IsError();
+		Writer.Reset();
+
+		if (!bWritten || !IFileManager::Get().Move(*Filename, *TempFilename, true, true, false, true))
+		{
+			IFileManager::Get().Delete(*TempFilename, false, false, true);
+			return false;
+		}
+		return true;
+	}
+}
+
+using namespace MkGpuScatteringDiskCache;
+
+//~ FMkGpuScatteringDiskCache
+bool FMkGpuScatteringDiskCache::IsEnabled()
+{
+	return GMkGpuScatteringDiskCache != 0;
+}
+
+FString FMkGpuScatteringDiskCache::GetCacheDir()
+{
+	return FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("MkGpuScattering"));
+}
+
+void FMkGpuScatteringDiskCache::StartScan()
+{
+	check(IsInGameThread());
+
+	if (bScanStarted)
+	{
+		return;
+	}
+	bScanStarted = true;
+	AddTask(UE::Tasks::Launch(UE_SOURCE_LOCATION, []()
+	{
+		LLM_SCOPE_BYTAG(MkGpuScatteringDiskCache);
+		ScanCacheDir();
+	}));
+}
+
+bool FMkGpuScatteringDiskCache::Contains(uint64 Key)
+{
+	check(IsInGameThread());
+
+	// Enabled after the subsystem started, the jobs miss until the directory is scanned
+	StartScan();
+
+	bool bContains = false;
+	{
+		FScopeLock Lock(&KnownKeysLock);
+		if (FEntry* Entry = KnownKeys.Find(Key))
+		{
+			Entry->LastUse = FDateTime::UtcNow();
+			bContains = true;
+		}
+	}
+
+	if (bContains)
+	{
+		INC_DWORD_STAT(STAT_MkGpuScatteringDiskCacheHits);
+	}
+	else
+	{
+		INC_DWORD_STAT(STAT_MkGpuScatteringDiskCacheMisses);
+	}
+	return bContains;
+}
+
+void FMkGpuScatteringDiskCache::LoadAsync(uint64 Key, const FMkGpuScatteringBuilderHandle& Builder, FMkGpuScatteringBuilderOutput&& Output)
+{
+	// The task and the output it captures, not the caller's scope
+	LLM_SCOPE_BYTAG(MkGpuScatteringDiskCache);
+
+	AddTask(UE::Tasks::Launch(UE_SOURCE_LOCATION, [Key, Builder, Output = MoveTemp(Output)]() mutable
+	{
+		LLM_SCOPE_BYTAG(MkGpuScatteringDiskCache);
+
+		if (!Load(Key, Output))
+		{
+			// Unreadable, stale or evicted since Contains. The builder gathers the job again and the miss writes the file again.
+			UE_LOG(LogTemp, Warning, TEXT("[FMkGpuScatteringDiskCache] Dropping unreadable cache file %016llx"), Key);
+			Output.ResultBuffer.Reset();
+			Output.PackedResults.Reset();
+			Output.bDiskCacheLoadFailed = true;
+			Forget(Key);
+			IFileManager::Get().Delete(*GetFilename(Key), false, false, true);
+		}
+		else
+		{
+			// Keeps the file at the young end of the next session's scan
+			IFileManager::Get().SetTimeStamp(*GetFilename(Key), FDateTime::UtcNow());
+		}
+
+		Output.bGpuTransforms = false;
+		// The proxy may have streamed out meanwhile, Deliver drops the results then
+		Builder.Deliver(MoveTemp(Output));
+	}));
+}
+
+template <typename ResultType>
+static void StoreResultsAsync(uint64 Key, const TArray<ResultType>& Results)
+{
+	{
+		FScopeLock Lock(&KnownKeysLock);
+		if (KnownKeys.Contains(Key))
+		{
+			return;
+		}
+	}
+
+	AddTask(UE::Tasks::Launch(UE_SOURCE_LOCATION, [Key, Results = TArray<ResultType>(Results)]()
+	{
+		LLM_SCOPE_BYTAG(MkGpuScatteringDiskCache);
+
+		if (!Store(Key, Results))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[FMkGpuScatteringDiskCache] Failed to write cache file %016llx"), Key);
+			return;
+		}
+
+		{
+			FScopeLock Lock(&KnownKeysLock);
+			if (!KnownKeys.Contains(Key))
+			{
+				FEntry& Entry = KnownKeys.Add(Key);
+				Entry.NumBytes = (int64)sizeof(FHeader) + (int64)Results.Num() * sizeof(ResultType);
+				Entry.LastUse = FDateTime::UtcNow();
+				TotalBytes += Entry.NumBytes;
+			}
+			UpdateStats();
+		}
+		TrimToBudget();
+	}));
+}
+
+void FMkGpuScatteringDiskCache::StoreAsync(uint64 Key, const TArray<FLocationNormalScaleZ>& Results)
+{
+	StoreResultsAsync(Key, Results);
+}
+
+void FMkGpuScatteringDiskCache::StoreAsync(uint64 Key, const TArray<FPackedLocationNormalScaleZ>& Results)
+{
+	StoreResultsAsync(Key, Results);
+}
+
+void FMkGpuScatteringDiskCache::WaitForTasks()
+{
+	TArray<UE::Tasks::FTask> TasksToWait;
+	{
+		FScopeLock Lock(&TasksLock);
+		TasksToWait = MoveTemp(Tasks);
+	}
+	UE::Tasks::Wait(TasksToWait);
+}
+
+void FMkGpuScatteringDiskCache::Clear()
+{
+	WaitForTasks();
+
+	IFileManager::Get().DeleteDirectory(*GetCacheDir(), false, true);
+
+	FScopeLock Lock(&KnownKeysLock);
+	KnownKeys.Empty();
+	TotalBytes = 0;
+	UpdateStats();
+}
+//~ end of FMkGpuScatteringDiskCache
+
+#if !UE_BUILD_SHIPPING
+static FAutoConsoleCommand MkGpuScatteringClearDiskCacheCmd(
+	TEXT("MkGpuScattering.ClearDiskCache"),
+	TEXT("Deletes every file of the scattering disk cache."),
+	FConsoleCommandDelegate::CreateStatic(&FMkGpuScatteringDiskCache::Clear)
+);
+#endif
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,724 @@
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Cpu/MkGpuScatteringCpuLibrary.h"
+#include "Shaders/MkGpuScatteringShaders.h"
+#include "Builder/MkGpuScatteringBuilder.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "LandscapeProxy.h"
+#include "LandscapeComponent.h"
+#include "LandscapeDataAccess.h"
+#include "Engine/Texture.h"
+#include "Async/ParallelFor.h"
+#include "HAL/LowLevelMemTracker.h"
+#include "Misc/App.h"
+#include "Tasks/Task.h"
+
+LLM_DEFINE_TAG(MkGpuScatteringCpuEngine);
+
+MK_OPTIMIZATION_OFF
+
+static int32 GMkGpuScatteringBackend = -1;
+static FAutoConsoleVariableRef CVarMkBackend(
+	TEXT("MkGpuScattering.Backend"),
+	GMkGpuScatteringBackend,
+	TEXT("Where the scattering jobs run. -1: on the CPU when the process cannot render (dedicated server, NullRHI) or the RHI has no SM5, on the GPU otherwise. 0: Scattering_CS. 1: CPU engine, also disables MkGpuScattering.GpuTransform. Can be set per platform in the device profiles."));
+
+static int32 GMkGpuScatteringCpuTextureCacheSize = 64;
+static FAutoConsoleVariableRef CVarMkCpuTextureCacheSize(
+	TEXT("MkGpuScattering.CpuTextureCacheSize"),
+	GMkGpuScatteringCpuTextureCacheSize,
+	TEXT("Landscape textures the CPU backend keeps copies of, the least recently used are dropped above it."));
+
+DECLARE_CYCLE_STAT(TEXT("CPU Scatter"), STAT_MkGpuScatteringCpuScatter, STATGROUP_MkGpuScattering);
+DECLARE_CYCLE_STAT(TEXT("CPU Texture Copy"), STAT_MkGpuScatteringCpuTextureCopy, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("CPU Scatter Jobs"), STAT_MkGpuScatteringCpuJobs, STATGROUP_MkGpuScattering);
+DECLARE_MEMORY_STAT(TEXT("CPU Texture Copies"), STAT_MkGpuScatteringCpuTextureBytes, STATGROUP_MkGpuScattering);
+
+using namespace MkGpuScatteringBuilderTypes;
+
+namespace MkGpuScatteringCpuEngine
+{
+	using namespace MkGpuScatteringCpuLibrary;
+
+	constexpr int32 BatchSize = 4;
+
+	// saturate(Diff / Range). The GPU divides by a zero range too : any difference saturates to 1, none is NaN and saturates to 0.
+	static FORCEINLINE float SaturateDiv(float Diff, float Range)
+	{
+		if (Range > 0.0f)
+		{
+			return FMath::Clamp(Diff / Range, 0.0f, 1.0f);
+		}
+		return Diff > 0.0f ? 1.0f : 0.0f;
+	}
+
+	// One candidate between the passes of Scatter
+	struct FCandidate
+	{
+		FNumberGenerator NumberGenerator;
+		FVector2f Location;
+		float LayerWeight;
+		uint32 Reject;
+	};
+	static constexpr uint32 NotRejected = Reject_Num;
+
+	// Structure-of-arrays inputs and outputs of the height and normal pass
+	struct alignas(16) FCandidateBatch
+	{
+		float X1[BatchSize], Y1[BatchSize], X2[BatchSize], Y2[BatchSize];
+		float LerpX[BatchSize], LerpY[BatchSize];
+		float H11[BatchSize], H21[BatchSize], H12[BatchSize], H22[BatchSize];
+
+		float FinalZ[BatchSize];
+		float NormalX[BatchSize], NormalY[BatchSize], NormalZ[BatchSize];
+	};
+
+	static FORCEINLINE VectorRegister4Float Lerp(VectorRegister4Float A, VectorRegister4Float B, VectorRegister4Float Alpha)
+	{
+		return VectorMultiplyAdd(Alpha, VectorSubtract(B, A), A);
+	}
+
+	static FORCEINLINE void Cross(
+		VectorRegister4Float AX, VectorRegister4Float AY, VectorRegister4Float AZ,
+		VectorRegister4Float BX, VectorRegister4Float BY, VectorRegister4Float BZ,
+		VectorRegister4Float& OutX, VectorRegister4Float& OutY, VectorRegister4Float& OutZ)
+	{
+		OutX = VectorSubtract(VectorMultiply(AY, BZ), VectorMultiply(AZ, BY));
+		OutY = VectorSubtract(VectorMultiply(AZ, BX), VectorMultiply(AX, BZ));
+		OutZ = VectorSubtract(VectorMultiply(AX, BY), VectorMultiply(AY, BX));
+	}
+
+	// Bilinear height and triangle normal of 4 candidates, the "Bilinear interpolate sampled heights" and
+	// "Compute normal" blocks of Scattering_CS
+	static void ComputeHeightsAndNormals(FCandidateBatch& Batch, float DrawScaleZ)
+	{
+		const VectorRegister4Float Zero = VectorZeroFloat();
+
+		const VectorRegister4Float X1 = VectorLoadAligned(Batch.X1);
+		const VectorRegister4Float Y1 = VectorLoadAligned(Batch.Y1);
+		const VectorRegister4Float X2 = VectorLoadAligned(Batch.X2);
+		const VectorRegister4Float Y2 = VectorLoadAligned(Batch.Y2);
+		const VectorRegister4Float LerpX = VectorLoadAligned(Batch.LerpX);
+		const VectorRegister4Float LerpY = VectorLoadAligned(Batch.LerpY);
+		const VectorRegister4Float H11 = VectorLoadAligned(Batch.H11);
+		const VectorRegister4Float H21 = VectorLoadAligned(Batch.H21);
+		const VectorRegister4Float H12 = VectorLoadAligned(Batch.H12);
+		const VectorRegister4Float H22 = VectorLoadAligned(Batch.H22);
+
+		const VectorRegister4Float Interp1 = Lerp(H11, H21, LerpX);
+		const VectorRegister4Float Interp2 = Lerp(H12, H22, LerpX);
+		VectorStoreAligned(VectorMultiply(Lerp(Interp1, Interp2, LerpY), VectorSetFloat1(DrawScaleZ)), Batch.FinalZ);
+
+		const VectorRegister4Float SameX = VectorCompareEQ(X1, X2);
+		const VectorRegister4Float SameY = VectorCompareEQ(Y1, Y2);
+
+		// LerpX > LerpY : P21 corner, cross(P22 - P21, P11 - P21)
+		VectorRegister4Float UpperX, UpperY, UpperZ;
+		Cross(VectorSubtract(X2, X2), VectorSubtract(Y2, Y1), VectorSubtract(H22, H21),
+			VectorSubtract(X1, X2), VectorSubtract(Y1, Y1), VectorSubtract(H11, H21),
+			UpperX, UpperY, UpperZ);
+		const VectorRegister4Float UpperDegenerate = VectorBitwiseOr(
+			VectorBitwiseAnd(SameX, VectorCompareEQ(H11, H21)),
+			VectorBitwiseAnd(SameY, VectorCompareEQ(H22, H21)));
+
+		// Otherwise : P12 corner, cross(P11 - P12, P22 - P12)
+		VectorRegister4Float LowerX, LowerY, LowerZ;
+		Cross(VectorSubtract(X1, X1), VectorSubtract(Y1, Y2), VectorSubtract(H11, H12),
+			VectorSubtract(X2, X1), VectorSubtract(Y2, Y2), VectorSubtract(H22, H12),
+			LowerX, LowerY, LowerZ);
+		const VectorRegister4Float LowerDegenerate = VectorBitwiseOr(
+			VectorBitwiseAnd(SameY, VectorCompareEQ(H11, H12)),
+			VectorBitwiseAnd(SameX, VectorCompareEQ(H22, H12)));
+
+		const VectorRegister4Float UseUpper = VectorCompareGT(LerpX, LerpY);
+		VectorRegister4Float NX = VectorSelect(UseUpper, UpperX, LowerX);
+		VectorRegister4Float NY = VectorSelect(UseUpper, UpperY, LowerY);
+		VectorRegister4Float NZ = VectorSelect(UseUpper, UpperZ, LowerZ);
+		const VectorRegister4Float Degenerate = VectorSelect(UseUpper, UpperDegenerate, LowerDegenerate);
+
+		// Collinear corners would be NaN on the GPU, they get the zero normal of a degenerate triangle here
+		const VectorRegister4Float LengthSquared = VectorMultiplyAdd(NX, NX, VectorMultiplyAdd(NY, NY, VectorMultiply(NZ, NZ)));
+		const VectorRegister4Float Valid = VectorBitwiseAnd(VectorCompareGT(LengthSquared, Zero), VectorCompareEQ(Degenerate, Zero));
+		const VectorRegister4Float InvLength = VectorDivide(VectorOneFloat(), VectorSqrt(VectorMax(LengthSquared, VectorSetFloat1(UE_SMALL_NUMBER))));
+
+		VectorStoreAligned(VectorSelect(Valid, VectorMultiply(NX, InvLength), Zero), Batch.NormalX);
+		VectorStoreAligned(VectorSelect(Valid, VectorMultiply(NY, InvLength), Zero), Batch.NormalY);
+		VectorStoreAligned(VectorSelect(Valid, VectorMultiply(NZ, InvLength), Zero), Batch.NormalZ);
+	}
+
+	// One row of candidates, DispatchThreadId.y == Row
+	static void ScatterRow(const FScatteringJobDesc& Desc, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture* Weightmap,
+		uint32 Row, TArray<FLocationNormalScaleZ>& OutResults, FProgressInfo& OutProgress)
+	{
+		const uint32 SqrtMaxInstances = Desc.SqrtMaxInstances;
+		const FVector2f Extent = Desc.Extent;
+		const FVector3f DrawScale = Desc.DrawScale;
+		const float Quads = (float)(Desc.Stride - 1);
+		const bool bUseWeightmap = Weightmap && Desc.WeightmapChannelIdx > 0;
+		const uint32 Channel = Desc.WeightmapChannelIdx - 1;
+
+		const float MaxNormalAngle = FMath::Cos(FMath::DegreesToRadians(Desc.SlopeMinMax.Y));
+		const float MinNormalAngle = FMath::Cos(FMath::DegreesToRadians(Desc.SlopeMinMax.X));
+		constexpr float SlopeTolerance = 1.e-8f;
+
+		FCandidate Candidates[BatchSize];
+		FCandidateBatch Batch;
+
+		for (uint32 Column = 0; Column < SqrtMaxInstances; Column += BatchSize)
+		{
+			const uint32 NumLanes = FMath::Min<uint32>(BatchSize, SqrtMaxInstances - Column);
+
+			// Location, layer weight and the heights to interpolate, in shader order so the random sequence matches
+			for (uint32 Lane = 0; Lane < BatchSize; ++Lane)
+			{
+				FCandidate& Candidate = Candidates[Lane];
+				Candidate.Reject = NotRejected;
+				Candidate.LayerWeight = 1.0f;
+				if (Lane >= NumLanes)
+				{
+					// Padding, the height pass still runs on it
+					Batch.X1[Lane] = Batch.Y1[Lane] = Batch.LerpX[Lane] = Batch.LerpY[Lane] = 0.0f;
+					Batch.X2[Lane] = Batch.Y2[Lane] = 1.0f;
+					Batch.H11[Lane] = Batch.H21[Lane] = Batch.H12[Lane] = Batch.H22[Lane] = 0.0f;
+					continue;
+				}
+
+				const uint32 InstanceIndex = Row * SqrtMaxInstances + Column + Lane;
+				FNumberGenerator& NumberGenerator = Candidate.NumberGenerator;
+				NumberGenerator.SetSeed((uint32)Desc.InstancingRandomSeed + InstanceIndex);
+
+				if (Desc.UseGrid)
+				{
+					const float Div = 1.0f / (float)SqrtMaxInstances;
+					const FVector2f Origin = Desc.Origin + Extent * (Div * 0.5f);
+
+					const float GridX = (float)(InstanceIndex / SqrtMaxInstances);
+					const float GridY = (float)(InstanceIndex % SqrtMaxInstances);
+					Candidate.Location = FVector2f(Origin.X + GridX * Div * Extent.X, Origin.Y + GridY * Div * Extent.Y);
+
+					const float MaxJitter1D = FMath::Clamp(Desc.PlacementJitter, 0.0f, 0.99f) * Div * 0.5f;
+					const float Rand = NumberGenerator.GetRandomFloat(0.0f, Desc.PlacementJitter);
+					Candidate.Location.X += (Rand * 2.0f - 1.0f) * MaxJitter1D * Extent.X;
+					Candidate.Location.Y += (Rand * 2.0f - 1.0f) * MaxJitter1D * Extent.Y;
+				}
+				else
+				{
+					const float HaltonX = Halton(InstanceIndex + Desc.HaltonBaseIndex, 2);
+					const float HaltonY = Halton(InstanceIndex + Desc.HaltonBaseIndex, 3);
+					Candidate.Location = FVector2f(Desc.Origin.X + HaltonX * Extent.X, Desc.Origin.Y + HaltonY * Extent.Y);
+				}
+
+				const float TestX = (Candidate.Location.X / DrawScale.X) - Desc.SectionBase.X;
+				const float TestY = (Candidate.Location.Y / DrawScale.Y) - Desc.SectionBase.Y;
+
+				const float X1 = FMath::FloorToFloat(TestX);
+				const float Y1 = FMath::FloorToFloat(TestY);
+				const float X2 = FMath::CeilToFloat(TestX);
+				const float Y2 = FMath::CeilToFloat(TestY);
+
+				const float IdxX1 = FMath::Clamp(X1, 0.0f, Quads);
+				const float IdxY1 = FMath::Clamp(Y1, 0.0f, Quads);
+				const float IdxX2 = FMath::Clamp(X2, 0.0f, Quads);
+				const float IdxY2 = FMath::Clamp(Y2, 0.0f, Quads);
+
+				if (bUseWeightmap)
+				{
+					const float IndexX = FMath::Clamp(TestX, 0.0f, Quads);
+					const float IndexY = FMath::Clamp(TestY, 0.0f, Quads);
+					const FVector4f SampleWeight = Weightmap->SampleBilinear(IndexX / Quads, IndexY / Quads);
+
+					Candidate.LayerWeight = SampleWeight[Channel];
+					const float SumWeights = SampleWeight.X + SampleWeight.Y + SampleWeight.Z + SampleWeight.W;
+					const float OtherWeights = (SumWeights - Candidate.LayerWeight) / 3.0f;
+					if (SumWeights < OtherWeights)
+					{
+						Candidate.Reject = Reject_LayerWeightSum;
+					}
+					else if (Candidate.LayerWeight < NumberGenerator.GetRandomFloat(Candidate.LayerWeight * 0.5f, 1.0f))
+					{
+						Candidate.Reject = Reject_LayerWeight;
+					}
+				}
+
+				Batch.X1[Lane] = X1;
+				Batch.Y1[Lane] = Y1;
+				Batch.X2[Lane] = X2;
+				Batch.Y2[Lane] = Y2;
+				Batch.LerpX[Lane] = TestX - X1;
+				Batch.LerpY[Lane] = TestY - Y1;
+				Batch.H11[Lane] = FMkScatteringCpuTexture::DecodeHeight(Heightmap.SamplePoint(IdxX1 / Quads, IdxY1 / Quads));
+				Batch.H21[Lane] = FMkScatteringCpuTexture::DecodeHeight(Heightmap.SamplePoint(IdxX2 / Quads, IdxY1 / Quads));
+				Batch.H12[Lane] = FMkScatteringCpuTexture::DecodeHeight(Heightmap.SamplePoint(IdxX1 / Quads, IdxY2 / Quads));
+				Batch.H22[Lane] = FMkScatteringCpuTexture::DecodeHeight(Heightmap.SamplePoint(IdxX2 / Quads, IdxY2 / Quads));
+			}
+
+			ComputeHeightsAndNormals(Batch, DrawScale.Z);
+
+			// Remaining tests in shader order
+			for (uint32 Lane = 0; Lane < NumLanes; ++Lane)
+			{
+				FCandidate& Candidate = Candidates[Lane];
+				if (Candidate.Reject != NotRejected)
+				{
+					++OutProgress.RejectCounts[Candidate.Reject];
+					continue;
+				}
+
+				const float FinalZ = Batch.FinalZ[Lane];
+				if (FinalZ < Desc.HeightMinMax.X || FinalZ > Desc.HeightMinMax.Y)
+				{
+					++OutProgress.RejectCounts[Reject_Height];
+					continue;
+				}
+
+				const float HeightFalloff = FMath::Min(
+					SaturateDiv(FMath::Abs(Desc.HeightMinMax.X - FinalZ), Desc.HeightFalloffRange),
+					SaturateDiv(FMath::Abs(Desc.HeightMinMax.Y - FinalZ), Desc.HeightFalloffRange));
+				if (HeightFalloff < Candidate.NumberGenerator.GetRandomFloat(HeightFalloff * 0.5f, 1.0f))
+				{
+					++OutProgress.RejectCounts[Reject_HeightFalloff];
+					continue;
+				}
+
+				float ScaleZ = 1.0f;
+				if (Desc.bUseVoronoiNoise)
+				{
+					const FVector4f& VoronoiSetting = Desc.VoronoiSetting;
+					const float LerpZ = 1.0f - VoronoiNoise(Candidate.Location / VoronoiSetting.X, VoronoiSetting.Y);
+					const float RandRes = Candidate.NumberGenerator.GetRandomFloat(0.05f, 1.0f);
+					if ((LerpZ < VoronoiSetting.Z || LerpZ > VoronoiSetting.W) && LerpZ < RandRes)
+					{
+						++OutProgress.RejectCounts[Reject_Voronoi];
+						continue;
+					}
+					ScaleZ = LerpZ;
+				}
+
+				const float NormalZ = Batch.NormalZ[Lane];
+				if (MaxNormalAngle > (NormalZ + SlopeTolerance) || MinNormalAngle < (NormalZ - SlopeTolerance))
+				{
+					++OutProgress.RejectCounts[Reject_Slope];
+					continue;
+				}
+
+				FLocationNormalScaleZ& Result = OutResults.AddDefaulted_GetRef();
+				Result.Location = FVector3f(Candidate.Location.X - DrawScale.X * Desc.Offset.X, Candidate.Location.Y - DrawScale.Y * Desc.Offset.Y, FinalZ);
+				Result.ComputedNormal = FVector3f(Batch.NormalX[Lane], Batch.NormalY[Lane], NormalZ);
+				Result.ScaleZ = ScaleZ * Candidate.LayerWeight * HeightFalloff;
+			}
+		}
+	}
+
+	//~ Texture copies
+	struct FCachedTexture
+	{
+		TSharedPtr<const FMkScatteringCpuTexture> Texture;
+		FGuid ContentId;
+		uint64 LastUsedFrame = 0;
+	};
+
+	// Game thread only. Keyed by the texture, or by the component for heights read from collision.
+	static TMap<TObjectKey<UObject>, FCachedTexture> TextureCache;
+	static int64 TextureCacheBytes = 0;
+
+	static void RemoveCachedTexture(const TObjectKey<UObject>& Key)
+	{
+		FCachedTexture Cached;
+		if (TextureCache.RemoveAndCopyValue(Key, Cached))
+		{
+			const int64 NumBytes = Cached.Texture->GetAllocatedSize();
+			TextureCacheBytes -= NumBytes;
+			DEC_MEMORY_STAT_BY(STAT_MkGpuScatteringCpuTextureBytes, NumBytes);
+		}
+	}
+
+	static void TrimTextureCache(int32 MaxEntries)
+	{
+		while (TextureCache.Num() > FMath::Max(MaxEntries, 0))
+		{
+			TObjectKey<UObject> Oldest;
+			uint64 OldestFrame = MAX_uint64;
+			for (const TPair<TObjectKey<UObject>, FCachedTexture>& Pair : TextureCache)
+			{
+				if (Pair.Value.LastUsedFrame < OldestFrame)
+				{
+					Oldest = Pair.Key;
+					OldestFrame = Pair.Value.LastUsedFrame;
+				}
+			}
+			RemoveCachedTexture(Oldest);
+		}
+	}
+
+	// The copy is shared with the jobs still running, a new content id replaces it
+	static TSharedPtr<const FMkScatteringCpuTexture> FindOrCopy(const UObject* Object, const FGuid& ContentId, TFunctionRef<bool(FMkScatteringCpuTexture&)> Copy)
+	{
+		check(IsInGameThread());
+
+		const TObjectKey<UObject> Key(Object);
+		if (FCachedTexture* Cached = TextureCache.Find(Key))
+		{
+			if (Cached->ContentId == ContentId)
+			{
+				Cached->LastUsedFrame = GFrameCounter;
+				return Cached->Texture;
+			}
+			RemoveCachedTexture(Key);
+		}
+
+		SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringCpuTextureCopy);
+		LLM_SCOPE_BYTAG(MkGpuScatteringCpuEngine);
+
+		TSharedRef<FMkScatteringCpuTexture> Texture = MakeShared<FMkScatteringCpuTexture>();
+		if (!Copy(*Texture))
+		{
+			return nullptr;
+		}
+
+		TrimTextureCache(GMkGpuScatteringCpuTextureCacheSize - 1);
+
+		FCachedTexture& Cached = TextureCache.Add(Key);
+		Cached.Texture = Texture;
+		Cached.ContentId = ContentId;
+		Cached.LastUsedFrame = GFrameCounter;
+
+		const int64 NumBytes = Texture->GetAllocatedSize();
+		TextureCacheBytes += NumBytes;
+		INC_MEMORY_STAT_BY(STAT_MkGpuScatteringCpuTextureBytes, NumBytes);
+		return Texture;
+	}
+
+	// Mip 0 of the texture source, what the GPU samples. Editor only.
+	static bool CopyTextureSource(UTexture* Texture, FMkScatteringCpuTexture& Out)
+	{
+#if WITH_EDITORONLY_DATA
+		FTextureSource& Source = Texture->Source;
+		if (!Source.IsValid() || Source.GetFormat() != TSF_BGRA8)
+		{
+			return false;
+		}
+
+		TArray64<uint8> MipData;
+		if (!Source.GetMipData(MipData, 0, 0, 0))
+		{
+			return false;
+		}
+
+		Out.SizeX = Source.GetSizeX();
+		Out.SizeY = Source.GetSizeY();
+		const int64 NumTexels = (int64)Out.SizeX * Out.SizeY;
+		if (MipData.Num() < NumTexels * (int64)sizeof(FColor))
+		{
+			return false;
+		}
+
+		Out.Texels.SetNumUninitialized(NumTexels);
+		FPlatformMemory::Memcpy(Out.Texels.GetData(), MipData.GetData(), NumTexels * sizeof(FColor));
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Cooked builds have no texture source. The collision heightfield has the same heights at the vertices,
+	// re-encoded like the heightmap so Scatter samples both the same way.
+	static bool CopyCollisionHeights(const ULandscapeComponent* Component, FMkScatteringCpuTexture& Out)
+	{
+		const ALandscapeProxy* LandscapeProxy = Component->GetLandscapeProxy();
+		if (!LandscapeProxy)
+		{
+			return false;
+		}
+
+		const int32 Stride = Component->ComponentSizeQuads + 1;
+		const FTransform& ComponentToWorld = Component->GetComponentTransform();
+
+		Out.SizeX = Stride;
+		Out.SizeY = Stride;
+		Out.Texels.SetNumUninitialized(Stride * Stride);
+		for (int32 Y = 0; Y < Stride; ++Y)
+		{
+			for (int32 X = 0; X < Stride; ++X)
+			{
+				const FVector WorldLocation = ComponentToWorld.TransformPosition(FVector(X, Y, 0.0));
+				const TOptional<float> WorldHeight = LandscapeProxy->GetHeightAtLocation(WorldLocation);
+				if (!WorldHeight.IsSet())
+				{
+					// Collision not created yet, the next job tries again
+					return false;
+				}
+
+				const float LocalHeight = (float)ComponentToWorld.InverseTransformPosition(FVector(WorldLocation.X, WorldLocation.Y, WorldHeight.GetValue())).Z;
+				const uint16 TexHeight = LandscapeDataAccess::GetTexHeight(LocalHeight);
+				Out.Texels[Y * Stride + X] = FColor((uint8)(TexHeight >> 8), (uint8)(TexHeight & 0xff), 0, 0);
+			}
+		}
+		return true;
+	}
+	//~ end of Texture copies
+
+	// Jobs still running, tagged with the builder they deliver to
+	struct FPendingTask
+	{
+		uint32 BuilderId = 0;
+		UE::Tasks::FTask Task;
+	};
+	static TArray<FPendingTask> Tasks;
+	static FCriticalSection TasksLock;
+
+	static void AddTask(uint32 BuilderId, UE::Tasks::FTask&& Task)
+	{
+		FScopeLock Lock(&TasksLock);
+		Tasks.RemoveAllSwap([](const FPendingTask& Existing) { return Existing.Task.IsCompleted(); }, EAllowShrinking::No);
+		Tasks.Add({ BuilderId, MoveTemp(Task) });
+	}
+
+	// BuilderId 0 takes every task
+	static void TakeTasks(uint32 BuilderId, TArray<UE::Tasks::FTask>& OutTasks)
+	{
+		FScopeLock Lock(&TasksLock);
+		for (int32 Index = Tasks.Num() - 1; Index >= 0; --Index)
+		{
+			if (BuilderId == 0 || Tasks[Index].BuilderId == BuilderId)
+			{
+				OutTasks.Add(MoveTemp(Tasks[Index].Task));
+				Tasks.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+			}
+		}
+	}
+
+	static bool bWarnedMissingData = false;
+}
+
+FVector4f FMkScatteringCpuTexture::SampleBilinear(float U, float V) const
+{
+	const float X = U * SizeX - 0.5f;
+	const float Y = V * SizeY - 0.5f;
+	const float FloorX = FMath::FloorToFloat(X);
+	const float FloorY = FMath::FloorToFloat(Y);
+	const float FracX = X - FloorX;
+	const float FracY = Y - FloorY;
+
+	const int32 X0 = FMath::Clamp((int32)FloorX, 0, SizeX - 1);
+	const int32 Y0 = FMath::Clamp((int32)FloorY, 0, SizeY - 1);
+	const int32 X1 = FMath::Clamp((int32)FloorX + 1, 0, SizeX - 1);
+	const int32 Y1 = FMath::Clamp((int32)FloorY + 1, 0, SizeY - 1);
+
+	auto ToVector = [](const FColor& Texel)
+	{
+		return FVector4f(Texel.R, Texel.G, Texel.B, Texel.A) * (1.0f / 255.0f);
+	};
+	const FVector4f Top = FMath::Lerp(ToVector(Texels[Y0 * SizeX + X0]), ToVector(Texels[Y0 * SizeX + X1]), FracX);
+	const FVector4f Bottom = FMath::Lerp(ToVector(Texels[Y1 * SizeX + X0]), ToVector(Texels[Y1 * SizeX + X1]), FracX);
+	return FMath::Lerp(Top, Bottom, FracY);
+}
+
+bool FMkGpuScatteringCpuEngine::IsActive()
+{
+	if (GMkGpuScatteringBackend >= 0)
+	{
+		return GMkGpuScatteringBackend == 1;
+	}
+	// Scattering_CS needs a renderer with SM5
+	return !FApp::CanEverRender() || !IsFeatureLevelSupported(GMaxRHIShaderPlatform, ERHIFeatureLevel::SM5);
+}
+
+void FMkGpuScatteringCpuEngine::Scatter(const FScatteringJobDesc& Desc, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture* Weightmap,
+	TArray<FLocationNormalScaleZ>& OutResults, FProgressInfo* OutProgress)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringCpuScatter);
+	LLM_SCOPE_BYTAG(MkGpuScatteringCpuEngine);
+	// Stands in for the GPU scatter and its readback
+	MK_SCATTERING_STAGE_SCOPE(Readback);
+
+	OutResults.Reset();
+	const int32 NumRows = (int32)Desc.SqrtMaxInstances;
+	if (NumRows <= 0 || Heightmap.Texels.IsEmpty())
+	{
+		return;
+	}
+
+	// Rows are independent, they are appended in row order so the output does not depend on the scheduling
+	TArray<TArray<FLocationNormalScaleZ>> RowResults;
+	TArray<FProgressInfo> RowProgress;
+	RowResults.SetNum(NumRows);
+	RowProgress.SetNum(NumRows);
+
+	ParallelFor(TEXT("MkGpuScattering.CpuScatter"), NumRows, 4, [&](int32 Row)
+	{
+		RowResults[Row].Reserve(NumRows);
+		ScatterRow(Desc, Heightmap, Weightmap, (uint32)Row, RowResults[Row], RowProgress[Row]);
+	});
+
+	int32 NumResults = 0;
+	for (const TArray<FLocationNormalScaleZ>& Results : RowResults)
+	{
+		NumResults += Results.Num();
+	}
+	OutResults.Reserve(NumResults);
+	for (const TArray<FLocationNormalScaleZ>& Results : RowResults)
+	{
+		OutResults.Append(Results);
+	}
+
+	if (OutProgress)
+	{
+		*OutProgress = FProgressInfo();
+		OutProgress->Count = NumResults;
+		OutProgress->MaxInstances = Desc.SqrtMaxInstances * Desc.SqrtMaxInstances;
+		for (const FProgressInfo& Progress : RowProgress)
+		{
+			for (int32 Reason = 0; Reason < Reject_Num; ++Reason)
+			{
+				OutProgress->RejectCounts[Reason] += Progress.RejectCounts[Reason];
+			}
+		}
+	}
+}
+
+TSharedPtr<const FMkScatteringCpuTexture> FMkGpuScatteringCpuEngine::GetHeightmap(UTexture* Texture, const ULandscapeComponent* Component)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+#if WITH_EDITORONLY_DATA
+	if (Texture && Texture->Source.IsValid())
+	{
+		// The source id changes with every landscape edit
+		return FindOrCopy(Texture, Texture->Source.GetId(), [Texture](FMkScatteringCpuTexture& Out) { return CopyTextureSource(Texture, Out); });
+	}
+#endif
+
+	if (Component)
+	{
+		return FindOrCopy(Component, FGuid(), [Component](FMkScatteringCpuTexture& Out) { return CopyCollisionHeights(Component, Out); });
+	}
+	return nullptr;
+}
+
+TSharedPtr<const FMkScatteringCpuTexture> FMkGpuScatteringCpuEngine::GetWeightmap(UTexture* Texture)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+#if WITH_EDITORONLY_DATA
+	if (Texture && Texture->Source.IsValid())
+	{
+		return FindOrCopy(Texture, Texture->Source.GetId(), [Texture](FMkScatteringCpuTexture& Out) { return CopyTextureSource(Texture, Out); });
+	}
+#endif
+	return nullptr;
+}
+
+void FMkGpuScatteringCpuEngine::Dispatch(FMkGpuScatteringCS_Param&& Param, int64 JobBytes)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	check(IsInGameThread());
+	LLM_SCOPE_BYTAG(MkGpuScatteringCpuEngine);
+
+	// Jobs whose component went away are dropped like on the GPU, the cache item is released with the component
+	const FMkGpuScatteringBuilderHandle Builder = Param.Builder;
+	if (!Builder.WeakBuilder.IsValid() || !Param.Foliage.IsValid())
+	{
+		FMkAsyncBuilderInterface::ReleaseArenaBytes(JobBytes);
+		return;
+	}
+
+	const FScatteringJobDesc Desc = Param.MakeJobDesc();
+	TSharedPtr<const FMkScatteringCpuTexture> Heightmap = GetHeightmap(Param.HeightmapTexture, Param.BuilderOutput.BasedOn.Get());
+	TSharedPtr<const FMkScatteringCpuTexture> Weightmap = Param.WeightmapTexture ? GetWeightmap(Param.WeightmapTexture) : nullptr;
+
+	FMkGpuScatteringBuilderOutput Output = MoveTemp(Param.BuilderOutput);
+	Output.bGpuTransforms = false;
+
+	if (!Heightmap.IsValid() || (Param.WeightmapTexture && !Weightmap.IsValid()))
+	{
+		// Cooked builds keep no weightmap on the CPU. The job finishes empty so the builder does not wait for it.
+		if (!bWarnedMissingData)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[FMkGpuScatteringCpuEngine] No CPU copy of the landscape data for %s, jobs without one finish empty"),
+				*GetNameSafe(Param.WeightmapTexture && !Weightmap.IsValid() ? Param.WeightmapTexture : Param.HeightmapTexture));
+			bWarnedMissingData = true;
+		}
+		FMkAsyncBuilderInterface::ReleaseArenaBytes(JobBytes);
+		Builder.Deliver(MoveTemp(Output));
+		return;
+	}
+
+	INC_DWORD_STAT(STAT_MkGpuScatteringCpuJobs);
+
+	AddTask(Builder.BuilderId, UE::Tasks::Launch(UE_SOURCE_LOCATION, [Desc, Heightmap = MoveTemp(Heightmap), Weightmap = MoveTemp(Weightmap), Builder, Output = MoveTemp(Output), JobBytes]() mutable
+	{
+		LLM_SCOPE_BYTAG(MkGpuScatteringCpuEngine);
+
+		// The builder is being destroyed, nobody takes the result
+		if (!Builder.CompletedOutputs.IsValid())
+		{
+			FMkAsyncBuilderInterface::ReleaseArenaBytes(JobBytes);
+			return;
+		}
+
+		TArray<FLocationNormalScaleZ> Results;
+		Scatter(Desc, *Heightmap, Weightmap.Get(), Results);
+
+		if (Output.bCompactResults)
+		{
+			Output.PackedResults.SetNumUninitialized(Results.Num());
+			for (int32 Index = 0; Index < Results.Num(); ++Index)
+			{
+				Output.PackedResults[Index] = Output.PackedFrame.Pack(Results[Index]);
+			}
+		}
+		else
+		{
+			Output.ResultBuffer = MoveTemp(Results);
+		}
+
+		FMkAsyncBuilderInterface::ReleaseArenaBytes(JobBytes);
+		Builder.Deliver(MoveTemp(Output));
+	}));
+}
+
+void FMkGpuScatteringCpuEngine::WaitForTasks()
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	TArray<UE::Tasks::FTask> TasksToWait;
+	TakeTasks(0, TasksToWait);
+	UE::Tasks::Wait(TasksToWait);
+}
+
+void FMkGpuScatteringCpuEngine::WaitForTasks(uint32 BuilderId)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	if (BuilderId == 0)
+	{
+		return;
+	}
+	TArray<UE::Tasks::FTask> TasksToWait;
+	TakeTasks(BuilderId, TasksToWait);
+	UE::Tasks::Wait(TasksToWait);
+}
+
+bool FMkGpuScatteringCpuEngine::HasPendingTasks(uint32 BuilderId)
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	FScopeLock Lock(&TasksLock);
+	return Tasks.ContainsByPredicate([BuilderId](const FPendingTask& Existing) { return Existing.BuilderId == BuilderId && !Existing.Task.IsCompleted(); });
+}
+
+void FMkGpuScatteringCpuEngine::ClearCache()
+{
+	using namespace MkGpuScatteringCpuEngine;
+
+	check(IsInGameThread());
+	TextureCache.Empty();
+	DEC_MEMORY_STAT_BY(STAT_MkGpuScatteringCpuTextureBytes, TextureCacheBytes);
+	TextureCacheBytes = 0;
+}
+
+MK_OPTIMIZATION_ON
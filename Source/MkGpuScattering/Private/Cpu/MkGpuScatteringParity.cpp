@@ -0,0 +1,814 @@
+#include "Cpu/MkGpuScatteringParity.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Cpu/MkGpuScatteringCpuLibrary.h"
+#include "Shaders/MkGpuScatteringShaders.h"
+#include "Types/MkGpuScatteringTypes.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "RenderingThread.h"
+#include "RHIGPUReadback.h"
+#include "RenderGraphUtils.h"
+#include "Hash/xxhash.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/FileManager.h"
+#include "Interfaces/IPluginManager.h"
+#include "Misc/App.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#if !UE_BUILD_SHIPPING
+
+namespace MkGpuScatteringParity
+{
+	using namespace MkGpuScatteringBuilderTypes;
+
+	//~ Synthetic landscape
+	// One component, no subsections. The data is made from integers only so every platform hashes the same inputs.
+	static constexpr int32 ComponentSizeQuads = 63;
+	static constexpr int32 TextureSize = ComponentSizeQuads + 1;
+	static const FVector3f DrawScale(100.0f, 100.0f, 100.0f);
+
+	// Bowl and saddle with some roughness for the slope test, plus a flat band for the zero slope normals
+	static void MakeHeightmap(FMkScatteringCpuTexture& Out)
+	{
+		Out.SizeX = TextureSize;
+		Out.SizeY = TextureSize;
+		Out.Texels.SetNumUninitialized(TextureSize * TextureSize);
+		for (int32 Y = 0; Y < TextureSize; ++Y)
+		{
+			for (int32 X = 0; X < TextureSize; ++X)
+			{
+				int32 Value = 0;
+				if (Y >= 6)
+				{
+					Value = (X - 32) * (X - 32) * 2 - (Y - 24) * (Y - 24) + X * Y + ((X * 7 + Y * 13) % 17) * 8;
+				}
+				const uint16 TexHeight = (uint16)FMath::Clamp(32768 + Value, 0, 65535);
+				Out.Texels[Y * TextureSize + X] = FColor((uint8)(TexHeight >> 8), (uint8)(TexHeight & 0xff), 0, 255);
+			}
+		}
+	}
+
+	// Layer in R, its complement in G
+	static void MakeWeightmap(FMkScatteringCpuTexture& Out)
+	{
+		Out.SizeX = TextureSize;
+		Out.SizeY = TextureSize;
+		Out.Texels.SetNumUninitialized(TextureSize * TextureSize);
+		for (int32 Y = 0; Y < TextureSize; ++Y)
+		{
+			for (int32 X = 0; X < TextureSize; ++X)
+			{
+				const uint8 Weight = (uint8)FMath::Clamp(X * 6 - Y * 2 + ((X * Y) % 23) * 4, 0, 255);
+				Out.Texels[Y * TextureSize + X] = FColor(Weight, 255 - Weight, 0, 0);
+			}
+		}
+	}
+	//~ end of Synthetic landscape
+
+	struct FCase
+	{
+		const TCHAR* Name;
+		FMkGrassVariety Variety;
+		uint32 SqrtMaxInstances = 128;
+		uint32 WeightmapChannelIdx = 0;
+		FIntPoint SectionBase = FIntPoint::ZeroValue;
+		FIntPoint SectionOffset = FIntPoint::ZeroValue;
+		int32 InstancingRandomSeed = 1234;
+		uint32 HaltonBaseIndex = 0;
+		// Instances allowed to differ, relative to the GPU count
+		float AllowedMismatchFraction = 0.0f;
+	};
+
+	static TArray<FCase> MakeCases()
+	{
+		TArray<FCase> Cases;
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Halton");
+			Case.Variety.bUseGrid = false;
+			Case.Variety.HeightFalloffRange = 0.0f;
+			Case.HaltonBaseIndex = 77;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("GridJitter");
+			Case.Variety.bUseGrid = true;
+			Case.Variety.PlacementJitter = 0.8f;
+			Case.Variety.HeightFalloffRange = 0.0f;
+			// Negative seeds take the unsigned division path of FNumberGenerator
+			Case.InstancingRandomSeed = -987654321;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Weightmap");
+			Case.Variety.bUseGrid = false;
+			Case.Variety.HeightFalloffRange = 0.0f;
+			Case.WeightmapChannelIdx = 1;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("HeightSlope");
+			Case.Variety.bUseGrid = true;
+			Case.Variety.PlacementJitter = 1.0f;
+			Case.Variety.Height = FFloatInterval(-2000.0f, 6000.0f);
+			Case.Variety.HeightFalloffRange = 1500.0f;
+			Case.Variety.Slope = FFloatInterval(5.0f, 35.0f);
+			Case.SectionBase = FIntPoint(ComponentSizeQuads * 3, ComponentSizeQuads * 2);
+			Case.SectionOffset = FIntPoint(ComponentSizeQuads * 2, ComponentSizeQuads);
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Voronoi");
+			Case.Variety.bUseGrid = false;
+			Case.Variety.HeightFalloffRange = 0.0f;
+			Case.Variety.bUseVoronoiNoise = true;
+			Case.Variety.VoronoiValidRange = FFloatInterval(0.3f, 0.7f);
+			// The sin hash of voronoiNoise is not bit exact, candidates near a cell edge can flip
+			Case.AllowedMismatchFraction = 0.05f;
+		}
+		{
+			FCase& Case = Cases.AddDefaulted_GetRef();
+			Case.Name = TEXT("Compact");
+			Case.Variety.bUseGrid = false;
+			Case.Variety.HeightFalloffRange = 500.0f;
+			Case.Variety.Height = FFloatInterval(-1000.0f, 4000.0f);
+			Case.Variety.bCompactResults = true;
+			Case.WeightmapChannelIdx = 2;
+			Case.SectionBase = FIntPoint(ComponentSizeQuads, 0);
+		}
+		return Cases;
+	}
+
+	static FScatteringJobDesc MakeJobDesc(const FCase& Case)
+	{
+		FScatteringJobDesc Desc = FMkGpuScatteringCS_Param::MakeJobDesc(Case.Variety);
+		// Same layout as the FMkGpuScatteringCS_Param constructor
+		Desc.Origin = FVector2f(DrawScale.X * Case.SectionBase.X, DrawScale.Y * Case.SectionBase.Y);
+		Desc.Extent = FVector2f(DrawScale.X * ComponentSizeQuads, DrawScale.Y * ComponentSizeQuads);
+		Desc.Offset = FVector2f(Case.SectionOffset.X, Case.SectionOffset.Y);
+		Desc.SectionBase = FVector2f(Case.SectionBase.X, Case.SectionBase.Y);
+		Desc.DrawScale = DrawScale;
+		Desc.SqrtMaxInstances = Case.SqrtMaxInstances;
+		Desc.InstancingRandomSeed = Case.InstancingRandomSeed;
+		Desc.HaltonBaseIndex = Case.HaltonBaseIndex;
+		Desc.Stride = ComponentSizeQuads + 1;
+		Desc.WeightmapChannelIdx = Case.WeightmapChannelIdx;
+		return Desc;
+	}
+
+	static FPackedResultFrame MakePackedFrame(const FScatteringJobDesc& Desc)
+	{
+		FPackedResultFrame Frame;
+		Frame.Base = Desc.Origin - FVector2f(Desc.DrawScale.X * Desc.Offset.X, Desc.DrawScale.Y * Desc.Offset.Y);
+		Frame.Extent = Desc.Extent;
+		return Frame;
+	}
+
+	//~ Library probes, GPUScatteringLibraryProbe_CS.usf
+	static constexpr uint32 ProbeDraws = 4;
+	static constexpr uint32 ProbeDwords = ProbeDraws + 3;
+	static constexpr uint32 NumProbes = 4096;
+	static constexpr uint32 ProbeSeed = 0x9E3779B9u;
+	static constexpr uint32 ProbeHaltonBaseIndex = 12345;
+	static constexpr float ProbeVoronoiScale = 10.0f;
+
+	static FVector2f GetProbeUV(uint32 ProbeIndex)
+	{
+		return FVector2f((float)(ProbeIndex % 257u) * 0.731f - 40.0f, (float)(ProbeIndex / 257u) * 1.377f - 25.0f);
+	}
+
+	static void RunProbesCpu(TArray<uint32>& OutDwords)
+	{
+		using namespace MkGpuScatteringCpuLibrary;
+
+		OutDwords.SetNumUninitialized(NumProbes * ProbeDwords);
+		for (uint32 ProbeIndex = 0; ProbeIndex < NumProbes; ++ProbeIndex)
+		{
+			uint32* Dwords = OutDwords.GetData() + ProbeIndex * ProbeDwords;
+
+			FNumberGenerator NumberGenerator;
+			NumberGenerator.SetSeed(ProbeSeed + ProbeIndex);
+			for (uint32 Draw = 0; Draw < ProbeDraws; ++Draw)
+			{
+				Dwords[Draw] = (uint32)NumberGenerator.GetCurrentInt();
+			}
+
+			const float HaltonX = Halton(ProbeIndex + ProbeHaltonBaseIndex, 2);
+			const float HaltonY = Halton(ProbeIndex + ProbeHaltonBaseIndex, 3);
+			const float Voronoi = VoronoiNoise(GetProbeUV(ProbeIndex), ProbeVoronoiScale);
+			Dwords[ProbeDraws + 0] = BitCast<uint32>(HaltonX);
+			Dwords[ProbeDraws + 1] = BitCast<uint32>(HaltonY);
+			Dwords[ProbeDraws + 2] = BitCast<uint32>(Voronoi);
+		}
+	}
+	//~ end of Library probes
+
+	//~ GPU side, blocking
+	static bool CanRunGpu()
+	{
+		return FApp::CanEverRender() && IsFeatureLevelSupported(GMaxRHIShaderPlatform, ERHIFeatureLevel::SM5);
+	}
+
+	static FTextureRHIRef CreateTexture(FRHICommandListImmediate& RHICmdList, const FMkScatteringCpuTexture& Texture, const TCHAR* Name)
+	{
+		const FRHITextureCreateDesc CreateDesc = FRHITextureCreateDesc::Create2D(Name, Texture.SizeX, Texture.SizeY, PF_B8G8R8A8)
+			.SetFlags(ETextureCreateFlags::ShaderResource);
+		FTextureRHIRef TextureRHI = RHICreateTexture(CreateDesc);
+		RHICmdList.UpdateTexture2D(TextureRHI, 0, FUpdateTextureRegion2D(0, 0, 0, 0, Texture.SizeX, Texture.SizeY), Texture.SizeX * sizeof(FColor), (const uint8*)Texture.Texels.GetData());
+		return TextureRHI;
+	}
+
+	static void ReadBuffer(FRHIGPUBufferReadback& Readback, uint32 NumBytes, void* OutData)
+	{
+		const void* Data = Readback.Lock(NumBytes);
+		FPlatformMemory::Memcpy(OutData, Data, NumBytes);
+		Readback.Unlock();
+	}
+
+	template<typename ShaderType>
+	static void AddScatteringPass(FRDGBuilder& GraphBuilder, typename ShaderType::FParameters* PassParameters, uint32 SqrtMaxInstances)
+	{
+		TShaderMapRef<ShaderType> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		// [numthreads(32, 32, 1)]
+		const int32 NumGroups = FMath::DivideAndRoundUp<int32>((int32)SqrtMaxInstances, 32);
+		FComputeShaderUtils::AddPass(GraphBuilder, RDG_EVENT_NAME("MkParityScattering"), ComputeShader, PassParameters, FIntVector(NumGroups, NumGroups, 1));
+	}
+
+	template<typename FParameters>
+	static void SetCommonParameters(FParameters* PassParameters, FRDGBufferSRVRef JobDescs, FRDGBufferUAVRef ProgressInfoUAV, FRDGBufferUAVRef ResultsUAV, FRHITexture* Heightmap)
+	{
+		PassParameters->JobDescs = JobDescs;
+		PassParameters->JobIndex = 0;
+		PassParameters->RWProgressInfo = ProgressInfoUAV;
+		PassParameters->RWResultBuffer = ResultsUAV;
+		PassParameters->HeightmapTexture = Heightmap;
+		PassParameters->HeightmapTextureSampler = TStaticSamplerState<SF_Point>::GetRHI();
+	}
+
+	// One Scattering_CS dispatch on the synthetic textures, results unpacked
+	static void ScatterGpu(const FScatteringJobDesc& Desc, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture* Weightmap,
+		TArray<FLocationNormalScaleZ>& OutResults, FProgressInfo& OutProgress)
+	{
+		const uint32 MaxInstances = Desc.SqrtMaxInstances * Desc.SqrtMaxInstances;
+		const uint32 NumResultDwords = FMath::Max(1u, MaxInstances * (Desc.CompactResults ? PackedResultDwords : ResultDwords));
+		TArray<uint32> ResultDwordData;
+
+		ENQUEUE_RENDER_COMMAND(MkParityScattering)([&](FRHICommandListImmediate& RHICmdList)
+		{
+			FTextureRHIRef HeightmapRHI = CreateTexture(RHICmdList, Heightmap, TEXT("MkParityHeightmap"));
+			FTextureRHIRef WeightmapRHI = Weightmap ? CreateTexture(RHICmdList, *Weightmap, TEXT("MkParityWeightmap")) : nullptr;
+
+			FRDGBuilder GraphBuilder(RHICmdList);
+
+			FProgressInfo InitialProgress;
+			InitialProgress.MaxInstances = MaxInstances;
+			FRDGBufferRef JobDescBuffer = CreateStructuredBuffer(GraphBuilder, TEXT("MkParityJobDesc"), sizeof(FScatteringJobDesc), 1, &Desc, sizeof(FScatteringJobDesc));
+			FRDGBufferRef ProgressBuffer = CreateStructuredBuffer(GraphBuilder, TEXT("MkParityProgressInfo"), sizeof(FProgressInfo), 1, &InitialProgress, sizeof(FProgressInfo));
+			FRDGBufferRef ResultBuffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(uint32), NumResultDwords), TEXT("MkParityResults"));
+
+			FRDGBufferSRVRef JobDescs = GraphBuilder.CreateSRV(JobDescBuffer);
+			FRDGBufferUAVRef ProgressInfoUAV = GraphBuilder.CreateUAV(ProgressBuffer);
+			FRDGBufferUAVRef ResultsUAV = GraphBuilder.CreateUAV(ResultBuffer);
+
+			if (WeightmapRHI)
+			{
+				FMkGPUScattering_CS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMkGPUScattering_CS::FParameters>();
+				SetCommonParameters(PassParameters, JobDescs, ProgressInfoUAV, ResultsUAV, HeightmapRHI);
+				PassParameters->WeightmapTexture = WeightmapRHI;
+				PassParameters->WeightmapTextureSampler = TStaticSamplerState<SF_Bilinear>::GetRHI();
+				AddScatteringPass<FMkGPUScattering_CS>(GraphBuilder, PassParameters, Desc.SqrtMaxInstances);
+			}
+			else
+			{
+				FMkGPUScatteringNoWeightmap_CS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMkGPUScatteringNoWeightmap_CS::FParameters>();
+				SetCommonParameters(PassParameters, JobDescs, ProgressInfoUAV, ResultsUAV, HeightmapRHI);
+				AddScatteringPass<FMkGPUScatteringNoWeightmap_CS>(GraphBuilder, PassParameters, Desc.SqrtMaxInstances);
+			}
+
+			FRHIGPUBufferReadback ProgressReadback(TEXT("MkParityProgressInfo"));
+			FRHIGPUBufferReadback ResultReadback(TEXT("MkParityResults"));
+			AddEnqueueCopyPass(GraphBuilder, &ProgressReadback, ProgressBuffer, sizeof(FProgressInfo));
+			AddEnqueueCopyPass(GraphBuilder, &ResultReadback, ResultBuffer, NumResultDwords * sizeof(uint32));
+			GraphBuilder.Execute();
+			RHICmdList.BlockUntilGPUIdle();
+
+			ReadBuffer(ProgressReadback, sizeof(FProgressInfo), &OutProgress);
+			ResultDwordData.SetNumUninitialized(NumResultDwords);
+			ReadBuffer(ResultReadback, NumResultDwords * sizeof(uint32), ResultDwordData.GetData());
+		});
+		FlushRenderingCommands();
+
+		const int32 NumResults = (int32)FMath::Min(OutProgress.Count, MaxInstances);
+		if (Desc.CompactResults)
+		{
+			const TConstArrayView<FPackedLocationNormalScaleZ> Packed(reinterpret_cast<const FPackedLocationNormalScaleZ*>(ResultDwordData.GetData()), NumResults);
+			MakePackedFrame(Desc).Unpack(Packed, OutResults);
+		}
+		else
+		{
+			OutResults.SetNumUninitialized(NumResults);
+			FPlatformMemory::Memcpy(OutResults.GetData(), ResultDwordData.GetData(), NumResults * sizeof(FLocationNormalScaleZ));
+		}
+	}
+
+	static void RunProbesGpu(TArray<uint32>& OutDwords)
+	{
+		OutDwords.SetNumUninitialized(NumProbes * ProbeDwords);
+
+		ENQUEUE_RENDER_COMMAND(MkParityProbes)([&OutDwords](FRHICommandListImmediate& RHICmdList)
+		{
+			FRDGBuilder GraphBuilder(RHICmdList);
+			FRDGBufferRef ProbeBuffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(uint32), NumProbes * ProbeDwords), TEXT("MkParityProbes"));
+
+			FMkGPUScatteringLibraryProbe_CS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMkGPUScatteringLibraryProbe_CS::FParameters>();
+			PassParameters->NumProbes = NumProbes;
+			PassParameters->Seed = ProbeSeed;
+			PassParameters->HaltonBaseIndex = ProbeHaltonBaseIndex;
+			PassParameters->VoronoiScale = ProbeVoronoiScale;
+			PassParameters->RWProbeOutputs = GraphBuilder.CreateUAV(ProbeBuffer);
+
+			TShaderMapRef<FMkGPUScatteringLibraryProbe_CS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+			FComputeShaderUtils::AddPass(GraphBuilder, RDG_EVENT_NAME("MkParityProbes"), ComputeShader, PassParameters,
+				FComputeShaderUtils::GetGroupCount((int32)NumProbes, (int32)FMkGPUScatteringLibraryProbe_CS::ThreadGroupSize));
+
+			FRHIGPUBufferReadback ProbeReadback(TEXT("MkParityProbes"));
+			AddEnqueueCopyPass(GraphBuilder, &ProbeReadback, ProbeBuffer, NumProbes * ProbeDwords * sizeof(uint32));
+			GraphBuilder.Execute();
+			RHICmdList.BlockUntilGPUIdle();
+
+			ReadBuffer(ProbeReadback, NumProbes * ProbeDwords * sizeof(uint32), OutDwords.GetData());
+		});
+		FlushRenderingCommands();
+	}
+	//~ end of GPU side
+
+	//~ Golden files
+	static constexpr uint32 GoldenMagic = 0x54504B4D; // MKPT
+	// Bump when the cases or the synthetic data change, old files are then reported as stale
+	static constexpr uint32 GoldenVersion = 1;
+
+	struct FGoldenHeader
+	{
+		uint32 Magic;
+		uint32 Version;
+		uint64 InputHash;
+		uint32 ElementSize;
+		uint32 NumElements;
+		FProgressInfo Progress;
+	};
+	static_assert(sizeof(FGoldenHeader) == 56, "FGoldenHeader is written as is");
+
+	static uint64 HashInputs(const FScatteringJobDesc& Desc, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture* Weightmap)
+	{
+		FXxHash64Builder Hasher;
+		Hasher.Update(&GoldenVersion, sizeof(GoldenVersion));
+		Hasher.Update(&Desc, sizeof(FScatteringJobDesc));
+		Hasher.Update(Heightmap.Texels.GetData(), Heightmap.Texels.Num() * sizeof(FColor));
+		if (Weightmap)
+		{
+			Hasher.Update(Weightmap->Texels.GetData(), Weightmap->Texels.Num() * sizeof(FColor));
+		}
+		return Hasher.Finalize().Hash;
+	}
+
+	static uint64 HashProbeInputs()
+	{
+		const uint32 Inputs[] = { GoldenVersion, NumProbes, ProbeDraws, ProbeSeed, ProbeHaltonBaseIndex, BitCast<uint32>(ProbeVoronoiScale) };
+		return FXxHash64::HashBuffer(Inputs, sizeof(Inputs)).Hash;
+	}
+
+	static FString GetGoldenFilename(const FString& GoldenDir, const TCHAR* Name)
+	{
+		return FPaths::Combine(GoldenDir, FString::Printf(TEXT("%s.mkparity"), Name));
+	}
+
+	template<typename ElementType>
+	static bool SaveGolden(const FString& Filename, uint64 InputHash, const FProgressInfo& Progress, const TArray<ElementType>& Elements)
+	{
+		FGoldenHeader Header;
+		Header.Magic = GoldenMagic;
+		Header.Version = GoldenVersion;
+		Header.InputHash = InputHash;
+		Header.ElementSize = sizeof(ElementType);
+		Header.NumElements = Elements.Num();
+		Header.Progress = Progress;
+
+		TArray<uint8> Bytes;
+		Bytes.Append(reinterpret_cast<const uint8*>(&Header), sizeof(FGoldenHeader));
+		Bytes.Append(reinterpret_cast<const uint8*>(Elements.GetData()), Elements.Num() * sizeof(ElementType));
+		return FFileHelper::SaveArrayToFile(Bytes, *Filename);
+	}
+
+	// False with a reason if the file is missing or was recorded from other inputs
+	template<typename ElementType>
+	static bool LoadGolden(const FString& Filename, uint64 InputHash, FProgressInfo& OutProgress, TArray<ElementType>& OutElements, FString& OutError)
+	{
+		TArray<uint8> Bytes;
+		if (!FFileHelper::LoadFileToArray(Bytes, *Filename, FILEREAD_Silent))
+		{
+			OutError = FString::Printf(TEXT("missing %s, record it with a renderer (Record mode)"), *Filename);
+			return false;
+		}
+
+		FGoldenHeader Header;
+		if (Bytes.Num() < (int32)sizeof(FGoldenHeader))
+		{
+			OutError = FString::Printf(TEXT("%s is cut short"), *Filename);
+			return false;
+		}
+		FPlatformMemory::Memcpy(&Header, Bytes.GetData(), sizeof(FGoldenHeader));
+
+		if (Header.Magic != GoldenMagic || Header.Version != GoldenVersion || Header.ElementSize != sizeof(ElementType)
+			|| Bytes.Num() < (int64)sizeof(FGoldenHeader) + (int64)Header.NumElements * sizeof(ElementType))
+		{
+			OutError = FString::Printf(TEXT("%s has another format, record it again"), *Filename);
+			return false;
+		}
+		if (Header.InputHash != InputHash)
+		{
+			OutError = FString::Printf(TEXT("%s was recorded from other inputs, record it again"), *Filename);
+			return false;
+		}
+
+		OutProgress = Header.Progress;
+		OutElements.SetNumUninitialized(Header.NumElements);
+		FPlatformMemory::Memcpy(OutElements.GetData(), Bytes.GetData() + sizeof(FGoldenHeader), Header.NumElements * sizeof(ElementType));
+		return true;
+	}
+	//~ end of Golden files
+
+	//~ Comparison
+	// Upper bounds of the distance histogram, the last bucket ends at FOptions::MatchDistance
+	static constexpr float DistanceBuckets[] = { 0.0f, 1.0e-3f, 1.0e-2f, 1.0e-1f };
+	static constexpr int32 NumDistanceBuckets = UE_ARRAY_COUNT(DistanceBuckets) + 1;
+
+	struct FCaseReport
+	{
+		int32 NumMatched = 0;
+		int32 NumUnmatchedGpu = 0;
+		int32 NumUnmatchedCpu = 0;
+		// Matched but outside the tolerances
+		int32 NumOutOfTolerance = 0;
+		int32 DistanceHistogram[NumDistanceBuckets] = {};
+		float MaxDistance = 0.0f;
+		float MaxNormalError = 0.0f;
+		float MaxScaleZError = 0.0f;
+
+		int32 GetNumDifferent() const { return NumUnmatchedGpu + NumUnmatchedCpu + NumOutOfTolerance; }
+	};
+
+	struct FTolerances
+	{
+		float Distance = 1.0e-2f;
+		float Normal = 1.0e-3f;
+		float ScaleZ = 1.0e-3f;
+	};
+
+	// Pairs every GPU instance with the closest free CPU instance. The GPU appends in execution order, so the order says nothing.
+	static FCaseReport CompareResults(TConstArrayView<FLocationNormalScaleZ> Gpu, TConstArrayView<FLocationNormalScaleZ> Cpu, float MatchDistance, const FTolerances& Tolerances)
+	{
+		FCaseReport Report;
+
+		const float CellSize = FMath::Max(MatchDistance, UE_KINDA_SMALL_NUMBER);
+		auto GetCell = [CellSize](const FVector3f& Location)
+		{
+			return FIntPoint(FMath::FloorToInt32(Location.X / CellSize), FMath::FloorToInt32(Location.Y / CellSize));
+		};
+
+		TMultiMap<FIntPoint, int32> CpuCells;
+		for (int32 Index = 0; Index < Cpu.Num(); ++Index)
+		{
+			CpuCells.Add(GetCell(Cpu[Index].Location), Index);
+		}
+		TBitArray<> CpuUsed(false, Cpu.Num());
+
+		TArray<int32, TInlineAllocator<8>> Candidates;
+		for (const FLocationNormalScaleZ& GpuResult : Gpu)
+		{
+			const FIntPoint Cell = GetCell(GpuResult.Location);
+			int32 Best = INDEX_NONE;
+			float BestDistance = MatchDistance;
+			for (int32 CellY = Cell.Y - 1; CellY <= Cell.Y + 1; ++CellY)
+			{
+				for (int32 CellX = Cell.X - 1; CellX <= Cell.X + 1; ++CellX)
+				{
+					Candidates.Reset();
+					CpuCells.MultiFind(FIntPoint(CellX, CellY), Candidates);
+					for (int32 Candidate : Candidates)
+					{
+						const float Distance = FVector3f::Dist(GpuResult.Location, Cpu[Candidate].Location);
+						if (!CpuUsed[Candidate] && Distance <= BestDistance)
+						{
+							Best = Candidate;
+							BestDistance = Distance;
+						}
+					}
+				}
+			}
+
+			if (Best == INDEX_NONE)
+			{
+				++Report.NumUnmatchedGpu;
+				continue;
+			}
+
+			CpuUsed[Best] = true;
+			++Report.NumMatched;
+
+			const FLocationNormalScaleZ& CpuResult = Cpu[Best];
+			const float NormalError = (GpuResult.ComputedNormal - CpuResult.ComputedNormal).GetAbsMax();
+			const float ScaleZError = FMath::Abs(GpuResult.ScaleZ - CpuResult.ScaleZ);
+			Report.MaxDistance = FMath::Max(Report.MaxDistance, BestDistance);
+			Report.MaxNormalError = FMath::Max(Report.MaxNormalError, NormalError);
+			Report.MaxScaleZError = FMath::Max(Report.MaxScaleZError, ScaleZError);
+
+			int32 Bucket = 0;
+			while (Bucket < UE_ARRAY_COUNT(DistanceBuckets) && BestDistance > DistanceBuckets[Bucket])
+			{
+				++Bucket;
+			}
+			++Report.DistanceHistogram[Bucket];
+
+			if (BestDistance > Tolerances.Distance || NormalError > Tolerances.Normal || ScaleZError > Tolerances.ScaleZ)
+			{
+				++Report.NumOutOfTolerance;
+			}
+		}
+
+		Report.NumUnmatchedCpu = Cpu.Num() - Report.NumMatched;
+		return Report;
+	}
+
+	static void LogCaseReport(const TCHAR* Name, const FCaseReport& Report, const FProgressInfo& GpuProgress, const FProgressInfo& CpuProgress, float MatchDistance)
+	{
+		static const TCHAR* RejectNames[Reject_Num] = { TEXT("LayerWeightSum"), TEXT("LayerWeight"), TEXT("Height"), TEXT("HeightFalloff"), TEXT("Voronoi"), TEXT("Slope") };
+
+		UE_LOG(LogTemp, Log, TEXT("  %s : accepted gpu %u cpu %u of %u, matched %d, unmatched gpu %d cpu %d, out of tolerance %d"),
+			Name, GpuProgress.Count, CpuProgress.Count, GpuProgress.MaxInstances, Report.NumMatched, Report.NumUnmatchedGpu, Report.NumUnmatchedCpu, Report.NumOutOfTolerance);
+		for (int32 Reason = 0; Reason < Reject_Num; ++Reason)
+		{
+			const int32 Difference = (int32)CpuProgress.RejectCounts[Reason] - (int32)GpuProgress.RejectCounts[Reason];
+			if (GpuProgress.RejectCounts[Reason] || CpuProgress.RejectCounts[Reason])
+			{
+				UE_LOG(LogTemp, Log, TEXT("    reject %-14s gpu %8u cpu %8u diff %+d"), RejectNames[Reason], GpuProgress.RejectCounts[Reason], CpuProgress.RejectCounts[Reason], Difference);
+			}
+		}
+
+		TStringBuilder<256> Histogram;
+		Histogram.Appendf(TEXT("exact %d"), Report.DistanceHistogram[0]);
+		for (int32 Bucket = 1; Bucket < NumDistanceBuckets; ++Bucket)
+		{
+			const float Limit = Bucket < UE_ARRAY_COUNT(DistanceBuckets) ? DistanceBuckets[Bucket] : MatchDistance;
+			Histogram.Appendf(TEXT(", <=%g %d"), Limit, Report.DistanceHistogram[Bucket]);
+		}
+		UE_LOG(LogTemp, Log, TEXT("    distance %s"), Histogram.ToString());
+		UE_LOG(LogTemp, Log, TEXT("    max distance %g, max normal error %g, max ScaleZ error %g"), Report.MaxDistance, Report.MaxNormalError, Report.MaxScaleZError);
+	}
+
+	static bool CompareProbes(const TArray<uint32>& Gpu, const TArray<uint32>& Cpu)
+	{
+		int32 NumRandomMismatches = 0;
+		int32 NumHaltonMismatches = 0;
+		int32 NumVoronoiMismatches = 0;
+		float MaxHaltonError = 0.0f;
+		float MaxVoronoiError = 0.0f;
+		int32 FirstRandomMismatch = INDEX_NONE;
+
+		for (uint32 ProbeIndex = 0; ProbeIndex < NumProbes; ++ProbeIndex)
+		{
+			const uint32* GpuDwords = Gpu.GetData() + ProbeIndex * ProbeDwords;
+			const uint32* CpuDwords = Cpu.GetData() + ProbeIndex * ProbeDwords;
+
+			// The integer sequence has to be identical
+			if (FMemory::Memcmp(GpuDwords, CpuDwords, ProbeDraws * sizeof(uint32)) != 0 && NumRandomMismatches++ == 0)
+			{
+				FirstRandomMismatch = (int32)ProbeIndex;
+			}
+
+			for (uint32 Axis = 0; Axis < 2; ++Axis)
+			{
+				const float Error = FMath::Abs(BitCast<float>(GpuDwords[ProbeDraws + Axis]) - BitCast<float>(CpuDwords[ProbeDraws + Axis]));
+				MaxHaltonError = FMath::Max(MaxHaltonError, Error);
+				// GPU divisions may be off by an ulp, anything above that is a real difference
+				NumHaltonMismatches += Error > 1.0e-6f ? 1 : 0;
+			}
+
+			const float VoronoiError = FMath::Abs(BitCast<float>(GpuDwords[ProbeDraws + 2]) - BitCast<float>(CpuDwords[ProbeDraws + 2]));
+			MaxVoronoiError = FMath::Max(MaxVoronoiError, VoronoiError);
+			NumVoronoiMismatches += VoronoiError > 1.0e-3f ? 1 : 0;
+		}
+
+		UE_LOG(LogTemp, Log, TEXT("  Library : %u probes, FNumberGenerator mismatches %d, Halton mismatches %d (max error %g), voronoiNoise > 0.001 %d (max error %g)"),
+			NumProbes, NumRandomMismatches, NumHaltonMismatches, MaxHaltonError, NumVoronoiMismatches, MaxVoronoiError);
+		if (FirstRandomMismatch != INDEX_NONE)
+		{
+			const uint32* GpuDwords = Gpu.GetData() + FirstRandomMismatch * ProbeDwords;
+			const uint32* CpuDwords = Cpu.GetData() + FirstRandomMismatch * ProbeDwords;
+			UE_LOG(LogTemp, Warning, TEXT("    probe %d : gpu %d %d %d %d, cpu %d %d %d %d"), FirstRandomMismatch,
+				(int32)GpuDwords[0], (int32)GpuDwords[1], (int32)GpuDwords[2], (int32)GpuDwords[3], (int32)CpuDwords[0], (int32)CpuDwords[1], (int32)CpuDwords[2], (int32)CpuDwords[3]);
+		}
+
+		// voronoiNoise is reported only, its sin hash differs between GPUs as well
+		return NumRandomMismatches == 0 && NumHaltonMismatches == 0;
+	}
+	//~ end of Comparison
+
+	static bool RunLibrary(const FOptions& Options, const FString& GoldenDir)
+	{
+		TArray<uint32> Cpu;
+		RunProbesCpu(Cpu);
+
+		TArray<uint32> Gpu;
+		const FString Filename = GetGoldenFilename(GoldenDir, TEXT("Library"));
+		if (Options.Mode == EMode::Compare)
+		{
+			FProgressInfo Unused;
+			FString Error;
+			if (!LoadGolden(Filename, HashProbeInputs(), Unused, Gpu, Error))
+			{
+				UE_LOG(LogTemp, Error, TEXT("  Library : %s"), *Error);
+				return false;
+			}
+		}
+		else
+		{
+			RunProbesGpu(Gpu);
+			if (Options.Mode == EMode::Record && !SaveGolden(Filename, HashProbeInputs(), FProgressInfo(), Gpu))
+			{
+				UE_LOG(LogTemp, Error, TEXT("  Library : failed to write %s"), *Filename);
+				return false;
+			}
+		}
+
+		return CompareProbes(Gpu, Cpu);
+	}
+
+	static bool RunCase(const FCase& Case, const FOptions& Options, const FString& GoldenDir, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture& WeightmapTexture)
+	{
+		const FScatteringJobDesc Desc = MakeJobDesc(Case);
+		const FMkScatteringCpuTexture* Weightmap = Case.WeightmapChannelIdx > 0 ? &WeightmapTexture : nullptr;
+		const uint64 InputHash = HashInputs(Desc, Heightmap, Weightmap);
+
+		// The CPU results go through the same quantization as the GPU ones
+		TArray<FLocationNormalScaleZ> Cpu;
+		FProgressInfo CpuProgress;
+		FMkGpuScatteringCpuEngine::Scatter(Desc, Heightmap, Weightmap, Cpu, &CpuProgress);
+		FTolerances Tolerances;
+		if (Desc.CompactResults)
+		{
+			const FPackedResultFrame Frame = MakePackedFrame(Desc);
+			for (FLocationNormalScaleZ& Result : Cpu)
+			{
+				Result = Frame.Unpack(Frame.Pack(Result));
+			}
+			// One quantization step either way
+			Tolerances.Distance += Frame.Extent.GetMax() / 65535.0f;
+			Tolerances.Normal += 4.0f / 4095.0f;
+			Tolerances.ScaleZ += 1.0f / 255.0f;
+		}
+
+		TArray<FLocationNormalScaleZ> Gpu;
+		FProgressInfo GpuProgress;
+		const FString Filename = GetGoldenFilename(GoldenDir, Case.Name);
+		if (Options.Mode == EMode::Compare)
+		{
+			FString Error;
+			if (!LoadGolden(Filename, InputHash, GpuProgress, Gpu, Error))
+			{
+				UE_LOG(LogTemp, Error, TEXT("  %s : %s"), Case.Name, *Error);
+				return false;
+			}
+		}
+		else
+		{
+			ScatterGpu(Desc, Heightmap, Weightmap, Gpu, GpuProgress);
+			if (Options.Mode == EMode::Record && !SaveGolden(Filename, InputHash, GpuProgress, Gpu))
+			{
+				UE_LOG(LogTemp, Error, TEXT("  %s : failed to write %s"), Case.Name, *Filename);
+				return false;
+			}
+		}
+
+		const FCaseReport Report = CompareResults(Gpu, Cpu, Options.MatchDistance, Tolerances);
+		LogCaseReport(Case.Name, Report, GpuProgress, CpuProgress, Options.MatchDistance);
+
+		const float AllowedFraction = Options.AllowedMismatchFraction >= 0.0f ? Options.AllowedMismatchFraction : Case.AllowedMismatchFraction;
+		const int32 AllowedMismatches = FMath::FloorToInt32(AllowedFraction * FMath::Max(Gpu.Num(), 1));
+		if (Report.GetNumDifferent() > AllowedMismatches)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("    %d instances differ, %d allowed"), Report.GetNumDifferent(), AllowedMismatches);
+			return false;
+		}
+		return true;
+	}
+
+	EMode GetDefaultMode()
+	{
+		return CanRunGpu() ? EMode::Live : EMode::Compare;
+	}
+
+	FString GetDefaultGoldenDir()
+	{
+		// Versioned with the plugin, so Compare runs against the goldens recorded for this revision of the shaders
+		const TSharedPtr<IPlugin> Plugin = IPluginManager::Get().FindPlugin(TEXT("MkGpuScattering"));
+		return Plugin.IsValid() ? FPaths::Combine(Plugin->GetBaseDir(), TEXT("Resources"), TEXT("Parity")) : FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("MkGpuScattering"), TEXT("Parity"));
+	}
+
+	bool Run(const FOptions& Options)
+	{
+		static const TCHAR* ModeNames[] = { TEXT("Live"), TEXT("Record"), TEXT("Compare") };
+
+		if (Options.Mode != EMode::Compare && !CanRunGpu())
+		{
+			UE_LOG(LogTemp, Error, TEXT("[MkGpuScatteringParity] %s needs a renderer with SM5, use Compare against golden files"), ModeNames[(int32)Options.Mode]);
+			return false;
+		}
+
+		const FString GoldenDir = Options.GoldenDir.IsEmpty() ? GetDefaultGoldenDir() : Options.GoldenDir;
+		UE_LOG(LogTemp, Log, TEXT("[MkGpuScatteringParity] %s, golden files in %s"), ModeNames[(int32)Options.Mode], *GoldenDir);
+
+		if (Options.Mode == EMode::Compare)
+		{
+			// One error for the whole set rather than one per case, the usual cause is a checkout without recorded goldens
+			TArray<FString> GoldenFiles;
+			IFileManager::Get().FindFiles(GoldenFiles, *FPaths::Combine(GoldenDir, TEXT("*.mkparity")), true, false);
+			if (GoldenFiles.IsEmpty())
+			{
+				UE_LOG(LogTemp, Error, TEXT("[MkGpuScatteringParity] No golden files in %s. Record them on a machine with an SM5 renderer (Record mode) and check them in."), *GoldenDir);
+				return false;
+			}
+		}
+
+		FMkScatteringCpuTexture Heightmap;
+		FMkScatteringCpuTexture Weightmap;
+		MakeHeightmap(Heightmap);
+		MakeWeightmap(Weightmap);
+
+		bool bAllPassed = true;
+		int32 NumRun = 0;
+		if (Options.CaseFilter.IsEmpty() || FString(TEXT("Library")).Contains(Options.CaseFilter))
+		{
+			bAllPassed &= RunLibrary(Options, GoldenDir);
+			++NumRun;
+		}
+
+		for (const FCase& Case : MakeCases())
+		{
+			if (!Options.CaseFilter.IsEmpty() && !FString(Case.Name).Contains(Options.CaseFilter))
+			{
+				continue;
+			}
+			bAllPassed &= RunCase(Case, Options, GoldenDir, Heightmap, Weightmap);
+			++NumRun;
+		}
+
+		if (NumRun == 0)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[MkGpuScatteringParity] No case matches %s"), *Options.CaseFilter);
+		}
+		else if (bAllPassed)
+		{
+			UE_LOG(LogTemp, Log, TEXT("  passed"));
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT("[MkGpuScatteringParity] The CPU engine does not match Scattering_CS"));
+		}
+		return bAllPassed && NumRun > 0;
+	}
+
+	static void RunCommand(const TArray<FString>& Args)
+	{
+		FOptions Options;
+		Options.Mode = GetDefaultMode();
+		for (const FString& Arg : Args)
+		{
+			if (Arg.Equals(TEXT("Live"), ESearchCase::IgnoreCase))
+			{
+				Options.Mode = EMode::Live;
+			}
+			else if (Arg.Equals(TEXT("Record"), ESearchCase::IgnoreCase))
+			{
+				Options.Mode = EMode::Record;
+			}
+			else if (Arg.Equals(TEXT("Compare"), ESearchCase::IgnoreCase))
+			{
+				Options.Mode = EMode::Compare;
+			}
+			else
+			{
+				Options.CaseFilter = Arg;
+			}
+		}
+		Run(Options);
+	}
+}
+
+static FAutoConsoleCommand MkValidateCpuEngineCmd(
+	TEXT("MkGpuScattering.ValidateCpuEngine"),
+	TEXT("Compares the CPU scattering engine with Scattering_CS on synthetic landscapes. Optional args : Live (default with a renderer), Record (also writes the golden files), Compare (golden files, default without a renderer), a case name filter."),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&MkGpuScatteringParity::RunCommand)
+);
+
+#endif
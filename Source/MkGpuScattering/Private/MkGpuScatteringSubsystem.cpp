@@ -3,7 +3,11 @@
 #include "Types/MkGpuScatteringTypes.h"
 #include "Builder/MkGpuScatteringBuilder.h"
 #include "Readback/MkGpuScatteringReadbackManager.h"
+#include "Scheduler/MkGpuScatteringScheduler.h"
+#include "Cache/MkGpuScatteringDiskCache.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
 #include "Shaders/MkGpuScatteringShaders.h"
+#include "Trace/MkGpuScatteringTrace.h"
 #include "MkGpuScatteringGlobal.h"
 
 #include "Landscape.h"
@@ -50,12 +54,33 @@ void UMkGpuScatteringSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 		ReadbackManager = NewObject<UMkGpuScatteringReadbackManager>();
 		ReadbackManager->AddToRoot();
 	}
+
+	if (!Scheduler)
+	{
+		Scheduler = NewObject<UMkGpuScatteringScheduler>(this);
+	}
+
+	if (FMkGpuScatteringDiskCache::IsEnabled())
+	{
+		FMkGpuScatteringDiskCache::StartScan();
+	}
 }
 
 void UMkGpuScatteringSubsystem::Deinitialize()
 {
 	FlushCache();
 
+	if (Scheduler)
+	{
+		Scheduler->ClearAll();
+		Scheduler = nullptr;
+	}
+
+	// Loads still running would hand their results to builders that are going away
+	FMkGpuScatteringDiskCache::WaitForTasks();
+	FMkGpuScatteringCpuEngine::WaitForTasks();
+	FMkGpuScatteringCpuEngine::ClearCache();
+
 	if (ReadbackManager)
 	{
 		ReadbackManager->ClearAll();
@@ -297,6 +322,11 @@ void UMkGpuScatteringSubsystem::FlushCache()
 
 	CurrentBuilders.Empty();
 
+	if (Scheduler)
+	{
+		Scheduler->ClearAll();
+	}
+
 	if (!bEnableMkGpuScattering)
 	{
 		return;
@@ -372,18 +402,38 @@ void UMkGpuScatteringSubsystem::Tick(float DeltaTime)
 		return;
 	}
 
+	TickCameras(*Cameras, DeltaTime);
+}
+
+void UMkGpuScatteringSubsystem::TickCameras(const TArray<FVector>& Cameras, float DeltaTime)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringSubsystem_Tick);
+
 	TArray<UMkGpuScatteringBuilder*> CollectedBuilders;
-	if (CollectInstanceBuilder(*Cameras, CollectedBuilders))
+	if (CollectInstanceBuilder(Cameras, CollectedBuilders))
 	{
 		CurrentBuilders = CollectedBuilders;
 	}
 
-	int32 InOutNumComponentsCreated = 0;
+	Scheduler->BeginFrame();
+
+	int32 NumJobsInFlight = 0;
 	for (UMkGpuScatteringBuilder* Builder : CurrentBuilders)
 	{
-		Builder->UpdateTick(*Cameras, DeltaTime, InOutNumComponentsCreated, ReadbackManager);
+		// Kept from an earlier collect, the proxy may have streamed out since
+		if (!Builder || !Builder->IsRegistered())
+		{
+			continue;
+		}
+		Builder->UpdateTick(Cameras, DeltaTime, Scheduler);
+		NumJobsInFlight += Builder->GetNumPendingJobs();
 	}
 
+	// Jobs of all builders compete for the same budget, nearest first.
+	Scheduler->IssueJobs(NumJobsInFlight, ReadbackManager);
+	UMkGpuScatteringBuilder::EndFrameIssueJobStats();
+	FMkGpuScatteringTrace::EndFrame();
+
 	ENQUEUE_RENDER_COMMAND(MkReadbackManagerUpdate)([ReadbackManager = ReadbackManager](FRHICommandListImmediate& RHICmdList)
 		{
 			LLM_SCOPE_BYTAG(MkGpuScatteringSubsystem_RenderThread);
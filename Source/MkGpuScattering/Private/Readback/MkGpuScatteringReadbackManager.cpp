@@ -1,6 +1,8 @@
 #include "Readback/MkGpuScatteringReadbackManager.h"
 #include "Types/MkGpuScatteringTypes.h"
 #include "Builder/MkGpuScatteringBuilder.h"
+#include "Shaders/MkGpuScatteringShaders.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
 #include "MkGpuScatteringGlobal.h"
 
 #include "RHIGPUReadback.h"
@@ -14,7 +16,6 @@
 
 LLM_DEFINE_TAG(MkGpuScatteringReadbackManager);
 LLM_DEFINE_TAG(MkGpuScatteringReadbackManager_Clear);
-LLM_DEFINE_TAG(MkGpuScatteringReadbackManager_AddEnque);
 LLM_DEFINE_TAG(MkGpuScatteringReadbackManager_AddReadback);
 LLM_DEFINE_TAG(MkGpuScatteringReadbackManager_RemoveReadback);
 
@@ -25,162 +26,279 @@ bool bShowMkReadbackLog = false;
 FAutoConsoleVariableRef ShowMkReadbackDebugLogVar(TEXT("MkGpuScattering.ShowReadbackLog"), bShowMkReadbackLog, TEXT(""), ECVF_Default);
 
 int32 MkMaxReadbackCountPerFrame = 10;
-FAutoConsoleVariableRef MkMaxReadbackCountPerFrameVar(TEXT("MkGpuScattering.MaxReadbackPerFrame"), MkMaxReadbackCountPerFrame, TEXT(""), ECVF_Default);
+FAutoConsoleVariableRef MkMaxReadbackCountPerFrameVar(TEXT("MkGpuScattering.MaxReadbackPerFrame"), MkMaxReadbackCountPerFrame, TEXT("Maximum number of jobs completed per frame, oldest first."), ECVF_Default);
 
 int32 MkReadbackDelayFrameCount = 2;
 FAutoConsoleVariableRef MkReadbackDelayFrameCountVar(TEXT("MkGpuScattering.ReadbackDelayFrameCount"), MkReadbackDelayFrameCount, TEXT(""), ECVF_Default);
 
+int32 MkReadbackPoolSizePerClass = 32;
+FAutoConsoleVariableRef MkReadbackPoolSizePerClassVar(TEXT("MkGpuScattering.ReadbackPoolSizePerClass"), MkReadbackPoolSizePerClass, TEXT("Idle staging readbacks kept per byte class, the rest are deleted when returned."), ECVF_Default);
+
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Readback Slots In Use"), STAT_MkGpuScatteringReadbackSlotsInUse, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Readback Slots Pooled"), STAT_MkGpuScatteringReadbackSlotsPooled, STATGROUP_MkGpuScattering);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Readback Wait Frames (Avg)"), STAT_MkGpuScatteringReadbackWaitFrames, STATGROUP_MkGpuScattering);
+DECLARE_MEMORY_STAT(TEXT("Readback Bytes In Flight"), STAT_MkGpuScatteringReadbackBytesInFlight, STATGROUP_MkGpuScattering);
+
 using namespace MkGpuScatteringBuilderTypes;
 
 //~ FMkReadback
 //void FMkReadback::AddReadback(TRefCountPtr<FRDGPooledBuffer> Buffer, FRHIGPUBufferReadback* ReadbackPtr, TFunction<void(FMkReadback& InReadback)> ReadbackFunc)
-void FMkReadback::AddReadback(UMkGpuScatteringBuilder* InBuilder, const FMkGpuScatteringBuilderOutput& InBuilderOutput, TRefCountPtr<FRDGPooledBuffer> Buffer, FRHIGPUBufferReadback* ReadbackPtr)
+void FMkReadback::AddReadback(EArena Arena, FRHIGPUBufferReadback* ReadbackPtr, uint32 NumBytes)
 {
-	Builder = InBuilder;
-	BuilderOutput = InBuilderOutput;
-
-	Buffers.Add(Buffer);
-	ReadbackPtrs.Add(ReadbackPtr);
+	if (ReadbackPtrs.Num() < Arena_Num)
+	{
+		ReadbackPtrs.SetNumZeroed(Arena_Num);
+		ReadbackBytes.SetNumZeroed(Arena_Num);
+	}
+	ReadbackPtrs[Arena] = ReadbackPtr;
+	ReadbackBytes[Arena] = NumBytes;
 }
 //~ end of FMkReadback
 
+//~ FMkReadbackStagingPool
+int32 FMkReadbackStagingPool::GetByteClass(uint32 NumBytes)
+{
+	// 256 bytes and up, ProgressInfo always lands in the first class
+	return (int32)FMath::CeilLogTwo(FMath::Max(NumBytes, 256u)) - 8;
+}
+
+FRHIGPUBufferReadback* FMkReadbackStagingPool::Acquire(uint32 NumBytes)
+{
+	check(IsInRenderingThread());
+
+	const int32 ByteClass = GetByteClass(NumBytes);
+	if (FreeLists.IsValidIndex(ByteClass) && FreeLists[ByteClass].Num())
+	{
+		--NumPooled;
+		DEC_DWORD_STAT(STAT_MkGpuScatteringReadbackSlotsPooled);
+		return FreeLists[ByteClass].Pop(EAllowShrinking::No);
+	}
+	return new FRHIGPUBufferReadback(TEXT("MkScatteringReadback"));
+}
+
+void FMkReadbackStagingPool::Release(FRHIGPUBufferReadback* Readback, uint32 NumBytes)
+{
+	check(IsInRenderingThread());
+	if (!Readback)
+	{
+		return;
+	}
+
+	const int32 ByteClass = GetByteClass(NumBytes);
+	if (ByteClass >= FreeLists.Num())
+	{
+		FreeLists.SetNum(ByteClass + 1);
+	}
+
+	if (FreeLists[ByteClass].Num() >= MkReadbackPoolSizePerClass)
+	{
+		delete(Readback);
+		return;
+	}
+
+	FreeLists[ByteClass].Add(Readback);
+	++NumPooled;
+	INC_DWORD_STAT(STAT_MkGpuScatteringReadbackSlotsPooled);
+}
+
+void FMkReadbackStagingPool::Empty()
+{
+	for (TArray<FRHIGPUBufferReadback*>& FreeList : FreeLists)
+	{
+		for (FRHIGPUBufferReadback* Readback : FreeList)
+		{
+			delete(Readback);
+		}
+	}
+	FreeLists.Empty();
+	DEC_DWORD_STAT_BY(STAT_MkGpuScatteringReadbackSlotsPooled, NumPooled);
+	NumPooled = 0;
+}
+//~ end of FMkReadbackStagingPool
+
 void UMkGpuScatteringReadbackManager::ClearAll()
 {
 	LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager_Clear);
-	for(FMkReadback Readback : ReadbackList)
+
+	// The queue and the pool belong to the render thread
+	if (!IsInRenderingThread())
+	{
+		FlushRenderingCommands();
+	}
+
+	while (!ReadbackQueue.IsEmpty())
 	{
-		Readback.Clear();
+		FMkAsyncBuilderInterface::ReleaseArenaBytes(ReadbackQueue.First().ArenaBytes);
+		ReleaseReadbacks(ReadbackQueue.First());
+		ReadbackQueue.PopFront();
 	}
-	ReadbackList.Empty();
+	ReadbackQueue.Empty();
+	StagingPool.Empty();
 }
 
 //~ UMkGpuScatteringReadbackManager
+FRHIGPUBufferReadback* UMkGpuScatteringReadbackManager::AcquireReadback(uint32 NumBytes)
+{
+	INC_DWORD_STAT(STAT_MkGpuScatteringReadbackSlotsInUse);
+	INC_MEMORY_STAT_BY(STAT_MkGpuScatteringReadbackBytesInFlight, NumBytes);
+	return StagingPool.Acquire(NumBytes);
+}
+
+void UMkGpuScatteringReadbackManager::ReleaseReadbacks(FMkReadback& Readback)
+{
+	for (int32 Index = 0; Index < Readback.ReadbackPtrs.Num(); ++Index)
+	{
+		if (!Readback.ReadbackPtrs[Index])
+		{
+			continue;
+		}
+		const uint32 NumBytes = Readback.ReadbackBytes[Index];
+		DEC_DWORD_STAT(STAT_MkGpuScatteringReadbackSlotsInUse);
+		DEC_MEMORY_STAT_BY(STAT_MkGpuScatteringReadbackBytesInFlight, NumBytes);
+
+		// A readback still in flight cannot be handed out again
+		if (Readback.ReadbackPtrs[Index]->IsReady())
+		{
+			StagingPool.Release(Readback.ReadbackPtrs[Index], NumBytes);
+		}
+		else
+		{
+			delete(Readback.ReadbackPtrs[Index]);
+		}
+	}
+	Readback.Clear();
+}
+
+void UMkGpuScatteringReadbackManager::CompleteJob(FMkReadback::FJob& Job, const FProgressInfo* ProgressInfos, const void* Results, const void* Transforms, uint32 WaitFrames)
+{
+	const FProgressInfo& ProgressInfo = ProgressInfos[Job.JobIndex];
+
+#if !UE_BUILD_SHIPPING
+	if (bShowMkReadbackLog)
+	{
+		static const TCHAR* RejectNames[Reject_Num] = { TEXT("LayerWeightSum"), TEXT("LayerWeight"), TEXT("Height"), TEXT("HeightFalloff"), TEXT("Voronoi"), TEXT("Slope") };
+		UE_LOG(LogTemp, Log, TEXT("Readback accepted %u / %u, %u frames after dispatch"), ProgressInfo.Count, ProgressInfo.MaxInstances, WaitFrames);
+		for (int32 Reason = 0; Reason < Reject_Num; ++Reason)
+		{
+			UE_LOG(LogTemp, Log, TEXT("  Rejected %s : %u"), RejectNames[Reason], ProgressInfo.RejectCounts[Reason]);
+		}
+	}
+#endif
+
+	// Scattering_CS compacted the accepted results to the front of the job's range, only those are copied out
+	const int32 CurrentBufferSize = (int32)FMath::Min(ProgressInfo.Count, ProgressInfo.MaxInstances);
+	if (CurrentBufferSize > 0 && (Job.BuilderOutput.bGpuTransforms ? Transforms != nullptr : Results != nullptr))
+	{
+		if (Job.BuilderOutput.bGpuTransforms)
+		{
+			// Final transforms from Transform_CS
+			const FInstanceTransform* Source = static_cast<const FInstanceTransform*>(Transforms) + Job.TransformOffset;
+			Job.BuilderOutput.InstanceTransforms.SetNumUninitialized(CurrentBufferSize);
+			FPlatformMemory::Memcpy(Job.BuilderOutput.InstanceTransforms.GetData(), Source, sizeof(FInstanceTransform) * CurrentBufferSize);
+		}
+		else if (Job.BuilderOutput.bCompactResults)
+		{
+			// Kept packed, the transform build decodes them
+			const uint32* Source = static_cast<const uint32*>(Results) + Job.ResultOffset;
+			Job.BuilderOutput.PackedResults.SetNumUninitialized(CurrentBufferSize);
+			FPlatformMemory::Memcpy(Job.BuilderOutput.PackedResults.GetData(), Source, sizeof(FPackedLocationNormalScaleZ) * CurrentBufferSize);
+		}
+		else
+		{
+			const uint32* Source = static_cast<const uint32*>(Results) + Job.ResultOffset;
+			Job.BuilderOutput.ResultBuffer.SetNumUninitialized(CurrentBufferSize);
+			FPlatformMemory::Memcpy(Job.BuilderOutput.ResultBuffer.GetData(), Source, sizeof(FLocationNormalScaleZ) * CurrentBufferSize);
+		}
+	}
+
+	// Render thread, the builder may have been streamed out since the dispatch
+	Job.Builder.Deliver(MoveTemp(Job.BuilderOutput));
+}
+
 void UMkGpuScatteringReadbackManager::Readback(FRHICommandListImmediate& RHICmdList)
 {
-	if (ReadbackList.IsEmpty())
+	MK_SCATTERING_STAGE_SCOPE(Readback);
+
+	if (ReadbackQueue.IsEmpty())
 	{
 		return;
 	}
 
 	LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager);
 
-	int32 MaxLoop = ReadbackList.Num() > MkMaxReadbackCountPerFrame ? FMath::Max(1, ReadbackList.Num() / MkMaxReadbackCountPerFrame) : ReadbackList.Num();
-
-	for (int32 Index = 0; Index < MaxLoop; ++Index)
+	const int32 MaxCompleted = FMath::Max(1, MkMaxReadbackCountPerFrame);
+	int32 NumCompleted = 0;
+	while (!ReadbackQueue.IsEmpty() && NumCompleted < MaxCompleted)
 	{
-		FMkReadback& Readback = ReadbackList[Index];
-		int32 ReadbackIndex = Readback.Index;
+		FMkReadback& Readback = ReadbackQueue.First();
 
 		if (Readback.LastUsedFrameNumberRenderThread + MkReadbackDelayFrameCount > GFrameNumberRenderThread)
 		{
-			continue;
+			break;
 		}
 
-
-		//
-		if (!Readback.ReadbackPtrs.IsValidIndex(ReadbackIndex))
+		if (!Readback.HasArena(FMkReadback::Arena_ProgressInfo))
 		{
+			FMkAsyncBuilderInterface::ReleaseArenaBytes(Readback.ArenaBytes);
+			ReleaseReadbacks(Readback);
+			ReadbackQueue.PopFront();
 			continue;
 		}
 
-
-		FRHIGPUBufferReadback* ReadbackPtr = Readback.ReadbackPtrs[ReadbackIndex];
-		TRefCountPtr<FRDGPooledBuffer> ReadbackBuffer = Readback.Buffers[ReadbackIndex];
-		if (ReadbackIndex == 0)
+		// Every arena copy was enqueued by the dispatch graph, one after the other, so one fence covers the batch.
+		// Batches behind the head were copied later and cannot be ready before it.
+		bool bReady = true;
+		for (FRHIGPUBufferReadback* ReadbackPtr : Readback.ReadbackPtrs)
 		{
-			if (ReadbackPtr->IsReady())
-			{
-				void* Buffer = (void*)ReadbackPtr->Lock(1);
-				FProgressInfo ProgressInfo;
-				FPlatformMemory::Memcpy(&ProgressInfo, Buffer, sizeof(FProgressInfo) * 1);
-				ReadbackPtr->Unlock();
-
-				if (ProgressInfo.Count >= ProgressInfo.MaxInstances)
-				{
-					Readback.NextBufferSize = ProgressInfo.MaxInstances;
-					Readback.IncrementIndex();
-				}
-
-				ReadbackBuffer.SafeRelease();
-				delete(ReadbackPtr);
-				continue;
-			}
+			bReady &= !ReadbackPtr || ReadbackPtr->IsReady();
 		}
-		else
+		if (!bReady)
 		{
-			if (ReadbackPtr->IsReady())
-			{
-				int32 CurrentBufferSize = Readback.NextBufferSize;
+			break;
+		}
 
-				void* Buffer = (void*)ReadbackPtr->Lock(1);
-				TArray<FLocationNormalScaleZ> ResultBuffer;
-				ResultBuffer.SetNumZeroed(CurrentBufferSize);
-				FPlatformMemory::Memcpy(ResultBuffer.GetData(), Buffer, sizeof(FLocationNormalScaleZ) * CurrentBufferSize);
-				ReadbackPtr->Unlock();
+		const uint32 WaitFrames = GFrameNumberRenderThread - Readback.LastUsedFrameNumberRenderThread;
+		AverageWaitFrames = FMath::Lerp(AverageWaitFrames, (float)WaitFrames, 0.1f);
+		SET_FLOAT_STAT(STAT_MkGpuScatteringReadbackWaitFrames, AverageWaitFrames);
 
-#if !UE_BUILD_SHIPPING
-				if (bShowMkReadbackLog)
-				{
-					TMap<float, int32> DebugCount;
-					for (auto& buff : ResultBuffer)
-					{
-						if (buff.ComputedNormal.Z > 1)
-						{
-							DebugCount.FindOrAdd(buff.ComputedNormal.Z)++;
-						}
-					}
-
-					for (auto& KV : DebugCount)
-					{
-						UE_LOG(LogTemp, Log, TEXT("ErrorCode %f,  Count %d"), KV.Key, KV.Value);
-					}
-				}
-#endif
+		const bool bHasResults = Readback.HasArena(FMkReadback::Arena_Results);
+		const bool bHasTransforms = Readback.HasArena(FMkReadback::Arena_Transforms);
+		const FProgressInfo* ProgressInfos = static_cast<const FProgressInfo*>(Readback.ReadbackPtrs[FMkReadback::Arena_ProgressInfo]->Lock(Readback.ReadbackBytes[FMkReadback::Arena_ProgressInfo]));
+		const void* Results = bHasResults ? Readback.ReadbackPtrs[FMkReadback::Arena_Results]->Lock(Readback.ReadbackBytes[FMkReadback::Arena_Results]) : nullptr;
+		const void* Transforms = bHasTransforms ? Readback.ReadbackPtrs[FMkReadback::Arena_Transforms]->Lock(Readback.ReadbackBytes[FMkReadback::Arena_Transforms]) : nullptr;
 
-				int32 BeforeCount = ResultBuffer.Num();
-				ResultBuffer.RemoveAll([](FLocationNormalScaleZ& Data) { return Data.ComputedNormal.Z > 1; });
-				int32 AfterCount = ResultBuffer.Num();
-				//UE_LOG(LogTemp, Log, TEXT("Readback before %d -> After %d"), BeforeCount, AfterCount);
-
-				ReadbackBuffer.SafeRelease();
-				delete(ReadbackPtr);
-
-				Readback.MarkComplete();
-
-				if (Readback.Builder)
-				{
-					Readback.BuilderOutput.ResultBuffer = MoveTemp(ResultBuffer);
-					Readback.Builder->OnDelegateCompueteFinish(Readback.BuilderOutput);
-				}
-				{
-					LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager_RemoveReadback);
-					if (!ReadbackList.IsValidIndex(Index))
-					{
-						break;
-					}
-					ReadbackList.RemoveAtSwap(Index--);
-					MaxLoop = ReadbackList.Num() > 10 ? FMath::Max(1, ReadbackList.Num() / 10) : ReadbackList.Num();
-				}
-				continue;
-			}
-		}
-
-		{
-			LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager_AddEnque);
-			FRDGBuilder GraphBuilder(RHICmdList);
-			FRDGBufferRef Buffer = GraphBuilder.RegisterExternalBuffer(ReadbackBuffer);
-			AddEnqueueCopyPass(GraphBuilder, ReadbackPtr, Buffer, 0);
-			Readback.Touch();
-			GraphBuilder.Execute();
+		for (FMkReadback::FJob& Job : Readback.Jobs)
+		{
+			CompleteJob(Job, ProgressInfos, Results, Transforms, WaitFrames);
+		}
+
+		Readback.ReadbackPtrs[FMkReadback::Arena_ProgressInfo]->Unlock();
+		if (bHasResults)
+		{
+			Readback.ReadbackPtrs[FMkReadback::Arena_Results]->Unlock();
+		}
+		if (bHasTransforms)
+		{
+			Readback.ReadbackPtrs[FMkReadback::Arena_Transforms]->Unlock();
 		}
-	}
 
+		// The arena ranges are free again, the scheduler may issue more jobs
+		FMkAsyncBuilderInterface::ReleaseArenaBytes(Readback.ArenaBytes);
+		ReleaseReadbacks(Readback);
+		Readback.MarkComplete();
+		// A batch always completes as a whole, MaxReadbackPerFrame only stops the next one
+		NumCompleted += Readback.Jobs.Num();
+		{
+			LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager_RemoveReadback);
+			ReadbackQueue.PopFront();
+		}
+	}
 }
 
-void UMkGpuScatteringReadbackManager::AddReadback(const FMkReadback& InReadback)
+void UMkGpuScatteringReadbackManager::AddReadback(FMkReadback&& InReadback)
 {
 	LLM_SCOPE_BYTAG(MkGpuScatteringReadbackManager_AddReadback);
-	ReadbackList.Add(InReadback);
+	ReadbackQueue.Emplace(MoveTemp(InReadback));
 }
 
 //TArray<FMkReadback>& UMkGpuScatteringReadbackManager::GetReadbackList()
@@ -0,0 +1,124 @@
+#include "Scheduler/MkGpuScatteringScheduler.h"
+#include "Builder/MkGpuScatteringBuilder.h"
+#include "Readback/MkGpuScatteringReadbackManager.h"
+#include "Shaders/MkGpuScatteringShaders.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "HAL/LowLevelMemTracker.h"
+
+LLM_DEFINE_TAG(MkGpuScatteringScheduler);
+
+#include UE_INLINE_GENERATED_CPP_BY_NAME(MkGpuScatteringScheduler)
+
+
+MK_OPTIMIZATION_OFF
+
+static float GMkGpuScatteringMaxCreateTimeMs = 1.0f;
+static FAutoConsoleVariableRef CVarMkMaxCreateTimeMs(
+	TEXT("MkGpuScattering.MaxCreateTimeMs"),
+	GMkGpuScatteringMaxCreateTimeMs,
+	TEXT("Game thread time budget (ms) per frame for issuing new scattering jobs across all builders. At least one job is issued per frame."));
+
+static int32 GMkGpuScatteringMaxJobsInFlight = 16;
+static FAutoConsoleVariableRef CVarMkMaxJobsInFlight(
+	TEXT("MkGpuScattering.MaxJobsInFlight"),
+	GMkGpuScatteringMaxJobsInFlight,
+	TEXT("Maximum number of issued scattering jobs that are not applied yet. <= 0 means unlimited."));
+
+DECLARE_CYCLE_STAT(TEXT("MkGpuScattering Issue Jobs"), STAT_MkGpuScatteringIssueJobs, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Jobs Queued"), STAT_MkGpuScatteringJobsQueued, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Jobs Issued"), STAT_MkGpuScatteringJobsIssued, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("In Flight Queued"), STAT_MkGpuScatteringInFlightQueued, STATGROUP_MkGpuScattering);
+
+
+//~ UMkGpuScatteringScheduler
+void UMkGpuScatteringScheduler::BeginFrame()
+{
+	// Candidates are gathered again by every full build, nothing carries over between frames.
+	PendingJobs.Reset();
+}
+
+void UMkGpuScatteringScheduler::AddJob(FMkGpuScatteringJob&& Job)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringScheduler);
+	PendingJobs.Emplace(MoveTemp(Job));
+}
+
+void UMkGpuScatteringScheduler::ClearAll()
+{
+	PendingJobs.Empty();
+}
+
+int32 UMkGpuScatteringScheduler::IssueJobs(int32 NumJobsInFlight, UMkGpuScatteringReadbackManager* ReadbackManager)
+{
+	SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringIssueJobs);
+	LLM_SCOPE_BYTAG(MkGpuScatteringScheduler);
+	MK_SCATTERING_STAGE_SCOPE(Dispatch);
+
+	INC_DWORD_STAT_BY(STAT_MkGpuScatteringJobsQueued, PendingJobs.Num());
+
+	if (PendingJobs.IsEmpty())
+	{
+		return 0;
+	}
+
+	auto JobPriority = [](const FMkGpuScatteringJob& A, const FMkGpuScatteringJob& B)
+	{
+		if (A.JobClass != B.JobClass)
+		{
+			return A.JobClass < B.JobClass;
+		}
+		return A.Distance < B.Distance;
+	};
+
+	// Usually only a handful of jobs fit in the budget, a heap avoids sorting the whole queue.
+	PendingJobs.Heapify(JobPriority);
+
+	const double StartTime = FPlatformTime::Seconds();
+	const double MaxTime = GMkGpuScatteringMaxCreateTimeMs * 0.001;
+	const int32 MaxJobsInFlight = GMkGpuScatteringMaxJobsInFlight > 0 ? GMkGpuScatteringMaxJobsInFlight : MAX_int32;
+
+	int32 NumIssued = 0;
+	while (PendingJobs.Num() && NumJobsInFlight < MaxJobsInFlight)
+	{
+		if (NumIssued > 0 && FPlatformTime::Seconds() - StartTime > MaxTime)
+		{
+			break;
+		}
+
+		// The arenas of earlier batches are still waiting for their readback, the jobs stay queued for a later frame
+		if (!FMkAsyncBuilderInterface::HasArenaBudget())
+		{
+			break;
+		}
+
+		FMkGpuScatteringJob Job;
+		PendingJobs.HeapPop(Job, JobPriority, EAllowShrinking::No);
+
+		if (!Job.Builder)
+		{
+			continue;
+		}
+
+		if (Job.Builder->IssueJob(Job, ReadbackManager))
+		{
+			++NumJobsInFlight;
+		}
+		++NumIssued;
+	}
+
+	INC_DWORD_STAT_BY(STAT_MkGpuScatteringJobsIssued, NumIssued);
+	// Left for a later frame, gathered again by the next full build
+	INC_DWORD_STAT_BY(STAT_MkGpuScatteringInFlightQueued, PendingJobs.Num());
+
+	// Everything issued this frame goes to the GPU as one graph
+	FMkAsyncBuilderInterface::FlushBatch();
+
+	PendingJobs.Reset();
+
+	return NumIssued;
+}
+//~ end of UMkGpuScatteringScheduler
+
+MK_OPTIMIZATION_ON
@@ -2,6 +2,8 @@
 #include "Types/MkGpuScatteringTypes.h"
 #include "Builder/MkGpuScatteringBuilder.h"
 #include "Readback/MkGpuScatteringReadbackManager.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
 #include "MkGpuScatteringGlobal.h"
 
 #include "ShadowMap.h"
@@ -11,9 +13,17 @@
 #include "LandscapeGrassType.h"
 #include "Engine/MapBuildDataRegistry.h"
 #include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "Engine/Texture.h"
+#include "Engine/Texture2D.h"
+#include "Hash/xxhash.h"
+#include "UObject/ObjectKey.h"
+#include "UObject/GarbageCollection.h"
+#include "Tasks/Task.h"
 
 #include "HAL/LowLevelMemTracker.h"
 
+#include <atomic>
+
 LLM_DEFINE_TAG(MkGpuScatteringShaders);
 LLM_DEFINE_TAG(MkGpuScatteringDispatch);
 
@@ -21,6 +31,8 @@ using namespace MkGpuScatteringBuilderTypes;
 
 IMPLEMENT_GLOBAL_SHADER(FMkGPUScattering_CS, "/MkGPUPlacementShaders/GPUScattering_CS.usf", "Scattering_CS", SF_Compute);
 IMPLEMENT_GLOBAL_SHADER(FMkGPUScatteringNoWeightmap_CS, "/MkGPUPlacementShaders/GPUScattering_CS.usf", "Scattering_CS", SF_Compute);
+IMPLEMENT_GLOBAL_SHADER(FMkGPUScatteringTransform_CS, "/MkGPUPlacementShaders/GPUScatteringTransform_CS.usf", "Transform_CS", SF_Compute);
+IMPLEMENT_GLOBAL_SHADER(FMkGPUScatteringLibraryProbe_CS, "/MkGPUPlacementShaders/GPUScatteringLibraryProbe_CS.usf", "LibraryProbe_CS", SF_Compute);
 
 MK_OPTIMIZATION_OFF
 
@@ -30,6 +42,23 @@ static FAutoConsoleVariableRef MkThreadNum_ScatteringCSVar(
 	MkThreadNum_ScatteringCS,
 	TEXT(""));
 
+static int32 GMkGpuScatteringGpuTransform = 0;
+static FAutoConsoleVariableRef CVarMkGpuTransform(
+	TEXT("MkGpuScattering.GpuTransform"),
+	GMkGpuScatteringGpuTransform,
+	TEXT("1: Build the final instance transforms on the GPU (Transform_CS) and only copy them after readback. Scale and ZOffset match the CPU path, rotation and the random fraction are hashed from the instance position instead. Varieties with bCheckCloseLandscape always use the CPU."));
+
+static int32 GMkGpuScatteringArenaBudgetMB = 128;
+static FAutoConsoleVariableRef CVarMkArenaBudgetMB(
+	TEXT("MkGpuScattering.ArenaBudgetMB"),
+	GMkGpuScatteringArenaBudgetMB,
+	TEXT("GPU memory the scattering arenas may hold until their readback completes. The scheduler stops issuing jobs above it, a single batch is always allowed. 0: no limit."));
+
+DECLARE_MEMORY_STAT(TEXT("Scattering Arena Bytes In Flight"), STAT_MkGpuScatteringArenaBytesInFlight, STATGROUP_MkGpuScattering);
+
+// Written on the game thread, released from the render thread
+static std::atomic<int64> GMkScatteringArenaBytesInFlight = 0;
+
 //~ MkGpuScatteringBuilderParam
 
 // LandscapeGrass.cpp 참고
@@ -37,17 +66,16 @@ static FAutoConsoleVariableRef MkThreadNum_ScatteringCSVar(
 
 FMkGpuScatteringCS_Param::FMkGpuScatteringCS_Param(
 	UMkGpuScatteringBuilder* InBuilder
-	, FString InSpawnLayerName
-	, FString InBlockingLayerName
+	, FStringView InSpawnLayerName
 	, ALandscapeProxy* Landscape
-	, FMkCachedLandscapeFoliage::FGrassComp GrassComp
+	, const FMkCachedLandscapeFoliage::FGrassComp& GrassComp
 	, const FMkGrassVariety* InGrassVariety
 	, uint32 InHaltonBaseIndex
 	, int32 CachedMaxInstancesPerComponent
 	, UMkGpuScatteringReadbackManager* InReadbackManager
 )
 {
-	Builder = InBuilder;
+	Builder = InBuilder->MakeHandle();
 	GrassVariety = InGrassVariety;
 	HaltonBaseIndex = InHaltonBaseIndex;
 	ReadbackManager = InReadbackManager;
@@ -59,7 +87,7 @@ FMkGpuScatteringCS_Param::FMkGpuScatteringCS_Param(
 	LandscapeToWorld = Landscape->GetRootComponent()->GetComponentTransform().ToMatrixNoScale();
 	//~ end of LandscapeProxy info
 
-	FMkCachedLandscapeFoliage::FGrassCompKey GrassCompKey = GrassComp.Key;
+	const FMkCachedLandscapeFoliage::FGrassCompKey& GrassCompKey = GrassComp.Key;
 	int32 SqrtSubsections = GrassCompKey.SqrtSubsections;
 	int32 SubX = GrassCompKey.SubsectionX;
 	int32 SubY = GrassCompKey.SubsectionY;
@@ -86,16 +114,16 @@ FMkGpuScatteringCS_Param::FMkGpuScatteringCS_Param(
 	LightMapComponentScale = FVector2D::UnitVector;
 
 
-	HISMC = GrassComp.Foliage;
-	RandomStream = FRandomStream(HISMC->InstancingRandomSeed);
-	XForm = LandscapeToWorld * HISMC->GetComponentTransform().ToMatrixWithScale().Inverse();
-	DesiredInstancesPerLeaf = HISMC->DesiredInstancesPerLeaf();
+	Foliage = GrassComp.GetFoliage();
+	InstancingRandomSeed = GrassComp.InstancingRandomSeed;
+	RandomStream = FRandomStream(InstancingRandomSeed);
+	XForm = LandscapeToWorld * Foliage->GetComponentTransform().ToMatrixWithScale().Inverse();
+	// Merged components have no cluster tree, see FMkGrassVariety::bMergeComponents
+	const UHierarchicalInstancedStaticMeshComponent* HISMC = Cast<UHierarchicalInstancedStaticMeshComponent>(Foliage.Get());
+	DesiredInstancesPerLeaf = HISMC ? HISMC->DesiredInstancesPerLeaf() : 0;
 	BuildTime = 0;
 	TotalInstances = 0;
 
-
-	CachedBuffers = GrassComp.CachedBuffers;
-
 	TWeakObjectPtr<ULandscapeComponent> Component = GrassCompKey.BasedOn;
 	SectionBase = Component->GetSectionBase();
 	ComponentSizeQuads = Component->ComponentSizeQuads;
@@ -119,10 +147,12 @@ FMkGpuScatteringCS_Param::FMkGpuScatteringCS_Param(
 	TArray<FWeightmapLayerAllocationInfo>& WeightmapLayerAllocations = Component->GetWeightmapLayerAllocations(true);
 
 	int32 WeightmapIndex = -1;
+	TStringBuilder<NAME_SIZE> LayerName;
 	for (const FWeightmapLayerAllocationInfo& WeightLayerInfo : WeightmapLayerAllocations)
 	{
-		FString LayerName = WeightLayerInfo.LayerInfo.GetName();
-		if (LayerName.Contains(InSpawnLayerName))
+		LayerName.Reset();
+		WeightLayerInfo.LayerInfo.GetFName().AppendString(LayerName);
+		if (UE::String::FindFirst(LayerName.ToView(), InSpawnLayerName, ESearchCase::IgnoreCase) != INDEX_NONE)
 		{
 			WeightmapIndex = WeightLayerInfo.WeightmapTextureIndex;
 			WeightmapChannelIdx = WeightLayerInfo.WeightmapTextureChannel + 1;
@@ -164,12 +194,25 @@ FMkGpuScatteringCS_Param::FMkGpuScatteringCS_Param(
 		check(0);
 	}
 
-	BuilderOutput = FMkGpuScatteringBuilderOutput(Component, SqrtSubsections, CachedMaxInstancesPerComponent, SubX, SubY, NumVarieties, VarietyIndex, XForm, GrassVariety);
+	BuilderOutput = FMkGpuScatteringBuilderOutput(Component, GrassCompKey.ComponentId, SqrtSubsections, CachedMaxInstancesPerComponent, SubX, SubY, NumVarieties, VarietyIndex, XForm, GrassVariety);
 	BuilderOutput.RandomScale = RandomScale;
+	BuilderOutput.DispatchFrame = GFrameCounter;
+
+	// Scattering_CS quantizes the results against the rectangle it scatters into
+	BuilderOutput.bCompactResults = GrassVariety->bCompactResults;
+	BuilderOutput.PackedFrame.Base = Origin - FVector2f(DrawScale.X * LandscapeSectionOffset.X, DrawScale.Y * LandscapeSectionOffset.Y);
+	BuilderOutput.PackedFrame.Extent = Extent;
+
+	// bCheckCloseLandscape needs the locations on the game thread, the CPU backend has no Transform_CS
+	bGpuTransform = GMkGpuScatteringGpuTransform && !GrassVariety->bCheckCloseLandscape && !FMkGpuScatteringCpuEngine::IsActive();
+	if (bGpuTransform)
+	{
+		GpuTransformParams = MkGpuScatteringGpuTransform::FParams::Make(*GrassVariety, InstancingRandomSeed, XForm);
+	}
 
 	bHaveValidData = true;
 
-	check(DesiredInstancesPerLeaf > 0);
+	check(DesiredInstancesPerLeaf > 0 || !HISMC);
 
 	if (UseLandscapeLightmap)
 	{
@@ -225,14 +268,181 @@ void FMkGpuScatteringCS_Param::InitLandscapeLightmap(TWeakObjectPtr<ULandscapeCo
 
 void FMkGPUScattering_CS::SetUniqueParameters(FMkGPUScattering_CS::FParameters* PassParameters, const FMkGpuScatteringCS_Param& Param)
 {
-	PassParameters->WeightmapChannelIdx = Param.WeightmapChannelIdx;
 	PassParameters->WeightmapTexture = Param.WeightmapTexture->TextureReference.TextureReferenceRHI;
 	//PassParameters->WeightmapTextureSampler = TStaticSamplerState<SF_Point>::GetRHI();
 	PassParameters->WeightmapTextureSampler = TStaticSamplerState<SF_Bilinear>::GetRHI();
 }
 
+FScatteringJobDesc FMkGpuScatteringCS_Param::MakeJobDesc(const FMkGrassVariety& GrassVariety)
+{
+	FScatteringJobDesc Desc;
+	FMemory::Memzero(Desc);
+	Desc.VoronoiSetting = (GrassVariety.bUseVoronoiNoise == true)
+							? FVector4f(GrassVariety.VoronoiGroupSize, GrassVariety.VoronoiScale, GrassVariety.VoronoiValidRange.Min, GrassVariety.VoronoiValidRange.Max)
+							: FVector4f::Zero();
+	Desc.SlopeMinMax = FVector2f(GrassVariety.Slope.Min, GrassVariety.Slope.Max);
+	Desc.HeightMinMax = FVector2f(GrassVariety.Height.Min, GrassVariety.Height.Max);
+	Desc.HeightFalloffRange = GrassVariety.HeightFalloffRange;
+	Desc.PlacementJitter = GrassVariety.PlacementJitter;
+	Desc.UseGrid = GrassVariety.bUseGrid;
+	Desc.bUseVoronoiNoise = GrassVariety.bUseVoronoiNoise;
+	Desc.CompactResults = GrassVariety.bCompactResults;
+	return Desc;
+}
+
+FScatteringJobDesc FMkGpuScatteringCS_Param::MakeJobDesc() const
+{
+	FScatteringJobDesc Desc = MakeJobDesc(*GrassVariety);
+	Desc.Origin = Origin;
+	Desc.Extent = Extent;
+	Desc.Offset = FVector2f(LandscapeSectionOffset.X, LandscapeSectionOffset.Y);
+	Desc.SectionBase = FVector2f(SectionBase.X, SectionBase.Y);
+	Desc.DrawScale = FVector3f(DrawScale.X, DrawScale.Y, DrawScale.Z);
+	Desc.SqrtMaxInstances = SqrtMaxInstances;
+	Desc.InstancingRandomSeed = InstancingRandomSeed;
+	Desc.HaltonBaseIndex = HaltonBaseIndex;
+	Desc.Stride = ComponentSizeQuads + 1;
+	Desc.WeightmapChannelIdx = WeightmapChannelIdx;
+	Desc.ResultOffset = 0;
+	return Desc;
+}
+
+#if !WITH_EDITORONLY_DATA
+namespace MkGpuScatteringContentId
+{
+	// Cooked textures do not change while the game runs, each one is hashed once. Invalid while the hash is pending.
+	static TMap<TObjectKey<UTexture>, FGuid> ContentIds;
+	static FCriticalSection ContentIdsLock;
+
+	// Hash of mip 0, the same mip whatever is streamed in. The lighting guid does not change when the landscape is
+	// edited and cooked again, so the disk cache would keep serving the old results. May read from disk, worker only.
+	static FGuid HashMip0(const UTexture2D* Texture)
+	{
+		const FTexturePlatformData* PlatformData = Texture->GetPlatformData();
+		if (!PlatformData || PlatformData->Mips.IsEmpty())
+		{
+			return FGuid();
+		}
+
+		FByteBulkData& BulkData = const_cast<FByteBulkData&>(PlatformData->Mips[0].BulkData);
+		if (BulkData.GetBulkDataSize() <= 0 || (!BulkData.IsBulkDataLoaded() && !BulkData.CanLoadFromDisk()))
+		{
+			return FGuid();
+		}
+
+		// A copy, the resident data stays for the texture's own upload
+		void* Data = nullptr;
+		BulkData.GetCopy(&Data, false);
+		if (!Data)
+		{
+			return FGuid();
+		}
+
+		const FXxHash128 Hash = FXxHash128::HashBuffer(Data, BulkData.GetBulkDataSize());
+		FMemory::Free(Data);
+		return FGuid((uint32)(Hash.HashHigh >> 32), (uint32)Hash.HashHigh, (uint32)(Hash.HashLow >> 32), (uint32)Hash.HashLow);
+	}
+}
+#endif
+
+// Invalid when the content is not known (yet), the job then skips the disk cache
+static FGuid GetTextureContentId(const UTexture* Texture)
+{
+	if (!Texture)
+	{
+		return FGuid();
+	}
+#if WITH_EDITORONLY_DATA
+	// Changes with every landscape edit
+	return Texture->Source.GetId();
+#else
+	using namespace MkGpuScatteringContentId;
+
+	FScopeLock Lock(&ContentIdsLock);
+	if (const FGuid* ContentId = ContentIds.Find(Texture))
+	{
+		return *ContentId;
+	}
+
+	// The first jobs of the texture go to the GPU while its hash is computed on a worker
+	ContentIds.Add(Texture, FGuid());
+	UE::Tasks::Launch(UE_SOURCE_LOCATION, [WeakTexture = TWeakObjectPtr<const UTexture2D>(Cast<UTexture2D>(Texture)), Key = TObjectKey<UTexture>(Texture)]()
+	{
+		FGuid ContentId;
+		{
+			// The texture cannot be collected while its bulk data is read
+			FGCScopeGuard GCGuard;
+			if (const UTexture2D* Texture2D = WeakTexture.Get())
+			{
+				ContentId = HashMip0(Texture2D);
+			}
+		}
+
+		FScopeLock Lock(&ContentIdsLock);
+		ContentIds.Add(Key, ContentId);
+	});
+	return FGuid();
+#endif
+}
+
+uint64 FMkGpuScatteringCS_Param::MakePlacementKey() const
+{
+	// Bump when Scattering_CS places instances differently
+	static constexpr uint32 KeyVersion = 1;
+
+	// The descriptor already carries the placement settings of the variety, the seeds and the instance count
+	const FScatteringJobDesc Desc = MakeJobDesc();
+	const float DensityScale = GMkGpuScatteringDensityScale;
+
+	FXxHash64Builder Hasher;
+	Hasher.Update(&KeyVersion, sizeof(KeyVersion));
+	Hasher.Update(&Desc, sizeof(FScatteringJobDesc));
+	Hasher.Update(&GrassDensity, sizeof(GrassDensity));
+	Hasher.Update(&DensityScale, sizeof(DensityScale));
+
+	const uint64 Key = Hasher.Finalize().Hash;
+	return Key != 0 ? Key : 1;
+}
+
+uint64 FMkGpuScatteringCS_Param::MakeDiskCacheKey() const
+{
+	const uint64 PlacementKey = MakePlacementKey();
+	const FGuid HeightmapId = GetTextureContentId(HeightmapTexture);
+	const FGuid WeightmapId = GetTextureContentId(WeightmapTexture);
+	if (!HeightmapId.IsValid() || (WeightmapTexture && !WeightmapId.IsValid()))
+	{
+		return 0;
+	}
+
+	FXxHash64Builder Hasher;
+	Hasher.Update(&PlacementKey, sizeof(PlacementKey));
+	Hasher.Update(&HeightmapId, sizeof(FGuid));
+	Hasher.Update(&WeightmapId, sizeof(FGuid));
+
+	const uint64 Key = Hasher.Finalize().Hash;
+	return Key != 0 ? Key : 1;
+}
+
+static uint32 GetMaxInstances(const FMkGpuScatteringCS_Param& Param)
+{
+	return Param.SqrtMaxInstances * Param.SqrtMaxInstances;
+}
+
+static uint32 GetResultDwords(const FMkGpuScatteringCS_Param& Param)
+{
+	return Param.BuilderOutput.bCompactResults ? PackedResultDwords : ResultDwords;
+}
+
+// What the job holds in the arenas until its batch is read back
+static int64 GetJobArenaBytes(const FMkGpuScatteringCS_Param& Param)
+{
+	const int64 ElementBytes = GetResultDwords(Param) * sizeof(uint32) + (Param.bGpuTransform ? sizeof(FInstanceTransform) : 0);
+	return (int64)GetMaxInstances(Param) * ElementBytes + sizeof(FProgressInfo) + sizeof(FScatteringJobDesc);
+}
+
+// Returns false if nothing was added
 template<class T, typename FParameters>
-void AddPass_MkScattering(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param)
+bool AddPass_MkScattering(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param, const FMkScatteringArena& Arena, uint32 JobIndex)
 {
 	LLM_SCOPE_BYTAG(MkGpuScatteringShaders);
 
@@ -240,149 +450,336 @@ void AddPass_MkScattering(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Pa
 	TShaderMapRef<T> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
 	if (!ComputeShader.IsValid())
 	{
-		return;
+		return false;
 	}
 
 	//~ Init parameters
 	FParameters* PassParameters = GraphBuilder.AllocParameters<FParameters>();
 
 	int32 SqrtMaxInstances = Param.SqrtMaxInstances;
-	int32 MaxInstances = SqrtMaxInstances * SqrtMaxInstances;
-
-	const auto& GrassVariety = Param.GrassVariety;
-	PassParameters->bUseVoronoiNoise = GrassVariety->bUseVoronoiNoise;
-	PassParameters->VoronoiSetting = (GrassVariety->bUseVoronoiNoise == true)
-										? FVector4f(GrassVariety->VoronoiGroupSize, GrassVariety->VoronoiScale, GrassVariety->VoronoiValidRange.Min, GrassVariety->VoronoiValidRange.Max)
-										: FVector4f::Zero();
-	PassParameters->SlopeMinMax = FVector2f(GrassVariety->Slope.Min, GrassVariety->Slope.Max);
-	PassParameters->HeightMinMax = FVector2f(GrassVariety->Height.Min, GrassVariety->Height.Max);
-	PassParameters->HeightFalloffRange = GrassVariety->HeightFalloffRange;
-	PassParameters->PlacementJitter = GrassVariety->PlacementJitter;
-	PassParameters->InstancingRandomSeed = Param.HISMC->InstancingRandomSeed;
-	PassParameters->UseGrid = GrassVariety->bUseGrid;
-	PassParameters->AlignToSurface = GrassVariety->AlignToSurface;
+
+	PassParameters->JobDescs = Arena.JobDescs;
+	PassParameters->JobIndex = JobIndex;
 
 	PassParameters->HeightmapTexture = Param.HeightmapTexture->TextureReference.TextureReferenceRHI;
 	PassParameters->HeightmapTextureSampler = TStaticSamplerState<SF_Point>::GetRHI();
 	//PassParameters->HeightmapTextureSampler = TStaticSamplerState<SF_Bilinear>::GetRHI();
 
-	FRDGBufferRef ProgressInfoBuffer;
-	FRDGBufferRef Result_Buffer;
+	// The job only touches ProgressInfo[JobIndex] and its own range of the result arena
+	PassParameters->RWProgressInfo = Arena.ProgressInfoUAV;
+	PassParameters->RWResultBuffer = Arena.ResultsUAV;
 
-	FMkGpuScatteringCachedBuffers* CachedBuffers = Param.CachedBuffers;
-	if (!CachedBuffers)
+	T::SetUniqueParameters(PassParameters, Param);
+	//~ end of Init parameters
+
+	int32 NumThreadCS = MkThreadNum_ScatteringCS;
+	int32 NeedGroupCount = FMath::CeilToInt((float)SqrtMaxInstances / (float)NumThreadCS);
+	FIntVector GroupCount = FIntVector(NeedGroupCount, NeedGroupCount, 1);
+	FComputeShaderUtils::AddPass<T>(
+		GraphBuilder,
+		RDG_EVENT_NAME("AddPass_MkScattering"),
+		ComputeShader, PassParameters, GroupCount);
+
+	return true;
+}
+
+void AddPass_MkTransform(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param, const FMkScatteringArena& Arena, uint32 JobIndex, uint32 ResultOffset, uint32 TransformOffset)
+{
+	const FPackedResultFrame* PackedFrame = Param.BuilderOutput.bCompactResults ? &Param.BuilderOutput.PackedFrame : nullptr;
+	AddPass_MkTransform(GraphBuilder, Param.GpuTransformParams, PackedFrame, GetMaxInstances(Param), Arena, JobIndex, ResultOffset, TransformOffset);
+}
+
+void AddPass_MkTransform(FRDGBuilder& GraphBuilder, const MkGpuScatteringGpuTransform::FParams& GpuParams, const FPackedResultFrame* PackedFrame,
+	uint32 MaxInstances, const FMkScatteringArena& Arena, uint32 JobIndex, uint32 ResultOffset, uint32 TransformOffset)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringShaders);
+
+	TShaderMapRef<FMkGPUScatteringTransform_CS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+	if (!ComputeShader.IsValid() || !Arena.TransformsUAV)
 	{
 		return;
 	}
 
-	if (CachedBuffers->Input_Buffer.IsValid())
+	FMkGPUScatteringTransform_CS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMkGPUScatteringTransform_CS::FParameters>();
+	PassParameters->ProgressInfo = GraphBuilder.CreateSRV(Arena.ProgressInfo);
+	PassParameters->ResultBuffer = GraphBuilder.CreateSRV(Arena.Results);
+	PassParameters->RWInstanceTransforms = Arena.TransformsUAV;
+	PassParameters->JobIndex = JobIndex;
+	PassParameters->ResultOffset = ResultOffset;
+	PassParameters->TransformOffset = TransformOffset;
+	PassParameters->Seed = GpuParams.Seed;
+	PassParameters->CompactResults = PackedFrame != nullptr;
+	PassParameters->PackedBase = PackedFrame ? PackedFrame->Base : FVector2f::ZeroVector;
+	PassParameters->PackedExtent = PackedFrame ? PackedFrame->Extent : FVector2f::ZeroVector;
+	PassParameters->XForm = GpuParams.XForm;
+	PassParameters->RotationAxis = GpuParams.RotationAxis;
+	PassParameters->DefaultScale = GpuParams.DefaultScale;
+	PassParameters->ScaleX = GpuParams.ScaleX;
+	PassParameters->ScaleY = GpuParams.ScaleY;
+	PassParameters->ScaleZ = GpuParams.ScaleZ;
+	PassParameters->ZOffset = GpuParams.ZOffset;
+	PassParameters->Scaling = GpuParams.Scaling;
+	PassParameters->RandomScale = GpuParams.bRandomScale;
+	PassParameters->RandomRotation = GpuParams.bRandomRotation;
+	PassParameters->AlignToSurface = GpuParams.bAlignToSurface;
+	PassParameters->bUseVoronoiNoise = GpuParams.bUseVoronoiNoise;
+	PassParameters->VoronoiValidMax = GpuParams.VoronoiValidMax;
+	PassParameters->AlignMaxPitch = GpuParams.AlignMaxPitch;
+
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("AddPass_MkTransform"),
+		ComputeShader, PassParameters, FComputeShaderUtils::GetGroupCount((int32)MaxInstances, (int32)FMkGPUScatteringTransform_CS::ThreadGroupSize));
+}
+
+//~ FMkAsyncBuilderInterface
+TArray<FMkGpuScatteringCS_Param> FMkAsyncBuilderInterface::PendingBatch;
+
+void FMkAsyncBuilderInterface::Dispatch(FMkGpuScatteringCS_Param&& Param)
+{
+	check(IsInGameThread());
+	const int64 JobBytes = GetJobArenaBytes(Param);
+	GMkScatteringArenaBytesInFlight += JobBytes;
+	INC_MEMORY_STAT_BY(STAT_MkGpuScatteringArenaBytesInFlight, JobBytes);
+
+	if (FMkGpuScatteringCpuEngine::IsActive())
 	{
-		PassParameters->Input = GraphBuilder.CreateSRV(GraphBuilder.RegisterExternalBuffer(CachedBuffers->Input_Buffer));
+		// No GPU arena, the bytes still hold the scheduler back until the results reach the builder
+		FMkGpuScatteringCpuEngine::Dispatch(MoveTemp(Param), JobBytes);
+		return;
 	}
-	else
+
+	PendingBatch.Add(MoveTemp(Param));
+}
+
+void FMkAsyncBuilderInterface::FlushBatch()
+{
+	check(IsInGameThread());
+	if (PendingBatch.IsEmpty())
 	{
-		FRDGBufferRef Input_Buffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FScatteringInput), 1), TEXT("Input_Buffer"));
-		CachedBuffers->Input_Buffer = GraphBuilder.ConvertToExternalBuffer(Input_Buffer);
-
-		FRDGUploadData<FScatteringInput> InputData(GraphBuilder, 1);
-		FScatteringInput& InputRef = InputData[0];
-		InputRef.Origin = Param.Origin;
-		InputRef.Extent = Param.Extent;
-		InputRef.Offset = FVector2f(Param.LandscapeSectionOffset.X, Param.LandscapeSectionOffset.Y);
-		InputRef.DrawScale = FVector3f(Param.DrawScale.X, Param.DrawScale.Y, Param.DrawScale.Z);
-		InputRef.SectionBase = FVector2f(Param.SectionBase.X, Param.SectionBase.Y);
-
-		InputRef.SqrtMaxInstances = Param.SqrtMaxInstances;
-		InputRef.HaltonBaseIndex = Param.HaltonBaseIndex;
-		InputRef.Stride = Param.ComponentSizeQuads + 1;
-		GraphBuilder.QueueBufferUpload<FScatteringInput>(Input_Buffer, InputData, ERDGInitialDataFlags::NoCopy);
-
-		PassParameters->Input = GraphBuilder.CreateSRV(Input_Buffer);
+		return;
 	}
 
-	if (CachedBuffers->Result_Buffer.IsValid())
+	// The batch is shared by every world, each world's jobs are read back by its own manager: one graph per manager
+	struct FManagerBatch
 	{
-		Result_Buffer = GraphBuilder.RegisterExternalBuffer(CachedBuffers->Result_Buffer);
-		PassParameters->RWResultBuffer = GraphBuilder.CreateUAV(Result_Buffer);
-	}
-	else
+		TWeakObjectPtr<UMkGpuScatteringReadbackManager> ReadbackManager;
+		TArray<FMkGpuScatteringCS_Param> Jobs;
+		int64 ArenaBytes = 0;
+	};
+	TArray<FManagerBatch, TInlineAllocator<2>> Batches;
+	for (FMkGpuScatteringCS_Param& Param : PendingBatch)
 	{
-		Result_Buffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FLocationNormalScaleZ), MaxInstances), TEXT("Result_Buffer"));
-		CachedBuffers->Result_Buffer = GraphBuilder.ConvertToExternalBuffer(Result_Buffer);
-		PassParameters->RWResultBuffer = GraphBuilder.CreateUAV(Result_Buffer);
+		FManagerBatch* Batch = Batches.FindByPredicate([&Param](const FManagerBatch& Existing) { return Existing.ReadbackManager == Param.ReadbackManager; });
+		if (!Batch)
+		{
+			Batch = &Batches.AddDefaulted_GetRef();
+			Batch->ReadbackManager = Param.ReadbackManager;
+		}
+		Batch->ArenaBytes += GetJobArenaBytes(Param);
+		Batch->Jobs.Add(MoveTemp(Param));
 	}
+	PendingBatch.Reset();
 
-	if (CachedBuffers->ProgressInfo_Buffer.IsValid())
-	{
-		ProgressInfoBuffer = GraphBuilder.RegisterExternalBuffer(CachedBuffers->ProgressInfo_Buffer);
-		PassParameters->RWProgressInfo = GraphBuilder.CreateUAV(ProgressInfoBuffer);
-	}
-	else
+	for (FManagerBatch& Batch : Batches)
 	{
-		ProgressInfoBuffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FProgressInfo), 1), TEXT("ProgressInfo_Buffer"));
-		CachedBuffers->ProgressInfo_Buffer = GraphBuilder.ConvertToExternalBuffer(ProgressInfoBuffer);
-
-		FRDGUploadData<FProgressInfo> ProgressData(GraphBuilder, 1);
-		ProgressData[0].Count = 0;
-		ProgressData[0].MaxInstances = MaxInstances;
-		GraphBuilder.QueueBufferUpload<FProgressInfo>(ProgressInfoBuffer, ProgressData, ERDGInitialDataFlags::NoCopy);
-
-		PassParameters->RWProgressInfo = GraphBuilder.CreateUAV(ProgressInfoBuffer);
+		ENQUEUE_RENDER_COMMAND(MkAsyncBuilder)(
+			[Jobs = MoveTemp(Batch.Jobs), ArenaBytes = Batch.ArenaBytes](FRHICommandListImmediate& RHICmdList) mutable
+			{
+				DispatchRenderThread(RHICmdList, MoveTemp(Jobs), ArenaBytes);
+			});
 	}
+}
 
-	T::SetUniqueParameters(PassParameters, Param);
-	//~ end of Init parameters
-
-	int32 NumThreadCS = MkThreadNum_ScatteringCS;
-	int32 NeedGroupCount = FMath::CeilToInt((float)SqrtMaxInstances / (float)NumThreadCS);
-	FIntVector GroupCount = FIntVector(NeedGroupCount, NeedGroupCount, 1);
-	FComputeShaderUtils::AddPass<T>(
-		GraphBuilder,
-		RDG_EVENT_NAME("AddPass_MkScattering"),
-		ComputeShader, PassParameters, GroupCount);
+int64 FMkAsyncBuilderInterface::GetArenaBytesInFlight()
+{
+	return GMkScatteringArenaBytesInFlight;
 }
 
+bool FMkAsyncBuilderInterface::HasArenaBudget()
+{
+	const int64 BytesInFlight = GetArenaBytesInFlight();
+	return GMkScatteringArenaBudgetMB <= 0 || BytesInFlight <= 0 || BytesInFlight < (int64)GMkScatteringArenaBudgetMB * 1024 * 1024;
+}
 
-//~ FMkAsyncBuilderInterface
-void FMkAsyncBuilderInterface::DispatchGameThread(FMkGpuScatteringCS_Param Param)
+void FMkAsyncBuilderInterface::ReleaseArenaBytes(int64 NumBytes)
 {
-	ENQUEUE_RENDER_COMMAND(MkAsyncBuilder)(
-		[Param](FRHICommandListImmediate& RHICmdList)
-		{
-			DispatchRenderThread(RHICmdList, Param);
-		});
+	if (NumBytes > 0)
+	{
+		GMkScatteringArenaBytesInFlight -= NumBytes;
+		DEC_MEMORY_STAT_BY(STAT_MkGpuScatteringArenaBytesInFlight, NumBytes);
+	}
 }
 
 
-void FMkAsyncBuilderInterface::DispatchRenderThread(FRHICommandListImmediate& RHICmdList, FMkGpuScatteringCS_Param Param/*, TFunction<void(const FMkGpuScatteringBuilderOutput& Output)> AsyncCallback*/)
+void FMkAsyncBuilderInterface::DispatchRenderThread(FRHICommandListImmediate& RHICmdList, TArray<FMkGpuScatteringCS_Param>&& Batch, int64 ArenaBytes)
 {
 	LLM_SCOPE_BYTAG(MkGpuScatteringDispatch);
-	if (!Param.HISMC.IsValid())
+	MK_SCATTERING_STAGE_SCOPE(Dispatch);
+
+	// Jobs whose component went away are dropped like before, the cache item is released with the component
+	Batch.RemoveAllSwap([](const FMkGpuScatteringCS_Param& Param) { return !Param.Foliage.IsValid(); });
+	if (Batch.IsEmpty())
 	{
+		ReleaseArenaBytes(ArenaBytes);
 		return;
 	}
 
 	FRDGBuilder GraphBuilder(RHICmdList);
 
-	if (Param.WeightmapTexture)
+	// Sub-allocate every job's result range from one arena. Results are sized by the job's format, transforms only
+	// for the jobs that run Transform_CS. The jobs whose results are read back come first, so their ranges are a prefix
+	// of the arena and the readback copies only that prefix; the results Transform_CS consumes stay on the GPU.
+	TArray<uint32, TInlineAllocator<64>> ResultOffsets;
+	TArray<uint32, TInlineAllocator<64>> TransformOffsets;
+	ResultOffsets.SetNumUninitialized(Batch.Num());
+	TransformOffsets.SetNumUninitialized(Batch.Num());
+	uint32 NumResultDwords = 0;
+	uint32 NumTransforms = 0;
+	for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
 	{
-		AddPass_MkScattering<FMkGPUScattering_CS, FMkGPUScattering_CS::FParameters>(GraphBuilder, Param);
+		const FMkGpuScatteringCS_Param& Param = Batch[JobIndex];
+		if (!Param.bGpuTransform)
+		{
+			ResultOffsets[JobIndex] = NumResultDwords;
+			NumResultDwords += GetMaxInstances(Param) * GetResultDwords(Param);
+		}
+		TransformOffsets[JobIndex] = NumTransforms;
+		NumTransforms += Param.bGpuTransform ? GetMaxInstances(Param) : 0;
 	}
-	else
+	const uint32 NumReadbackResultDwords = NumResultDwords;
+	for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
 	{
-		AddPass_MkScattering<FMkGPUScatteringNoWeightmap_CS, FMkGPUScatteringNoWeightmap_CS::FParameters>(GraphBuilder, Param);
+		const FMkGpuScatteringCS_Param& Param = Batch[JobIndex];
+		if (Param.bGpuTransform)
+		{
+			ResultOffsets[JobIndex] = NumResultDwords;
+			NumResultDwords += GetMaxInstances(Param) * GetResultDwords(Param);
+		}
 	}
+	NumResultDwords = FMath::Max(NumResultDwords, 1u);
 
+	FMkScatteringArena Arena;
+
+	// One descriptor upload for the whole batch, every pass picks its own entry by JobIndex
+	FRDGBufferRef JobDescBuffer = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FScatteringJobDesc), Batch.Num()), TEXT("MkScatteringJobDescs"));
+	{
+		FRDGUploadData<FScatteringJobDesc> JobDescData(GraphBuilder, Batch.Num());
+		for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
+		{
+			JobDescData[JobIndex] = Batch[JobIndex].MakeJobDesc();
+			JobDescData[JobIndex].ResultOffset = ResultOffsets[JobIndex];
+		}
+		GraphBuilder.QueueBufferUpload<FScatteringJobDesc>(JobDescBuffer, JobDescData, ERDGInitialDataFlags::NoCopy);
+	}
+	Arena.JobDescs = GraphBuilder.CreateSRV(JobDescBuffer);
+
+	// The append counters and the reject counts start from zero on every dispatch
+	Arena.ProgressInfo = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FProgressInfo), Batch.Num()), TEXT("MkScatteringProgressInfoArena"));
+	{
+		FRDGUploadData<FProgressInfo> ProgressData(GraphBuilder, Batch.Num());
+		for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
+		{
+			ProgressData[JobIndex] = FProgressInfo();
+			ProgressData[JobIndex].MaxInstances = GetMaxInstances(Batch[JobIndex]);
+		}
+		GraphBuilder.QueueBufferUpload<FProgressInfo>(Arena.ProgressInfo, ProgressData, ERDGInitialDataFlags::NoCopy);
+	}
+
+	// Transient, the RDG pool hands the same allocations back to the next batches of about the same size.
+	// The jobs write disjoint ranges, so back to back passes do not need a UAV barrier between them.
+	Arena.Results = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(uint32), NumResultDwords), TEXT("MkScatteringResultArena"));
+	Arena.ProgressInfoUAV = GraphBuilder.CreateUAV(FRDGBufferUAVDesc(Arena.ProgressInfo), ERDGUnorderedAccessViewFlags::SkipBarrier);
+	Arena.ResultsUAV = GraphBuilder.CreateUAV(FRDGBufferUAVDesc(Arena.Results), ERDGUnorderedAccessViewFlags::SkipBarrier);
+	if (NumTransforms > 0)
+	{
+		Arena.Transforms = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(FInstanceTransform), NumTransforms), TEXT("MkScatteringTransformArena"));
+		Arena.TransformsUAV = GraphBuilder.CreateUAV(FRDGBufferUAVDesc(Arena.Transforms), ERDGUnorderedAccessViewFlags::SkipBarrier);
+	}
 
 	FMkReadback Readback;
+	Readback.ArenaBytes = ArenaBytes;
+	Readback.Jobs.Reserve(Batch.Num());
+
+	// All scattering passes first, the transform passes read the arenas after a single transition
+	TArray<bool, TInlineAllocator<64>> bDispatched;
+	bDispatched.SetNumZeroed(Batch.Num());
+	for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
+	{
+		FMkGpuScatteringCS_Param& Param = Batch[JobIndex];
+		if (Param.WeightmapTexture)
+		{
+			bDispatched[JobIndex] = AddPass_MkScattering<FMkGPUScattering_CS, FMkGPUScattering_CS::FParameters>(GraphBuilder, Param, Arena, JobIndex);
+		}
+		else
+		{
+			bDispatched[JobIndex] = AddPass_MkScattering<FMkGPUScatteringNoWeightmap_CS, FMkGPUScatteringNoWeightmap_CS::FParameters>(GraphBuilder, Param, Arena, JobIndex);
+		}
+	}
+
+	for (int32 JobIndex = 0; JobIndex < Batch.Num(); ++JobIndex)
+	{
+		FMkGpuScatteringCS_Param& Param = Batch[JobIndex];
+
+		if (!bDispatched[JobIndex])
+		{
+			// Nothing was dispatched, hand back an empty output so the cache item does not stay pending
+			Param.BuilderOutput.DiskCacheKey = 0;
+			Param.BuilderOutput.BakeKey = 0;
+			Param.Builder.Deliver(MoveTemp(Param.BuilderOutput));
+			continue;
+		}
+
+		const bool bGpuTransform = Param.bGpuTransform && Arena.TransformsUAV;
+		if (bGpuTransform)
+		{
+			AddPass_MkTransform(GraphBuilder, Param, Arena, JobIndex, ResultOffsets[JobIndex], TransformOffsets[JobIndex]);
+		}
+		Param.BuilderOutput.bGpuTransforms = bGpuTransform;
+
+		FMkReadback::FJob& Job = Readback.Jobs.AddDefaulted_GetRef();
+		Job.Builder = Param.Builder;
+		Job.BuilderOutput = MoveTemp(Param.BuilderOutput);
+		Job.JobIndex = JobIndex;
+		Job.ResultOffset = ResultOffsets[JobIndex];
+		Job.TransformOffset = TransformOffsets[JobIndex];
+	}
+
+	// FlushBatch splits the batches by manager
+	UMkGpuScatteringReadbackManager* ReadbackManager = Batch[0].ReadbackManager.Get();
+	if (Readback.Jobs.IsEmpty() || !ReadbackManager)
+	{
+		ReleaseArenaBytes(ArenaBytes);
+		GraphBuilder.Execute();
+		return;
+	}
+
+	// Counts and payload are copied right behind the passes, the readback manager waits on a single fence for the batch.
+	// The count is not known when the copies are recorded, so the payload is bounded by the jobs' MaxInstances and
+	// sliced on the CPU: the results prefix of the jobs without Transform_CS, and the transforms of the others.
+	const uint32 ProgressBytes = sizeof(FProgressInfo) * Batch.Num();
+	FRHIGPUBufferReadback* ProgressReadback = ReadbackManager->AcquireReadback(ProgressBytes);
+	AddEnqueueCopyPass(GraphBuilder, ProgressReadback, Arena.ProgressInfo, ProgressBytes);
+	Readback.AddReadback(FMkReadback::Arena_ProgressInfo, ProgressReadback, ProgressBytes);
+
+	if (NumReadbackResultDwords > 0)
+	{
+		const uint32 ResultBytes = sizeof(uint32) * NumReadbackResultDwords;
+		FRHIGPUBufferReadback* ResultReadback = ReadbackManager->AcquireReadback(ResultBytes);
+		AddEnqueueCopyPass(GraphBuilder, ResultReadback, Arena.Results, ResultBytes);
+		Readback.AddReadback(FMkReadback::Arena_Results, ResultReadback, ResultBytes);
+	}
+
+	if (Arena.Transforms)
+	{
+		const uint32 TransformBytes = sizeof(FInstanceTransform) * NumTransforms;
+		FRHIGPUBufferReadback* TransformReadback = ReadbackManager->AcquireReadback(TransformBytes);
+		AddEnqueueCopyPass(GraphBuilder, TransformReadback, Arena.Transforms, TransformBytes);
+		Readback.AddReadback(FMkReadback::Arena_Transforms, TransformReadback, TransformBytes);
+	}
 
-	FRHIGPUBufferReadback* ProgressInfoReadback = new FRHIGPUBufferReadback(TEXT("MkProgressInfo"));
-	FRHIGPUBufferReadback* LocationAndNormalReadback = new FRHIGPUBufferReadback(TEXT("MkLocationAndNormalRes"));
+	ReadbackManager->AddReadback(MoveTemp(Readback));
 
-	FMkGpuScatteringCachedBuffers* CachedBuffers = Param.CachedBuffers;
-	Readback.AddReadback(Param.Builder, Param.BuilderOutput, CachedBuffers->ProgressInfo_Buffer, ProgressInfoReadback);
-	Readback.AddReadback(Param.Builder, Param.BuilderOutput, CachedBuffers->Result_Buffer, LocationAndNormalReadback);
-	Param.ReadbackManager->AddReadback(Readback);
 	GraphBuilder.Execute();
 }
 //~ end of FMkAsyncBuilderInterface
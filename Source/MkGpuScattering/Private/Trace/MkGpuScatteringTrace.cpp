@@ -0,0 +1,140 @@
+#include "Trace/MkGpuScatteringTrace.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "Trace/Trace.h"
+#include "Trace/Trace.inl"
+
+MK_OPTIMIZATION_OFF
+
+static int32 GMkGpuScatteringTimeToVisibleSamples = 256;
+static FAutoConsoleVariableRef CVarMkTimeToVisibleSamples(
+	TEXT("MkGpuScattering.TimeToVisibleSamples"),
+	GMkGpuScatteringTimeToVisibleSamples,
+	TEXT("Number of recent applied jobs the time to visible mean and p95 stats are computed over."));
+
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Time To Visible Mean (ms)"), STAT_MkGpuScatteringTimeToVisibleMean, STATGROUP_MkGpuScattering);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Time To Visible P95 (ms)"), STAT_MkGpuScatteringTimeToVisibleP95, STATGROUP_MkGpuScattering);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Jobs Applied"), STAT_MkGpuScatteringJobsApplied, STATGROUP_MkGpuScattering);
+
+#if UE_TRACE_ENABLED
+UE_TRACE_CHANNEL_DEFINE(MkGpuScatteringChannel)
+
+UE_TRACE_EVENT_BEGIN(MkGpuScattering, JobStage)
+	UE_TRACE_EVENT_FIELD(uint64, Cycle)
+	UE_TRACE_EVENT_FIELD(uint64, QueuedCycle)
+	UE_TRACE_EVENT_FIELD(uint32, BuilderId)
+	UE_TRACE_EVENT_FIELD(uint32, ComponentId)
+	UE_TRACE_EVENT_FIELD(uint16, VarietyIndex)
+	UE_TRACE_EVENT_FIELD(uint8, SubsectionX)
+	UE_TRACE_EVENT_FIELD(uint8, SubsectionY)
+	// EMkScatteringJobStage
+	UE_TRACE_EVENT_FIELD(uint8, Stage)
+UE_TRACE_EVENT_END()
+#endif
+
+namespace MkGpuScatteringTrace
+{
+	// Ring of the last time to visible samples in ms, game thread only
+	static TArray<float> TimeToVisibleSamples;
+	static int32 NextSample = 0;
+	static bool bSamplesChanged = false;
+}
+
+bool FMkGpuScatteringTrace::IsTracking()
+{
+#if UE_TRACE_ENABLED
+	if (UE_TRACE_CHANNELEXPR_IS_ENABLED(MkGpuScatteringChannel))
+	{
+		return true;
+	}
+#endif
+#if STATS
+	return FThreadStats::IsCollectingData();
+#else
+	return false;
+#endif
+}
+
+void FMkGpuScatteringTrace::JobStage(EMkScatteringJobStage Stage, uint32 BuilderId, uint32 ComponentId, int32 SubsectionX, int32 SubsectionY, int32 VarietyIndex, uint64 QueuedCycles)
+{
+#if UE_TRACE_ENABLED
+	UE_TRACE_LOG(MkGpuScattering, JobStage, MkGpuScatteringChannel)
+		<< JobStage.Cycle(FPlatformTime::Cycles64())
+		<< JobStage.QueuedCycle(QueuedCycles)
+		<< JobStage.BuilderId(BuilderId)
+		<< JobStage.ComponentId(ComponentId)
+		<< JobStage.VarietyIndex((uint16)VarietyIndex)
+		<< JobStage.SubsectionX((uint8)SubsectionX)
+		<< JobStage.SubsectionY((uint8)SubsectionY)
+		<< JobStage.Stage((uint8)Stage);
+#endif
+}
+
+void FMkGpuScatteringTrace::AddTimeToVisible(uint64 QueuedCycles)
+{
+	check(IsInGameThread());
+
+	INC_DWORD_STAT(STAT_MkGpuScatteringJobsApplied);
+
+	if (!QueuedCycles)
+	{
+		return;
+	}
+
+	using namespace MkGpuScatteringTrace;
+
+	const int32 MaxSamples = FMath::Max(GMkGpuScatteringTimeToVisibleSamples, 1);
+	if (TimeToVisibleSamples.Num() > MaxSamples)
+	{
+		TimeToVisibleSamples.Reset();
+		NextSample = 0;
+	}
+
+	const float Milliseconds = (float)FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - QueuedCycles);
+	if (TimeToVisibleSamples.Num() < MaxSamples)
+	{
+		TimeToVisibleSamples.Add(Milliseconds);
+	}
+	else
+	{
+		TimeToVisibleSamples[NextSample] = Milliseconds;
+		NextSample = (NextSample + 1) % MaxSamples;
+	}
+	bSamplesChanged = true;
+}
+
+void FMkGpuScatteringTrace::EndFrame()
+{
+	check(IsInGameThread());
+
+	using namespace MkGpuScatteringTrace;
+
+	if (!bSamplesChanged || TimeToVisibleSamples.IsEmpty())
+	{
+		return;
+	}
+	bSamplesChanged = false;
+
+#if STATS
+	double Sum = 0.0;
+	for (float Sample : TimeToVisibleSamples)
+	{
+		Sum += Sample;
+	}
+
+	TArray<float, TInlineAllocator<256>> Sorted(TimeToVisibleSamples);
+	Sorted.Sort();
+	const int32 P95Index = FMath::Min(FMath::CeilToInt32(Sorted.Num() * 0.95f) - 1, Sorted.Num() - 1);
+
+	SET_FLOAT_STAT(STAT_MkGpuScatteringTimeToVisibleMean, (float)(Sum / TimeToVisibleSamples.Num()));
+	SET_FLOAT_STAT(STAT_MkGpuScatteringTimeToVisibleP95, Sorted[FMath::Max(P95Index, 0)]);
+#endif
+}
+
+const TCHAR* FMkGpuScatteringTrace::GetStageName(EMkScatteringJobStage Stage)
+{
+	static const TCHAR* Names[(int32)EMkScatteringJobStage::Num] = { TEXT("queued"), TEXT("dispatched"), TEXT("cache_hit"), TEXT("readback_ready"), TEXT("transform_built"), TEXT("applied") };
+	return Stage < EMkScatteringJobStage::Num ? Names[(int32)Stage] : TEXT("unknown");
+}
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,193 @@
+#include "Types/MkGpuScatteringBuilderTypes.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "HAL/LowLevelMemTracker.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+
+LLM_DEFINE_TAG(MkGpuScatteringFoliageCache);
+
+
+MK_OPTIMIZATION_OFF
+
+//~ FMkCachedLandscapeFoliage
+TWeakObjectPtr<UInstancedStaticMeshComponent> FMkCachedLandscapeFoliage::FGrassComp::GetFoliage() const
+{
+	if (MergedRangeHandle)
+	{
+		return MergedFoliage;
+	}
+	return Foliage;
+}
+
+uint64 FMkCachedLandscapeFoliage::PackKey(const FGrassCompKey& Key, int32 InstanceCapSlot)
+{
+	MK_ENSURE_DEBUG(Key.ComponentId > 0 && Key.ComponentId < (1u << 24));
+	MK_ENSURE_DEBUG(Key.SqrtSubsections >= 1 && Key.SqrtSubsections <= 16);
+	MK_ENSURE_DEBUG(Key.VarietyIndex >= 0 && Key.VarietyIndex < 1024 && Key.NumVarieties < 1024);
+
+	return uint64(Key.ComponentId & 0xffffff)
+		| (uint64(Key.SubsectionX & 0xf) << 24)
+		| (uint64(Key.SubsectionY & 0xf) << 28)
+		| (uint64((Key.SqrtSubsections - 1) & 0xf) << 32)
+		| (uint64(Key.VarietyIndex & 0x3ff) << 36)
+		| (uint64(Key.NumVarieties & 0x3ff) << 46)
+		| (uint64(InstanceCapSlot & 0xff) << 56);
+}
+
+int32 FMkCachedLandscapeFoliage::FindSlot(uint64 PackedKey) const
+{
+	if (Slots.IsEmpty())
+	{
+		return INDEX_NONE;
+	}
+
+	const uint32 Mask = Slots.Num() - 1;
+	for (uint32 SlotIndex = HashKey(PackedKey) & Mask; ; SlotIndex = (SlotIndex + 1) & Mask)
+	{
+		const FSlot& Slot = Slots[SlotIndex];
+		if (Slot.Key == PackedKey)
+		{
+			return SlotIndex;
+		}
+		if (Slot.Key == 0)
+		{
+			return INDEX_NONE;
+		}
+	}
+}
+
+void FMkCachedLandscapeFoliage::InsertSlot(uint64 PackedKey, int32 ItemIndex)
+{
+	const uint32 Mask = Slots.Num() - 1;
+	uint32 SlotIndex = HashKey(PackedKey) & Mask;
+	while (Slots[SlotIndex].Key != 0)
+	{
+		SlotIndex = (SlotIndex + 1) & Mask;
+	}
+	Slots[SlotIndex].Key = PackedKey;
+	Slots[SlotIndex].ItemIndex = ItemIndex;
+}
+
+void FMkCachedLandscapeFoliage::RemoveSlot(int32 SlotIndex)
+{
+	// Backward shift deletion, no tombstones so probe lengths do not grow with churn
+	const uint32 Mask = Slots.Num() - 1;
+	uint32 Hole = SlotIndex;
+	for (uint32 Next = (Hole + 1) & Mask; Slots[Next].Key != 0; Next = (Next + 1) & Mask)
+	{
+		const uint32 Ideal = HashKey(Slots[Next].Key) & Mask;
+		// the entry may move back only if the hole is not before its ideal slot
+		if (((Next - Ideal) & Mask) >= ((Next - Hole) & Mask))
+		{
+			Slots[Hole] = Slots[Next];
+			Hole = Next;
+		}
+	}
+	Slots[Hole] = FSlot();
+}
+
+void FMkCachedLandscapeFoliage::Rehash(int32 NewNumSlots)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringFoliageCache);
+
+	Slots.Reset();
+	Slots.SetNum(NewNumSlots);
+	for (int32 ItemIndex = 0; ItemIndex < PackedKeys.Num(); ++ItemIndex)
+	{
+		InsertSlot(PackedKeys[ItemIndex], ItemIndex);
+	}
+}
+
+int32 FMkCachedLandscapeFoliage::Find(const FGrassCompKey& Key) const
+{
+	const int32 InstanceCapSlot = FindInstanceCapSlot(Key.CachedMaxInstancesPerComponent);
+	if (InstanceCapSlot == INDEX_NONE)
+	{
+		return INDEX_NONE;
+	}
+
+	const int32 SlotIndex = FindSlot(PackKey(Key, InstanceCapSlot));
+	return SlotIndex != INDEX_NONE ? Slots[SlotIndex].ItemIndex : INDEX_NONE;
+}
+
+int32 FMkCachedLandscapeFoliage::Add(FGrassComp&& Comp, const FGrassCompState& State)
+{
+	LLM_SCOPE_BYTAG(MkGpuScatteringFoliageCache);
+
+	int32 InstanceCapSlot = FindInstanceCapSlot(Comp.Key.CachedMaxInstancesPerComponent);
+	if (InstanceCapSlot == INDEX_NONE)
+	{
+		// the cap only changes with MkGpuScattering.MaxInstancesPerComponent, a handful of values per session
+		MK_ENSURE_DEBUG(InstanceCaps.Num() < 256);
+		InstanceCapSlot = InstanceCaps.Add(Comp.Key.CachedMaxInstancesPerComponent);
+	}
+
+	const uint64 PackedKey = PackKey(Comp.Key, InstanceCapSlot);
+	const int32 ExistingSlot = FindSlot(PackedKey);
+	if (ExistingSlot != INDEX_NONE)
+	{
+		const int32 ItemIndex = Slots[ExistingSlot].ItemIndex;
+		Comps[ItemIndex] = MoveTemp(Comp);
+		States[ItemIndex] = State;
+		return ItemIndex;
+	}
+
+	if ((PackedKeys.Num() + 1) * 2 > Slots.Num())
+	{
+		Rehash(FMath::Max(64, Slots.Num() * 2));
+	}
+
+	const int32 ItemIndex = PackedKeys.Add(PackedKey);
+	States.Add(State);
+	Comps.Add(MoveTemp(Comp));
+	InsertSlot(PackedKey, ItemIndex);
+
+	return ItemIndex;
+}
+
+void FMkCachedLandscapeFoliage::RemoveAt(int32 Index)
+{
+	const int32 SlotIndex = FindSlot(PackedKeys[Index]);
+	check(SlotIndex != INDEX_NONE);
+	RemoveSlot(SlotIndex);
+
+	const int32 LastIndex = PackedKeys.Num() - 1;
+	if (Index != LastIndex)
+	{
+		const int32 MovedSlotIndex = FindSlot(PackedKeys[LastIndex]);
+		check(MovedSlotIndex != INDEX_NONE);
+		Slots[MovedSlotIndex].ItemIndex = Index;
+	}
+
+	PackedKeys.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+	States.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+	Comps.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+}
+
+void FMkCachedLandscapeFoliage::MarkComponentRemoved(uint32 ComponentId)
+{
+	for (int32 Index = 0; Index < PackedKeys.Num(); ++Index)
+	{
+		if ((PackedKeys[Index] & 0xffffff) == ComponentId)
+		{
+			States[Index].bComponentRemoved = true;
+		}
+	}
+}
+
+void FMkCachedLandscapeFoliage::ClearCache()
+{
+	for (FGrassComp& Comp : Comps)
+	{
+		Comp.BuilderOutput = nullptr;
+	}
+
+	Slots.Empty();
+	PackedKeys.Empty();
+	States.Empty();
+	Comps.Empty();
+	InstanceCaps.Reset();
+}
+//~ end of FMkCachedLandscapeFoliage
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,203 @@
+#include "Types/MkGpuScatteringBuilderTypes.h"
+#include "MkGpuScatteringGlobal.h"
+
+#include "LandscapeComponent.h"
+#include "UObject/Package.h"
+#include "UObject/StrongObjectPtr.h"
+#include "HAL/IConsoleManager.h"
+
+#if !UE_BUILD_SHIPPING
+
+// Not wrapped in MK_OPTIMIZATION_OFF, the numbers are meaningless without optimizations.
+namespace MkFoliageCacheBenchmark
+{
+	// The TSet based cache FMkCachedLandscapeFoliage used before, kept here only as the baseline.
+	struct FLegacyGrassComp
+	{
+		FMkCachedLandscapeFoliage::FGrassCompKey Key;
+		FMkGpuScatteringBuilderOutput* BuilderOutput = nullptr;
+		void* CachedBuffers = nullptr;
+		TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> Foliage;
+		TArray<FBox> ExcludedBoxes;
+		uint32 LastUsedFrameNumber = 0;
+		uint32 ExclusionChangeTag = 0;
+		uint32 LastTouchedBuild = 0;
+		double LastUsedTime = 0.0;
+		bool Pending = false;
+		bool PendingRemovalRebuild = false;
+	};
+
+	struct FLegacyKeyFuncs : BaseKeyFuncs<FLegacyGrassComp, FMkCachedLandscapeFoliage::FGrassCompKey>
+	{
+		static KeyInitType GetSetKey(const FLegacyGrassComp& Element)
+		{
+			return Element.Key;
+		}
+
+		static bool Matches(KeyInitType A, KeyInitType B)
+		{
+			return A.SqrtSubsections == B.SqrtSubsections
+				&& A.CachedMaxInstancesPerComponent == B.CachedMaxInstancesPerComponent
+				&& A.SubsectionX == B.SubsectionX
+				&& A.SubsectionY == B.SubsectionY
+				&& A.BasedOn == B.BasedOn
+				&& A.NumVarieties == B.NumVarieties
+				&& A.VarietyIndex == B.VarietyIndex;
+		}
+
+		static uint32 GetKeyHash(KeyInitType Key)
+		{
+			return GetTypeHash(Key.BasedOn) ^ Key.SqrtSubsections ^ Key.CachedMaxInstancesPerComponent ^ (Key.SubsectionX << 16) ^ (Key.SubsectionY << 24) ^ (Key.NumVarieties << 3) ^ (Key.VarietyIndex << 13);
+		}
+	};
+
+	static void Run(const TArray<FString>& Args)
+	{
+		const int32 NumEntries = Args.Num() > 0 ? FMath::Max(1, FCString::Atoi(*Args[0])) : 50000;
+		const int32 NumLookupPasses = 10;
+
+		// 4x4 subsections and 8 varieties per component, close to a dense grass setup
+		const int32 SqrtSubsections = 4;
+		const int32 NumVarieties = 8;
+		const int32 EntriesPerComponent = SqrtSubsections * SqrtSubsections * NumVarieties;
+		const int32 NumComponents = FMath::DivideAndRoundUp(NumEntries, EntriesPerComponent);
+
+		// Real components so the legacy hash sees real weak pointer hashes
+		TArray<TStrongObjectPtr<ULandscapeComponent>> Components;
+		for (int32 Index = 0; Index < NumComponents; ++Index)
+		{
+			Components.Emplace(NewObject<ULandscapeComponent>(GetTransientPackage(), NAME_None, RF_Transient));
+		}
+
+		TArray<FMkCachedLandscapeFoliage::FGrassCompKey> Keys;
+		Keys.Reserve(NumEntries);
+		for (int32 Index = 0; Index < NumEntries; ++Index)
+		{
+			const int32 ComponentIndex = Index / EntriesPerComponent;
+			const int32 Local = Index % EntriesPerComponent;
+
+			FMkCachedLandscapeFoliage::FGrassCompKey& Key = Keys.AddDefaulted_GetRef();
+			Key.BasedOn = Components[ComponentIndex].Get();
+			Key.ComponentId = ComponentIndex + 1;
+			Key.SqrtSubsections = SqrtSubsections;
+			Key.CachedMaxInstancesPerComponent = 65536;
+			Key.SubsectionX = (Local / NumVarieties) / SqrtSubsections;
+			Key.SubsectionY = (Local / NumVarieties) % SqrtSubsections;
+			Key.NumVarieties = NumVarieties;
+			Key.VarietyIndex = Local % NumVarieties;
+		}
+
+		TArray<FMkCachedLandscapeFoliage::FGrassCompKey> MissKeys = Keys;
+		for (FMkCachedLandscapeFoliage::FGrassCompKey& Key : MissKeys)
+		{
+			Key.VarietyIndex += NumVarieties;
+		}
+
+		double LegacyInsert, LegacyLookup, LegacyEvict;
+		double FlatInsert, FlatLookup, FlatEvict;
+		int32 LegacyFound = 0, FlatFound = 0;
+
+		//~ legacy
+		{
+			TSet<FLegacyGrassComp, FLegacyKeyFuncs> Set;
+
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 Index = 0; Index < NumEntries; ++Index)
+			{
+				FLegacyGrassComp Comp;
+				Comp.Key = Keys[Index];
+				Comp.LastUsedFrameNumber = Index & 1;
+				Set.Add(MoveTemp(Comp));
+			}
+			LegacyInsert = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			for (int32 Pass = 0; Pass < NumLookupPasses; ++Pass)
+			{
+				for (int32 Index = 0; Index < NumEntries; ++Index)
+				{
+					LegacyFound += Set.Find(Keys[Index]) ? 1 : 0;
+					LegacyFound += Set.Find(MissKeys[Index]) ? 1 : 0;
+				}
+			}
+			LegacyLookup = FPlatformTime::Seconds() - StartTime;
+
+			// same checks the trim pass used to do, minus the foliage pointer which is null here
+			StartTime = FPlatformTime::Seconds();
+			for (TSet<FLegacyGrassComp, FLegacyKeyFuncs>::TIterator Iter(Set); Iter; ++Iter)
+			{
+				const FLegacyGrassComp& Comp = *Iter;
+				const bool bOld = !Comp.Pending && (!Comp.Key.BasedOn.Get() || Comp.LastUsedFrameNumber == 0);
+				if (bOld)
+				{
+					Iter.RemoveCurrent();
+				}
+			}
+			LegacyEvict = FPlatformTime::Seconds() - StartTime;
+		}
+
+		//~ flat
+		{
+			FMkCachedLandscapeFoliage Cache;
+
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 Index = 0; Index < NumEntries; ++Index)
+			{
+				FMkCachedLandscapeFoliage::FGrassComp Comp;
+				Comp.Key = Keys[Index];
+				FMkCachedLandscapeFoliage::FGrassCompState State;
+				State.LastUsedFrameNumber = Index & 1;
+				State.bPending = false;
+				Cache.Add(MoveTemp(Comp), State);
+			}
+			FlatInsert = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			for (int32 Pass = 0; Pass < NumLookupPasses; ++Pass)
+			{
+				for (int32 Index = 0; Index < NumEntries; ++Index)
+				{
+					FlatFound += Cache.Find(Keys[Index]) != INDEX_NONE ? 1 : 0;
+					FlatFound += Cache.Find(MissKeys[Index]) != INDEX_NONE ? 1 : 0;
+				}
+			}
+			FlatLookup = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			for (int32 Index = Cache.Num() - 1; Index >= 0; --Index)
+			{
+				const FMkCachedLandscapeFoliage::FGrassCompState& State = Cache.GetState(Index);
+				if (!State.bPending && (State.bComponentRemoved || State.LastUsedFrameNumber == 0))
+				{
+					Cache.RemoveAt(Index);
+				}
+			}
+			FlatEvict = FPlatformTime::Seconds() - StartTime;
+
+			Cache.ClearCache();
+		}
+
+		for (TStrongObjectPtr<ULandscapeComponent>& Component : Components)
+		{
+			Component->MarkAsGarbage();
+		}
+
+		const int32 NumLookups = NumEntries * NumLookupPasses * 2;
+		UE_LOG(LogTemp, Log, TEXT("[MkGpuScattering] Foliage cache benchmark, %d entries (%d components), %d lookups (half misses)"), NumEntries, NumComponents, NumLookups);
+		UE_LOG(LogTemp, Log, TEXT("  %-8s %12s %12s %12s"), TEXT(""), TEXT("insert ms"), TEXT("lookup ms"), TEXT("evict ms"));
+		UE_LOG(LogTemp, Log, TEXT("  %-8s %12.3f %12.3f %12.3f"), TEXT("TSet"), LegacyInsert * 1000.0, LegacyLookup * 1000.0, LegacyEvict * 1000.0);
+		UE_LOG(LogTemp, Log, TEXT("  %-8s %12.3f %12.3f %12.3f"), TEXT("Flat"), FlatInsert * 1000.0, FlatLookup * 1000.0, FlatEvict * 1000.0);
+		if (LegacyFound != FlatFound)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("  lookup results differ, TSet %d, Flat %d"), LegacyFound, FlatFound);
+		}
+	}
+}
+
+static FAutoConsoleCommand MkBenchmarkFoliageCacheCmd(
+	TEXT("MkGpuScattering.BenchmarkFoliageCache"),
+	TEXT("Compares insert, lookup and eviction of the foliage cache against the former TSet. Optional arg : number of entries (50000)."),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&MkFoliageCacheBenchmark::Run)
+);
+
+#endif
@@ -40,6 +40,8 @@ FMkGrassVariety::FMkGrassVariety()
 	, RotationAxis(0.0f, 1.0f, 0.0f)
 	, bCheckCloseLandscape(false)
 	, bUseLandscapeLightmap(false)
+	, bCompactResults(false)
+	, bMergeComponents(false)
 	, bReceivesDecals(true)
 	, bAffectDistanceFieldLighting(false)
 	, bCastDynamicShadow(true)
@@ -64,6 +66,11 @@ bool FMkGrassVariety::IsGrassQualityLevelEnable() const
 	return (GEngine && GEngine->UseGrassVarityPerQualityLevels);
 }
 
+bool FMkGrassVariety::UsesMergedComponent() const
+{
+	return bMergeComponents && CollisionProfileName == UCollisionProfile::NoCollision_ProfileName;
+}
+
 int32 FMkGrassVariety::GetStartCullDistance() const
 {
 	if (IsGrassQualityLevelEnable())
@@ -105,6 +112,8 @@ void UMkGpuScatteringTypes::PostEditChangeProperty(struct FPropertyChangedEvent&
 {
 	Super::PostEditChangeProperty(PropertyChangedEvent);
 
+	++ChangeTag;
+
 	/*if (bGenerate)
 	{
 
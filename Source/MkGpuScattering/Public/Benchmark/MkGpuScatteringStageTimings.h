@@ -0,0 +1,85 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MkGpuScatteringGlobal.h"
+
+
+// Pipeline stages measured by FMkGpuScatteringStageTimings
+enum class EMkScatteringStage : uint8
+{
+	// UMkGpuScatteringBuilder::Build, gathering the jobs
+	Build,
+	// Scheduler issue, the batch flush and the render thread dispatch
+	Dispatch,
+	// Until the results are on the CPU : readback polling and copies, or the scatter of the CPU engine
+	Readback,
+	// Transform builds, the cluster tree included
+	TransformBuild,
+	ClusterTree,
+	// UMkGpuScatteringBuilder::WaitAndApplyResults
+	Apply,
+	Num
+};
+
+// Per frame ms of every stage in stat MkGpuScattering, fed by MK_SCATTERING_STAGE_SCOPE
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Build"), STAT_MkGpuScatteringStage_Build, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Dispatch"), STAT_MkGpuScatteringStage_Dispatch, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Readback"), STAT_MkGpuScatteringStage_Readback, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Transform Build"), STAT_MkGpuScatteringStage_TransformBuild, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Cluster Tree"), STAT_MkGpuScatteringStage_ClusterTree, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Stage Apply"), STAT_MkGpuScatteringStage_Apply, STATGROUP_MkGpuScattering, MKGPUSCATTERING_API);
+
+/**
+ * Wall time per pipeline stage, summed over every thread, for the MkGpuScatteringBenchmark commandlet.
+ * Off by default, a disabled scope costs one relaxed load. Compiled out of shipping builds.
+ */
+struct MKGPUSCATTERING_API FMkGpuScatteringStageTimings
+{
+	struct FSnapshot
+	{
+		uint64 Cycles[(int32)EMkScatteringStage::Num] = {};
+		uint32 Calls[(int32)EMkScatteringStage::Num] = {};
+
+		double GetMilliseconds(EMkScatteringStage Stage) const { return FPlatformTime::ToMilliseconds64(Cycles[(int32)Stage]); }
+	};
+
+	static const TCHAR* GetStageName(EMkScatteringStage Stage);
+
+#if !UE_BUILD_SHIPPING
+	static void SetEnabled(bool bInEnabled);
+	static bool IsEnabled();
+	static void Add(EMkScatteringStage Stage, uint64 Cycles);
+
+	// Totals since the last Reset
+	static FSnapshot GetSnapshot();
+	static void Reset();
+#endif
+};
+
+#if !UE_BUILD_SHIPPING
+struct FMkScopedStageTimer
+{
+	explicit FMkScopedStageTimer(EMkScatteringStage InStage)
+		: Stage(InStage)
+		, StartCycles(FMkGpuScatteringStageTimings::IsEnabled() ? FPlatformTime::Cycles64() : 0)
+	{
+	}
+
+	~FMkScopedStageTimer()
+	{
+		if (StartCycles)
+		{
+			FMkGpuScatteringStageTimings::Add(Stage, FPlatformTime::Cycles64() - StartCycles);
+		}
+	}
+
+	EMkScatteringStage Stage;
+	uint64 StartCycles;
+};
+
+#define MK_SCATTERING_STAGE_SCOPE(Stage) \
+	SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringStage_##Stage); \
+	FMkScopedStageTimer ANONYMOUS_VARIABLE(MkStageTimer)(EMkScatteringStage::Stage)
+#else
+#define MK_SCATTERING_STAGE_SCOPE(Stage) SCOPE_CYCLE_COUNTER(STAT_MkGpuScatteringStage_##Stage)
+#endif
@@ -5,8 +5,11 @@
 #include "CoreMinimal.h"
 #include "Components/ActorComponent.h"
 #include "RHIGPUReadback.h"
+#include "Containers/Queue.h"
 #include "LandscapeGrassType.h"
 #include "Types/MkGpuScatteringBuilderTypes.h" // FMkCachedLandscapeFoliage
+#include "Builder/MkGpuScatteringComponentIndex.h"
+#include "Builder/MkGpuScatteringLayoutTable.h"
 #include "Shaders/MkGpuScatteringShaders.h"
 #include "MkGpuScatteringBuilder.generated.h"
 
@@ -15,8 +18,14 @@ class ALandscapeProxy;
 class FRDGPooledBuffer;
 class ULandscapeComponent;
 class UHierarchicalInstancedStaticMeshComponent;
+class UInstancedStaticMeshComponent;
 class UMkGpuScatteringTypes;
+class UMkGpuScatteringScheduler;
+class UBodySetup;
+class UStaticMesh;
+class UMaterialInterface;
 
+struct FMkGpuScatteringJob;
 struct FMkGpuScatteringTransformBuilder;
 
 
@@ -40,20 +49,37 @@ public:
 protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
+	// Streaming proxies unregister their builder with jobs still in flight
+	virtual void OnUnregister() override;
+
+public:
+	//~ UObject
+	virtual void BeginDestroy() override;
+	virtual bool IsReadyForFinishDestroy() override;
+	virtual void FinishDestroy() override;
+	//~ end of UObject
 
 public:
 	UFUNCTION() void SetScatteringTypes(const TArray<UMkGpuScatteringTypes*>& InScatteringTypes);
-	UFUNCTION() void SetLandscapeProxy(ALandscapeProxy* InLandscapeProxy) { LandscapeProxy = InLandscapeProxy; }
+	UFUNCTION() void SetLandscapeProxy(ALandscapeProxy* InLandscapeProxy) { LandscapeProxy = InLandscapeProxy; ComponentIndex.MarkDirty(); LayoutTable.Reset(); bForceFullBuild = true; }
 	UFUNCTION() const ALandscapeProxy* GetLandscapeProxy() { return LandscapeProxy; }
 	UFUNCTION() UHierarchicalInstancedStaticMeshComponent* CreateHISMC(AActor* Owner, const FMkGrassVariety& GrassVariety, int32 InstancingRandomSeed);
 
 
 	UFUNCTION() void FlushCache();
 
-	UFUNCTION() void Build(const TArray<FVector>& Cameras, int32& InOutNumCompsCreated, UMkGpuScatteringReadbackManager* ReadbackManager);
+	UFUNCTION() void Build(const TArray<FVector>& Cameras, UMkGpuScatteringScheduler* Scheduler);
 	UFUNCTION() void WaitAndApplyResults();
 
-	UFUNCTION() void UpdateTick(const TArray<FVector>& Cameras, float DeltaTime, int32& InOutNumComponentsCreated, UMkGpuScatteringReadbackManager* ReadbackManager);
+	UFUNCTION() void UpdateTick(const TArray<FVector>& Cameras, float DeltaTime, UMkGpuScatteringScheduler* Scheduler);
+
+	// Creates the foliage component of a job gathered by Build and dispatches it. Returns true if the job is in flight.
+	bool IssueJob(const FMkGpuScatteringJob& Job, UMkGpuScatteringReadbackManager* ReadbackManager);
+	// Game thread, once per frame after the scheduler issued the jobs. Publishes the IssueJob LLM bytes per job.
+	static void EndFrameIssueJobStats();
+
+	// Cache items waiting for their results, updated by WaitAndApplyResults
+	FORCEINLINE int32 GetNumPendingJobs() const { return NumPendingComps; }
 
 	FORCEINLINE int32 GetGrassUpdateInterval() const
 	{
@@ -74,7 +100,41 @@ public:
 		return true;
 	}
 
-	void OnDelegateCompueteFinish(const FMkGpuScatteringBuilderOutput& Output);
+	// Game thread. The render thread and the workers go through MakeHandle, see FMkGpuScatteringBuilderHandle::Deliver.
+	void OnDelegateCompueteFinish(FMkGpuScatteringBuilderOutput&& Output);
+	// What the jobs of this builder keep once they leave the game thread
+	FMkGpuScatteringBuilderHandle MakeHandle();
+
+	// Bake support, see the MkGpuScatteringBake commandlet. While set, every job goes to the GPU and its results are
+	// added to InBakeCapture by placement key instead of becoming instances.
+	void SetBakeCapture(TMap<uint64, TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>>* InBakeCapture) { BakeCapture = InBakeCapture; }
+
+	// Bucket of the component pool : what can't change on a registered component without recreating its render or physics state
+	struct FComponentPoolKey
+	{
+		const UStaticMesh* Mesh = nullptr;
+		TArray<TObjectPtr<UMaterialInterface>> OverrideMaterials;
+		FName CollisionProfileName;
+		bool bGrassComponent = false;
+		bool bCastShadow = false;
+		bool bCastDynamicShadow = false;
+		bool bCastContactShadow = false;
+
+		bool operator==(const FComponentPoolKey& Other) const
+		{
+			return Mesh == Other.Mesh && OverrideMaterials == Other.OverrideMaterials && CollisionProfileName == Other.CollisionProfileName
+				&& bGrassComponent == Other.bGrassComponent && bCastShadow == Other.bCastShadow && bCastDynamicShadow == Other.bCastDynamicShadow && bCastContactShadow == Other.bCastContactShadow;
+		}
+		friend uint32 GetTypeHash(const FComponentPoolKey& Key)
+		{
+			uint32 Hash = HashCombineFast(PointerHash(Key.Mesh), GetTypeHash(Key.CollisionProfileName));
+			for (const TObjectPtr<UMaterialInterface>& Material : Key.OverrideMaterials)
+			{
+				Hash = HashCombineFast(Hash, GetTypeHash(Material));
+			}
+			return HashCombineFast(Hash, (uint32)Key.bGrassComponent | ((uint32)Key.bCastShadow << 1) | ((uint32)Key.bCastDynamicShadow << 2) | ((uint32)Key.bCastContactShadow << 3));
+		}
+	};
 
 public:
 	/** Frame offset for tick interval*/
@@ -84,13 +144,114 @@ protected:
 	static int32 GrassUpdateInterval;
 
 private:
+	bool CanSkipBuild(const TArray<FVector>& Cameras, float SmallestGuardBand) const;
+	// Results baked into the landscape proxy for this job, see UMkGpuScatteringBakedData
+	bool FindBakedResults(const FMkGpuScatteringCS_Param& Param, TArrayView<const MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>& OutResults) const;
+	void UpdateLayoutTable();
+
+	//~ Transform builds
+	// Turns the queued readback results into transform builders
+	void ConsumeCompletedOutputs();
+	// Starts the builders that are not running yet, within MkGpuScattering.MaxConcurrentTransformTasks
+	void LaunchTransformBuilds();
+	void WaitForTransformBuilds();
+	// Frees the transform builders whose task is not running, all of them if bWait
+	void ReleaseTransformBuilds(bool bWait);
+	// Instance bodies of the applied collision builds, in batches within MkGpuScattering.MaxApplyTimeMs
+	void CreatePendingInstanceBodies();
+	//~ end of Transform builds
+
+	//~ Component pool, see MkGpuScattering.ComponentPoolSize
+	UHierarchicalInstancedStaticMeshComponent* AcquirePooledHISMC(const FComponentPoolKey& Key);
+	// Empties and hides HISMC for a later CreateHISMC, false when the pool is full
+	bool ReleaseHISMC(UHierarchicalInstancedStaticMeshComponent* HISMC);
+	//~ end of Component pool
+
 	UPROPERTY(Transient) bool bPendingFlushCache = false;
 	UPROPERTY(Transient) TArray<TObjectPtr<UMkGpuScatteringTypes>> ScatteringTypes;
 	UPROPERTY(transient, duplicatetransient) TArray<TObjectPtr<UHierarchicalInstancedStaticMeshComponent>> FoliageComponents;
 
 	ALandscapeProxy* LandscapeProxy = nullptr;
-	FMkAsyncBuilderInterface* AsyncBuilderInterface = nullptr;
 
 	FMkCachedLandscapeFoliage FoliageCache;
+	FMkLandscapeComponentIndex ComponentIndex;
+	FMkGpuScatteringLayoutTable LayoutTable;
+	// Foliage of evicted cache items, destroyed within MkGpuScattering.MaxApplyTimeMs
+	TArray<TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent>> PendingDestroyFoliage;
+	// Hidden, empty and still registered. FoliageComponents keeps them alive.
+	TMap<FComponentPoolKey, TArray<TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent>>> ComponentPool;
+	int32 NumPooledComponents = 0;
+
+	//~ Incremental build
+	TArray<FVector> LastBuildCameras;
+	uint32 BuildEpoch = 0;
+	int32 NumPendingComps = 0;
+	int32 NumPendingAtLastBuild = 0;
+	bool bForceFullBuild = true;
+	bool bSkippedBuildThisFrame = false;
+	//~ end of Incremental build
+
 	TArray<FMkGpuScatteringTransformBuilder*> TransformBuilders;
+	// Filled by the render thread and the workers through FMkGpuScatteringBuilderHandle, drained by WaitAndApplyResults
+	TSharedRef<FMkGpuScatteringCompletedOutputs, ESPMode::ThreadSafe> CompletedOutputs = MakeShared<FMkGpuScatteringCompletedOutputs, ESPMode::ThreadSafe>();
+
+	// Collision builds with their bodies created in batches. Kept once all bodies exist: the component has no
+	// PerInstanceSMData, so after RecreatePhysicsState only these transforms can make its bodies again.
+	struct FPendingInstanceBodies
+	{
+		TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC;
+		TWeakObjectPtr<UBodySetup> BodySetup;
+		// World transforms from the transform builder, in instance order
+		TArray<FTransform> Transforms;
+		int32 NextIndex = 0;
+	};
+	TArray<FPendingInstanceBodies> PendingInstanceBodies;
+
+	//~ Merged components, see FMkGrassVariety::bMergeComponents
+	// One per variety, FMkCachedLandscapeFoliage::FGrassComp::MergedRangeHandle tags the instances of each cache item
+	struct FMergedFoliage
+	{
+		// See FMkGpuScatteringLayoutTable::FVarietyLayout::MergedKey
+		uint32 MergedKey = 0;
+		TWeakObjectPtr<UInstancedStaticMeshComponent> Component;
+		// Range handle of every instance, in component order. Kept in step with the swap removal of the component.
+		TArray<uint32> InstanceOwners;
+	};
+	TArray<FMergedFoliage> MergedFoliage;
+	UPROPERTY(Transient) TArray<TObjectPtr<UInstancedStaticMeshComponent>> MergedComponents;
+	struct FPendingRangeRemoval
+	{
+		TWeakObjectPtr<UInstancedStaticMeshComponent> Component;
+		uint32 RangeHandle = 0;
+	};
+	// Ranges of evicted merged cache items, removed within MkGpuScattering.MaxApplyTimeMs
+	TArray<FPendingRangeRemoval> PendingRangeRemovals;
+	uint32 NextMergedRangeHandle = 0;
+
+	UInstancedStaticMeshComponent* FindOrCreateMergedComponent(AActor* Owner, const FMkGrassVariety& GrassVariety, uint32 MergedKey);
+	FMergedFoliage* FindMergedFoliage(const UInstancedStaticMeshComponent* Component);
+	// Removes the instances tagged with RangeHandle, returns how many
+	int32 RemoveMergedRange(UInstancedStaticMeshComponent* Component, uint32 RangeHandle);
+	//~ end of Merged components
+
+	//~ Tracing, see FMkGpuScatteringTrace
+	struct FQueuedJobTime
+	{
+		uint64 Cycles = 0;
+		// Last full build that gathered the job, the others went out of range before they were issued
+		uint32 BuildEpoch = 0;
+	};
+	// Jobs gathered but not issued yet, by FMkGpuScatteringTrace::MakeJobId. Empty while not tracing.
+	TMap<uint64, FQueuedJobTime> QueuedJobTimes;
+	//~ end of Tracing
+
+	// Owned by the bake, see SetBakeCapture
+	TMap<uint64, TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>>* BakeCapture = nullptr;
+
+#if WITH_EDITOR
+	// Whether the baked data still matches the landscape, checked once per frame since sculpting changes it any time
+	mutable uint64 BakedSourceCheckFrame = 0;
+	mutable bool bBakedSourceMatches = false;
+	mutable bool bWarnedStaleBakedData = false;
+#endif
 };
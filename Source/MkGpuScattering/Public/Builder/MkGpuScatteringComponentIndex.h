@@ -0,0 +1,68 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+class ALandscapeProxy;
+class ULandscapeComponent;
+
+
+/**
+ * Uniform 2D grid over the cached world bounds of a landscape proxy's components.
+ * Rebuilt only when the proxy's component list (or its transform) changes, so the per-frame
+ * culling in UMkGpuScatteringBuilder::Build only visits the components around the cameras.
+ */
+struct FMkLandscapeComponentIndex
+{
+	struct FEntry
+	{
+		TWeakObjectPtr<ULandscapeComponent> Component;
+		// Stays the same across rebuilds as long as the component is part of the proxy, never 0
+		uint32 ComponentId = 0;
+		FTransform ComponentTransform;
+		FBox WorldBox;
+		// Crc of the lower case component name, seeds the foliage of the component
+		uint32 NameHash = 0;
+		uint32 QueryStamp = 0;
+	};
+
+	// Returns true if the component list of the proxy does not match the one the grid was built from.
+	bool NeedsRebuild(const ALandscapeProxy* LandscapeProxy) const;
+	// OutRemovedIds : ids of the components that were indexed before but are not part of the proxy anymore
+	void Rebuild(const ALandscapeProxy* LandscapeProxy, TArray<uint32>& OutRemovedIds);
+	void MarkDirty() { bDirty = true; }
+	// Also forgets the component ids
+	void Reset();
+
+	// Collects the indices of every entry whose cell range overlaps the square of Radius around any camera.
+	// Each entry is reported once even if several cameras touch it.
+	void Query(const TArray<FVector>& Cameras, double Radius, TArray<int32>& OutCandidates);
+
+	FORCEINLINE const FEntry& GetEntry(int32 Index) const { return Entries[Index]; }
+	FORCEINLINE int32 Num() const { return Entries.Num(); }
+
+private:
+	void ResetGrid();
+	FORCEINLINE int32 GetCellIndex(int32 X, int32 Y) const { return Y * GridSize.X + X; }
+	FIntPoint GetCellCoord(const FVector2D& Location) const;
+
+	TArray<FEntry> Entries;
+
+	// CSR layout : entries of cell N are CellEntries[CellStart[N] .. CellStart[N + 1])
+	TArray<int32> CellStart;
+	TArray<int32> CellEntries;
+
+	FVector2D GridOrigin = FVector2D::ZeroVector;
+	double CellSize = 1.0;
+	FIntPoint GridSize = FIntPoint::ZeroValue;
+
+	uint32 CurrentStamp = 0;
+
+	TMap<TWeakObjectPtr<ULandscapeComponent>, uint32> ComponentIds;
+	uint32 NextComponentId = 1;
+
+	//~ Signature of the source the grid was built from
+	int32 SourceNum = INDEX_NONE;
+	const void* SourceData = nullptr;
+	FTransform SourceTransform;
+	bool bDirty = true;
+};
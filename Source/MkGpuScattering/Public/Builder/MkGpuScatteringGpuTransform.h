@@ -0,0 +1,64 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Types/MkGpuScatteringBuilderTypes.h" // FLocationNormalScaleZ, FInstanceTransform
+
+struct FMkGrassVariety;
+
+
+/**
+ * C++ reference of Transform_CS (GPUScatteringTransform_CS.usf), the optional GPU stage that turns the scattering
+ * results into final instance transforms.
+ * Scale and ZOffset come from the FRandomStream seeded by the instance position, like the CPU path. Rotation and
+ * RandomFraction are drawn in instance order on the CPU, so they come from a hash of the position instead and every
+ * instance can be computed on its own. Keep both sides in sync, the MkGpuScattering.GpuTransform automation test
+ * checks this one against the CPU kernel and, with a renderer, against Transform_CS.
+ */
+namespace MkGpuScatteringGpuTransform
+{
+	// Mirrors the Transform_CS shader parameters
+	struct FParams
+	{
+		FMatrix44f XForm = FMatrix44f::Identity;
+		FVector3f RotationAxis = FVector3f::ZeroVector;
+		FVector3f DefaultScale = FVector3f::OneVector;
+		// (Min, Max)
+		FVector2f ScaleX = FVector2f::UnitVector;
+		FVector2f ScaleY = FVector2f::UnitVector;
+		FVector2f ScaleZ = FVector2f::UnitVector;
+		FVector2f ZOffset = FVector2f::ZeroVector;
+		// AlignMaxAngle truncated like AlignToNormal does, 0 : no limit
+		float AlignMaxPitch = 0.0f;
+		float VoronoiValidMax = 1.0f;
+		uint32 Scaling = 0;
+		uint32 Seed = 0;
+		bool bRandomScale = false;
+		bool bRandomRotation = false;
+		bool bAlignToSurface = false;
+		bool bUseVoronoiNoise = false;
+
+		static FParams Make(const FMkGrassVariety& GrassVariety, int32 InstancingRandomSeed, const FMatrix& XForm);
+	};
+
+	struct FDraws
+	{
+		FVector3f Scale;
+		float OffsetZ;
+		// Degrees, multiplied by RotationAxis
+		float Rotation;
+		float RandomFraction;
+	};
+
+	uint32 Hash(uint32 Value);
+	// Position rounded to cm, combined with the seed
+	uint32 GetInstanceKey(const FVector3f& Location, uint32 Seed);
+	// [0, 1). 24 bits, exact in float on both sides.
+	float GetRandom(uint32 Key, uint32 Index);
+	// FMkFoliagePlacementUtil::GetRandomSeedForPosition, rounded in float like Transform_CS
+	int32 GetRandomSeedForPosition(const FVector3f& Location);
+
+	FDraws Draw(const FParams& Params, const MkGpuScatteringBuilderTypes::FLocationNormalScaleZ& Result);
+
+	// Result has to be an accepted one, Scattering_CS only writes those
+	MkGpuScatteringBuilderTypes::FInstanceTransform ComputeInstance(const FParams& Params, const MkGpuScatteringBuilderTypes::FLocationNormalScaleZ& Result);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UMkGpuScatteringTypes;
+struct FMkGrassVariety;
+
+
+/**
+ * Per-variety subsection layout of a landscape proxy.
+ * Everything here only depends on the scattering types, the quality level, the density and distance cvars
+ * and the proxy scale, so it is computed once and reused by every component of the proxy.
+ */
+struct FMkGpuScatteringLayoutTable
+{
+	struct FVarietyLayout
+	{
+		const UMkGpuScatteringTypes* ScatteringType = nullptr;
+		const FMkGrassVariety* GrassVariety = nullptr;
+
+		int32 VarietyIndex = INDEX_NONE;
+		int32 NumVarieties = 0;
+
+		// Names the merged component of the variety, stable across loads: index in its types asset hashed with the asset path
+		uint32 MergedKey = 0;
+
+		int32 SqrtSubsections = 1;
+		int32 MaxInstancesSub = 0;
+
+		// Halton index of the first subsection, subsection (X, Y) starts at HaltonBaseIndex + (X * SqrtSubsections + Y) * MaxInstancesSub
+		uint32 HaltonBaseIndex = 0;
+
+		float DiscardDistance = 0.0f;
+
+		// Matched against the weightmap layer names when a job is issued
+		FString SpawnLayerName;
+
+		bool bUseHalton = false;
+		bool bCollision = false;
+
+		// Local XY boxes of the subsections, X major. Z comes from the component's cached local box.
+		TArray<FBox2D> LocalSubBoxes;
+
+		FORCEINLINE uint32 GetHaltonIndex(int32 SubX, int32 SubY) const
+		{
+			return bUseHalton ? HaltonBaseIndex + uint32(SubX * SqrtSubsections + SubY) * uint32(MaxInstancesSub) : 0;
+		}
+	};
+
+	// Inputs the table was built from
+	struct FSettings
+	{
+		FVector DrawScale = FVector::ZeroVector;
+		int32 ComponentSizeQuads = 0;
+		int32 QualityLevel = INDEX_NONE;
+		bool bUseQualityLevels = false;
+		float DensityScale = 0.0f;
+		float CullDistanceScale = 0.0f;
+		float GuardBandMultiplier = 0.0f;
+		float GuardBandDiscardMultiplier = 0.0f;
+		int32 MaxInstancesPerComponent = 0;
+		uint32 ScatteringTypesChangeTag = 0;
+
+		bool operator==(const FSettings& Other) const
+		{
+			return DrawScale == Other.DrawScale
+				&& ComponentSizeQuads == Other.ComponentSizeQuads
+				&& QualityLevel == Other.QualityLevel
+				&& bUseQualityLevels == Other.bUseQualityLevels
+				&& DensityScale == Other.DensityScale
+				&& CullDistanceScale == Other.CullDistanceScale
+				&& GuardBandMultiplier == Other.GuardBandMultiplier
+				&& GuardBandDiscardMultiplier == Other.GuardBandDiscardMultiplier
+				&& MaxInstancesPerComponent == Other.MaxInstancesPerComponent
+				&& ScatteringTypesChangeTag == Other.ScatteringTypesChangeTag;
+		}
+		bool operator!=(const FSettings& Other) const { return !(*this == Other); }
+	};
+
+	// Only varieties that can spawn anything are listed
+	TArray<FVarietyLayout> Varieties;
+
+	// Largest discard distance of all varieties, used to query the component index
+	float MaxDiscardDistance = 0.0f;
+	// Smallest (discard distance - cull distance), used to gate incremental builds
+	float SmallestGuardBand = 0.0f;
+
+	FSettings Settings;
+	bool bValid = false;
+
+	void Reset()
+	{
+		Varieties.Reset();
+		MaxDiscardDistance = 0.0f;
+		SmallestGuardBand = 0.0f;
+		bValid = false;
+	}
+};
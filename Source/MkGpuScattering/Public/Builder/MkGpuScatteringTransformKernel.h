@@ -0,0 +1,56 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+/**
+ * Instance transform math of FMkGpuScatteringTransformBuilder.
+ * The random values (scale, z offset, rotation) are drawn up front in instance order, the local rotation, scale and
+ * offset are then built from structure-of-arrays streams, 4 instances at a time in float. The composition with XForm
+ * stays in double, so large proxy offsets lose no precision, only the render instance is rounded to float. TransformScalar is the reference.
+ */
+namespace MkGpuScatteringTransformKernel
+{
+	constexpr int32 BatchSize = 4;
+
+	// Per-variety inputs
+	struct FParams
+	{
+		FVector RotationAxis = FVector::ZeroVector;
+		float AlignMaxAngle = 0.0f;
+		bool bAlignToSurface = false;
+		// Component-local to foliage space
+		FMatrix XForm = FMatrix::Identity;
+	};
+
+	// Per-instance inputs, component-local. Padded to a multiple of BatchSize so the batch loop never reads past the end.
+	struct FInstanceStreams
+	{
+		TArray<float> LocationX, LocationY, LocationZ;
+		TArray<float> NormalX, NormalY, NormalZ;
+		TArray<float> ScaleX, ScaleY, ScaleZ;
+		// ZOffset, scaled by ScaleZ along the instance up axis
+		TArray<float> OffsetZ;
+		// Degrees, multiplied by RotationAxis
+		TArray<float> Rotation;
+
+		void Reset(int32 ExpectedNum);
+		void Add(const FVector3f& Location, const FVector3f& Normal, const FVector3f& Scale, float InOffsetZ, float InRotation);
+		// Appends zeros up to the next multiple of BatchSize, Num() is unchanged
+		void Pad();
+
+		FORCEINLINE int32 Num() const { return NumInstances; }
+
+	private:
+		int32 NumInstances = 0;
+	};
+
+	// InstancedFoliage.h
+	FMatrix AlignToNormal(const FVector& InNormal, float AlignMaxAngle);
+
+	// Double precision, same operations as the per-instance loop Build used to run
+	FMatrix TransformScalar(const FParams& Params, const FInstanceStreams& Streams, int32 Index);
+
+	// Streams must be padded. OutTransforms.Num() >= Streams.Num().
+	void TransformBatch(const FParams& Params, const FInstanceStreams& Streams, TArrayView<FMatrix> OutTransforms);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/AssetUserData.h"
+#include "Types/MkGpuScatteringBuilderTypes.h" // FLocationNormalScaleZ
+#include "MkGpuScatteringBakedData.generated.h"
+
+class ALandscapeProxy;
+
+/**
+ * Scattering results baked by the MkGpuScatteringBake commandlet, stored on the root component of a landscape proxy
+ * so they are cooked and streamed with it. Keyed by FMkGpuScatteringCS_Param::MakePlacementKey, every quality level
+ * that was baked has its own entries. Jobs without an entry go through the GPU as usual.
+ * The editor ignores the data once the landscape was sculpted or painted since the bake.
+ */
+UCLASS()
+class MKGPUSCATTERING_API UMkGpuScatteringBakedData : public UAssetUserData
+{
+	GENERATED_BODY()
+
+public:
+	virtual void Serialize(FArchive& Ar) override;
+
+	// Results of Key, false if it was not baked
+	bool Find(uint64 Key, TArrayView<const MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>& OutResults) const;
+
+	// Replaces everything, used by the bake
+	void SetResults(TMap<uint64, TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>>&& InResults);
+
+	int32 GetNumEntries() const { return Keys.Num(); }
+	int32 GetNumResults() const { return Results.Num(); }
+
+#if WITH_EDITOR
+	// Hash of the Source ids of the proxy's heightmaps and weightmaps, changes with every landscape edit
+	static uint64 MakeSourceHash(const ALandscapeProxy* LandscapeProxy);
+
+	void SetSourceHash(uint64 InSourceHash) { SourceHash = InSourceHash; }
+	// False once the landscape was edited since the bake, or if it was baked without a hash
+	bool MatchesSource(const ALandscapeProxy* LandscapeProxy) const;
+#endif
+
+private:
+#if WITH_EDITORONLY_DATA
+	uint64 SourceHash = 0;
+#endif
+
+	// Sorted
+	TArray<uint64> Keys;
+	// Results of Keys[i] are [Offsets[i], Offsets[i + 1])
+	TArray<uint32> Offsets;
+	TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ> Results;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Types/MkGpuScatteringBuilderTypes.h" // FLocationNormalScaleZ, FMkGpuScatteringBuilderOutput
+
+
+
+/**
+ * Scattering results kept on disk between sessions, one file per (component, subsection, variety) job.
+ * The key hashes every input of Scattering_CS (landscape textures, job descriptor, density), so an edit anywhere
+ * simply misses and writes a new file. Files are memory mapped and read on a worker, a hit skips the GPU entirely.
+ * The least recently used files are deleted once the cache outgrows MkGpuScattering.DiskCacheMaxMB.
+ * See MkGpuScattering.DiskCache.
+ */
+struct MKGPUSCATTERING_API FMkGpuScatteringDiskCache
+{
+	static bool IsEnabled();
+
+	// Game thread. Lists the cache directory on a worker, once. Contains misses until it is done.
+	static void StartScan();
+
+	// Game thread. True if a file for Key was written by this or an earlier session.
+	static bool Contains(uint64 Key);
+
+	// Reads the results of Key on a worker and hands Output to the builder like a readback would, if the builder is still alive
+	static void LoadAsync(uint64 Key, const FMkGpuScatteringBuilderHandle& Builder, FMkGpuScatteringBuilderOutput&& Output);
+
+	// Any thread. Copies the results and writes them on a worker.
+	static void StoreAsync(uint64 Key, const TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>& Results);
+	// Same for varieties with bCompactResults, the file keeps the packed format
+	static void StoreAsync(uint64 Key, const TArray<MkGpuScatteringBuilderTypes::FPackedLocationNormalScaleZ>& Results);
+
+	// Game thread. Waits for the loads and stores still running.
+	static void WaitForTasks();
+
+	// Deletes every cache file
+	static void Clear();
+
+	static FString GetCacheDir();
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Types/MkGpuScatteringBuilderTypes.h" // FScatteringJobDesc, FLocationNormalScaleZ, FProgressInfo
+
+struct FMkGpuScatteringCS_Param;
+class ULandscapeComponent;
+class UTexture;
+
+
+// CPU copy of a landscape texture as Scattering_CS samples it, BGRA8 texels like the texture source.
+// Heightmaps keep the packed height in R (high byte) and G (low byte), weightmaps one layer per channel.
+struct FMkScatteringCpuTexture
+{
+	int32 SizeX = 0;
+	int32 SizeY = 0;
+	TArray<FColor> Texels;
+
+	// SF_Point, clamped
+	FORCEINLINE const FColor& SamplePoint(float U, float V) const
+	{
+		const int32 X = FMath::Clamp(FMath::FloorToInt32(U * SizeX), 0, SizeX - 1);
+		const int32 Y = FMath::Clamp(FMath::FloorToInt32(V * SizeY), 0, SizeY - 1);
+		return Texels[Y * SizeX + X];
+	}
+
+	// SF_Bilinear with clamped addressing, channels in [0, 1] in RGBA order like the shader sees them
+	FVector4f SampleBilinear(float U, float V) const;
+
+	// DecodePackedHeight, the local height of LandscapeDataAccess::GetLocalHeight
+	static FORCEINLINE float DecodeHeight(const FColor& Texel)
+	{
+		return ((float)(((uint32)Texel.R << 8) | Texel.G) - 32768.0f) * (1.0f / 128.0f);
+	}
+
+	int64 GetAllocatedSize() const { return Texels.GetAllocatedSize(); }
+};
+
+
+/**
+ * Scattering_CS on the CPU, for dedicated servers, NullRHI commandlets and RHIs without SM5.
+ * Same candidates, random sequence and rejection tests as the shader, rows are scattered in parallel and
+ * the bilinear heights and normals 4 candidates at a time. The results come out in candidate order instead of
+ * the GPU's append order, and the Voronoi hash uses the CPU sin, so they are close to the GPU ones but not bit exact.
+ *
+ * The landscape textures are copied from their source in the editor. Cooked builds have no texture source,
+ * heights are then read from the collision heightfield and weightmap jobs finish empty.
+ * See MkGpuScattering.Backend.
+ */
+struct MKGPUSCATTERING_API FMkGpuScatteringCpuEngine
+{
+	// True when FMkAsyncBuilderInterface sends the jobs here instead of Scattering_CS
+	static bool IsActive();
+
+	// Game thread. Copies the textures the job reads (cached) and scatters on a worker.
+	// The output reaches the builder like a readback would, JobBytes is released from the arena budget then.
+	static void Dispatch(FMkGpuScatteringCS_Param&& Param, int64 JobBytes);
+
+	// Any thread. One job, SqrtMaxInstances^2 candidates. Weightmap may be null for jobs without a spawn layer.
+	static void Scatter(const MkGpuScatteringBuilderTypes::FScatteringJobDesc& Desc, const FMkScatteringCpuTexture& Heightmap, const FMkScatteringCpuTexture* Weightmap,
+		TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>& OutResults, MkGpuScatteringBuilderTypes::FProgressInfo* OutProgress = nullptr);
+
+	// Game thread. Texture copies, shared by the jobs of a component. Null if the texture has no CPU data in this build.
+	static TSharedPtr<const FMkScatteringCpuTexture> GetHeightmap(UTexture* Texture, const ULandscapeComponent* Component);
+	static TSharedPtr<const FMkScatteringCpuTexture> GetWeightmap(UTexture* Texture);
+
+	// Game thread. Waits for every job still running, called before the subsystem goes away.
+	static void WaitForTasks();
+
+	// Waits for the jobs of one builder, called when it unregisters or is destroyed
+	static void WaitForTasks(uint32 BuilderId);
+	static bool HasPendingTasks(uint32 BuilderId);
+
+	// Drops the texture copies
+	static void ClearCache();
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+/**
+ * C++ twins of the MkGPUScatteringLibrary.ush functions the placement depends on.
+ * Same operations in the same precision, MkGpuScattering.ValidateCpuEngine checks them against the shader.
+ */
+namespace MkGpuScatteringCpuLibrary
+{
+	// FNumberGenerator. RANDOM_IQ is unsigned, so HLSL divides unsigned and wraps the products,
+	// the same sequence comes out of uint32 math here.
+	struct FNumberGenerator
+	{
+		static constexpr uint32 IA = 16807;
+		static constexpr uint32 IM = 2147483647;
+		static constexpr uint32 IQ = 127773u;
+		static constexpr uint32 IR = 2836;
+		static constexpr int32 Mask = 123459876;
+
+		int32 Seed = 0;
+
+		FORCEINLINE void SetSeed(uint32 Value)
+		{
+			Seed = (int32)Value;
+			Cycle();
+		}
+
+		FORCEINLINE void Cycle()
+		{
+			Seed ^= Mask;
+			const uint32 K = (uint32)Seed / IQ;
+			Seed = (int32)(IA * ((uint32)Seed - K * IQ) - IR * K);
+			if (Seed < 0)
+			{
+				Seed = (int32)((uint32)Seed + IM);
+			}
+			Seed ^= Mask;
+		}
+
+		FORCEINLINE int32 GetCurrentInt()
+		{
+			Cycle();
+			return Seed;
+		}
+
+		FORCEINLINE float GetCurrentFloat()
+		{
+			Cycle();
+			// RANDOM_AM, float(RANDOM_IM) rounds to 2^31
+			return (1.0f / (float)IM) * (float)Seed;
+		}
+
+		FORCEINLINE float GetRandomFloat(float Low, float High)
+		{
+			const float V = GetCurrentFloat();
+			return Low * (1.0f - V) + High * V;
+		}
+	};
+
+	FORCEINLINE float Halton(uint32 Index, uint32 Base)
+	{
+		float Result = 0.0f;
+		const float InvBase = 1.0f / (float)Base;
+		float Fraction = InvBase;
+		while (Index > 0)
+		{
+			Result += (float)(Index % Base) * Fraction;
+			Index /= Base;
+			Fraction *= InvBase;
+		}
+		return Result;
+	}
+
+	FORCEINLINE FVector2f Random2(const FVector2f& P)
+	{
+		return FVector2f(
+			FMath::Frac(FMath::Sin(P.X * 127.1f + P.Y * 311.7f) * 43758.5453f),
+			FMath::Frac(FMath::Sin(P.X * 269.5f + P.Y * 183.3f) * 43758.5453f));
+	}
+
+	// voronoiNoise with a square image and no animation, the distance to the closest cell point (every channel of the shader's result).
+	// The hash in Random2 amplifies the sin error 43758 times, the GPU and CPU values drift apart for large UVs.
+	inline float VoronoiNoise(const FVector2f& UV, float Scale)
+	{
+		const FVector2f St = UV * Scale;
+		const FVector2f IntSt(FMath::FloorToFloat(St.X), FMath::FloorToFloat(St.Y));
+		const FVector2f FracSt = St - IntSt;
+
+		float MinDist = 1.0f;
+		for (int32 Y = -1; Y <= 1; ++Y)
+		{
+			for (int32 X = -1; X <= 1; ++X)
+			{
+				const FVector2f Neighbor((float)X, (float)Y);
+				FVector2f P = Random2(IntSt + Neighbor);
+				P.X = 0.5f + 0.5f * FMath::Sin(6.2381f * P.X);
+				P.Y = 0.5f + 0.5f * FMath::Sin(6.2381f * P.Y);
+				MinDist = FMath::Min(MinDist, (Neighbor + P - FracSt).Size());
+			}
+		}
+		return MinDist;
+	}
+}
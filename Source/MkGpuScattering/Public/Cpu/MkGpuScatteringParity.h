@@ -0,0 +1,50 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+#if !UE_BUILD_SHIPPING
+
+/**
+ * Parity check between Scattering_CS and FMkGpuScatteringCpuEngine on synthetic landscapes.
+ * Every case feeds the same heightmap, weightmap and FMkGrassVariety settings to both sides and matches the results
+ * instance by instance, with the reject counts per reason and a histogram of the distances between matched instances.
+ * A library case compares FNumberGenerator, Halton and voronoiNoise of MkGPUScatteringLibrary.ush with their C++ twins.
+ *
+ * Without a renderer the GPU side comes from golden files recorded on a machine with one, so the check also runs
+ * headless (NullRHI, Linux CI). Run it from MkGpuScattering.ValidateCpuEngine or the MkGpuScatteringParity commandlet.
+ */
+namespace MkGpuScatteringParity
+{
+	enum class EMode : uint8
+	{
+		// Scattering_CS against the CPU engine, needs a renderer
+		Live,
+		// Same as Live and writes the GPU results as golden files
+		Record,
+		// Golden files against the CPU engine, no renderer needed
+		Compare,
+	};
+
+	struct FOptions
+	{
+		EMode Mode = EMode::Compare;
+		// Where the golden files are, GetDefaultGoldenDir() when empty
+		FString GoldenDir;
+		// Only the cases whose name contains this, all when empty
+		FString CaseFilter;
+		// Instances farther apart than this (world units) are not paired
+		float MatchDistance = 1.0f;
+		// Overrides the fraction of instances each case allows to differ when >= 0
+		float AllowedMismatchFraction = -1.0f;
+	};
+
+	// Live when the process can render, Compare otherwise
+	MKGPUSCATTERING_API EMode GetDefaultMode();
+	// Resources/Parity of the plugin, the recorded golden files are checked in there
+	MKGPUSCATTERING_API FString GetDefaultGoldenDir();
+
+	// Logs a report per case. True if every case passed.
+	MKGPUSCATTERING_API bool Run(const FOptions& Options);
+}
+
+#endif
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("MkGpuScattering"), STATGROUP_MkGpuScattering, STATCAT_Advanced);
 
 #define MK_GPUSCATTERING_ONLY 1
 #if MK_GPUSCATTERING_ONLY
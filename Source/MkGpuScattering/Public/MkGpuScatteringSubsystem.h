@@ -12,6 +12,7 @@ struct FMkGrassVariety;
 class AMkGpuScatteringVolume;
 class UMkGpuScatteringBuilder;
 class UMkGpuScatteringReadbackManager;
+class UMkGpuScatteringScheduler;
 
 UCLASS()
 class MKGPUSCATTERING_API UMkGpuScatteringSubsystem : public UTickableWorldSubsystem
@@ -29,6 +30,10 @@ public:
 	//~ end of UTickableWorldSubsystem
 
 
+	// One update for the given view origins, what Tick does with the streaming manager's views.
+	// The MkGpuScatteringBenchmark commandlet drives it along scripted camera paths.
+	void TickCameras(const TArray<FVector>& Cameras, float DeltaTime);
+
 	UFUNCTION(BlueprintCallable) void FlushCache();
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite) float PoissonRandomSeed = 100.0f;
@@ -58,5 +63,6 @@ private:
 	UPROPERTY(Transient) TArray<FVector> OldCameras;
 	UPROPERTY(Transient) TArray<TObjectPtr<UMkGpuScatteringBuilder>> CurrentBuilders;
 	UPROPERTY(Transient) TObjectPtr<UMkGpuScatteringReadbackManager> ReadbackManager = nullptr;
+	UPROPERTY(Transient) TObjectPtr<UMkGpuScatteringScheduler> Scheduler = nullptr;
 
 };
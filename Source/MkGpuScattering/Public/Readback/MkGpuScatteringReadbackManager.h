@@ -7,6 +7,7 @@
 #include "Types/MkGpuScatteringTypes.h"
 #include "Types/MkGpuScatteringBuilderTypes.h"
 #include "HAL/LowLevelMemTracker.h"
+#include "Containers/RingBuffer.h"
 #include "MkGpuScatteringReadbackManager.generated.h"
 
 
@@ -17,19 +18,44 @@ struct FMkGpuScatteringBuilderOutput;
 struct FMkReadback
 {
 public:
+	// Arena readbacks, see FMkAsyncBuilderInterface::DispatchRenderThread
+	enum EArena
+	{
+		Arena_ProgressInfo,
+		// Only when a job of the batch did not run Transform_CS, the prefix of the arena holding those jobs
+		Arena_Results,
+		// Only when a job of the batch ran Transform_CS
+		Arena_Transforms,
+		Arena_Num,
+	};
+
+	// One scattering job of the batch
+	struct FJob
+	{
+		FMkGpuScatteringBuilderHandle Builder;
+		FMkGpuScatteringBuilderOutput BuilderOutput;
+		// Index into the ProgressInfo arena
+		uint32 JobIndex = 0;
+		// First dword of the job's range in the Results arena
+		uint32 ResultOffset = 0;
+		// First element of the job's range in the Transforms arena
+		uint32 TransformOffset = 0;
+	};
+
 	uint32 LastUsedFrameNumberRenderThread = 0;
 	TFunction<void(TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ>&)> AsyncCallback;
 
-	int32 Index = 0;
-	int32 NextBufferSize = 0;
-
 	bool bComplete = false;
 
-	UMkGpuScatteringBuilder* Builder = nullptr;
-	FMkGpuScatteringBuilderOutput BuilderOutput;
-	mutable TArray<TRefCountPtr<FRDGPooledBuffer>> Buffers;
+	TArray<FJob> Jobs;
+
+	// Counted against MkGpuScattering.ArenaBudgetMB until the batch is read back or dropped
+	int64 ArenaBytes = 0;
 
-	TArray<FRHIGPUBufferReadback*> ReadbackPtrs;
+	// Indexed by EArena, every copy is enqueued in the dispatch graph
+	// Borrowed from the manager's staging pool, returned once the batch completes
+	TArray<FRHIGPUBufferReadback*, TInlineAllocator<Arena_Num>> ReadbackPtrs;
+	TArray<uint32, TInlineAllocator<Arena_Num>> ReadbackBytes;
 	TArray<TFunction<void(FMkReadback& InReadback)>> ReadbackFuncs;
 
 	//TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ> LocationAndNormals;
@@ -45,17 +71,14 @@ public:
 
 	void Clear()
 	{
-		/*for (FRHIGPUBufferReadback* Ptr : ReadbackPtrs)
-		{
-			delete(Ptr);
-			Ptr = nullptr;
-		}*/
-		Buffers.Empty();
 		ReadbackPtrs.Empty();
+		ReadbackBytes.Empty();
 	}
 
 	//void AddReadback(TRefCountPtr<FRDGPooledBuffer> Buffer, FRHIGPUBufferReadback* ReadbackPtr, TFunction<void(FMkReadback& InReadback)> ReadbackFunc);
-	void AddReadback(UMkGpuScatteringBuilder* InBuilder, const FMkGpuScatteringBuilderOutput& InBuilderOutput, TRefCountPtr<FRDGPooledBuffer> Buffer, FRHIGPUBufferReadback* ReadbackPtr);
+	void AddReadback(EArena Arena, FRHIGPUBufferReadback* ReadbackPtr, uint32 NumBytes);
+
+	bool HasArena(EArena Arena) const { return ReadbackPtrs.IsValidIndex(Arena) && ReadbackPtrs[Arena] != nullptr; }
 
 	void Touch()
 	{
@@ -65,11 +88,31 @@ public:
 
 	void MarkComplete() { bComplete = true; }
 
-	void IncrementIndex() { ++Index; }
-
 	bool IsCompleted() const { return bComplete; }
 };
 
+/**
+ * Reusable staging readbacks, grouped by power of two byte classes so a slot keeps a staging buffer of about the same size.
+ * Render thread only.
+ */
+struct FMkReadbackStagingPool
+{
+	~FMkReadbackStagingPool() { Empty(); }
+
+	FRHIGPUBufferReadback* Acquire(uint32 NumBytes);
+	// The readback must be done with its last copy
+	void Release(FRHIGPUBufferReadback* Readback, uint32 NumBytes);
+	void Empty();
+
+	int32 GetNumPooled() const { return NumPooled; }
+
+private:
+	static int32 GetByteClass(uint32 NumBytes);
+
+	TArray<TArray<FRHIGPUBufferReadback*>> FreeLists;
+	int32 NumPooled = 0;
+};
+
 UCLASS()
 class MKGPUSCATTERING_API UMkGpuScatteringReadbackManager : public UObject
 {
@@ -78,9 +121,21 @@ class MKGPUSCATTERING_API UMkGpuScatteringReadbackManager : public UObject
 public:
 	void Readback(FRHICommandListImmediate& RHICmdList);
 
-	void AddReadback(const FMkReadback& InReadback);
+	void AddReadback(FMkReadback&& InReadback);
 	void ClearAll();
 
+	// Render thread. The returned readback goes back to the pool when its job completes.
+	FRHIGPUBufferReadback* AcquireReadback(uint32 NumBytes);
+
 private:
-	TArray<FMkReadback> ReadbackList;
+	void ReleaseReadbacks(FMkReadback& Readback);
+
+	// Copies the job's accepted range out of the locked arenas and hands it to its builder
+	void CompleteJob(FMkReadback::FJob& Job, const MkGpuScatteringBuilderTypes::FProgressInfo* ProgressInfos, const void* Results, const void* Transforms, uint32 WaitFrames);
+
+	// Batches in dispatch order. The GPU finishes the copies in the same order, so only the head is polled.
+	TRingBuffer<FMkReadback> ReadbackQueue;
+	FMkReadbackStagingPool StagingPool;
+
+	float AverageWaitFrames = 0.0f;
 };
@@ -0,0 +1,65 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/NoExportTypes.h"
+#include "Types/MkGpuScatteringBuilderTypes.h" // FMkCachedLandscapeFoliage
+#include "MkGpuScatteringScheduler.generated.h"
+
+
+class ULandscapeComponent;
+class UMkGpuScatteringTypes;
+class UMkGpuScatteringBuilder;
+class UMkGpuScatteringReadbackManager;
+struct FMkGrassVariety;
+
+// Lower value is issued first
+enum class EMkGpuScatteringJobClass : uint8
+{
+	Collision,
+	Visual,
+};
+
+// One (component, subsection, variety) that is in range but not cached yet.
+// Only valid for the frame it was gathered in.
+struct FMkGpuScatteringJob
+{
+	UMkGpuScatteringBuilder* Builder = nullptr;
+	ULandscapeComponent* LandscapeComponent = nullptr;
+	const UMkGpuScatteringTypes* ScatteringType = nullptr;
+	const FMkGrassVariety* GrassVariety = nullptr;
+
+	FMkCachedLandscapeFoliage::FGrassCompKey Key;
+	uint32 HaltonBaseIndex = 0;
+	uint32 ComponentNameHash = 0;
+	// Entry of the builder's layout table
+	int32 LayoutIndex = INDEX_NONE;
+
+	float Distance = 0.0f;
+	EMkGpuScatteringJobClass JobClass = EMkGpuScatteringJobClass::Visual;
+
+	// First frame the job was gathered, only kept while FMkGpuScatteringTrace::IsTracking
+	uint64 QueuedCycles = 0;
+};
+
+/**
+ * Gathers the candidate jobs of every builder for the frame and issues them in
+ * (class, distance) order until the time or in-flight budget is used up.
+ */
+UCLASS()
+class MKGPUSCATTERING_API UMkGpuScatteringScheduler : public UObject
+{
+	GENERATED_BODY()
+
+public:
+	void BeginFrame();
+	void AddJob(FMkGpuScatteringJob&& Job);
+
+	// NumJobsInFlight : jobs issued on earlier frames that have not been applied yet. Returns the number of jobs issued.
+	int32 IssueJobs(int32 NumJobsInFlight, UMkGpuScatteringReadbackManager* ReadbackManager);
+	void ClearAll();
+
+private:
+	TArray<FMkGpuScatteringJob> PendingJobs;
+};
@@ -9,6 +9,7 @@
 #include "DataDrivenShaderPlatformInfo.h"
 #include "Types/MkGpuScatteringTypes.h"        // EMkGrassScaling, FMkGrassVariety
 #include "Types/MkGpuScatteringBuilderTypes.h" // FMkGpuScatteringBuilderOutput, FMkCachedLandscapeFoliage
+#include "Builder/MkGpuScatteringGpuTransform.h"
 
 class UMkGpuScatteringBuilder;
 class UMkGpuScatteringReadbackManager;
@@ -16,6 +17,7 @@ class UMkGpuScatteringReadbackManager;
 class ALandscapeProxy;
 class ULandscapeComponent;
 class UHierarchicalInstancedStaticMeshComponent;
+class UInstancedStaticMeshComponent;
 
 
 struct FMkGpuScatteringCS_Param
@@ -37,14 +39,13 @@ struct FMkGpuScatteringCS_Param
 	int32 SqrtMaxInstances;
 
 	//
-	UMkGpuScatteringBuilder* Builder = nullptr;
+	// The results go back through it, the builder may be gone by then
+	FMkGpuScatteringBuilderHandle Builder;
 	UTexture* HeightmapTexture = nullptr;
 	UTexture* WeightmapTexture = nullptr;
 
 	int32 WeightmapChannelIdx = -1;
 
-	FString SpawnLayerName;
-	FString BlockingLayerName;
 	const FMkGrassVariety* GrassVariety = nullptr;
 	//
 
@@ -60,6 +61,8 @@ struct FMkGpuScatteringCS_Param
 	bool AlignToSurface;
 
 	FRandomStream RandomStream;
+	// FMkCachedLandscapeFoliage::FGrassComp::InstancingRandomSeed
+	int32 InstancingRandomSeed = 0;
 	FMatrix XForm;
 	FBox MeshBox;
 	int32 DesiredInstancesPerLeaf;
@@ -76,17 +79,20 @@ struct FMkGpuScatteringCS_Param
 	FVector2D LightMapComponentBias;
 	FVector2D LightMapComponentScale;
 
-	FMkGpuScatteringCachedBuffers* CachedBuffers = nullptr;
 	FMkGpuScatteringBuilderOutput BuilderOutput;
 
-	TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> HISMC = nullptr;
+	// Run Transform_CS after the scattering pass and read back final transforms, see MkGpuScattering.GpuTransform
+	bool bGpuTransform = false;
+	MkGpuScatteringGpuTransform::FParams GpuTransformParams;
+
+	// The HISMC of the cache item, or the merged component of its variety
+	TWeakObjectPtr<UInstancedStaticMeshComponent> Foliage = nullptr;
 	TWeakObjectPtr<UMkGpuScatteringReadbackManager> ReadbackManager = nullptr;
 
 	FMkGpuScatteringCS_Param(UMkGpuScatteringBuilder* InBuilder
-		, FString InSpawnLayerName
-		, FString InBlockingLayerName
+		, FStringView InSpawnLayerName
 		, ALandscapeProxy* Landscape
-		, struct FMkCachedLandscapeFoliage::FGrassComp GrassComp
+		, const struct FMkCachedLandscapeFoliage::FGrassComp& GrassComp
 		, const FMkGrassVariety* GrassVariety
 		, uint32 InHaltonBaseIndex
 		, int32 CachedMaxInstancesPerComponent
@@ -94,6 +100,17 @@ struct FMkGpuScatteringCS_Param
 	);
 
 	void InitLandscapeLightmap(TWeakObjectPtr<ULandscapeComponent> Component);
+
+	// What Scattering_CS reads for this job, ResultOffset is left at 0.
+	MkGpuScatteringBuilderTypes::FScatteringJobDesc MakeJobDesc() const;
+	// The part of the descriptor that comes from the variety, the landscape and instance fields are left at 0
+	static MkGpuScatteringBuilderTypes::FScatteringJobDesc MakeJobDesc(const FMkGrassVariety& GrassVariety);
+
+	// Hash of the job without the landscape textures, never 0. Stable between the editor and cooked builds, see UMkGpuScatteringBakedData.
+	uint64 MakePlacementKey() const;
+	// Hash of everything Scattering_CS reads for this job. 0 while a cooked texture's content hash is still computed,
+	// the job skips the disk cache then. See FMkGpuScatteringDiskCache.
+	uint64 MakeDiskCacheKey() const;
 };
 
 
@@ -111,25 +128,19 @@ public:
 	static inline void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
 	{
 		OutEnvironment.SetDefine(TEXT("USE_WEIGHTMAP"), 1);
+		// Accepted results and reject counts are appended once per wave (WaveOpUtil.ush falls back to per thread atomics)
+		if (FDataDrivenShaderPlatformInfo::GetSupportsWaveOperations(Parameters.Platform) == ERHIFeatureSupport::RuntimeGuaranteed)
+		{
+			OutEnvironment.CompilerFlags.Add(CFLAG_WaveOperations);
+		}
 	}
 
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
-		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FScatteringInput>, Input)
+		// The frame's job batch, see FMkAsyncBuilderInterface::FlushBatch
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FScatteringJobDesc>, JobDescs)
+		SHADER_PARAMETER(unsigned int, JobIndex)
 		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FProgressInfo>, RWProgressInfo)
-		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FLocationNormalScaleZ>, RWResultBuffer)
-		SHADER_PARAMETER(unsigned int, WeightmapChannelIdx)
-
-
-		SHADER_PARAMETER(unsigned int, bUseVoronoiNoise)
-		SHADER_PARAMETER(FVector4f, VoronoiSetting)
-		SHADER_PARAMETER(FVector2f, SlopeMinMax)
-		SHADER_PARAMETER(FVector2f, HeightMinMax)
-
-		SHADER_PARAMETER(float, HeightFalloffRange)
-		SHADER_PARAMETER(float, PlacementJitter)
-		SHADER_PARAMETER(int, InstancingRandomSeed)
-		SHADER_PARAMETER(unsigned int, UseGrid)
-		SHADER_PARAMETER(unsigned int, AlignToSurface)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<uint>, RWResultBuffer)
 
 		SHADER_PARAMETER_TEXTURE(Texture2D, HeightmapTexture)
 		SHADER_PARAMETER_SAMPLER(SamplerState, HeightmapTextureSampler)
@@ -158,24 +169,19 @@ public:
 	static inline void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
 	{
 		OutEnvironment.SetDefine(TEXT("USE_WEIGHTMAP"), 0);
+		// Accepted results and reject counts are appended once per wave (WaveOpUtil.ush falls back to per thread atomics)
+		if (FDataDrivenShaderPlatformInfo::GetSupportsWaveOperations(Parameters.Platform) == ERHIFeatureSupport::RuntimeGuaranteed)
+		{
+			OutEnvironment.CompilerFlags.Add(CFLAG_WaveOperations);
+		}
 	}
 
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
-		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FScatteringInput>, Input)
+		// The frame's job batch, see FMkAsyncBuilderInterface::FlushBatch
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FScatteringJobDesc>, JobDescs)
+		SHADER_PARAMETER(unsigned int, JobIndex)
 		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FProgressInfo>, RWProgressInfo)
-		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FLocationNormalScaleZ>, RWResultBuffer)
-		SHADER_PARAMETER(unsigned int, WeightmapChannelIdx)
-
-		SHADER_PARAMETER(unsigned int, bUseVoronoiNoise)
-		SHADER_PARAMETER(FVector4f, VoronoiSetting)
-		SHADER_PARAMETER(FVector2f, SlopeMinMax)
-		SHADER_PARAMETER(FVector2f, HeightMinMax)
-
-		SHADER_PARAMETER(float, HeightFalloffRange)
-		SHADER_PARAMETER(float, PlacementJitter)
-		SHADER_PARAMETER(int, InstancingRandomSeed)
-		SHADER_PARAMETER(unsigned int, UseGrid)
-		SHADER_PARAMETER(unsigned int, AlignToSurface)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<uint>, RWResultBuffer)
 
 		SHADER_PARAMETER_TEXTURE(Texture2D, HeightmapTexture)
 		SHADER_PARAMETER_SAMPLER(SamplerState, HeightmapTextureSampler)
@@ -185,28 +191,129 @@ public:
 };
 
 
-void AddPass_MkScattering(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param);
+class FMkGPUScatteringTransform_CS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FMkGPUScatteringTransform_CS);
+	SHADER_USE_PARAMETER_STRUCT(FMkGPUScatteringTransform_CS, FGlobalShader);
 
-class FMkAsyncBuilderInterface
+	static constexpr uint32 ThreadGroupSize = 64;
+
+	static inline bool ShouldCompilePermutation(FGlobalShaderPermutationParameters const& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static inline void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		OutEnvironment.SetDefine(TEXT("THREADGROUP_SIZE"), ThreadGroupSize);
+	}
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FProgressInfo>, ProgressInfo)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint>, ResultBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FInstanceTransform>, RWInstanceTransforms)
+		SHADER_PARAMETER(unsigned int, JobIndex)
+		SHADER_PARAMETER(unsigned int, ResultOffset)
+		SHADER_PARAMETER(unsigned int, TransformOffset)
+		SHADER_PARAMETER(unsigned int, Seed)
+
+		SHADER_PARAMETER(unsigned int, CompactResults)
+		SHADER_PARAMETER(FVector2f, PackedBase)
+		SHADER_PARAMETER(FVector2f, PackedExtent)
+
+		SHADER_PARAMETER(FMatrix44f, XForm)
+		SHADER_PARAMETER(FVector3f, RotationAxis)
+		SHADER_PARAMETER(FVector3f, DefaultScale)
+		SHADER_PARAMETER(FVector2f, ScaleX)
+		SHADER_PARAMETER(FVector2f, ScaleY)
+		SHADER_PARAMETER(FVector2f, ScaleZ)
+		SHADER_PARAMETER(FVector2f, ZOffset)
+
+		SHADER_PARAMETER(unsigned int, Scaling)
+		SHADER_PARAMETER(unsigned int, RandomScale)
+		SHADER_PARAMETER(unsigned int, RandomRotation)
+		SHADER_PARAMETER(unsigned int, AlignToSurface)
+		SHADER_PARAMETER(unsigned int, bUseVoronoiNoise)
+		SHADER_PARAMETER(float, VoronoiValidMax)
+		SHADER_PARAMETER(float, AlignMaxPitch)
+	END_SHADER_PARAMETER_STRUCT()
+};
+
+
+// Records the MkGPUScatteringLibrary.ush functions the placement depends on, for MkGpuScattering.ValidateCpuEngine
+class FMkGPUScatteringLibraryProbe_CS : public FGlobalShader
 {
 public:
-	// Dispatches this shader. Can be called from any thread
-	static void Dispatch(FMkGpuScatteringCS_Param Param)
+	DECLARE_GLOBAL_SHADER(FMkGPUScatteringLibraryProbe_CS);
+	SHADER_USE_PARAMETER_STRUCT(FMkGPUScatteringLibraryProbe_CS, FGlobalShader);
+
+	static constexpr uint32 ThreadGroupSize = 64;
+
+	static inline bool ShouldCompilePermutation(FGlobalShaderPermutationParameters const& Parameters)
 	{
-		if (IsInRenderingThread())
-		{
-			DispatchRenderThread(GetImmediateCommandList_ForRenderCommand(), Param);
-		}
-		else
-		{
-			DispatchGameThread(Param);
-		}
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static inline void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		OutEnvironment.SetDefine(TEXT("THREADGROUP_SIZE"), ThreadGroupSize);
 	}
 
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER(unsigned int, NumProbes)
+		SHADER_PARAMETER(unsigned int, Seed)
+		SHADER_PARAMETER(unsigned int, HaltonBaseIndex)
+		SHADER_PARAMETER(float, VoronoiScale)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<uint>, RWProbeOutputs)
+	END_SHADER_PARAMETER_STRUCT()
+};
+
+
+// Buffers shared by every job of a batch. Each job owns ProgressInfo[JobIndex], MaxInstances results from its
+// ResultOffset (dwords, 7 or 3 per result, see FMkGrassVariety::bCompactResults) and MaxInstances transforms from its
+// TransformOffset. The ranges never overlap so the passes skip the UAV barriers between each other.
+struct FMkScatteringArena
+{
+	FRDGBufferSRVRef JobDescs = nullptr;
+	FRDGBufferRef ProgressInfo = nullptr;
+	FRDGBufferUAVRef ProgressInfoUAV = nullptr;
+	FRDGBufferRef Results = nullptr;
+	FRDGBufferUAVRef ResultsUAV = nullptr;
+	// Only created when a job of the batch runs Transform_CS
+	FRDGBufferRef Transforms = nullptr;
+	FRDGBufferUAVRef TransformsUAV = nullptr;
+};
+
+void AddPass_MkScattering(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param);
+// Only the first ProgressInfo.Count results are read, the dispatch covers the whole range.
+void AddPass_MkTransform(FRDGBuilder& GraphBuilder, const FMkGpuScatteringCS_Param& Param, const FMkScatteringArena& Arena, uint32 JobIndex, uint32 ResultOffset, uint32 TransformOffset);
+// Same without a job, PackedFrame is null for unpacked results. Used by the MkGpuScattering.GpuTransform automation test.
+void AddPass_MkTransform(FRDGBuilder& GraphBuilder, const MkGpuScatteringGpuTransform::FParams& GpuParams, const MkGpuScatteringBuilderTypes::FPackedResultFrame* PackedFrame,
+	uint32 MaxInstances, const FMkScatteringArena& Arena, uint32 JobIndex, uint32 ResultOffset, uint32 TransformOffset);
+
+class FMkAsyncBuilderInterface
+{
+public:
+	// Queues the job for this frame's batch. Game thread only, nothing is sent to the GPU before FlushBatch.
+	static void Dispatch(FMkGpuScatteringCS_Param&& Param);
+
+	// Sends the queued jobs to the render thread as one graph with one job descriptor upload per readback manager.
+	// Called once per frame after the scheduler issued its jobs.
+	static void FlushBatch();
+
+	//~ Arena budget, see MkGpuScattering.ArenaBudgetMB
+	// Arena bytes of the jobs that were issued and not read back yet
+	static int64 GetArenaBytesInFlight();
+	// False when the scheduler should wait for readbacks before issuing more jobs
+	static bool HasArenaBudget();
+	// Called when a batch's readback completed or was dropped
+	static void ReleaseArenaBytes(int64 NumBytes);
+	//~ end of Arena budget
+
 private:
-	// Executes this shader on the render thread
-	static void DispatchRenderThread(FRHICommandListImmediate& RHICmdList, FMkGpuScatteringCS_Param Param);
+	// Records every job of the batch in a single FRDGBuilder, the jobs all share one readback manager
+	static void DispatchRenderThread(FRHICommandListImmediate& RHICmdList, TArray<FMkGpuScatteringCS_Param>&& Batch, int64 ArenaBytes);
 
-	// Executes this shader on the render thread from the game thread via EnqueueRenderThreadCommand
-	static void DispatchGameThread(FMkGpuScatteringCS_Param Param);
+	static TArray<FMkGpuScatteringCS_Param> PendingBatch;
 };
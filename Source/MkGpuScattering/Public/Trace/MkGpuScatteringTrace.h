@@ -0,0 +1,50 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+// Stages of one scattering job, in the order a job goes through them
+enum class EMkScatteringJobStage : uint8
+{
+	// First gathered by UMkGpuScatteringBuilder::Build
+	Queued,
+	// Handed to FMkAsyncBuilderInterface::Dispatch by the scheduler : GPU or CPU engine
+	Dispatched,
+	// Instead of Dispatched, the results come from baked data or the disk cache
+	CacheHit,
+	// Results handed back to the builder, see UMkGpuScatteringBuilder::OnDelegateCompueteFinish
+	ReadbackReady,
+	// Instance data and cluster tree built
+	TransformBuilt,
+	// Instances added to the HISMC in UMkGpuScatteringBuilder::WaitAndApplyResults
+	Applied,
+	Num
+};
+
+/**
+ * Per job latency tracing. Every stage is an event on the MkGpuScattering trace channel (-trace=mkgpuscattering),
+ * keyed by builder, component, subsection and variety, and the time to visible (queued to applied) feeds
+ * the stat MkGpuScattering group.
+ */
+struct MKGPUSCATTERING_API FMkGpuScatteringTrace
+{
+	// The queued timestamps are only kept while the channel is on or stats are collected
+	static bool IsTracking();
+
+	// Any thread. QueuedCycles is the FPlatformTime::Cycles64 of the Queued event, 0 if unknown.
+	static void JobStage(EMkScatteringJobStage Stage, uint32 BuilderId, uint32 ComponentId, int32 SubsectionX, int32 SubsectionY, int32 VarietyIndex, uint64 QueuedCycles);
+
+	// Game thread, for the jobs that reached Applied
+	static void AddTimeToVisible(uint64 QueuedCycles);
+
+	// Game thread, once per frame after the builders ticked. Publishes the time to visible stats.
+	static void EndFrame();
+
+	static const TCHAR* GetStageName(EMkScatteringJobStage Stage);
+
+	// Identifies a job within its builder, for the queued timestamps
+	static FORCEINLINE uint64 MakeJobId(uint32 ComponentId, int32 SubsectionX, int32 SubsectionY, int32 VarietyIndex)
+	{
+		return (uint64)ComponentId | ((uint64)(SubsectionX & 0xff) << 32) | ((uint64)(SubsectionY & 0xff) << 40) | ((uint64)(VarietyIndex & 0xffff) << 48);
+	}
+};
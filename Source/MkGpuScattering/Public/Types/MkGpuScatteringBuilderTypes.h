@@ -10,10 +10,13 @@
 #include "Engine/EngineTypes.h"
 #include "UObject/PerPlatformProperties.h"
 #include "RenderGraphResources.h"  // FRDGPooledBuffer full definition
+#include "Containers/Queue.h"
 
 
 class ULandscapeComponent;
 class UHierarchicalInstancedStaticMeshComponent;
+class UInstancedStaticMeshComponent;
+class UMkGpuScatteringBuilder;
 
 struct FMkGpuScatteringBuilderOutput;
 
@@ -26,26 +29,13 @@ static FAutoConsoleVariableRef CVarMkGpuScatteringDensityScale(
 
 
 //~ For cache
-struct FMkGpuScatteringCachedBuffers
-{
-	// Multi-frame buffers used to store the instance data.
-	mutable TRefCountPtr<FRDGPooledBuffer> Input_Buffer;
-	mutable TRefCountPtr<FRDGPooledBuffer> ProgressInfo_Buffer;
-	mutable TRefCountPtr<FRDGPooledBuffer> Result_Buffer;
-
-	void SafeReleaseAll()
-	{
-		Input_Buffer.SafeRelease();
-		ProgressInfo_Buffer.SafeRelease();
-		Result_Buffer.SafeRelease();
-	}
-};
-
 struct FMkCachedLandscapeFoliage
 {
 	struct FGrassCompKey
 	{
 		TWeakObjectPtr<ULandscapeComponent> BasedOn;
+		// Stable id of BasedOn within its builder, see FMkLandscapeComponentIndex
+		uint32 ComponentId;
 		int32 SqrtSubsections;
 		int32 CachedMaxInstancesPerComponent;
 		int32 SubsectionX;
@@ -54,7 +44,8 @@ struct FMkCachedLandscapeFoliage
 		int32 VarietyIndex;
 
 		FGrassCompKey()
-			: SqrtSubsections(0)
+			: ComponentId(0)
+			, SqrtSubsections(0)
 			, CachedMaxInstancesPerComponent(0)
 			, SubsectionX(0)
 			, SubsectionY(0)
@@ -65,6 +56,7 @@ struct FMkCachedLandscapeFoliage
 		inline bool operator==(const FGrassCompKey& Other) const
 		{
 			return
+				ComponentId == Other.ComponentId &&
 				SqrtSubsections == Other.SqrtSubsections &&
 				CachedMaxInstancesPerComponent == Other.CachedMaxInstancesPerComponent &&
 				SubsectionX == Other.SubsectionX &&
@@ -73,115 +65,182 @@ struct FMkCachedLandscapeFoliage
 				NumVarieties == Other.NumVarieties &&
 				VarietyIndex == Other.VarietyIndex;
 		}
-
-		friend uint32 GetTypeHash(const FGrassCompKey& Key)
-		{
-			return GetTypeHash(Key.BasedOn) ^ Key.SqrtSubsections ^ Key.CachedMaxInstancesPerComponent ^ (Key.SubsectionX << 16) ^ (Key.SubsectionY << 24) ^ (Key.NumVarieties << 3) ^ (Key.VarietyIndex << 13);
-		}
-
 	};
 
+	// Cold part of a cache item, only touched when the item is created, applied or evicted
 	struct FGrassComp
 	{
 		FGrassCompKey Key;
 		FMkGpuScatteringBuilderOutput* BuilderOutput = nullptr;
-		FMkGpuScatteringCachedBuffers* CachedBuffers = nullptr;
 
 		TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> Foliage;
+		// Shared component of the variety when it is merged, see FMkGrassVariety::bMergeComponents. Foliage is null then.
+		TWeakObjectPtr<UInstancedStaticMeshComponent> MergedFoliage;
+		// Tags this item's instances in MergedFoliage, 0 when not merged
+		uint32 MergedRangeHandle = 0;
+		// Seed of the item's instances, the InstancingRandomSeed of Foliage when not merged
+		int32 InstancingRandomSeed = 0;
 
 		TArray<FBox> ExcludedBoxes;
-		uint32 LastUsedFrameNumber;
 		uint32 ExclusionChangeTag;
-
-		double LastUsedTime;
-		bool Pending;
 		bool PendingRemovalRebuild;
 
 		FGrassComp()
 			: ExclusionChangeTag(0)
-			, Pending(true)
 			, PendingRemovalRebuild(false)
 		{
-			Touch();
 		}
 		~FGrassComp()
 		{
-			CachedBuffers = nullptr;
 			BuilderOutput = nullptr;
 			Foliage = nullptr;
+			MergedFoliage = nullptr;
 		}
 
-		void Touch()
-		{
-			LastUsedFrameNumber = GFrameNumber;
-			LastUsedTime = FPlatformTime::Seconds();
-		}
+		// The component the instances go to, Foliage or MergedFoliage
+		TWeakObjectPtr<UInstancedStaticMeshComponent> GetFoliage() const;
 	};
 
-	struct FGrassCompKeyFuncs : BaseKeyFuncs<FGrassComp, FGrassCompKey>
+	// Hot part of a cache item, walked every frame by the trim pass
+	struct FGrassCompState
 	{
-		static KeyInitType GetSetKey(const FGrassComp& Element)
+		double LastUsedTime = 0.0;
+		uint32 LastUsedFrameNumber = 0;
+		// Full build pass that last found this item in range, see UMkGpuScatteringBuilder::Build
+		uint32 LastTouchedBuild = 0;
+		bool bPending = true;
+		// the landscape component left the proxy, see MarkComponentRemoved
+		bool bComponentRemoved = false;
+
+		void Touch(uint32 InFrameNumber, double InTime)
 		{
-			return Element.Key;
+			LastUsedFrameNumber = InFrameNumber;
+			LastUsedTime = InTime;
 		}
+	};
 
-		static bool Matches(KeyInitType A, KeyInitType B)
-		{
-			return A == B;
-		}
+	// Returns the item index or INDEX_NONE. Indices stay valid until the next Add or RemoveAt.
+	int32 Find(const FGrassCompKey& Key) const;
+	int32 Add(FGrassComp&& Comp, const FGrassCompState& State);
+	// Swaps the last item into Index
+	void RemoveAt(int32 Index);
+	void MarkComponentRemoved(uint32 ComponentId);
+
+	FORCEINLINE int32 Num() const { return Comps.Num(); }
+	FORCEINLINE FGrassComp& GetComp(int32 Index) { return Comps[Index]; }
+	FORCEINLINE FGrassCompState& GetState(int32 Index) { return States[Index]; }
+	FORCEINLINE const FGrassCompState& GetState(int32 Index) const { return States[Index]; }
+
+	void ClearCache();
+
+private:
+	/**
+	 * Bit layout, 0 is never a valid key since component ids start at 1
+	 *  [0, 24) ComponentId, [24, 28) SubsectionX, [28, 32) SubsectionY, [32, 36) SqrtSubsections - 1,
+	 *  [36, 46) VarietyIndex, [46, 56) NumVarieties, [56, 64) interned CachedMaxInstancesPerComponent
+	 */
+	static uint64 PackKey(const FGrassCompKey& Key, int32 InstanceCapSlot);
+	static FORCEINLINE uint32 HashKey(uint64 PackedKey)
+	{
+		// 64 bit murmur finalizer, the packed fields are small integers so they need a proper mix
+		PackedKey ^= PackedKey >> 33;
+		PackedKey *= 0xff51afd7ed558ccdull;
+		PackedKey ^= PackedKey >> 33;
+		PackedKey *= 0xc4ceb9fe1a85ec53ull;
+		PackedKey ^= PackedKey >> 33;
+		return (uint32)PackedKey;
+	}
 
-		static uint32 GetKeyHash(KeyInitType Key)
-		{
-			return GetTypeHash(Key);
-		}
+	int32 FindInstanceCapSlot(int32 InstanceCap) const { return InstanceCaps.Find(InstanceCap); }
+	int32 FindSlot(uint64 PackedKey) const;
+	void InsertSlot(uint64 PackedKey, int32 ItemIndex);
+	void RemoveSlot(int32 SlotIndex);
+	void Rehash(int32 NewNumSlots);
+
+	struct FSlot
+	{
+		uint64 Key = 0;
+		int32 ItemIndex = INDEX_NONE;
 	};
 
-	typedef TSet<FGrassComp, FGrassCompKeyFuncs> TGrassSet;
-	TSet<FGrassComp, FGrassCompKeyFuncs> CachedGrassComps;
+	// Open addressing with linear probing, power of two sized and kept at most half full
+	TArray<FSlot> Slots;
 
-	void ClearCache()
-	{
-		for (FGrassComp& Comp : CachedGrassComps)
-		{
-			if (Comp.CachedBuffers)
-			{
-				Comp.CachedBuffers->SafeReleaseAll();
-				delete(Comp.CachedBuffers);
-			}
-			Comp.CachedBuffers = nullptr;
-			Comp.BuilderOutput = nullptr;
-		}
+	// Dense item storage, same index in every array
+	TArray<uint64> PackedKeys;
+	TArray<FGrassCompState> States;
+	TArray<FGrassComp> Comps;
 
-		CachedGrassComps.Empty();
-	}
+	TArray<int32, TInlineAllocator<4>> InstanceCaps;
 };
 //~!
 
 namespace MkGpuScatteringBuilderTypes
 {
-	// Parameter를 늘리면 높이값 계산이 안되는거 같은 모습이 보임.
-	// 모르는 제약 조건, 규칙 같은게 있는거 아닐까?
-	struct FScatteringInput
+	// Everything Scattering_CS needs for one job, uploaded once per frame for the whole batch.
+	// Matches FScatteringJobDesc in MkGPUScatteringLibrary.ush member for member. Structured buffers are packed
+	// without HLSL constant buffer padding, the offsets below are what the shader sees.
+	struct FScatteringJobDesc
 	{
 		FVector2f Origin;
 		FVector2f Extent;
 		FVector2f Offset;
 		FVector2f SectionBase;
+		// GroupSize, Scale, ValidRange Min, ValidRange Max
+		FVector4f VoronoiSetting;
 
 		FVector3f DrawScale;
-
 		uint32 SqrtMaxInstances;
+
+		FVector2f SlopeMinMax;
+		FVector2f HeightMinMax;
+
+		float HeightFalloffRange;
+		float PlacementJitter;
+		int32 InstancingRandomSeed;
 		uint32 HaltonBaseIndex;
+
 		uint32 Stride;
+		uint32 WeightmapChannelIdx;
+		uint32 UseGrid;
+		uint32 bUseVoronoiNoise;
+
+		// First dword of the job's range in the batch's result arena
+		uint32 ResultOffset;
+		// FMkGrassVariety::bCompactResults, the job writes FPackedLocationNormalScaleZ
+		uint32 CompactResults;
+		uint32 Pad1;
+		uint32 Pad2;
+	};
+	static_assert(sizeof(FScatteringJobDesc) == 128, "FScatteringJobDesc must match the shader struct");
+	static_assert(offsetof(FScatteringJobDesc, VoronoiSetting) == 32, "FScatteringJobDesc must match the shader struct");
+	static_assert(offsetof(FScatteringJobDesc, SqrtMaxInstances) == 60, "FScatteringJobDesc must match the shader struct");
+	static_assert(offsetof(FScatteringJobDesc, HeightFalloffRange) == 80, "FScatteringJobDesc must match the shader struct");
+	static_assert(offsetof(FScatteringJobDesc, Stride) == 96, "FScatteringJobDesc must match the shader struct");
+	static_assert(offsetof(FScatteringJobDesc, ResultOffset) == 112, "FScatteringJobDesc must match the shader struct");
+
+	// Why Scattering_CS dropped a candidate, index into FProgressInfo::RejectCounts.
+	// Matches the REJECT_* defines in MkGPUScatteringLibrary.ush.
+	enum EScatteringReject : uint32
+	{
+		Reject_LayerWeightSum,
+		Reject_LayerWeight,
+		Reject_Height,
+		Reject_HeightFalloff,
+		Reject_Voronoi,
+		Reject_Slope,
+		Reject_Num
 	};
 
-	// Todo. 정리
+	// Matches FProgressInfo in MkGPUScatteringLibrary.ush
 	struct FProgressInfo
 	{
+		// Accepted instances. Scattering_CS compacts them to the front of the result buffer.
 		uint32 Count = 0;
 		uint32 MaxInstances = 0;
-		//bool bComplete = false;
+		uint32 RejectCounts[Reject_Num] = {};
 	};
+	static_assert(sizeof(FProgressInfo) == 32, "FProgressInfo must match the shader struct");
 
 	struct FLocationOnly
 	{
@@ -200,6 +259,124 @@ namespace MkGpuScatteringBuilderTypes
 		FVector3f ComputedNormal;
 		float ScaleZ;
 	};
+
+	// FLocationNormalScaleZ quantized for varieties with bCompactResults, matches the PackResult* functions in MkGPUScatteringLibrary.ush.
+	// PackedXY : 16 bits each, X low, relative to the job's FPackedResultFrame. Z : unchanged.
+	// PackedNormalScaleZ : octahedral normal 12 + 12 bits, ScaleZ 8 bits on top.
+	struct FPackedLocationNormalScaleZ
+	{
+		uint32 PackedXY;
+		float Z;
+		uint32 PackedNormalScaleZ;
+	};
+	static_assert(sizeof(FPackedLocationNormalScaleZ) == 12, "FPackedLocationNormalScaleZ must match the shader layout");
+
+	// Both result formats share the arena as dwords
+	static constexpr uint32 ResultDwords = sizeof(FLocationNormalScaleZ) / sizeof(uint32);
+	static constexpr uint32 PackedResultDwords = sizeof(FPackedLocationNormalScaleZ) / sizeof(uint32);
+
+	// The rectangle a job scatters into, what the packed XY is relative to
+	struct FPackedResultFrame
+	{
+		// Job origin minus the landscape section offset
+		FVector2f Base = FVector2f::ZeroVector;
+		FVector2f Extent = FVector2f::ZeroVector;
+
+		FORCEINLINE FLocationNormalScaleZ Unpack(const FPackedLocationNormalScaleZ& Packed) const
+		{
+			constexpr float InvMaxXY = 1.0f / 65535.0f;
+			constexpr float InvMaxOct = 2.0f / 4095.0f;
+
+			FLocationNormalScaleZ Result;
+			Result.Location.X = Base.X + (float)(Packed.PackedXY & 0xffff) * InvMaxXY * Extent.X;
+			Result.Location.Y = Base.Y + (float)(Packed.PackedXY >> 16) * InvMaxXY * Extent.Y;
+			Result.Location.Z = Packed.Z;
+
+			const uint32 OctX = Packed.PackedNormalScaleZ & 0xfff;
+			const uint32 OctY = (Packed.PackedNormalScaleZ >> 12) & 0xfff;
+			if (OctX == 0 && OctY == 0)
+			{
+				// Zero normal of a degenerate triangle, the code of a straight down normal which terrain never has
+				Result.ComputedNormal = FVector3f::ZeroVector;
+			}
+			else
+			{
+				FVector3f Normal((float)OctX * InvMaxOct - 1.0f, (float)OctY * InvMaxOct - 1.0f, 0.0f);
+				Normal.Z = 1.0f - FMath::Abs(Normal.X) - FMath::Abs(Normal.Y);
+				if (Normal.Z < 0.0f)
+				{
+					const float X = Normal.X;
+					Normal.X = (1.0f - FMath::Abs(Normal.Y)) * (X >= 0.0f ? 1.0f : -1.0f);
+					Normal.Y = (1.0f - FMath::Abs(X)) * (Normal.Y >= 0.0f ? 1.0f : -1.0f);
+				}
+				Result.ComputedNormal = Normal.GetUnsafeNormal();
+			}
+
+			Result.ScaleZ = (float)(Packed.PackedNormalScaleZ >> 24) * (1.0f / 255.0f);
+			return Result;
+		}
+
+		void Unpack(TConstArrayView<FPackedLocationNormalScaleZ> Packed, TArray<FLocationNormalScaleZ>& OutResults) const
+		{
+			OutResults.SetNumUninitialized(Packed.Num());
+			for (int32 Index = 0; Index < Packed.Num(); ++Index)
+			{
+				OutResults[Index] = Unpack(Packed[Index]);
+			}
+		}
+
+		// PackResultXY and PackResultNormalScaleZ, for results produced on the CPU
+		FORCEINLINE FPackedLocationNormalScaleZ Pack(const FLocationNormalScaleZ& Result) const
+		{
+			const float U = FMath::Clamp((Result.Location.X - Base.X) / Extent.X, 0.0f, 1.0f);
+			const float V = FMath::Clamp((Result.Location.Y - Base.Y) / Extent.Y, 0.0f, 1.0f);
+
+			uint32 OctX = 0;
+			uint32 OctY = 0;
+			const FVector3f& Normal = Result.ComputedNormal;
+			const float L1 = FMath::Abs(Normal.X) + FMath::Abs(Normal.Y) + FMath::Abs(Normal.Z);
+			if (L1 > 0.0f)
+			{
+				float PX = Normal.X / L1;
+				float PY = Normal.Y / L1;
+				if (Normal.Z < 0.0f)
+				{
+					const float X = PX;
+					PX = (1.0f - FMath::Abs(PY)) * (X >= 0.0f ? 1.0f : -1.0f);
+					PY = (1.0f - FMath::Abs(X)) * (PY >= 0.0f ? 1.0f : -1.0f);
+				}
+				OctX = (uint32)FMath::RoundToInt32(FMath::Clamp(PX * 0.5f + 0.5f, 0.0f, 1.0f) * 4095.0f);
+				OctY = (uint32)FMath::RoundToInt32(FMath::Clamp(PY * 0.5f + 0.5f, 0.0f, 1.0f) * 4095.0f);
+			}
+			const uint32 Scale = (uint32)FMath::RoundToInt32(FMath::Clamp(Result.ScaleZ, 0.0f, 1.0f) * 255.0f);
+
+			FPackedLocationNormalScaleZ Packed;
+			Packed.PackedXY = (uint32)FMath::RoundToInt32(U * 65535.0f) | ((uint32)FMath::RoundToInt32(V * 65535.0f) << 16);
+			Packed.Z = Result.Location.Z;
+			Packed.PackedNormalScaleZ = OctX | (OctY << 12) | (Scale << 24);
+			return Packed;
+		}
+	};
+
+	// Output of Transform_CS, what FStaticMeshInstanceData::SetInstance takes : the instance matrix and its random fraction.
+	// Matches FInstanceTransform in MkGPUScatteringLibrary.ush.
+	struct FInstanceTransform
+	{
+		// xyz : rows 0-2 of the matrix, w unused
+		FVector4f Rows[3];
+		// xyz : translation, w : random fraction
+		FVector4f OriginAndRandom;
+
+		FORCEINLINE FMatrix44f ToMatrix() const
+		{
+			return FMatrix44f(
+				FPlane4f(Rows[0].X, Rows[0].Y, Rows[0].Z, 0.0f),
+				FPlane4f(Rows[1].X, Rows[1].Y, Rows[1].Z, 0.0f),
+				FPlane4f(Rows[2].X, Rows[2].Y, Rows[2].Z, 0.0f),
+				FPlane4f(OriginAndRandom.X, OriginAndRandom.Y, OriginAndRandom.Z, 1.0f));
+		}
+	};
+	static_assert(sizeof(FInstanceTransform) == 64, "FInstanceTransform must match the shader struct");
 };
 
 
@@ -207,8 +384,16 @@ struct FMkGpuScatteringBuilderOutput
 {
 	//TArray<MkGpuScatteringBuilderTypes::FLocationAndNormal> LocationAndNormals;
 	TArray<MkGpuScatteringBuilderTypes::FLocationNormalScaleZ> ResultBuffer;
+	// Filled instead of ResultBuffer when Transform_CS ran
+	TArray<MkGpuScatteringBuilderTypes::FInstanceTransform> InstanceTransforms;
+	bool bGpuTransforms = false;
+	// Filled instead of ResultBuffer for varieties with bCompactResults, decoded with PackedFrame when the instances are built
+	TArray<MkGpuScatteringBuilderTypes::FPackedLocationNormalScaleZ> PackedResults;
+	MkGpuScatteringBuilderTypes::FPackedResultFrame PackedFrame;
+	bool bCompactResults = false;
 
 	TWeakObjectPtr<ULandscapeComponent> BasedOn;
+	uint32 ComponentId = 0;
 	int32 SqrtSubsections;
 	int32 CachedMaxInstancesPerComponent;
 	int32 SubsectionX;
@@ -220,6 +405,16 @@ struct FMkGpuScatteringBuilderOutput
 
 	const FMkGrassVariety* GrassVariety;
 	bool RandomScale = false;
+	// GFrameCounter when the job was issued, for the dispatch to apply latency stat
+	uint64 DispatchFrame = 0;
+	// FPlatformTime::Cycles64 when Build first gathered the job, 0 while not tracing, see FMkGpuScatteringTrace
+	uint64 QueuedCycles = 0;
+	// Set when the results go to the disk cache after readback, 0 otherwise
+	uint64 DiskCacheKey = 0;
+	// The disk cache file could not be read (evicted or damaged), the builder gathers the job again
+	bool bDiskCacheLoadFailed = false;
+	// Set while the builder captures results for the bake, see UMkGpuScatteringBuilder::SetBakeCapture
+	uint64 BakeKey = 0;
 
 	FMkGpuScatteringBuilderOutput()
 	{
@@ -228,6 +423,7 @@ struct FMkGpuScatteringBuilderOutput
 
 	FMkGpuScatteringBuilderOutput(
 		TWeakObjectPtr<ULandscapeComponent> InBasedOn
+		, uint32 InComponentId
 		, int32 InSqrtSubsections
 		, int32 InCachedMaxInstancesPerComponent
 		, int32 InSubsectionX
@@ -238,6 +434,7 @@ struct FMkGpuScatteringBuilderOutput
 		, const FMkGrassVariety* InGrassVariety
 	)
 		: BasedOn(InBasedOn)
+		, ComponentId(InComponentId)
 		, SqrtSubsections(InSqrtSubsections)
 		, CachedMaxInstancesPerComponent(InCachedMaxInstancesPerComponent)
 		, SubsectionX(InSubsectionX)
@@ -248,3 +445,25 @@ struct FMkGpuScatteringBuilderOutput
 		, GrassVariety(InGrassVariety)
 	{}
 };
+
+
+// Results handed back to a builder from the render thread and the workers, drained by UMkGpuScatteringBuilder::ConsumeCompletedOutputs
+using FMkGpuScatteringCompletedOutputs = TQueue<FMkGpuScatteringBuilderOutput, EQueueMode::Mpsc>;
+
+/**
+ * What a job keeps of its builder once it leaves the game thread. Builders live on streaming landscape proxies and can be
+ * unregistered and collected while their jobs are still in flight, so the jobs only hold weak references and late results are dropped.
+ */
+struct MKGPUSCATTERING_API FMkGpuScatteringBuilderHandle
+{
+	// Game thread only
+	TWeakObjectPtr<UMkGpuScatteringBuilder> WeakBuilder;
+	TWeakPtr<FMkGpuScatteringCompletedOutputs, ESPMode::ThreadSafe> CompletedOutputs;
+	// GetUniqueID of the builder, for the trace events
+	uint32 BuilderId = 0;
+
+	bool IsSet() const { return BuilderId != 0; }
+
+	// Any thread. Stores the results in the disk cache if asked and queues them for the builder, if it is still alive.
+	void Deliver(FMkGpuScatteringBuilderOutput&& Output) const;
+};
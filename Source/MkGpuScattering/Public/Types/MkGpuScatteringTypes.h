@@ -114,6 +114,15 @@ struct FMkGrassVariety
 	/* Whether to use the landscape's lightmap when rendering the grass. */
 	UPROPERTY(EditAnywhere, Category = Placement) bool bUseLandscapeLightmap;
 
+	/* Read the scattering results back quantized, 12 bytes instead of 28. Locations move by up to 1/65535 of the subsection size. */
+	UPROPERTY(EditAnywhere, AdvancedDisplay, Category = Placement) bool bCompactResults;
+
+	/*
+	 * Put the instances of every landscape subsection into one instanced component per landscape proxy, instead of one HISMC each.
+	 * Evicted subsections are removed by swapping, so PerInstanceRandom is not stable for this variety. Ignored with collision.
+	 */
+	UPROPERTY(EditAnywhere, AdvancedDisplay, Category = Grass) bool bMergeComponents;
+
 
 	/**
 	 * Lighting channels that the grass will be assigned. Lights with matching channels will affect the grass.
@@ -155,6 +164,9 @@ struct FMkGrassVariety
 
 	bool IsGrassQualityLevelEnable() const;
 
+	// bMergeComponents, collision varieties keep their own HISMC for the instance bodies
+	bool UsesMergedComponent() const;
+
 	int32 GetStartCullDistance() const;
 
 	int32 GetEndCullDistance() const;
@@ -179,8 +191,14 @@ public:
 	UPROPERTY(EditAnywhere, Category = Grass, meta = (EditCondition = "bEnableBlockingLayer")) FString BlockingLayerName;
 	UPROPERTY(EditAnywhere, Category = Grass) TArray<FMkGrassVariety> GrassVarieties;
 
+	// Bumped whenever the asset is edited, builders compare it to know when their cached layout is stale
+	uint32 GetChangeTag() const { return ChangeTag; }
+
 protected:
 #if WITH_EDITOR
 	virtual void PostEditChangeProperty(struct FPropertyChangedEvent& PropertyChangedEvent);
 #endif
+
+private:
+	uint32 ChangeTag = 0;
 };
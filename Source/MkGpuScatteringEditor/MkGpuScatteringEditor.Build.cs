@@ -53,7 +53,10 @@ public class MkGpuScatteringEditor : ModuleRules
 				"Engine",
 				"Slate",
 				"SlateCore",
-                "MkGpuScattering"
+                "MkGpuScattering",
+                "Landscape",
+                "RenderCore",
+                "RHI"
 			}
 			);
 
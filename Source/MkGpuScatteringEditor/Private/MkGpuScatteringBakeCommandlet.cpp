@@ -0,0 +1,360 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "MkGpuScatteringBakeCommandlet.h"
+#include "MkGpuScatteringGlobal.h"
+#include "MkGpuScatteringVolume.h"
+#include "Builder/MkGpuScatteringBuilder.h"
+#include "Cache/MkGpuScatteringBakedData.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Readback/MkGpuScatteringReadbackManager.h"
+#include "Scheduler/MkGpuScatteringScheduler.h"
+#include "Types/MkGpuScatteringTypes.h"
+
+#include "Editor.h"
+#include "EngineUtils.h"
+#include "LandscapeProxy.h"
+#include "PerQualityLevelProperties.h"
+#include "RenderingThread.h"
+#include "Misc/PackageName.h"
+#include "UObject/SavePackage.h"
+#include "WorldPartition/WorldPartition.h"
+#include "WorldPartition/WorldPartitionHelpers.h"
+#include "WorldPartition/WorldPartitionActorDescInstance.h"
+
+#include UE_INLINE_GENERATED_CPP_BY_NAME(MkGpuScatteringBakeCommandlet)
+
+MK_OPTIMIZATION_OFF
+
+using namespace MkGpuScatteringBuilderTypes;
+
+namespace MkGpuScatteringBake
+{
+	// A proxy that never settles is a bug, not a big landscape
+	static constexpr int32 MaxPassesPerQualityLevel = 10000;
+
+	// Defined by the runtime module, UMkGpuScatteringTypes resolves its densities through it
+	static const TCHAR* QualityLevelCVarName = TEXT("mk.grass.DensityQualityLevel");
+
+	// Overrides a console variable for the lifetime of the scope
+	struct FScopedCVar
+	{
+		FScopedCVar(const TCHAR* Name, int32 Value)
+			: CVar(IConsoleManager::Get().FindConsoleVariable(Name))
+		{
+			if (CVar)
+			{
+				OldValue = CVar->GetString();
+				CVar->Set(Value, ECVF_SetByCode);
+			}
+			else
+			{
+				UE_LOG(LogTemp, Warning, TEXT("[UMkGpuScatteringBakeCommandlet] Unknown console variable %s"), Name);
+			}
+		}
+
+		~FScopedCVar()
+		{
+			if (CVar)
+			{
+				CVar->Set(*OldValue, ECVF_SetByCode);
+			}
+		}
+
+		IConsoleVariable* CVar;
+		FString OldValue;
+	};
+
+	struct FVolumeInfo
+	{
+		FBox Bounds;
+		TArray<UMkGpuScatteringTypes*> ScatteringTypes;
+	};
+
+	static UWorld* LoadWorld(const FString& MapName)
+	{
+		UPackage* Package = LoadPackage(nullptr, *MapName, LOAD_None);
+		UWorld* World = Package ? UWorld::FindWorldInPackage(Package) : nullptr;
+		if (!World)
+		{
+			return nullptr;
+		}
+
+		World->WorldType = EWorldType::Editor;
+		World->AddToRoot();
+		if (!World->bIsWorldInitialized)
+		{
+			World->InitWorld(UWorld::InitializationValues()
+				.ShouldSimulatePhysics(false)
+				.EnableTraceCollision(false)
+				.CreateNavigation(false)
+				.CreateAISystem(false)
+				.AllowAudioPlayback(false)
+				.CreatePhysicsScene(true));
+		}
+		World->UpdateWorldComponents(true, true);
+
+		GEditor->GetEditorWorldContext().SetCurrentWorld(World);
+		GWorld = World;
+		return World;
+	}
+
+	static void UnloadWorld(UWorld* World)
+	{
+		GEditor->GetEditorWorldContext().SetCurrentWorld(nullptr);
+		GWorld = nullptr;
+
+		World->RemoveFromRoot();
+		World->DestroyWorld(false);
+		CollectGarbage(RF_NoFlags);
+	}
+
+	static bool SavePackage(UPackage* Package)
+	{
+		const FString Filename = FPackageName::LongPackageNameToFilename(Package->GetName(), Package->ContainsMap() ? FPackageName::GetMapPackageExtension() : FPackageName::GetAssetPackageExtension());
+
+		FSavePackageArgs SaveArgs;
+		SaveArgs.TopLevelFlags = RF_Standalone;
+		SaveArgs.SaveFlags = SAVE_None;
+		return UPackage::SavePackage(Package, nullptr, *Filename, SaveArgs);
+	}
+
+	// Calls Func for every actor of Class, loading and unloading world partition actors around it
+	template <typename ActorType>
+	static void ForEachActor(UWorld* World, TFunctionRef<void(ActorType*)> Func)
+	{
+		if (UWorldPartition* WorldPartition = World->GetWorldPartition())
+		{
+			FWorldPartitionHelpers::ForEachActorWithLoading(WorldPartition, ActorType::StaticClass(), [&Func](const FWorldPartitionActorDescInstance* ActorDescInstance)
+			{
+				if (ActorType* Actor = Cast<ActorType>(ActorDescInstance->GetActor()))
+				{
+					Func(Actor);
+				}
+				return true;
+			});
+			return;
+		}
+
+		for (ActorType* Actor : TActorRange<ActorType>(World))
+		{
+			Func(Actor);
+		}
+	}
+}
+
+using namespace MkGpuScatteringBake;
+
+//~ UMkGpuScatteringBakeCommandlet
+UMkGpuScatteringBakeCommandlet::UMkGpuScatteringBakeCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+int32 UMkGpuScatteringBakeCommandlet::Main(const FString& Params)
+{
+	FString MapName;
+	if (!FParse::Value(*Params, TEXT("Map="), MapName))
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] Missing -Map=<long package name>"));
+		return 1;
+	}
+
+	TArray<int32> QualityLevels;
+	FString QualityLevelsString;
+	if (FParse::Value(*Params, TEXT("QualityLevels="), QualityLevelsString))
+	{
+		TArray<FString> Tokens;
+		QualityLevelsString.ParseIntoArray(Tokens, TEXT(","));
+		for (const FString& Token : Tokens)
+		{
+			QualityLevels.AddUnique(FMath::Clamp(FCString::Atoi(*Token), 0, (int32)EPerQualityLevels::Num - 1));
+		}
+	}
+	if (QualityLevels.IsEmpty())
+	{
+		for (int32 QualityLevel = 0; QualityLevel < (int32)EPerQualityLevels::Num; ++QualityLevel)
+		{
+			QualityLevels.Add(QualityLevel);
+		}
+	}
+
+	const bool bSave = !FParse::Param(*Params, TEXT("NoSave"));
+
+	// Without a renderer the jobs go to the CPU engine, unless MkGpuScattering.Backend forces the GPU
+	if (!FApp::CanEverRender() && !FMkGpuScatteringCpuEngine::IsActive())
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] MkGpuScattering.Backend=0 needs a renderer, run with -AllowCommandletRendering and without -NullRHI"));
+		return 1;
+	}
+
+	UWorld* World = LoadWorld(MapName);
+	if (!World)
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] Failed to load %s"), *MapName);
+		return 1;
+	}
+
+	Scheduler = NewObject<UMkGpuScatteringScheduler>(this);
+	ReadbackManager = NewObject<UMkGpuScatteringReadbackManager>(this);
+
+	// Every job is read back in the pass that issued it, on the CPU
+	FScopedCVar ReadbackDelay(TEXT("MkGpuScattering.ReadbackDelayFrameCount"), 0);
+	FScopedCVar MaxReadbacks(TEXT("MkGpuScattering.MaxReadbackPerFrame"), MAX_int32);
+	FScopedCVar GpuTransform(TEXT("MkGpuScattering.GpuTransform"), 0);
+	// The cameras never move, an incremental build would stop gathering the jobs the budgets held back
+	FScopedCVar IncrementalBuild(TEXT("MkGpuScattering.IncrementalBuildFraction"), 0);
+	FScopedCVar QualityLevel(QualityLevelCVarName, 0);
+
+	TArray<FVolumeInfo> Volumes;
+	ForEachActor<AMkGpuScatteringVolume>(World, [this, &Volumes](AMkGpuScatteringVolume* Volume)
+	{
+		FVolumeInfo& VolumeInfo = Volumes.AddDefaulted_GetRef();
+		VolumeInfo.Bounds = Volume->GetBounds().GetBox();
+		VolumeInfo.ScatteringTypes = Volume->GetScatteringTypes();
+		VolumeInfo.ScatteringTypes.Remove(nullptr);
+
+		// Volumes of a partitioned world are unloaded before the proxies are baked
+		for (UMkGpuScatteringTypes* ScatteringTypes : VolumeInfo.ScatteringTypes)
+		{
+			ReferencedTypes.AddUnique(ScatteringTypes);
+		}
+	});
+
+	int32 NumBakedProxies = 0;
+	int32 NumBakedResults = 0;
+	int32 NumFailures = 0;
+	ForEachActor<ALandscapeProxy>(World, [&](ALandscapeProxy* LandscapeProxy)
+	{
+		const FBox ProxyBounds = LandscapeProxy->GetComponentsBoundingBox(false);
+		const FVolumeInfo* VolumeInfo = Volumes.FindByPredicate([&ProxyBounds](const FVolumeInfo& Info) { return ProxyBounds.IntersectXY(Info.Bounds); });
+		if (!VolumeInfo || VolumeInfo->ScatteringTypes.IsEmpty())
+		{
+			return;
+		}
+
+		if (!LandscapeProxy->GetRootComponent() || !LandscapeProxy->GetRootComponent()->IsRegistered())
+		{
+			LandscapeProxy->RegisterAllComponents();
+		}
+
+		const int32 NumResults = BakeProxy(LandscapeProxy, VolumeInfo->ScatteringTypes, QualityLevels);
+		if (NumResults == INDEX_NONE)
+		{
+			++NumFailures;
+			return;
+		}
+
+		if (bSave && !SavePackage(LandscapeProxy->GetPackage()))
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] Failed to save %s"), *LandscapeProxy->GetPackage()->GetName());
+			++NumFailures;
+			return;
+		}
+
+		++NumBakedProxies;
+		NumBakedResults += NumResults;
+	});
+
+	ReadbackManager->ClearAll();
+	Scheduler->ClearAll();
+	ReferencedTypes.Empty();
+	UnloadWorld(World);
+
+	UE_LOG(LogTemp, Display, TEXT("[UMkGpuScatteringBakeCommandlet] Baked %d results into %d landscape proxies, %d failures"), NumBakedResults, NumBakedProxies, NumFailures);
+	return NumFailures ? 1 : 0;
+}
+
+int32 UMkGpuScatteringBakeCommandlet::BakeProxy(ALandscapeProxy* LandscapeProxy, const TArray<UMkGpuScatteringTypes*>& ScatteringTypes, const TArray<int32>& QualityLevels)
+{
+	UMkGpuScatteringBuilder* Builder = NewObject<UMkGpuScatteringBuilder>(LandscapeProxy, NAME_None, RF_Transient);
+	Builder->SetLandscapeProxy(LandscapeProxy);
+
+	TMap<uint64, TArray<FLocationNormalScaleZ>> BakedResults;
+	Builder->SetBakeCapture(&BakedResults);
+
+	IConsoleVariable* QualityLevelCVar = IConsoleManager::Get().FindConsoleVariable(QualityLevelCVarName);
+	// No camera, every component of the proxy is in range
+	const TArray<FVector> NoCameras;
+
+	bool bSettled = true;
+	for (int32 QualityLevel : QualityLevels)
+	{
+		QualityLevelCVar->Set(QualityLevel, ECVF_SetByCode);
+
+		// The cached items of the previous level would hide the jobs of this one
+		Builder->FlushCache();
+		Builder->SetScatteringTypes(ScatteringTypes);
+
+		int32 NumPasses = 0;
+		for (;;)
+		{
+			Scheduler->BeginFrame();
+			Builder->Build(NoCameras, Scheduler);
+			const int32 NumIssued = Scheduler->IssueJobs(Builder->GetNumPendingJobs(), ReadbackManager);
+
+			// Everything issued is read back before the next pass
+			ENQUEUE_RENDER_COMMAND(MkGpuScatteringBakeReadback)([ReadbackManager = ReadbackManager.Get()](FRHICommandListImmediate& RHICmdList)
+			{
+				RHICmdList.BlockUntilGPUIdle();
+				ReadbackManager->Readback(RHICmdList);
+			});
+			FlushRenderingCommands();
+			FMkGpuScatteringCpuEngine::WaitForTasks();
+
+			Builder->WaitAndApplyResults();
+			if (NumIssued == 0 && Builder->GetNumPendingJobs() == 0)
+			{
+				break;
+			}
+
+			if (++NumPasses >= MaxPassesPerQualityLevel)
+			{
+				bSettled = false;
+				break;
+			}
+		}
+
+		if (!bSettled)
+		{
+			break;
+		}
+	}
+
+	// Drops the components the passes created, they are not part of the proxy
+	Builder->SetBakeCapture(nullptr);
+	Builder->FlushCache();
+	Builder->MarkAsGarbage();
+
+	if (!bSettled)
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] %s still had pending jobs after %d passes"), *LandscapeProxy->GetActorNameOrLabel(), MaxPassesPerQualityLevel);
+		return INDEX_NONE;
+	}
+
+	USceneComponent* RootComponent = LandscapeProxy->GetRootComponent();
+	if (!RootComponent)
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBakeCommandlet] %s has no root component to hold the baked data"), *LandscapeProxy->GetActorNameOrLabel());
+		return INDEX_NONE;
+	}
+
+	UMkGpuScatteringBakedData* BakedData = RootComponent->GetAssetUserData<UMkGpuScatteringBakedData>();
+	if (!BakedData)
+	{
+		BakedData = NewObject<UMkGpuScatteringBakedData>(RootComponent);
+		RootComponent->AddAssetUserData(BakedData);
+	}
+
+	BakedData->SetResults(MoveTemp(BakedResults));
+	BakedData->SetSourceHash(UMkGpuScatteringBakedData::MakeSourceHash(LandscapeProxy));
+	LandscapeProxy->MarkPackageDirty();
+
+	UE_LOG(LogTemp, Display, TEXT("[UMkGpuScatteringBakeCommandlet] %s: %d jobs, %d results"), *LandscapeProxy->GetActorNameOrLabel(), BakedData->GetNumEntries(), BakedData->GetNumResults());
+	return BakedData->GetNumResults();
+}
+//~ end of UMkGpuScatteringBakeCommandlet
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,686 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "MkGpuScatteringBenchmarkCommandlet.h"
+#include "MkGpuScatteringGlobal.h"
+#include "MkGpuScatteringSubsystem.h"
+#include "Benchmark/MkGpuScatteringStageTimings.h"
+#include "Builder/MkGpuScatteringBuilder.h"
+#include "Cpu/MkGpuScatteringCpuEngine.h"
+#include "Types/MkGpuScatteringTypes.h"
+
+#include "Editor.h"
+#include "Landscape.h"
+#include "LandscapeInfo.h"
+#include "LandscapeProxy.h"
+#include "LandscapeComponent.h"
+#include "LandscapeDataAccess.h"
+#include "LandscapeLayerInfoObject.h"
+#include "LandscapeStreamingProxy.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "RenderingThread.h"
+#include "Misc/App.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "UObject/UObjectIterator.h"
+
+#include UE_INLINE_GENERATED_CPP_BY_NAME(MkGpuScatteringBenchmarkCommandlet)
+
+MK_OPTIMIZATION_OFF
+
+namespace MkGpuScatteringBenchmark
+{
+	static constexpr int32 NumStages = (int32)EMkScatteringStage::Num;
+
+	struct FSettings
+	{
+		int32 ProxiesPerSide = 4;
+		int32 ComponentsPerProxy = 4;
+		int32 SubsectionQuads = 63;
+		int32 Subsections = 1;
+		int32 Frames = 300;
+		// Frames after the path to let the queues drain, stops earlier once nothing is pending
+		int32 SettleFrames = 600;
+		float DeltaTime = 1.0f / 30.0f;
+		// cm/s along Flyover and Orbit
+		float Speed = 2000.0f;
+		// Above the terrain
+		float CameraHeight = 200.0f;
+
+		int32 GetComponentQuads() const { return SubsectionQuads * Subsections; }
+		int32 GetProxyQuads() const { return GetComponentQuads() * ComponentsPerProxy; }
+		int32 GetLandscapeQuads() const { return GetProxyQuads() * ProxiesPerSide; }
+	};
+
+	static const FVector LandscapeScale(100.0, 100.0, 100.0);
+
+	//~ Synthetic landscape
+	// Rolling hills with small bumps, in landscape local height units (world = local * LandscapeScale.Z)
+	static float GetLocalHeight(float X, float Y)
+	{
+		return 18.0f * FMath::Sin(X * 0.011f) * FMath::Cos(Y * 0.008f)
+			+ 4.0f * FMath::Sin((X + Y) * 0.047f)
+			+ 1.0f * FMath::Sin(X * 0.31f) * FMath::Sin(Y * 0.27f);
+	}
+
+	// Patches of rock, the rest is grass
+	static uint8 GetRockWeight(float X, float Y)
+	{
+		const float Noise = FMath::Sin(X * 0.029f) * FMath::Sin(Y * 0.037f);
+		return (uint8)FMath::Clamp(FMath::RoundToInt32((Noise - 0.45f) * 4.0f * 255.0f), 0, 255);
+	}
+
+	static double GetWorldHeight(const FVector2D& Location)
+	{
+		return GetLocalHeight((float)(Location.X / LandscapeScale.X), (float)(Location.Y / LandscapeScale.Y)) * LandscapeScale.Z;
+	}
+
+	static ULandscapeLayerInfoObject* CreateLayerInfo(const TCHAR* Name)
+	{
+		// The builder matches SpawnLayerName against the layer info object name
+		ULandscapeLayerInfoObject* LayerInfo = NewObject<ULandscapeLayerInfoObject>(GetTransientPackage(), Name, RF_Transient);
+		LayerInfo->LayerName = Name;
+		return LayerInfo;
+	}
+
+	// Imports the whole landscape, then moves every ProxiesPerSide x ProxiesPerSide block of components to its own streaming proxy
+	static TArray<ALandscapeProxy*> CreateLandscape(UWorld* World, const FSettings& Settings)
+	{
+		const int32 SizeQuads = Settings.GetLandscapeQuads();
+		const int32 SizeVerts = SizeQuads + 1;
+
+		TArray<uint16> Heights;
+		TArray<uint8> GrassWeights;
+		TArray<uint8> RockWeights;
+		Heights.SetNumUninitialized(SizeVerts * SizeVerts);
+		GrassWeights.SetNumUninitialized(SizeVerts * SizeVerts);
+		RockWeights.SetNumUninitialized(SizeVerts * SizeVerts);
+		for (int32 Y = 0; Y < SizeVerts; ++Y)
+		{
+			for (int32 X = 0; X < SizeVerts; ++X)
+			{
+				const int32 Index = Y * SizeVerts + X;
+				Heights[Index] = LandscapeDataAccess::GetTexHeight(GetLocalHeight((float)X, (float)Y));
+				RockWeights[Index] = GetRockWeight((float)X, (float)Y);
+				GrassWeights[Index] = 255 - RockWeights[Index];
+			}
+		}
+
+		TArray<FLandscapeImportLayerInfo> ImportLayers;
+		{
+			FLandscapeImportLayerInfo& Grass = ImportLayers.AddDefaulted_GetRef();
+			Grass.LayerName = TEXT("MkBenchmarkGrass");
+			Grass.LayerInfo = CreateLayerInfo(TEXT("MkBenchmarkGrass"));
+			Grass.LayerData = MoveTemp(GrassWeights);
+
+			FLandscapeImportLayerInfo& Rock = ImportLayers.AddDefaulted_GetRef();
+			Rock.LayerName = TEXT("MkBenchmarkRock");
+			Rock.LayerInfo = CreateLayerInfo(TEXT("MkBenchmarkRock"));
+			Rock.LayerData = MoveTemp(RockWeights);
+		}
+
+		TMap<FGuid, TArray<uint16>> HeightData;
+		HeightData.Add(FGuid(), MoveTemp(Heights));
+		TMap<FGuid, TArray<FLandscapeImportLayerInfo>> LayerData;
+		LayerData.Add(FGuid(), MoveTemp(ImportLayers));
+
+		ALandscape* Landscape = World->SpawnActor<ALandscape>();
+		Landscape->bCanHaveLayersContent = false;
+		Landscape->SetActorTransform(FTransform(FQuat::Identity, FVector::ZeroVector, LandscapeScale));
+		Landscape->Import(FGuid::NewGuid(), 0, 0, SizeQuads, SizeQuads, Settings.Subsections, Settings.SubsectionQuads,
+			HeightData, nullptr, LayerData, ELandscapeImportAlphamapType::Additive);
+
+		ULandscapeInfo* LandscapeInfo = Landscape->GetLandscapeInfo();
+		if (!LandscapeInfo)
+		{
+			return {};
+		}
+
+		const int32 ProxyQuads = Settings.GetProxyQuads();
+		TArray<TArray<ULandscapeComponent*>> ComponentsPerProxy;
+		ComponentsPerProxy.SetNum(Settings.ProxiesPerSide * Settings.ProxiesPerSide);
+		for (ULandscapeComponent* Component : Landscape->LandscapeComponents)
+		{
+			const FIntPoint ProxyCoord = Component->GetSectionBase() / ProxyQuads;
+			ComponentsPerProxy[ProxyCoord.Y * Settings.ProxiesPerSide + ProxyCoord.X].Add(Component);
+		}
+
+		TArray<ALandscapeProxy*> Proxies;
+		for (const TArray<ULandscapeComponent*>& Components : ComponentsPerProxy)
+		{
+			if (ALandscapeProxy* Proxy = LandscapeInfo->MoveComponentsToLevel(Components, World->PersistentLevel))
+			{
+				Proxies.Add(Proxy);
+			}
+		}
+		return Proxies;
+	}
+	//~ end of Synthetic landscape
+
+	//~ Presets
+	static UStaticMesh* LoadMesh(const TCHAR* Path)
+	{
+		UStaticMesh* Mesh = LoadObject<UStaticMesh>(nullptr, Path);
+		if (!Mesh)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Missing %s, the preset scatters without building instances"), Path);
+		}
+		return Mesh;
+	}
+
+	static UMkGpuScatteringTypes* CreateTypes(UObject* Outer, const TCHAR* Name, const TCHAR* SpawnLayer)
+	{
+		UMkGpuScatteringTypes* Types = NewObject<UMkGpuScatteringTypes>(Outer, Name, RF_Transient);
+		Types->bEnableSpawnLayer = SpawnLayer != nullptr;
+		Types->SpawnLayerName = SpawnLayer ? SpawnLayer : TEXT("");
+		return Types;
+	}
+
+	// Low density everywhere, Halton placement
+	static UMkGpuScatteringTypes* CreateSparseGrass(UObject* Outer)
+	{
+		UMkGpuScatteringTypes* Types = CreateTypes(Outer, TEXT("SparseGrass"), nullptr);
+		FMkGrassVariety& Variety = Types->GrassVarieties.AddDefaulted_GetRef();
+		Variety.GrassMesh = LoadMesh(TEXT("/Engine/BasicShapes/Cone.Cone"));
+		Variety.GrassDensityQuality.Default = 20.0f;
+		Variety.bUseGrid = false;
+		Variety.StartCullDistanceQuality.Default = 8000;
+		Variety.EndCullDistanceQuality.Default = 10000;
+		Variety.ScaleX = FFloatInterval(0.1f, 0.2f);
+		return Types;
+	}
+
+	// Dense jittered grid on the grass layer, clumped by the Voronoi mask
+	static UMkGpuScatteringTypes* CreateDenseVoronoiGrass(UObject* Outer)
+	{
+		UMkGpuScatteringTypes* Types = CreateTypes(Outer, TEXT("DenseVoronoiGrass"), TEXT("MkBenchmarkGrass"));
+		for (int32 VarietyIndex = 0; VarietyIndex < 2; ++VarietyIndex)
+		{
+			FMkGrassVariety& Variety = Types->GrassVarieties.AddDefaulted_GetRef();
+			Variety.GrassMesh = LoadMesh(VarietyIndex ? TEXT("/Engine/BasicShapes/Cylinder.Cylinder") : TEXT("/Engine/BasicShapes/Cone.Cone"));
+			Variety.GrassDensityQuality.Default = VarietyIndex ? 200.0f : 800.0f;
+			Variety.bUseGrid = true;
+			Variety.PlacementJitter = 1.0f;
+			Variety.StartCullDistanceQuality.Default = 4000;
+			Variety.EndCullDistanceQuality.Default = 6000;
+			Variety.ScaleX = FFloatInterval(0.05f, 0.1f);
+			Variety.bUseVoronoiNoise = true;
+			Variety.VoronoiValidRange = FFloatInterval(0.2f, 0.8f);
+		}
+		return Types;
+	}
+
+	// Few large instances with collision on the rock layer
+	static UMkGpuScatteringTypes* CreateCollisionRocks(UObject* Outer)
+	{
+		UMkGpuScatteringTypes* Types = CreateTypes(Outer, TEXT("CollisionRocks"), TEXT("MkBenchmarkRock"));
+		FMkGrassVariety& Variety = Types->GrassVarieties.AddDefaulted_GetRef();
+		Variety.GrassMesh = LoadMesh(TEXT("/Engine/BasicShapes/Cube.Cube"));
+		Variety.CollisionProfileName = UCollisionProfile::BlockAll_ProfileName;
+		Variety.GrassDensityQuality.Default = 2.0f;
+		Variety.bUseGrid = false;
+		Variety.StartCullDistanceQuality.Default = 20000;
+		Variety.EndCullDistanceQuality.Default = 25000;
+		Variety.ScaleX = FFloatInterval(0.5f, 2.0f);
+		Variety.Slope = FFloatInterval(0.0f, 40.0f);
+		return Types;
+	}
+	//~ end of Presets
+
+	//~ Camera paths
+	enum class EPath : uint8
+	{
+		// Stands at the center, measures the initial fill
+		Static,
+		// Straight line corner to corner
+		Flyover,
+		// Circle around the center
+		Orbit,
+		// Jumps between fixed points, fast travel
+		Teleport,
+		Num
+	};
+
+	static const TCHAR* GetPathName(EPath Path)
+	{
+		static const TCHAR* Names[(int32)EPath::Num] = { TEXT("Static"), TEXT("Flyover"), TEXT("Orbit"), TEXT("Teleport") };
+		return Names[(int32)Path];
+	}
+
+	static FVector GetCameraLocation(EPath Path, int32 Frame, const FSettings& Settings)
+	{
+		const double Size = Settings.GetLandscapeQuads() * LandscapeScale.X;
+		const FVector2D Center(Size * 0.5, Size * 0.5);
+		const double Distance = (double)Frame * Settings.DeltaTime * Settings.Speed;
+
+		FVector2D Location = Center;
+		switch (Path)
+		{
+		case EPath::Flyover:
+		{
+			// Ping-pong so long runs stay on the landscape
+			const double Length = Size * UE_SQRT_2 * 0.9;
+			const double Along = FMath::Fmod(Distance, Length * 2.0);
+			const double Alpha = (Along < Length ? Along : Length * 2.0 - Along) / Length;
+			Location = FVector2D(Size * 0.05) + FVector2D(Size * 0.9) * Alpha;
+			break;
+		}
+		case EPath::Orbit:
+		{
+			const double Radius = Size * 0.3;
+			const double Angle = Distance / Radius;
+			Location = Center + FVector2D(FMath::Cos(Angle), FMath::Sin(Angle)) * Radius;
+			break;
+		}
+		case EPath::Teleport:
+		{
+			static const FVector2D Points[] = { { 0.15, 0.15 }, { 0.85, 0.8 }, { 0.2, 0.85 }, { 0.8, 0.2 }, { 0.5, 0.5 }, { 0.1, 0.5 }, { 0.9, 0.5 }, { 0.5, 0.1 } };
+			// A new point every two seconds
+			const int32 FramesPerPoint = FMath::Max(1, FMath::RoundToInt32(2.0f / Settings.DeltaTime));
+			Location = Points[(Frame / FramesPerPoint) % UE_ARRAY_COUNT(Points)] * Size;
+			break;
+		}
+		default:
+			break;
+		}
+
+		return FVector(Location, GetWorldHeight(Location) + Settings.CameraHeight);
+	}
+	//~ end of Camera paths
+
+	//~ Measurement
+	struct FFrameSample
+	{
+		double FrameMs = 0.0;
+		double StageMs[NumStages] = {};
+		uint64 UsedPhysical = 0;
+		int32 NumPendingJobs = 0;
+	};
+
+	struct FRunResult
+	{
+		FString Preset;
+		EPath Path = EPath::Static;
+		int32 NumSettleFrames = 0;
+		bool bSettled = false;
+		TArray<FFrameSample> Frames;
+		FMkGpuScatteringStageTimings::FSnapshot Totals;
+		uint64 BaselineUsedPhysical = 0;
+		uint64 PeakUsedPhysical = 0;
+		int64 NumInstances = 0;
+		int32 NumFoliageComponents = 0;
+	};
+
+	static double GetPercentile(TArray<double> Values, double Percentile)
+	{
+		if (Values.IsEmpty())
+		{
+			return 0.0;
+		}
+		Values.Sort();
+		const int32 Index = FMath::Clamp(FMath::CeilToInt32(Percentile * Values.Num()) - 1, 0, Values.Num() - 1);
+		return Values[Index];
+	}
+
+	static double ToMegabytes(uint64 Bytes)
+	{
+		return (double)Bytes / (1024.0 * 1024.0);
+	}
+
+	static void CountInstances(UWorld* World, FRunResult& OutResult)
+	{
+		// Merged varieties use plain instanced components, see FMkGrassVariety::bMergeComponents
+		for (TObjectIterator<UInstancedStaticMeshComponent> It; It; ++It)
+		{
+			// Pooled components stay registered but hidden
+			if (It->GetWorld() == World && It->IsRegistered() && It->IsVisible())
+			{
+				OutResult.NumInstances += It->GetInstanceCount();
+				++OutResult.NumFoliageComponents;
+			}
+		}
+	}
+
+	static FString MakeSummaryHeader()
+	{
+		FString Header = TEXT("preset,path,backend,proxies,components,frames,settle_frames,settled");
+		for (int32 Stage = 0; Stage < NumStages; ++Stage)
+		{
+			Header += FString::Printf(TEXT(",%s_ms,%s_calls"), FMkGpuScatteringStageTimings::GetStageName((EMkScatteringStage)Stage), FMkGpuScatteringStageTimings::GetStageName((EMkScatteringStage)Stage));
+		}
+		Header += TEXT(",frame_mean_ms,frame_p95_ms,frame_max_ms,instances,foliage_components,peak_used_mb,peak_delta_mb\n");
+		return Header;
+	}
+
+	static FString MakeSummaryRow(const FRunResult& Result, const FSettings& Settings)
+	{
+		TArray<double> FrameMs;
+		double TotalMs = 0.0;
+		for (const FFrameSample& Sample : Result.Frames)
+		{
+			FrameMs.Add(Sample.FrameMs);
+			TotalMs += Sample.FrameMs;
+		}
+
+		const int32 NumProxies = Settings.ProxiesPerSide * Settings.ProxiesPerSide;
+		FString Row = FString::Printf(TEXT("%s,%s,%s,%d,%d,%d,%d,%d"), *Result.Preset, GetPathName(Result.Path),
+			FMkGpuScatteringCpuEngine::IsActive() ? TEXT("cpu") : TEXT("gpu"),
+			NumProxies, NumProxies * Settings.ComponentsPerProxy * Settings.ComponentsPerProxy,
+			Result.Frames.Num() - Result.NumSettleFrames, Result.NumSettleFrames, Result.bSettled ? 1 : 0);
+		for (int32 Stage = 0; Stage < NumStages; ++Stage)
+		{
+			Row += FString::Printf(TEXT(",%.3f,%u"), Result.Totals.GetMilliseconds((EMkScatteringStage)Stage), Result.Totals.Calls[Stage]);
+		}
+		Row += FString::Printf(TEXT(",%.3f,%.3f,%.3f,%lld,%d,%.1f,%.1f\n"),
+			Result.Frames.Num() ? TotalMs / Result.Frames.Num() : 0.0, GetPercentile(FrameMs, 0.95), GetPercentile(FrameMs, 1.0),
+			Result.NumInstances, Result.NumFoliageComponents,
+			ToMegabytes(Result.PeakUsedPhysical), ToMegabytes(Result.PeakUsedPhysical - FMath::Min(Result.PeakUsedPhysical, Result.BaselineUsedPhysical)));
+		return Row;
+	}
+
+	static FString MakeFrameHeader()
+	{
+		FString Header = TEXT("preset,path,frame,frame_ms");
+		for (int32 Stage = 0; Stage < NumStages; ++Stage)
+		{
+			Header += FString::Printf(TEXT(",%s_ms"), FMkGpuScatteringStageTimings::GetStageName((EMkScatteringStage)Stage));
+		}
+		Header += TEXT(",used_mb,pending_jobs\n");
+		return Header;
+	}
+
+	static void AppendFrameRows(const FRunResult& Result, FString& OutCsv)
+	{
+		for (int32 Frame = 0; Frame < Result.Frames.Num(); ++Frame)
+		{
+			const FFrameSample& Sample = Result.Frames[Frame];
+			OutCsv += FString::Printf(TEXT("%s,%s,%d,%.3f"), *Result.Preset, GetPathName(Result.Path), Frame, Sample.FrameMs);
+			for (int32 Stage = 0; Stage < NumStages; ++Stage)
+			{
+				OutCsv += FString::Printf(TEXT(",%.3f"), Sample.StageMs[Stage]);
+			}
+			OutCsv += FString::Printf(TEXT(",%.1f,%d\n"), ToMegabytes(Sample.UsedPhysical), Sample.NumPendingJobs);
+		}
+	}
+	//~ end of Measurement
+
+	static UMkGpuScatteringBuilder* GetBuilder(ALandscapeProxy* Proxy)
+	{
+		// Same component UMkGpuScatteringSubsystem::CollectInstanceBuilder would create
+		UMkGpuScatteringBuilder* Builder = Proxy->GetComponentByClass<UMkGpuScatteringBuilder>();
+		if (!Builder)
+		{
+			Builder = NewObject<UMkGpuScatteringBuilder>(Proxy, TEXT("MkGpuScatteringBuilder"), RF_Transient);
+			Builder->SetLandscapeProxy(Proxy);
+		}
+		return Builder;
+	}
+
+	// Engine frame bookkeeping the commandlet does not get from FEngineLoop::Tick
+	static void BeginFrame()
+	{
+		++GFrameCounter;
+		++GFrameNumber;
+		ENQUEUE_RENDER_COMMAND(MkGpuScatteringBenchmarkBeginFrame)([](FRHICommandListImmediate& RHICmdList)
+		{
+			++GFrameNumberRenderThread;
+			++GFrameCounterRenderThread;
+		});
+	}
+
+	static FRunResult RunPath(UWorld* World, UMkGpuScatteringSubsystem* Subsystem, const TArray<ALandscapeProxy*>& Proxies,
+		const FString& PresetName, const TArray<UMkGpuScatteringTypes*>& Types, EPath Path, const FSettings& Settings)
+	{
+		FRunResult Result;
+		Result.Preset = PresetName;
+		Result.Path = Path;
+
+		// Starts from nothing, the builders forget their types on flush
+		FMkGpuScatteringCpuEngine::WaitForTasks();
+		Subsystem->FlushCache();
+		FlushRenderingCommands();
+		CollectGarbage(RF_NoFlags);
+		for (ALandscapeProxy* Proxy : Proxies)
+		{
+			GetBuilder(Proxy)->SetScatteringTypes(Types);
+		}
+
+		Result.BaselineUsedPhysical = FPlatformMemory::GetStats().UsedPhysical;
+		Result.PeakUsedPhysical = Result.BaselineUsedPhysical;
+		FMkGpuScatteringStageTimings::Reset();
+		FMkGpuScatteringStageTimings::FSnapshot Previous = FMkGpuScatteringStageTimings::GetSnapshot();
+
+		const int32 MaxFrames = Settings.Frames + Settings.SettleFrames;
+		TArray<FVector> Cameras;
+		for (int32 Frame = 0; Frame < MaxFrames; ++Frame)
+		{
+			const bool bSettling = Frame >= Settings.Frames;
+			Cameras.Reset();
+			Cameras.Add(GetCameraLocation(Path, FMath::Min(Frame, Settings.Frames - 1), Settings));
+
+			const uint64 StartCycles = FPlatformTime::Cycles64();
+			BeginFrame();
+			Subsystem->TickCameras(Cameras, Settings.DeltaTime);
+			// The readback the subsystem enqueued, a frame ends with the render thread caught up
+			FlushRenderingCommands();
+
+			FFrameSample& Sample = Result.Frames.AddDefaulted_GetRef();
+			Sample.FrameMs = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles);
+
+			const FMkGpuScatteringStageTimings::FSnapshot Current = FMkGpuScatteringStageTimings::GetSnapshot();
+			for (int32 Stage = 0; Stage < NumStages; ++Stage)
+			{
+				Sample.StageMs[Stage] = FPlatformTime::ToMilliseconds64(Current.Cycles[Stage] - Previous.Cycles[Stage]);
+			}
+			Previous = Current;
+
+			Sample.UsedPhysical = FPlatformMemory::GetStats().UsedPhysical;
+			Result.PeakUsedPhysical = FMath::Max(Result.PeakUsedPhysical, Sample.UsedPhysical);
+			for (ALandscapeProxy* Proxy : Proxies)
+			{
+				Sample.NumPendingJobs += GetBuilder(Proxy)->GetNumPendingJobs();
+			}
+
+			if (bSettling)
+			{
+				++Result.NumSettleFrames;
+				if (Sample.NumPendingJobs == 0)
+				{
+					Result.bSettled = true;
+					break;
+				}
+			}
+		}
+
+		// CPU jobs still running would land in the next run
+		FMkGpuScatteringCpuEngine::WaitForTasks();
+		Result.Totals = FMkGpuScatteringStageTimings::GetSnapshot();
+		CountInstances(World, Result);
+		return Result;
+	}
+
+	static TArray<FString> ParseList(const FString& Params, const TCHAR* Key, const TArray<FString>& Defaults)
+	{
+		FString Value;
+		if (!FParse::Value(*Params, Key, Value, false))
+		{
+			return Defaults;
+		}
+		TArray<FString> Tokens;
+		Value.ParseIntoArray(Tokens, TEXT(","));
+		return Tokens;
+	}
+}
+
+using namespace MkGpuScatteringBenchmark;
+
+//~ UMkGpuScatteringBenchmarkCommandlet
+UMkGpuScatteringBenchmarkCommandlet::UMkGpuScatteringBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+int32 UMkGpuScatteringBenchmarkCommandlet::Main(const FString& Params)
+{
+	if (!FApp::CanEverRender() && !FMkGpuScatteringCpuEngine::IsActive())
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] MkGpuScattering.Backend=0 needs a renderer, run with -AllowCommandletRendering and without -NullRHI"));
+		return 1;
+	}
+
+	FSettings Settings;
+	FParse::Value(*Params, TEXT("Proxies="), Settings.ProxiesPerSide);
+	FParse::Value(*Params, TEXT("ComponentsPerProxy="), Settings.ComponentsPerProxy);
+	FParse::Value(*Params, TEXT("SubsectionQuads="), Settings.SubsectionQuads);
+	FParse::Value(*Params, TEXT("Subsections="), Settings.Subsections);
+	FParse::Value(*Params, TEXT("Frames="), Settings.Frames);
+	FParse::Value(*Params, TEXT("SettleFrames="), Settings.SettleFrames);
+	FParse::Value(*Params, TEXT("DeltaTime="), Settings.DeltaTime);
+	FParse::Value(*Params, TEXT("Speed="), Settings.Speed);
+	Settings.ProxiesPerSide = FMath::Clamp(Settings.ProxiesPerSide, 1, 32);
+	Settings.ComponentsPerProxy = FMath::Clamp(Settings.ComponentsPerProxy, 1, 32);
+	Settings.Subsections = FMath::Clamp(Settings.Subsections, 1, 2);
+	Settings.Frames = FMath::Max(Settings.Frames, 1);
+	Settings.SettleFrames = FMath::Max(Settings.SettleFrames, 0);
+	Settings.DeltaTime = FMath::Max(Settings.DeltaTime, UE_KINDA_SMALL_NUMBER);
+	// Valid landscape section sizes only
+	if (Settings.SubsectionQuads != 7 && Settings.SubsectionQuads != 15 && Settings.SubsectionQuads != 31
+		&& Settings.SubsectionQuads != 63 && Settings.SubsectionQuads != 127 && Settings.SubsectionQuads != 255)
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] -SubsectionQuads must be 7, 15, 31, 63, 127 or 255"));
+		return 1;
+	}
+
+	const FString DefaultCsv = FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("MkGpuScattering"), TEXT("Benchmark"), FString::Printf(TEXT("Benchmark-%s.csv"), *FDateTime::Now().ToString()));
+	FString CsvFilename = DefaultCsv;
+	FString FrameCsvFilename;
+	FParse::Value(*Params, TEXT("Csv="), CsvFilename);
+	FParse::Value(*Params, TEXT("FrameCsv="), FrameCsvFilename);
+
+	const TArray<FString> PresetNames = ParseList(Params, TEXT("Presets="), { TEXT("SparseGrass"), TEXT("DenseVoronoiGrass"), TEXT("CollisionRocks"), TEXT("Mixed") });
+	const TArray<FString> PathNames = ParseList(Params, TEXT("Paths="), { TEXT("Static"), TEXT("Flyover"), TEXT("Orbit"), TEXT("Teleport") });
+
+	TArray<EPath> Paths;
+	for (const FString& PathName : PathNames)
+	{
+		int32 PathIndex = 0;
+		while (PathIndex < (int32)EPath::Num && !PathName.Equals(GetPathName((EPath)PathIndex), ESearchCase::IgnoreCase))
+		{
+			++PathIndex;
+		}
+		if (PathIndex == (int32)EPath::Num)
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Unknown path %s"), *PathName);
+			return 1;
+		}
+		Paths.Add((EPath)PathIndex);
+	}
+
+	UMkGpuScatteringTypes* SparseGrass = PresetTypes.Add_GetRef(CreateSparseGrass(this));
+	UMkGpuScatteringTypes* DenseVoronoiGrass = PresetTypes.Add_GetRef(CreateDenseVoronoiGrass(this));
+	UMkGpuScatteringTypes* CollisionRocks = PresetTypes.Add_GetRef(CreateCollisionRocks(this));
+
+	TArray<TPair<FString, TArray<UMkGpuScatteringTypes*>>> Presets;
+	for (const FString& PresetName : PresetNames)
+	{
+		if (PresetName.Equals(TEXT("SparseGrass"), ESearchCase::IgnoreCase))
+		{
+			Presets.Emplace(PresetName, TArray<UMkGpuScatteringTypes*>{ SparseGrass });
+		}
+		else if (PresetName.Equals(TEXT("DenseVoronoiGrass"), ESearchCase::IgnoreCase))
+		{
+			Presets.Emplace(PresetName, TArray<UMkGpuScatteringTypes*>{ DenseVoronoiGrass });
+		}
+		else if (PresetName.Equals(TEXT("CollisionRocks"), ESearchCase::IgnoreCase))
+		{
+			Presets.Emplace(PresetName, TArray<UMkGpuScatteringTypes*>{ CollisionRocks });
+		}
+		else if (PresetName.Equals(TEXT("Mixed"), ESearchCase::IgnoreCase))
+		{
+			Presets.Emplace(PresetName, TArray<UMkGpuScatteringTypes*>{ SparseGrass, DenseVoronoiGrass, CollisionRocks });
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Unknown preset %s"), *PresetName);
+			return 1;
+		}
+	}
+
+	UWorld* World = UWorld::CreateWorld(EWorldType::Editor, false, TEXT("MkGpuScatteringBenchmark"));
+	World->AddToRoot();
+	GEditor->GetEditorWorldContext().SetCurrentWorld(World);
+	GWorld = World;
+
+	const double LandscapeStartTime = FPlatformTime::Seconds();
+	const TArray<ALandscapeProxy*> Proxies = CreateLandscape(World, Settings);
+	UMkGpuScatteringSubsystem* Subsystem = World->GetSubsystem<UMkGpuScatteringSubsystem>();
+
+	int32 Result = 0;
+	if (Proxies.IsEmpty() || !Subsystem)
+	{
+		UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Failed to create the landscape"));
+		Result = 1;
+	}
+	else
+	{
+		UE_LOG(LogTemp, Display, TEXT("[UMkGpuScatteringBenchmarkCommandlet] %d proxies of %dx%d components (%d quads) in %.1f s, %s backend"),
+			Proxies.Num(), Settings.ComponentsPerProxy, Settings.ComponentsPerProxy, Settings.GetComponentQuads(),
+			FPlatformTime::Seconds() - LandscapeStartTime, FMkGpuScatteringCpuEngine::IsActive() ? TEXT("CPU") : TEXT("GPU"));
+
+		FString SummaryCsv = MakeSummaryHeader();
+		FString FrameCsv = MakeFrameHeader();
+
+		FMkGpuScatteringStageTimings::SetEnabled(true);
+		for (const TPair<FString, TArray<UMkGpuScatteringTypes*>>& Preset : Presets)
+		{
+			for (EPath Path : Paths)
+			{
+				const FRunResult Run = RunPath(World, Subsystem, Proxies, Preset.Key, Preset.Value, Path, Settings);
+				SummaryCsv += MakeSummaryRow(Run, Settings);
+				if (!FrameCsvFilename.IsEmpty())
+				{
+					AppendFrameRows(Run, FrameCsv);
+				}
+
+				UE_LOG(LogTemp, Display, TEXT("  %s %s : %d frames, %lld instances in %d components%s"), *Preset.Key, GetPathName(Path),
+					Run.Frames.Num(), Run.NumInstances, Run.NumFoliageComponents, Run.bSettled || Settings.SettleFrames == 0 ? TEXT("") : TEXT(", did not settle"));
+			}
+		}
+		FMkGpuScatteringStageTimings::SetEnabled(false);
+
+		if (!FFileHelper::SaveStringToFile(SummaryCsv, *CsvFilename))
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Failed to write %s"), *CsvFilename);
+			Result = 1;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Display, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Wrote %s"), *CsvFilename);
+		}
+
+		if (!FrameCsvFilename.IsEmpty() && !FFileHelper::SaveStringToFile(FrameCsv, *FrameCsvFilename))
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringBenchmarkCommandlet] Failed to write %s"), *FrameCsvFilename);
+			Result = 1;
+		}
+
+		FMkGpuScatteringCpuEngine::WaitForTasks();
+		Subsystem->FlushCache();
+	}
+
+	GEditor->GetEditorWorldContext().SetCurrentWorld(nullptr);
+	GWorld = nullptr;
+	World->RemoveFromRoot();
+	World->DestroyWorld(false);
+	PresetTypes.Empty();
+	CollectGarbage(RF_NoFlags);
+
+	return Result;
+}
+//~ end of UMkGpuScatteringBenchmarkCommandlet
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,61 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "MkGpuScatteringParityCommandlet.h"
+#include "MkGpuScatteringGlobal.h"
+#include "Cpu/MkGpuScatteringParity.h"
+
+#include UE_INLINE_GENERATED_CPP_BY_NAME(MkGpuScatteringParityCommandlet)
+
+MK_OPTIMIZATION_OFF
+
+//~ UMkGpuScatteringParityCommandlet
+UMkGpuScatteringParityCommandlet::UMkGpuScatteringParityCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+int32 UMkGpuScatteringParityCommandlet::Main(const FString& Params)
+{
+#if !UE_BUILD_SHIPPING
+	using namespace MkGpuScatteringParity;
+
+	FOptions Options;
+	Options.Mode = GetDefaultMode();
+
+	FString ModeName;
+	if (FParse::Value(*Params, TEXT("Mode="), ModeName))
+	{
+		if (ModeName.Equals(TEXT("Live"), ESearchCase::IgnoreCase))
+		{
+			Options.Mode = EMode::Live;
+		}
+		else if (ModeName.Equals(TEXT("Record"), ESearchCase::IgnoreCase))
+		{
+			Options.Mode = EMode::Record;
+		}
+		else if (ModeName.Equals(TEXT("Compare"), ESearchCase::IgnoreCase))
+		{
+			Options.Mode = EMode::Compare;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT("[UMkGpuScatteringParityCommandlet] Unknown mode %s, use Live, Record or Compare"), *ModeName);
+			return 1;
+		}
+	}
+
+	FParse::Value(*Params, TEXT("GoldenDir="), Options.GoldenDir);
+	FParse::Value(*Params, TEXT("Cases="), Options.CaseFilter);
+	FParse::Value(*Params, TEXT("AllowedMismatch="), Options.AllowedMismatchFraction);
+
+	return Run(Options) ? 0 : 1;
+#else
+	return 1;
+#endif
+}
+//~ end of UMkGpuScatteringParityCommandlet
+
+MK_OPTIMIZATION_ON
@@ -0,0 +1,43 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MkGpuScatteringBakeCommandlet.generated.h"
+
+class ALandscapeProxy;
+class UMkGpuScatteringTypes;
+class UMkGpuScatteringScheduler;
+class UMkGpuScatteringReadbackManager;
+
+
+/**
+ * Bakes the scattering results of every landscape proxy covered by an AMkGpuScatteringVolume into the proxy
+ * (UMkGpuScatteringBakedData), once per quality level. Runtime builders use the baked results and only dispatch
+ * what was not baked.
+ *
+ * UnrealEditor-Cmd.exe <Project> -run=MkGpuScatteringBake -Map=/Game/Maps/MyMap [-QualityLevels=0,1,2] [-NoSave] -AllowCommandletRendering
+ *
+ * The results come from the regular pipeline : Scattering_CS with -AllowCommandletRendering, the CPU engine under
+ * NullRHI (see MkGpuScattering.Backend).
+ */
+UCLASS()
+class UMkGpuScatteringBakeCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMkGpuScatteringBakeCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	// Returns the number of baked results, INDEX_NONE on failure
+	int32 BakeProxy(ALandscapeProxy* LandscapeProxy, const TArray<UMkGpuScatteringTypes*>& ScatteringTypes, const TArray<int32>& QualityLevels);
+
+	UPROPERTY(Transient) TObjectPtr<UMkGpuScatteringScheduler> Scheduler;
+	UPROPERTY(Transient) TObjectPtr<UMkGpuScatteringReadbackManager> ReadbackManager;
+	// Types of the volumes, kept while world partition unloads the volumes
+	UPROPERTY(Transient) TArray<TObjectPtr<UMkGpuScatteringTypes>> ReferencedTypes;
+};
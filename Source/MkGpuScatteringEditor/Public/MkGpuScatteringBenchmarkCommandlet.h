@@ -0,0 +1,37 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MkGpuScatteringBenchmarkCommandlet.generated.h"
+
+class ALandscapeProxy;
+class UMkGpuScatteringTypes;
+
+
+/**
+ * Headless benchmark of the whole scattering pipeline. Builds a synthetic landscape split into streaming proxies,
+ * scatters preset types on it and drives UMkGpuScatteringSubsystem::TickCameras along scripted camera paths.
+ * Writes one CSV row per preset and path : time per stage (FMkGpuScatteringStageTimings), frame times, instances and peak memory.
+ *
+ * UnrealEditor-Cmd.exe <Project> -run=MkGpuScatteringBenchmark -NullRHI [-Presets=SparseGrass,DenseVoronoiGrass,CollisionRocks,Mixed]
+ *     [-Paths=Static,Flyover,Orbit,Teleport] [-Proxies=4] [-ComponentsPerProxy=4] [-SubsectionQuads=63] [-Subsections=1]
+ *     [-Frames=300] [-SettleFrames=600] [-DeltaTime=0.0333] [-Speed=2000] [-Csv=<File>] [-FrameCsv=<File>]
+ *
+ * Under NullRHI the jobs go to the CPU engine, -dpcvars=MkGpuScattering.Backend=0 with -AllowCommandletRendering measures the GPU.
+ */
+UCLASS()
+class UMkGpuScatteringBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMkGpuScatteringBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	// Transient types, one per preset, kept alive for the whole run
+	UPROPERTY(Transient) TArray<TObjectPtr<UMkGpuScatteringTypes>> PresetTypes;
+};
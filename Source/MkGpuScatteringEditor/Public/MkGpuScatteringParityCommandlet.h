@@ -0,0 +1,26 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MkGpuScatteringParityCommandlet.generated.h"
+
+
+/**
+ * Runs MkGpuScatteringParity, the CPU engine against Scattering_CS. Returns 0 when every case passed.
+ *
+ * UnrealEditor-Cmd.exe <Project> -run=MkGpuScatteringParity [-Mode=Live|Record|Compare] [-GoldenDir=<Dir>] [-Cases=<Filter>] [-AllowedMismatch=<Fraction>]
+ *
+ * Live and Record need a renderer (-AllowCommandletRendering). Compare reads the golden files Record wrote and runs under NullRHI.
+ */
+UCLASS()
+class UMkGpuScatteringParityCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMkGpuScatteringParityCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};